@@ -0,0 +1,200 @@
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <map>
+#include <string_view>
+#include "basictoxwrapper.h"
+
+
+using namespace std;
+
+
+// Microseconds from a monotonic clock
+static uint64_t now()
+{
+    using namespace std::chrono;
+    return duration_cast<microseconds>(
+        steady_clock::now().time_since_epoch()).count();
+}
+
+
+// What every variant does with an event, so only the dispatch differs
+struct Totals
+{
+    uint64_t bytes = 0;
+    uint64_t reciepts = 0;
+};
+
+
+/*! @brief Handles the message and reciept hooks itself, as the static path.
+ */
+class StaticHandler : public BasicToxWrapper<StaticHandler>
+{
+public:
+    explicit StaticHandler(const ToxOptionsWrapper& options)
+        : BasicToxWrapper(options)
+    {
+    }
+
+    void onMessageSentSuccess(uint32_t friendAlias, uint32_t messageId)
+    {
+        ++mTotals.reciepts;
+    }
+
+    void onMessageRecieved(uint32_t friendAlias, string_view message,
+                           bool actionType)
+    {
+        mTotals.bytes += message.size();
+    }
+
+    Totals mTotals;
+};
+
+
+// The virtual interface ToxWrapper offers for the same two hooks
+class VirtualHooks
+{
+public:
+    virtual ~VirtualHooks() {}
+    virtual void onMessageSentSuccess(uint32_t friendAlias,
+                                      uint32_t messageId) = 0;
+    virtual void onMessageRecieved(uint32_t friendAlias, string_view message,
+                                   bool actionType) = 0;
+};
+
+class VirtualHandler : public VirtualHooks
+{
+public:
+    void onMessageSentSuccess(uint32_t friendAlias,
+                              uint32_t messageId) override
+    {
+        ++mTotals.reciepts;
+    }
+
+    void onMessageRecieved(uint32_t friendAlias, string_view message,
+                           bool actionType) override
+    {
+        mTotals.bytes += message.size();
+    }
+
+    Totals mTotals;
+};
+
+
+/*! @brief Forwards the static hooks to a virtual handler, as
+ *         ToxcoreTransport does for ToxWrapper.
+ */
+class AdapterHandler : public BasicToxWrapper<AdapterHandler>
+{
+public:
+    AdapterHandler(const ToxOptionsWrapper& options, VirtualHooks* hooks)
+        : BasicToxWrapper(options)
+        , mHooks(hooks)
+    {
+    }
+
+    void onMessageSentSuccess(uint32_t friendAlias, uint32_t messageId)
+    {
+        mHooks->onMessageSentSuccess(friendAlias, messageId);
+    }
+
+    void onMessageRecieved(uint32_t friendAlias, string_view message,
+                           bool actionType)
+    {
+        mHooks->onMessageRecieved(friendAlias, message, actionType);
+    }
+
+    VirtualHooks* mHooks;
+};
+
+
+// The previous dispatch: a global map from the tox instance to its wrapper,
+// then a virtual call
+static map<Tox*, VirtualHooks*> registry;
+
+static void registryReciept(Tox* tox, uint32_t alias, uint32_t messageId,
+                            void* userData)
+{
+    registry[tox]->onMessageSentSuccess(alias, messageId);
+}
+
+static void registryMessage(Tox* tox, uint32_t alias, TOX_MESSAGE_TYPE type,
+                            const uint8_t* message, size_t length,
+                            void* userData)
+{
+    registry[tox]->onMessageRecieved(
+        alias, string_view((const char*)message, length),
+        type == TOX_MESSAGE_TYPE_ACTION);
+}
+
+
+// Calls the given callbacks the way tox_iterate would, alternating messages
+// and reciepts, and returns the elapsed microseconds
+static uint64_t drive(tox_friend_message_cb* onMessage,
+                      tox_friend_read_receipt_cb* onReciept,
+                      Tox* tox, void* userData, uint64_t events)
+{
+    static const uint8_t text[] = "a message of an ordinary length";
+
+    uint64_t start = now();
+    for (uint64_t i = 0; i < events; i += 2)
+    {
+        onMessage(tox, i & 1023, TOX_MESSAGE_TYPE_NORMAL, text,
+                  1 + i % (sizeof(text) - 1), userData);
+        onReciept(tox, i & 1023, (uint32_t)i, userData);
+    }
+    return now() - start;
+}
+
+static void report(const char* name, uint64_t elapsed, uint64_t events,
+                   const Totals& totals)
+{
+    cout << name << elapsed / 1000.0 << " ms, "
+         << elapsed * 1000.0 / events << " ns/event"
+         << " (" << totals.bytes << " bytes, " << totals.reciepts
+         << " reciepts)" << endl;
+}
+
+
+int main(int argc, char* argv[])
+{
+    uint64_t events = (argc > 1) ? strtoull(argv[1], nullptr, 10) : 100000000;
+    if (events == 0)
+    {
+        cout << "usage: " << argv[0] << " [events]" << endl;
+        return 1;
+    }
+
+    // Nothing is sent, the instances only exist to be passed to callbacks
+    ToxOptionsWrapper options;
+    options.enableUdp(false);
+    options.enableLocalDiscovery(false);
+
+    StaticHandler direct(options);
+    uint64_t staticTime = drive(StaticHandler::friendMessage,
+                                StaticHandler::friendReadReciept,
+                                direct.getTox(), &direct, events);
+
+    VirtualHandler adapted;
+    AdapterHandler adapter(options, &adapted);
+    uint64_t adapterTime = drive(AdapterHandler::friendMessage,
+                                 AdapterHandler::friendReadReciept,
+                                 adapter.getTox(), &adapter, events);
+
+    // A few other instances, as when hosting more than one identity
+    VirtualHandler looked;
+    StaticHandler other1(options), other2(options), other3(options);
+    registry[other1.getTox()] = &looked;
+    registry[other2.getTox()] = &looked;
+    registry[other3.getTox()] = &looked;
+    registry[direct.getTox()] = &looked;
+    uint64_t registryTime = drive(registryMessage, registryReciept,
+                                  direct.getTox(), nullptr, events);
+
+    cout << "events:   " << events << endl;
+    report("static:   ", staticTime, events, direct.mTotals);
+    report("adapter:  ", adapterTime, events, adapted.mTotals);
+    report("registry: ", registryTime, events, looked.mTotals);
+
+    return 0;
+}
@@ -0,0 +1,303 @@
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <vector>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "intermediary.h"
+#include "loopbacktransport.h"
+
+
+using namespace std;
+
+
+static const string SpillDirectory = "fanoutbench-spill";
+
+// Microseconds from a monotonic clock
+static uint64_t now()
+{
+    using namespace std::chrono;
+    return duration_cast<microseconds>(
+        steady_clock::now().time_since_epoch()).count();
+}
+
+// Resident memory of this process in KiB
+static uint64_t residentKiB()
+{
+    uint64_t size = 0, resident = 0;
+    ifstream statm("/proc/self/statm");
+    statm >> size >> resident;
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+// Disk space taken by the files in a directory in KiB
+static uint64_t directoryKiB(const string& path)
+{
+    uint64_t blocks = 0;
+    DIR* dir = opendir(path.c_str());
+    while (dirent* entry = (dir ? readdir(dir) : nullptr))
+    {
+        struct stat info;
+        if (stat((path + "/" + entry->d_name).c_str(), &info) == 0 &&
+            S_ISREG(info.st_mode))
+        {
+            blocks += info.st_blocks;
+        }
+    }
+    if (dir)
+    {
+        closedir(dir);
+    }
+    return blocks / 2;
+}
+
+// Chat-like text of about size bytes, different for every message
+static string makeMessage(uint32_t i, uint32_t size)
+{
+    static const char* words[] =
+    {
+        "hey", "are", "you", "around", "later", "the", "build", "is", "green",
+        "again", "see", "at", "lunch", "sounds", "good", "meeting", "moved",
+        "to", "tomorrow", "thanks", "for", "review", "I'll", "push", "a", "fix"
+    };
+    const size_t count = sizeof(words) / sizeof(words[0]);
+
+    string message = "m" + to_string(i);
+    size_t minimum = message.size();
+    for (uint32_t seed = i * 2654435761u; message.size() < size;)
+    {
+        seed = seed * 1103515245u + 12345u;
+        message += ' ';
+        message += words[(seed >> 16) % count];
+    }
+    message.resize(max<size_t>(size, minimum));
+    return message;
+}
+
+// Deterministic public key for simulated friend i
+static ToxKey makeKey(uint32_t i)
+{
+    vector<uint8_t> bin(tox_public_key_size(), 0);
+    for (size_t b = 0; b < bin.size(); ++b)
+    {
+        bin[b] = (uint8_t)((i >> ((b % 4) * 8)) ^ (b * 131));
+    }
+    return ToxKey(ToxKey::Public, bin);
+}
+
+
+/*! @brief Has one sender post messages to every subscriber while they are
+ *         offline, then brings them online and stops once every copy has
+ *         been delivered. Shared sends go through a group, otherwise the
+ *         sender forwards to each subscriber in turn and sends again.
+ */
+class FanOutForwarder : public Intermediary
+{
+public:
+    FanOutForwarder(LoopbackTransport* transport, uint32_t subscribers,
+                    uint32_t messages, uint32_t size, bool shared)
+        : Intermediary(unique_ptr<ToxTransport>(transport))
+        , mTransport(transport)
+        , mSubscribers(subscribers)
+        , mMessages(messages)
+        , mSize(size)
+        , mShared(shared)
+        , mInjected(0)
+        , mDelivered(0)
+        , mBaseKiB(0)
+        , mQueuedKiB(0)
+        , mSpilledKiB(0)
+        , mQueueTime(0)
+        , mStart(0)
+        , mOnline(false)
+    {
+        transport->setDeliveryHandler(
+            [this](uint32_t alias, const string& message)
+            {
+                // Sender notices aren't counted
+                if (!message.empty() && message[0] == 'm')
+                {
+                    ++mDelivered;
+                }
+            });
+    }
+
+    void onCoreUpdate() override
+    {
+        Intermediary::onCoreUpdate();
+
+        if (mStart == 0)
+        {
+            mStart = now();
+            mBaseKiB = residentKiB();
+        }
+
+        if (mInjected < mMessages)
+        {
+            // One message per update, as a sender would post them
+            string message = makeMessage(mInjected, mSize);
+            if (mShared)
+            {
+                mTransport->injectMessage(0, message);
+            }
+            else
+            {
+                for (uint32_t i = 1; i <= mSubscribers; ++i)
+                {
+                    mTransport->injectMessage(0, "!forward " +
+                                                 makeKey(i).getHex());
+                    mTransport->injectMessage(0, message);
+                }
+            }
+            ++mInjected;
+        }
+        else if (!mOnline)
+        {
+            // Everything is queued, now deliver it
+            mQueueTime = now() - mStart;
+            mQueuedKiB = residentKiB() - mBaseKiB;
+            mSpilledKiB = directoryKiB(SpillDirectory);
+            mStart = now();
+            for (uint32_t i = 1; i <= mSubscribers; ++i)
+            {
+                mTransport->setFriendConnected(i, true);
+            }
+            mOnline = true;
+        }
+        else if (mDelivered == (uint64_t)mMessages * mSubscribers)
+        {
+            stop();
+        }
+    }
+
+    uint64_t getQueuedKiB() const
+    {
+        return mQueuedKiB;
+    }
+
+    uint64_t getSpilledKiB() const
+    {
+        return mSpilledKiB;
+    }
+
+    uint64_t getQueueTime() const
+    {
+        return mQueueTime;
+    }
+
+    uint64_t getDrainTime() const
+    {
+        return now() - mStart;
+    }
+
+private:
+    LoopbackTransport* mTransport;
+    uint32_t mSubscribers;
+    uint32_t mMessages;
+    uint32_t mSize;
+    bool mShared;
+    uint32_t mInjected;
+    uint64_t mDelivered;
+    uint64_t mBaseKiB;
+    uint64_t mQueuedKiB;
+    uint64_t mSpilledKiB;
+    uint64_t mQueueTime;
+    uint64_t mStart;
+    bool mOnline;
+};
+
+
+int main(int argc, char* argv[])
+{
+    uint32_t messages = (argc > 1) ? strtoul(argv[1], nullptr, 10) : 1000;
+    uint32_t subscribers = (argc > 2) ? strtoul(argv[2], nullptr, 10) : 500;
+    uint32_t size = (argc > 3) ? strtoul(argv[3], nullptr, 10) : 256;
+    bool shared = (argc <= 4) || strtoul(argv[4], nullptr, 10) != 0;
+    size_t budget = (argc > 5) ? strtoull(argv[5], nullptr, 10) : 0;
+    size_t friendBudget = (argc > 6) ? strtoull(argv[6], nullptr, 10) : 0;
+
+    if (messages == 0 || subscribers == 0)
+    {
+        cout << "usage: " << argv[0]
+             << " [messages] [subscribers] [message size] [shared]"
+             << " [memory budget KiB] [friend budget KiB]" << endl;
+        return 1;
+    }
+
+    // The sender is alias 0, subscribers [1, subscribers]
+    LoopbackTransport* transport = new LoopbackTransport();
+    FanOutForwarder forwarder(transport, subscribers, messages, size, shared);
+    if (budget > 0 || friendBudget > 0)
+    {
+        // Segments are deleted again when the forwarder is destroyed
+        if (!forwarder.setSpillDirectory(SpillDirectory))
+        {
+            cout << "error: failed to open the spill directory" << endl;
+            return 1;
+        }
+        if (budget > 0)
+        {
+            forwarder.setMemoryBudget(budget * 1024);
+        }
+        if (friendBudget > 0)
+        {
+            forwarder.setFriendMemoryBudget(friendBudget * 1024);
+        }
+    }
+    for (uint32_t i = 0; i <= subscribers; ++i)
+    {
+        forwarder.addAllowedFriend(makeKey(i));
+    }
+    transport->setFriendConnected(0, true);
+
+    if (shared)
+    {
+        // As many members per command as fit in a tox message
+        string command;
+        for (uint32_t i = 1; i <= subscribers; ++i)
+        {
+            if (command.empty())
+            {
+                command = "!group subscribers add";
+            }
+            command += ' ' + makeKey(i).getHex();
+            if (command.size() + 65 > tox_max_message_length() ||
+                i == subscribers)
+            {
+                transport->injectMessage(0, command);
+                command.clear();
+            }
+        }
+        transport->injectMessage(0, "!forward subscribers");
+    }
+
+    // Run
+    forwarder.run();
+    uint64_t drain = forwarder.getDrainTime();
+    uint64_t copies = (uint64_t)messages * subscribers;
+
+    // Report
+    cout << "messages:     " << messages << " of " << size << " bytes" << endl;
+    cout << "subscribers:  " << subscribers
+         << (shared ? ", shared" : ", one forward each") << endl;
+    if (budget > 0 || friendBudget > 0)
+    {
+        cout << "budget:       " << budget << " KiB, " << friendBudget
+             << " KiB per friend" << endl;
+    }
+    cout << "queue time:   " << forwarder.getQueueTime() / 1000.0 << " ms"
+         << endl;
+    cout << "queued rss:   " << forwarder.getQueuedKiB() << " KiB" << endl;
+    if (budget > 0 || friendBudget > 0)
+    {
+        cout << "spilled:      " << forwarder.getSpilledKiB() << " KiB"
+             << endl;
+    }
+    cout << "drain time:   " << drain / 1000.0 << " ms" << endl;
+    cout << "throughput:   " << copies * 1000000.0 / drain << " msg/s"
+         << endl;
+
+    return 0;
+}
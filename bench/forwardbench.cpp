@@ -0,0 +1,444 @@
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <unordered_map>
+#include <vector>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "channel.h"
+#include "fragment.h"
+#include "intermediary.h"
+#include "loopbacktransport.h"
+
+
+using namespace std;
+
+
+// Microseconds from a monotonic clock
+static uint64_t now()
+{
+    using namespace std::chrono;
+    return duration_cast<microseconds>(
+        steady_clock::now().time_since_epoch()).count();
+}
+
+// Counts last level cache misses in this process while enabled. Reads zero
+// if the kernel or hardware does not expose the counter.
+class CacheMissCounter
+{
+public:
+    CacheMissCounter()
+    {
+        perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.size = sizeof(attr);
+        attr.config = PERF_COUNT_HW_CACHE_MISSES;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        mFd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+
+    ~CacheMissCounter()
+    {
+        if (mFd >= 0)
+        {
+            close(mFd);
+        }
+    }
+
+    bool isAvailable() const
+    {
+        return mFd >= 0;
+    }
+
+    void start()
+    {
+        if (mFd >= 0)
+        {
+            ioctl(mFd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(mFd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+
+    uint64_t stop()
+    {
+        uint64_t count = 0;
+        if (mFd >= 0)
+        {
+            ioctl(mFd, PERF_EVENT_IOC_DISABLE, 0);
+            if (read(mFd, &count, sizeof(count)) != sizeof(count))
+            {
+                count = 0;
+            }
+        }
+        return count;
+    }
+
+private:
+    int mFd;
+};
+
+
+// Deterministic public key for simulated friend i
+static ToxKey makeKey(uint32_t i)
+{
+    vector<uint8_t> bin(tox_public_key_size(), 0);
+    for (size_t b = 0; b < bin.size(); ++b)
+    {
+        bin[b] = (uint8_t)((i >> ((b % 4) * 8)) ^ (b * 131));
+    }
+    return ToxKey(ToxKey::Public, bin);
+}
+
+
+/*! @brief Feeds messages into the intermediary a batch at a time and stops
+ *         once all of them have been delivered. Batches are at least pace
+ *         microseconds apart, so arrivals don't speed up with the updates.
+ *         Messages are padded to size bytes, reassembling any fragments.
+ *         Over the channel, each sender packs its share of a batch into as
+ *         few packets as possible.
+ */
+class BenchForwarder : public Intermediary
+{
+public:
+    BenchForwarder(LoopbackTransport* transport, uint32_t senders,
+                   uint64_t messages, uint32_t batch, uint64_t pace,
+                   uint32_t size, bool channel)
+        : Intermediary(unique_ptr<ToxTransport>(transport))
+        , mTransport(transport)
+        , mSenders(senders)
+        , mMessages(messages)
+        , mBatch(batch)
+        , mPace(pace)
+        , mSize(size)
+        , mChannel(channel)
+        , mNextBatch(0)
+        , mInjected(0)
+        , mDelivered(0)
+        , mToxMessages(0)
+        , mInjectTimes(messages, 0)
+        , mLatencies()
+        , mSeen(messages, false)
+        , mAssemblers()
+        , mPackets(channel ? senders : 0)
+        , mSequences(channel ? senders : 0, 1)
+        , mExpected()
+    {
+        mLatencies.reserve(messages);
+        transport->setDeliveryHandler(
+            [this](uint32_t alias, const string& message)
+            {
+                ++mToxMessages;
+                if (!FragmentAssembler::isFragment(message))
+                {
+                    onDelivered(message);
+                    return;
+                }
+
+                string whole;
+                if (mAssemblers[alias].add(message, whole))
+                {
+                    onDelivered(whole);
+                }
+            });
+        transport->setPacketHandler(
+            [this](uint32_t alias, const string& packet)
+            {
+                ++mToxMessages;
+                onPacket(alias, packet);
+            });
+    }
+
+    void onCoreUpdate() override
+    {
+        Intermediary::onCoreUpdate();
+
+        // Inject the next batch
+        uint64_t time = now();
+        for (uint32_t i = 0; i < mBatch && mInjected < mMessages &&
+                             time >= mNextBatch; ++i)
+        {
+            mInjectTimes[mInjected] = time;
+            string message = "m" + to_string(mInjected);
+            if (message.size() < mSize)
+            {
+                message += ' ';
+                message.resize(mSize, 'x');
+            }
+            if (mChannel)
+            {
+                addRecord(mInjected % mSenders, message);
+            }
+            else
+            {
+                mTransport->injectMessage(mInjected % mSenders, message);
+            }
+            ++mInjected;
+        }
+        for (auto it = mFilled.begin(); it != mFilled.end(); ++it)
+        {
+            mTransport->injectPacket(*it, mPackets[*it]);
+            mPackets[*it].clear();
+        }
+        mFilled.clear();
+        if (time >= mNextBatch)
+        {
+            mNextBatch = time + mPace;
+        }
+
+        if (mDelivered == mMessages)
+        {
+            stop();
+        }
+    }
+
+    vector<uint64_t>& getLatencies()
+    {
+        return mLatencies;
+    }
+
+    uint64_t getToxMessages() const
+    {
+        return mToxMessages;
+    }
+
+private:
+    // Adds a message to the packet a sender is filling, sending it first if
+    // the message doesn't fit
+    void addRecord(uint32_t sender, const string& message)
+    {
+        string& packet = mPackets[sender];
+        if (packet.empty())
+        {
+            writeChannelHeader(packet, CF_Data, 1, mSequences[sender]++);
+            mFilled.push_back(sender);
+        }
+        else if (packet.size() + RecordHeaderSize + message.size() >
+                 tox_max_custom_packet_size())
+        {
+            mTransport->injectPacket(sender, packet);
+            writeChannelHeader(packet, CF_Data, 1, mSequences[sender]++);
+        }
+
+        // Key id 1 was bound to the sender's reciever
+        appendRecord(packet, 1, 0, message);
+    }
+
+    // Unpacks the records of a data packet and acknowledges it
+    void onPacket(uint32_t alias, const string& packet)
+    {
+        ChannelReader reader(packet);
+        if (!reader.isValid() || reader.getFrame() != CF_Data)
+        {
+            return;
+        }
+
+        // Only the next packet is accepted, as a client must
+        auto expected = mExpected.emplace(alias, reader.getSequence()).first;
+        if (reader.getSequence() == expected->second)
+        {
+            ++expected->second;
+
+            ChannelRecord record;
+            while (reader.next(record))
+            {
+                string whole;
+                if (record.flags & (RF_Bind | RF_Server))
+                {
+                    continue;
+                }
+                else if (!(record.flags & RF_Fragment))
+                {
+                    onDelivered(record.payload);
+                }
+                else if (mAssemblers[alias].add(record.payload, whole))
+                {
+                    onDelivered(whole);
+                }
+            }
+        }
+
+        string ack;
+        writeChannelHeader(ack, CF_Ack, reader.getSession(),
+                           expected->second);
+        mTransport->injectPacket(alias, ack);
+    }
+
+    void onDelivered(string_view message)
+    {
+        // Unpack bundles, each entry is its length, a ':' and its text
+        static const string bundleHeader = "!bundle\n";
+        if (message.compare(0, bundleHeader.size(), bundleHeader) == 0)
+        {
+            size_t pos = bundleHeader.size();
+            while (pos < message.size())
+            {
+                size_t colon = message.find(':', pos);
+                size_t length = 0;
+                from_chars(message.data() + pos, message.data() + colon,
+                           length);
+                onDelivered(message.substr(colon + 1, length));
+                pos = colon + 1 + length;
+            }
+            return;
+        }
+
+        if (message.empty() || message[0] != 'm')
+        {
+            // Sender and server notices
+            return;
+        }
+
+        uint64_t index = 0;
+        from_chars(message.data() + 1, message.data() + message.size(),
+                   index);
+        if (index < mMessages && !mSeen[index])
+        {
+            mSeen[index] = true;
+            mLatencies.push_back(now() - mInjectTimes[index]);
+            ++mDelivered;
+        }
+    }
+
+    LoopbackTransport* mTransport;
+    uint32_t mSenders;
+    uint64_t mMessages;
+    uint32_t mBatch;
+    uint64_t mPace;
+    uint32_t mSize;
+    bool mChannel;
+    uint64_t mNextBatch;
+    uint64_t mInjected;
+    uint64_t mDelivered;
+    uint64_t mToxMessages;
+    vector<uint64_t> mInjectTimes;
+    vector<uint64_t> mLatencies;
+    vector<bool> mSeen;
+    unordered_map<uint32_t, FragmentAssembler> mAssemblers;
+    vector<string> mPackets;
+    vector<uint32_t> mFilled;
+    vector<uint32_t> mSequences;
+    unordered_map<uint32_t, uint32_t> mExpected;
+};
+
+
+int main(int argc, char* argv[])
+{
+    uint64_t messages = (argc > 1) ? strtoull(argv[1], nullptr, 10) : 2000000;
+    uint32_t pairs = (argc > 2) ? strtoul(argv[2], nullptr, 10) : 1000;
+    uint32_t window = (argc > 3) ? strtoul(argv[3], nullptr, 10) : 8;
+    uint32_t batch = (argc > 4) ? strtoul(argv[4], nullptr, 10) : 10000;
+    uint32_t interval = (argc > 5) ? strtoul(argv[5], nullptr, 10) : 0;
+    bool immediate = (argc > 6) && strtoul(argv[6], nullptr, 10) != 0;
+    bool bundle = (argc > 7) && strtoul(argv[7], nullptr, 10) != 0;
+    uint32_t size = (argc > 8) ? strtoul(argv[8], nullptr, 10) : 0;
+    bool channel = (argc > 9) && strtoul(argv[9], nullptr, 10) != 0;
+
+    // Senders send one record per message over the channel
+    size_t recordLimit = tox_max_custom_packet_size() - ChannelHeaderSize -
+                         RecordHeaderSize;
+    if (messages == 0 || pairs == 0 || window == 0 || batch == 0 ||
+        (channel && size > recordLimit))
+    {
+        cout << "usage: " << argv[0]
+             << " [messages] [sender/reciever pairs] [window] [batch]"
+             << " [interval ms] [immediate flush] [bundle] [message size]"
+             << " [channel]" << endl;
+        return 1;
+    }
+
+    // Senders are aliases [0, pairs), recievers [pairs, 2 * pairs)
+    LoopbackTransport* transport = new LoopbackTransport();
+    transport->setIterationInterval(interval);
+    BenchForwarder forwarder(transport, pairs, messages, batch,
+                             interval * 1000, size, channel);
+    forwarder.setWindowSize(window);
+    forwarder.setImmediateFlush(immediate);
+
+    for (uint32_t i = 0; i < 2 * pairs; ++i)
+    {
+        forwarder.addAllowedFriend(makeKey(i));
+        transport->setFriendConnected(i, true);
+    }
+    for (uint32_t i = 0; i < pairs; ++i)
+    {
+        if (channel)
+        {
+            // Senders bind key id 1 to their reciever in their first packet
+            ToxKey reciever = makeKey(pairs + i);
+            string packet;
+            writeChannelHeader(packet, CF_Data, 1, 0);
+            appendRecord(packet, 1, RF_Bind,
+                         string_view((const char*)reciever.data(),
+                                     reciever.size()));
+            transport->injectPacket(i, packet);
+
+            writeChannelHeader(packet, CF_Hello, 1, 0);
+            transport->injectPacket(pairs + i, packet);
+        }
+        else
+        {
+            transport->injectMessage(i, "!forward " +
+                                        makeKey(pairs + i).getHex());
+        }
+        if (bundle)
+        {
+            transport->injectMessage(pairs + i, "!bundle on");
+        }
+    }
+
+    // Run
+    CacheMissCounter cacheMisses;
+    uint64_t start = now();
+    cacheMisses.start();
+    forwarder.run();
+    uint64_t misses = cacheMisses.stop();
+    uint64_t elapsed = now() - start;
+
+    // Report
+    vector<uint64_t>& latencies = forwarder.getLatencies();
+    sort(latencies.begin(), latencies.end());
+
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    cout << "messages:     " << messages << endl;
+    cout << "pairs:        " << pairs << endl;
+    cout << "window:       " << window << endl;
+    if (size > 0)
+    {
+        cout << "message size: " << size << " bytes" << endl;
+    }
+    cout << "interval:     " << interval << " ms"
+         << (immediate ? ", immediate flush" : "")
+         << (bundle ? ", bundled" : "")
+         << (channel ? ", channel" : "") << endl;
+    cout << "elapsed:      " << elapsed / 1000.0 << " ms" << endl;
+    cout << "throughput:   " << messages * 1000000.0 / elapsed << " msg/s"
+         << endl;
+    cout << "tox messages: " << forwarder.getToxMessages() << endl;
+    cout << "latency p50:  " << latencies[latencies.size() / 2] << " us"
+         << endl;
+    cout << "latency p99:  " << latencies[latencies.size() * 99 / 100]
+         << " us" << endl;
+    cout << "peak rss:     " << usage.ru_maxrss << " KiB" << endl;
+    if (cacheMisses.isAvailable())
+    {
+        cout << "cache misses: " << misses << " ("
+             << (double)misses / messages << " per msg)" << endl;
+    }
+    else
+    {
+        cout << "cache misses: unavailable" << endl;
+    }
+
+    return 0;
+}
@@ -0,0 +1,147 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <thread>
+#include <vector>
+#include "hex.h"
+#include "intermediary.h"
+#include "keyfile.h"
+#include "loopbacktransport.h"
+
+
+using namespace std;
+
+
+static const string HexFile = "importbench.txt";
+static const string BinaryFile = "importbench.bin";
+
+// Microseconds from a monotonic clock
+static uint64_t now()
+{
+    using namespace std::chrono;
+    return duration_cast<microseconds>(
+        steady_clock::now().time_since_epoch()).count();
+}
+
+// Deterministic public key for simulated friend i
+static vector<uint8_t> makeKey(uint32_t i)
+{
+    vector<uint8_t> bin(tox_public_key_size(), 0);
+    for (size_t b = 0; b < bin.size(); ++b)
+    {
+        bin[b] = (uint8_t)((i >> ((b % 4) * 8)) ^ (b * 131));
+    }
+    return bin;
+}
+
+// Writes the keys in hex and in binary, with every repeat-th one twice
+static void writeFiles(uint32_t friends, uint32_t repeat)
+{
+    ofstream hex(HexFile);
+    ofstream binary(BinaryFile, ios::binary);
+    hex << "# importbench friends" << endl;
+    for (uint32_t i = 0; i < friends; ++i)
+    {
+        vector<uint8_t> bin = makeKey(i);
+        for (int copies = (repeat > 0 && i % repeat == 0) ? 2 : 1;
+             copies > 0; --copies)
+        {
+            hex << convertToHex(bin.data(), bin.size()) << endl;
+            binary.write((const char*)bin.data(), bin.size());
+        }
+    }
+}
+
+// Adds the friends as configure() did before key files, one hex key at a time
+static size_t importEach(Intermediary& forwarder)
+{
+    ifstream hex(HexFile);
+    string line;
+    size_t count = 0;
+    while (getline(hex, line))
+    {
+        if (line.empty() || line[0] == '#')
+        {
+            continue;
+        }
+        forwarder.addAllowedFriend(ToxKey(ToxKey::Public, line));
+        ++count;
+    }
+    return count;
+}
+
+// Adds the friends in a file in one pass, as configure() does now
+static size_t importFile(Intermediary& forwarder, const string& path,
+                         unsigned threads, KeyFileStats& stats)
+{
+    vector<ToxKey> keys;
+    if (!readKeyFile(path, threads, keys, stats))
+    {
+        cout << "error: failed to read " << path << endl;
+        exit(1);
+    }
+    return forwarder.addAllowedFriends(keys);
+}
+
+
+int main(int argc, char* argv[])
+{
+    uint32_t friends = (argc > 1) ? strtoul(argv[1], nullptr, 10) : 100000;
+    uint32_t repeat = (argc > 2) ? strtoul(argv[2], nullptr, 10) : 100;
+    unsigned threads = (argc > 3) ? strtoul(argv[3], nullptr, 10) :
+                                    thread::hardware_concurrency();
+    threads = max(threads, 1u);
+
+    if (friends == 0)
+    {
+        cout << "usage: " << argv[0] << " [friends] [repeat every]"
+             << " [threads]" << endl;
+        return 1;
+    }
+
+    writeFiles(friends, repeat);
+
+    uint64_t start = now();
+    Intermediary each(unique_ptr<ToxTransport>(new LoopbackTransport()));
+    size_t eachCount = importEach(each);
+    uint64_t eachTime = now() - start;
+
+    KeyFileStats hexStats;
+    start = now();
+    Intermediary hex(unique_ptr<ToxTransport>(new LoopbackTransport()));
+    size_t hexAdded = importFile(hex, HexFile, threads, hexStats);
+    uint64_t hexTime = now() - start;
+
+    KeyFileStats binaryStats;
+    start = now();
+    Intermediary binary(unique_ptr<ToxTransport>(new LoopbackTransport()));
+    size_t binaryAdded = importFile(binary, BinaryFile, threads, binaryStats);
+    uint64_t binaryTime = now() - start;
+
+    // As on a restart, when every friend is already in the tox instance
+    start = now();
+    importEach(each);
+    uint64_t eachAgainTime = now() - start;
+
+    start = now();
+    importFile(hex, HexFile, threads, hexStats);
+    uint64_t hexAgainTime = now() - start;
+
+    // Report
+    cout << "friends:      " << friends << ", " << hexStats.read - friends
+         << " listed twice, " << threads << " threads" << endl;
+    cout << "one by one:   " << eachTime / 1000.0 << " ms for " << eachCount
+         << " keys" << endl;
+    cout << "hex file:     " << hexTime / 1000.0 << " ms, " << hexAdded
+         << " added" << endl;
+    cout << "binary file:  " << binaryTime / 1000.0 << " ms, " << binaryAdded
+         << " added" << endl;
+    cout << "again:        " << eachAgainTime / 1000.0 << " ms one by one, "
+         << hexAgainTime / 1000.0 << " ms from the hex file" << endl;
+
+    remove(HexFile.c_str());
+    remove(BinaryFile.c_str());
+    return 0;
+}
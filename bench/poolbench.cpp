@@ -0,0 +1,152 @@
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+#include <sys/resource.h>
+#include "forwarderpool.h"
+#include "loopbacktransport.h"
+
+
+using namespace std;
+
+
+// Microseconds from a monotonic clock
+static uint64_t now()
+{
+    using namespace std::chrono;
+    return duration_cast<microseconds>(
+        steady_clock::now().time_since_epoch()).count();
+}
+
+// Deterministic public key for simulated friend i
+static ToxKey makeKey(uint32_t i)
+{
+    vector<uint8_t> bin(tox_public_key_size(), 0);
+    for (size_t b = 0; b < bin.size(); ++b)
+    {
+        bin[b] = (uint8_t)((i >> ((b % 4) * 8)) ^ (b * 131));
+    }
+    return ToxKey(ToxKey::Public, bin);
+}
+
+
+/*! @brief Feeds its senders' messages into the intermediary a batch per
+ *         update, and counts what its recievers are delivered.
+ */
+class PoolForwarder : public Intermediary
+{
+public:
+    PoolForwarder(LoopbackTransport* transport, uint32_t pairs,
+                  uint64_t messages, uint32_t batch,
+                  atomic<uint64_t>& delivered)
+        : Intermediary(unique_ptr<ToxTransport>(transport))
+        , mTransport(transport)
+        , mPairs(pairs)
+        , mMessages(messages)
+        , mBatch(batch)
+        , mInjected(0)
+    {
+        transport->setDeliveryHandler(
+            [&delivered](uint32_t alias, const string& message)
+            {
+                // Sender and server notices aren't counted
+                if (!message.empty() && message[0] == 'm')
+                {
+                    ++delivered;
+                }
+            });
+    }
+
+    void onCoreUpdate() override
+    {
+        Intermediary::onCoreUpdate();
+
+        for (uint32_t i = 0; i < mBatch && mInjected < mMessages; ++i)
+        {
+            mTransport->injectMessage(mInjected % mPairs, "m");
+            ++mInjected;
+        }
+    }
+
+private:
+    LoopbackTransport* mTransport;
+    uint32_t mPairs;
+    uint64_t mMessages;
+    uint32_t mBatch;
+    uint64_t mInjected;
+};
+
+
+int main(int argc, char* argv[])
+{
+    uint32_t identities = (argc > 1) ? strtoul(argv[1], nullptr, 10) : 16;
+    uint32_t threads = (argc > 2) ? strtoul(argv[2], nullptr, 10) : 4;
+    uint64_t messages = (argc > 3) ? strtoull(argv[3], nullptr, 10) : 100000;
+    uint32_t pairs = (argc > 4) ? strtoul(argv[4], nullptr, 10) : 100;
+
+    if (identities == 0 || threads == 0 || messages == 0 || pairs == 0)
+    {
+        cout << "usage: " << argv[0]
+             << " [identities] [threads] [messages per identity]"
+             << " [sender/reciever pairs per identity]" << endl;
+        return 1;
+    }
+
+    // Senders of each identity forward to the recievers of the next one, so
+    // every message is routed to a sibling
+    atomic<uint64_t> delivered(0);
+    ForwarderPool pool(threads);
+    for (uint32_t id = 0; id < identities; ++id)
+    {
+        LoopbackTransport* transport = new LoopbackTransport();
+        PoolForwarder* forwarder = new PoolForwarder(transport, pairs,
+                                                     messages, 100,
+                                                     delivered);
+
+        // Senders are aliases [0, pairs), recievers [pairs, 2 * pairs)
+        for (uint32_t i = 0; i < 2 * pairs; ++i)
+        {
+            forwarder->addAllowedFriend(makeKey(id * 2 * pairs + i));
+            transport->setFriendConnected(i, true);
+        }
+
+        uint32_t next = (id + 1) % identities;
+        for (uint32_t i = 0; i < pairs; ++i)
+        {
+            ToxKey reciever = makeKey(next * 2 * pairs + pairs + i);
+            transport->injectMessage(i, "!forward " + reciever.getHex());
+        }
+
+        pool.add(unique_ptr<Intermediary>(forwarder));
+    }
+
+    // Stops the pool once everything has arrived
+    uint64_t total = messages * identities;
+    thread watcher([&]()
+    {
+        while (delivered < total)
+        {
+            this_thread::sleep_for(chrono::milliseconds(1));
+        }
+        pool.stop();
+    });
+
+    uint64_t start = now();
+    pool.run();
+    uint64_t elapsed = now() - start;
+    watcher.join();
+
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    cout << "identities:   " << identities << endl;
+    cout << "threads:      " << threads << endl;
+    cout << "messages:     " << total << endl;
+    cout << "elapsed:      " << elapsed / 1000.0 << " ms" << endl;
+    cout << "throughput:   " << total * 1000000.0 / elapsed << " msg/s"
+         << endl;
+    cout << "peak rss:     " << usage.ru_maxrss << " KiB" << endl;
+
+    return 0;
+}
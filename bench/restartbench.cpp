@@ -0,0 +1,160 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+#include "intermediary.h"
+#include "loopbacktransport.h"
+
+
+using namespace std;
+
+
+static const string JournalFile = "restartbench.journal";
+static const string SnapshotFile = "restartbench.snapshot";
+
+// Microseconds from a monotonic clock
+static uint64_t now()
+{
+    using namespace std::chrono;
+    return duration_cast<microseconds>(
+        steady_clock::now().time_since_epoch()).count();
+}
+
+// Deterministic public key for simulated friend i
+static ToxKey makeKey(uint32_t i)
+{
+    vector<uint8_t> bin(tox_public_key_size(), 0);
+    for (size_t b = 0; b < bin.size(); ++b)
+    {
+        bin[b] = (uint8_t)((i >> ((b % 4) * 8)) ^ (b * 131));
+    }
+    return ToxKey(ToxKey::Public, bin);
+}
+
+// Creates an intermediary over the files left by the last one, returning
+// null if they could not be opened
+static unique_ptr<Intermediary> start(LoopbackTransport* transport,
+                                      uint32_t friends, bool snapshots)
+{
+    unique_ptr<Intermediary> forwarder(
+        new Intermediary(unique_ptr<ToxTransport>(transport)));
+    if (snapshots)
+    {
+        unique_ptr<Snapshot> snapshot(new Snapshot());
+        if (!snapshot->open(SnapshotFile))
+        {
+            return nullptr;
+        }
+        forwarder->setSnapshot(SnapshotFile, snapshot->isOpen() ?
+                                                 move(snapshot) : nullptr);
+    }
+
+    // Friends 1 to friends are the recievers, 0 the sender
+    for (uint32_t i = 0; i <= friends; ++i)
+    {
+        forwarder->addAllowedFriend(makeKey(i));
+    }
+    if (!forwarder->openJournal(JournalFile))
+    {
+        return nullptr;
+    }
+    return forwarder;
+}
+
+
+int main(int argc, char* argv[])
+{
+    uint32_t friends = (argc > 1) ? strtoul(argv[1], nullptr, 10) : 100000;
+    uint32_t messages = (argc > 2) ? strtoul(argv[2], nullptr, 10) : 20;
+    uint32_t size = (argc > 3) ? strtoul(argv[3], nullptr, 10) : 64;
+    bool snapshots = (argc <= 4) || strtoul(argv[4], nullptr, 10) != 0;
+
+    if (friends == 0 || messages == 0)
+    {
+        cout << "usage: " << argv[0]
+             << " [friends] [messages per friend] [message size] [snapshots]"
+             << endl;
+        return 1;
+    }
+
+    remove(JournalFile.c_str());
+    remove(SnapshotFile.c_str());
+
+    // Queue messages for every offline reciever
+    uint64_t queueStart = now();
+    {
+        LoopbackTransport* transport = new LoopbackTransport();
+        unique_ptr<Intermediary> forwarder = start(transport, friends,
+                                                   snapshots);
+        if (!forwarder)
+        {
+            cout << "error: failed to open the journal" << endl;
+            return 1;
+        }
+        transport->setFriendConnected(0, true);
+
+        string message(size, 'x');
+        for (uint32_t i = 1; i <= friends; ++i)
+        {
+            transport->injectMessage(0, "!forward " + makeKey(i).getHex());
+            for (uint32_t m = 0; m < messages; ++m)
+            {
+                transport->injectMessage(0, message);
+            }
+
+            // Keep the command queue short
+            if (i % 1000 == 0 || i == friends)
+            {
+                forwarder->update();
+            }
+        }
+        if (snapshots)
+        {
+            forwarder->saveSnapshot();
+        }
+    }
+    uint64_t queueTime = now() - queueStart;
+
+    // Restart, and bring one reciever online
+    uint64_t restartStart = now();
+    LoopbackTransport* transport = new LoopbackTransport();
+    unique_ptr<Intermediary> forwarder = start(transport, friends, snapshots);
+    if (!forwarder)
+    {
+        cout << "error: failed to reopen the journal" << endl;
+        return 1;
+    }
+    uint64_t openTime = now() - restartStart;
+
+    uint32_t delivered = 0;
+    transport->setDeliveryHandler([&delivered](uint32_t alias,
+                                               const string& message)
+    {
+        if (!message.empty() && message[0] == 'x')
+        {
+            ++delivered;
+        }
+    });
+    transport->setFriendConnected(friends / 2 + 1, true);
+    while (delivered == 0)
+    {
+        forwarder->update();
+    }
+    uint64_t serveTime = now() - restartStart;
+
+    // Report
+    cout << "friends:      " << friends << ", " << messages
+         << " messages of " << size << " bytes each" << endl;
+    cout << "persistence:  " << (snapshots ? "snapshot and journal" :
+                                             "journal only") << endl;
+    cout << "queue time:   " << queueTime / 1000.0 << " ms" << endl;
+    cout << "restart:      " << openTime / 1000.0 << " ms" << endl;
+    cout << "first send:   " << serveTime / 1000.0 << " ms after restart"
+         << endl;
+
+    forwarder.reset();
+    remove(JournalFile.c_str());
+    remove(SnapshotFile.c_str());
+    return 0;
+}
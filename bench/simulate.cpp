@@ -0,0 +1,218 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <vector>
+#include "intermediary.h"
+#include "simulatedtransport.h"
+
+
+using namespace std;
+
+
+// Deterministic public key for simulated friend i
+static ToxKey makeKey(uint32_t i)
+{
+    vector<uint8_t> bin(tox_public_key_size(), 0);
+    for (size_t b = 0; b < bin.size(); ++b)
+    {
+        bin[b] = (uint8_t)((i >> ((b % 4) * 8)) ^ (b * 131));
+    }
+    return ToxKey(ToxKey::Public, bin);
+}
+
+
+/*! @brief Records deliveries and stops once the workload has drained or the
+ *         drain limit has passed.
+ */
+class SimForwarder : public Intermediary
+{
+public:
+    SimForwarder(SimulatedTransport* transport, uint64_t messages,
+                 uint64_t stopTime)
+        : Intermediary(unique_ptr<ToxTransport>(transport))
+        , mMessages(messages)
+        , mStopTime(stopTime)
+        , mDelivered(0)
+        , mDuplicates(0)
+        , mLastDelivery(0)
+        , mSendTimes(messages, 0)
+        , mSeen(messages, false)
+    {
+        transport->setDeliveryHandler(
+            [this](uint32_t alias, const string& message)
+            {
+                onDelivered(message);
+            });
+    }
+
+    void setSendTime(uint64_t index, uint64_t time)
+    {
+        mSendTimes[index] = time;
+    }
+
+    void onCoreUpdate() override
+    {
+        Intermediary::onCoreUpdate();
+
+        if (mDelivered == mMessages || getTime() >= mStopTime)
+        {
+            stop();
+        }
+    }
+
+    uint64_t mMessages;
+    uint64_t mStopTime;
+    uint64_t mDelivered;
+    uint64_t mDuplicates;
+    uint64_t mLastDelivery;
+    vector<uint64_t> mSendTimes;
+    vector<uint64_t> mLatencies;
+    vector<bool> mSeen;
+
+private:
+    void onDelivered(const string& message)
+    {
+        if (message.empty() || message[0] != 'm')
+        {
+            // Sender and server notices
+            return;
+        }
+
+        uint64_t index = strtoull(message.c_str() + 1, nullptr, 10);
+        if (index >= mMessages)
+        {
+            return;
+        }
+
+        if (mSeen[index])
+        {
+            ++mDuplicates;
+            return;
+        }
+
+        mSeen[index] = true;
+        mLastDelivery = getTime();
+        mLatencies.push_back(mLastDelivery - mSendTimes[index]);
+        ++mDelivered;
+    }
+};
+
+
+// Reads name=value from the arguments
+static double option(int argc, char* argv[], const char* name, double value)
+{
+    size_t length = strlen(name);
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strncmp(argv[i], name, length) == 0 && argv[i][length] == '=')
+        {
+            return atof(argv[i] + length + 1);
+        }
+    }
+    return value;
+}
+
+
+int main(int argc, char* argv[])
+{
+    SimulationConfig config;
+    config.seed = option(argc, argv, "seed", 1);
+    config.messageLoss = option(argc, argv, "loss", 0.01);
+    config.recieptLoss = option(argc, argv, "recieptloss", 0.01);
+    config.minRecieptDelay = option(argc, argv, "mindelay", 20);
+    config.maxRecieptDelay = option(argc, argv, "maxdelay", 800);
+    config.meanOnlineTime = option(argc, argv, "online", 30) * 60000;
+    config.meanOfflineTime = option(argc, argv, "offline", 10) * 60000;
+    config.firstMessageId = UINT32_MAX - option(argc, argv, "wrap", 1000);
+
+    uint64_t duration = option(argc, argv, "hours", 24) * 3600000;
+    uint64_t drainLimit = option(argc, argv, "drain", 12) * 3600000;
+    uint32_t pairs = option(argc, argv, "pairs", 200);
+    double perMinute = option(argc, argv, "rate", 2);
+    uint32_t window = option(argc, argv, "window", 8);
+
+    if (pairs == 0 || perMinute <= 0 || window == 0)
+    {
+        cout << "usage: " << argv[0] << " [seed=N] [hours=N] [pairs=N] "
+             << "[rate=msgs/min/sender] [loss=P] [recieptloss=P] "
+             << "[mindelay=ms] [maxdelay=ms] [online=min] [offline=min] "
+             << "[wrap=N] [window=N] [drain=hours]" << endl;
+        return 1;
+    }
+
+    // Generate the workload, senders send at exponential intervals
+    mt19937_64 random(config.seed ^ 0x9E3779B97F4A7C15ULL);
+    exponential_distribution<double> gap(perMinute / 60000.0);
+    vector<pair<uint64_t, uint32_t>> sends;
+    for (uint32_t sender = 0; sender < pairs; ++sender)
+    {
+        for (double t = gap(random); t < duration; t += gap(random))
+        {
+            sends.push_back(make_pair((uint64_t)t, sender));
+        }
+    }
+    sort(sends.begin(), sends.end());
+
+    // Senders are aliases [0, pairs), recievers [pairs, 2 * pairs)
+    SimulatedTransport* transport = new SimulatedTransport(config);
+    SimForwarder forwarder(transport, sends.size(), duration + drainLimit);
+    forwarder.setWindowSize(window);
+
+    for (uint32_t i = 0; i < 2 * pairs; ++i)
+    {
+        forwarder.addAllowedFriend(makeKey(i));
+        transport->setFriendConnected(i, true);
+        if (i >= pairs)
+        {
+            transport->startFlapping(i);
+        }
+    }
+    for (uint32_t i = 0; i < pairs; ++i)
+    {
+        transport->scheduleMessage(0, i,
+                                   "!forward " + makeKey(pairs + i).getHex());
+    }
+    for (size_t i = 0; i < sends.size(); ++i)
+    {
+        // After the forward commands
+        uint64_t time = sends[i].first + 1;
+        forwarder.setSendTime(i, time);
+        transport->scheduleMessage(time, sends[i].second, "m" + to_string(i));
+    }
+
+    // Run
+    auto start = chrono::steady_clock::now();
+    forwarder.run();
+    double wall = chrono::duration<double>(chrono::steady_clock::now() -
+                                           start).count();
+
+    // Report
+    vector<uint64_t>& latencies = forwarder.mLatencies;
+    sort(latencies.begin(), latencies.end());
+    uint64_t p50 = latencies.empty() ? 0 : latencies[latencies.size() / 2];
+    uint64_t p99 = latencies.empty() ? 0 :
+                                       latencies[latencies.size() * 99 / 100];
+    uint64_t drain = (forwarder.mLastDelivery > duration) ?
+                     forwarder.mLastDelivery - duration : 0;
+
+    cout << "seed:            " << config.seed << endl;
+    cout << "virtual time:    " << forwarder.getTime() / 1000.0 << " s"
+         << endl;
+    cout << "wall time:       " << wall << " s" << endl;
+    cout << "messages:        " << sends.size() << endl;
+    cout << "delivered:       " << forwarder.mDelivered << endl;
+    cout << "duplicates:      " << forwarder.mDuplicates << endl;
+    cout << "sends:           " << transport->getSendCount() << endl;
+    cout << "resends:         "
+         << transport->getSendCount() - forwarder.mDelivered << endl;
+    cout << "losses:          " << transport->getLossCount() << endl;
+    cout << "presence flaps:  " << transport->getFlapCount() << endl;
+    cout << "latency p50:     " << p50 << " ms" << endl;
+    cout << "latency p99:     " << p99 << " ms" << endl;
+    cout << "queue drain:     " << drain << " ms after the last send" << endl;
+
+    return (forwarder.mDelivered == sends.size()) ? 0 : 2;
+}
@@ -0,0 +1,242 @@
+#ifndef BASICTOXWRAPPER_H
+#define BASICTOXWRAPPER_H
+
+#include <cassert>
+#include <cstdint>
+#include <string_view>
+#include <type_traits>
+#include <tox/tox.h>
+#include "toxwrapper.h"
+
+/*! @brief Owns a tox instance and dispatches its callbacks to Derived without
+ *         virtual calls or a registry lookup. Derived passes itself as the
+ *         template argument and hides any of the on* hooks below that it wants
+ *         to handle; each callback casts toxcore's user_data back to Derived
+ *         and calls the hook directly, so it can be inlined.
+ *
+ *  Only hooks that Derived hides are registered with toxcore, the rest cost
+ *  nothing. Derived must make this class a friend if its hooks are private.
+ */
+template <typename Derived>
+class BasicToxWrapper
+{
+public:
+
+    /*! @brief Initializes a tox instance.
+     *  @param options The options to be set when creating the tox instance.
+     */
+    explicit BasicToxWrapper(const ToxOptionsWrapper& options)
+        : mTox(tox_new(options.mOptions, nullptr))
+    {
+        assert(mTox);
+
+        if constexpr (handles(&Derived::onConnectionStatusChanged,
+                              &BasicToxWrapper::onConnectionStatusChanged))
+        {
+            tox_callback_self_connection_status(mTox, selfConnectionStatus);
+        }
+        if constexpr (handles(&Derived::onFriendRequestRecieved,
+                              &BasicToxWrapper::onFriendRequestRecieved))
+        {
+            tox_callback_friend_request(mTox, friendRequest);
+        }
+        if constexpr (handles(&Derived::onFriendNameChanged,
+                              &BasicToxWrapper::onFriendNameChanged))
+        {
+            tox_callback_friend_name(mTox, friendName);
+        }
+        if constexpr (handles(&Derived::onFriendStatusMessageChanged,
+                              &BasicToxWrapper::onFriendStatusMessageChanged))
+        {
+            tox_callback_friend_status_message(mTox, friendStatusMessage);
+        }
+        if constexpr (
+            handles(&Derived::onFriendConnectionStatusChanged,
+                    &BasicToxWrapper::onFriendConnectionStatusChanged))
+        {
+            tox_callback_friend_connection_status(mTox,
+                                                  friendConnectionStatus);
+        }
+        if constexpr (handles(&Derived::onMessageSentSuccess,
+                              &BasicToxWrapper::onMessageSentSuccess))
+        {
+            tox_callback_friend_read_receipt(mTox, friendReadReciept);
+        }
+        if constexpr (handles(&Derived::onMessageRecieved,
+                              &BasicToxWrapper::onMessageRecieved))
+        {
+            tox_callback_friend_message(mTox, friendMessage);
+        }
+        if constexpr (handles(&Derived::onLosslessPacketRecieved,
+                              &BasicToxWrapper::onLosslessPacketRecieved))
+        {
+            tox_callback_friend_lossless_packet(mTox, friendLosslessPacket);
+        }
+    }
+
+    /*! @brief Destroys the tox instance.
+     */
+    ~BasicToxWrapper()
+    {
+        tox_kill(mTox);
+    }
+
+
+    // No copy/assignment allowed
+    BasicToxWrapper(const BasicToxWrapper&) = delete;
+    BasicToxWrapper& operator=(const BasicToxWrapper&) = delete;
+
+
+    /*! @brief Returns the tox instance.
+     */
+    Tox* getTox() const
+    {
+        return mTox;
+    }
+
+    /*! @brief Performs any pending work, calling the hooks of Derived for each
+     *         event that occurred.
+     */
+    void iterate()
+    {
+        tox_iterate(mTox, static_cast<Derived*>(this));
+    }
+
+
+    /*! @brief Called when the connection status changes.
+     *  @param online True if we are online.
+     */
+    void onConnectionStatusChanged(bool online) {}
+
+    /*! @brief Called when a friend request is recieved.
+     *  @param publicKey The public key of the sender.
+     *  @param message The message sent with the request.
+     */
+    void onFriendRequestRecieved(const ToxKey& publicKey,
+                                 std::string_view message) {}
+
+    /*! @brief Called when a friend's name is changed.
+     *  @param alias The alias for the friend.
+     *  @param name The new name.
+     */
+    void onFriendNameChanged(uint32_t alias, std::string_view name) {}
+
+    /*! @brief Called when a friend's status message is changed.
+     *  @param alias The alias for the friend.
+     *  @param message The new status message.
+     */
+    void onFriendStatusMessageChanged(uint32_t alias,
+                                      std::string_view message) {}
+
+    /*! @brief Called when the connection status of a friend is changed.
+     *  @param alias The alias for the friend.
+     *  @param online True if the friend is online.
+     */
+    void onFriendConnectionStatusChanged(uint32_t alias, bool online) {}
+
+    /*! @brief Called when the reciept for a sent message is recieved.
+     *  @param friendAlias The alias for the friend the message was sent to.
+     *  @param messageId The unique id (for the friend) of the message sent.
+     */
+    void onMessageSentSuccess(uint32_t friendAlias, uint32_t messageId) {}
+
+    /*! @brief Called when a message from a friend is recieved.
+     *  @param friendAlias The alias for the friend.
+     *  @param message The message recieved. Only valid until this returns.
+     *  @param actionType Whether or not the message is an action (/me for ex.).
+     */
+    void onMessageRecieved(uint32_t friendAlias, std::string_view message,
+                           bool actionType) {}
+
+    /*! @brief Called when a custom lossless packet from a friend is recieved.
+     *  @param friendAlias The alias for the friend.
+     *  @param packet The packet, including its first byte. Only valid until
+     *                this returns.
+     */
+    void onLosslessPacketRecieved(uint32_t friendAlias,
+                                  std::string_view packet) {}
+
+
+    // The callbacks given to toxcore, public so the cost of dispatch can be
+    // measured without a network
+
+    static void selfConnectionStatus(Tox* tox, TOX_CONNECTION status,
+                                     void* userData)
+    {
+        get(userData)->onConnectionStatusChanged(status != TOX_CONNECTION_NONE);
+    }
+
+    static void friendRequest(Tox* tox, const uint8_t* publicKey,
+                              const uint8_t* message, size_t length,
+                              void* userData)
+    {
+        get(userData)->onFriendRequestRecieved(
+            ToxKey(ToxKey::Public, publicKey, TOX_PUBLIC_KEY_SIZE),
+            std::string_view((const char*)message, length));
+    }
+
+    static void friendName(Tox* tox, uint32_t alias, const uint8_t* name,
+                           size_t length, void* userData)
+    {
+        get(userData)->onFriendNameChanged(
+            alias, std::string_view((const char*)name, length));
+    }
+
+    static void friendStatusMessage(Tox* tox, uint32_t alias,
+                                    const uint8_t* message, size_t length,
+                                    void* userData)
+    {
+        get(userData)->onFriendStatusMessageChanged(
+            alias, std::string_view((const char*)message, length));
+    }
+
+    static void friendConnectionStatus(Tox* tox, uint32_t alias,
+                                       TOX_CONNECTION status, void* userData)
+    {
+        get(userData)->onFriendConnectionStatusChanged(
+            alias, status != TOX_CONNECTION_NONE);
+    }
+
+    static void friendReadReciept(Tox* tox, uint32_t alias,
+                                  uint32_t messageId, void* userData)
+    {
+        get(userData)->onMessageSentSuccess(alias, messageId);
+    }
+
+    static void friendMessage(Tox* tox, uint32_t alias, TOX_MESSAGE_TYPE type,
+                              const uint8_t* message, size_t length,
+                              void* userData)
+    {
+        get(userData)->onMessageRecieved(
+            alias, std::string_view((const char*)message, length),
+            type == TOX_MESSAGE_TYPE_ACTION);
+    }
+
+    static void friendLosslessPacket(Tox* tox, uint32_t alias,
+                                     const uint8_t* data, size_t length,
+                                     void* userData)
+    {
+        get(userData)->onLosslessPacketRecieved(
+            alias, std::string_view((const char*)data, length));
+    }
+
+protected:
+
+    Tox* mTox;
+
+private:
+
+    static Derived* get(void* userData)
+    {
+        return static_cast<Derived*>(userData);
+    }
+
+    // True if Derived declares its own version of a hook
+    template <typename Hook, typename BaseHook>
+    static constexpr bool handles(Hook, BaseHook)
+    {
+        return !std::is_same<Hook, BaseHook>::value;
+    }
+};
+
+#endif
@@ -0,0 +1,124 @@
+#include "channel.h"
+
+#include <cassert>
+
+
+// Numbers are sent most significant byte first
+
+static void writeUint32(char* out, uint32_t value)
+{
+    out[0] = (char)(value >> 24);
+    out[1] = (char)(value >> 16);
+    out[2] = (char)(value >> 8);
+    out[3] = (char)value;
+}
+
+static uint32_t readUint32(const char* in)
+{
+    const uint8_t* bytes = (const uint8_t*)in;
+    return ((uint32_t)bytes[0] << 24) | ((uint32_t)bytes[1] << 16) |
+           ((uint32_t)bytes[2] << 8) | bytes[3];
+}
+
+
+void writeChannelHeader(std::string& packet, ChannelFrame frame,
+                        uint32_t session, uint32_t sequence)
+{
+    char header[ChannelHeaderSize];
+    header[0] = (char)ChannelPacketId;
+    header[1] = (char)frame;
+    writeUint32(header + 2, session);
+    writeUint32(header + 6, sequence);
+    packet.assign(header, sizeof(header));
+}
+
+void writeRecordHeader(char* header, uint32_t keyId, uint8_t flags,
+                       uint16_t length)
+{
+    writeUint32(header, keyId);
+    header[4] = (char)flags;
+    header[5] = (char)(length >> 8);
+    header[6] = (char)length;
+}
+
+void appendRecord(std::string& packet, uint32_t keyId, uint8_t flags,
+                  std::string_view payload)
+{
+    assert(payload.size() <= UINT16_MAX);
+
+    char header[RecordHeaderSize];
+    writeRecordHeader(header, keyId, flags, payload.size());
+    packet.append(header, sizeof(header));
+    packet.append(payload);
+}
+
+
+// The ChannelReader implementation
+
+ChannelReader::ChannelReader(std::string_view packet)
+    : mPacket(packet)
+    , mPos(ChannelHeaderSize)
+    , mValid(false)
+    , mFrame(CF_Hello)
+    , mSession(0)
+    , mSequence(0)
+{
+    if (packet.size() < ChannelHeaderSize ||
+        (uint8_t)packet[0] != ChannelPacketId)
+    {
+        return;
+    }
+
+    uint8_t frame = packet[1];
+    if (frame != CF_Hello && frame != CF_Data && frame != CF_Ack)
+    {
+        return;
+    }
+
+    mValid = true;
+    mFrame = (ChannelFrame)frame;
+    mSession = readUint32(packet.data() + 2);
+    mSequence = readUint32(packet.data() + 6);
+}
+
+bool ChannelReader::isValid() const
+{
+    return mValid;
+}
+
+ChannelFrame ChannelReader::getFrame() const
+{
+    return mFrame;
+}
+
+uint32_t ChannelReader::getSession() const
+{
+    return mSession;
+}
+
+uint32_t ChannelReader::getSequence() const
+{
+    return mSequence;
+}
+
+bool ChannelReader::next(ChannelRecord& record)
+{
+    if (!mValid || mFrame != CF_Data ||
+        mPacket.size() - mPos < RecordHeaderSize)
+    {
+        return false;
+    }
+
+    const char* header = mPacket.data() + mPos;
+    size_t length = ((size_t)(uint8_t)header[5] << 8) | (uint8_t)header[6];
+    if (mPacket.size() - mPos - RecordHeaderSize < length)
+    {
+        return false;
+    }
+
+    record.keyId = readUint32(header);
+    record.flags = header[4];
+    record.payload = mPacket.substr(mPos + RecordHeaderSize, length);
+    mPos += RecordHeaderSize + length;
+    return true;
+}
@@ -0,0 +1,143 @@
+#ifndef CHANNEL_H
+#define CHANNEL_H
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+/*! @brief The first byte of every channel packet. Toxcore only passes on
+ *         lossless packets starting with a byte from 160 to 191.
+ */
+const uint8_t ChannelPacketId = 160;
+
+/*! @brief The bytes before the records of a packet: the packet id, the
+ *         frame, the session and the sequence number.
+ */
+const size_t ChannelHeaderSize = 10;
+
+/*! @brief The bytes before the payload of a record: the key id, the flags
+ *         and the payload length.
+ */
+const size_t RecordHeaderSize = 7;
+
+/*! @brief The kinds of channel packets.
+ */
+enum ChannelFrame
+{
+    /*! @brief Asks for messages to be sent as records, without records of
+     *         its own.
+     */
+    CF_Hello = 1,
+
+    /*! @brief Carries records. The sequence number counts data packets.
+     */
+    CF_Data = 2,
+
+    /*! @brief Acknowledges every data packet of the session before the
+     *         sequence number.
+     */
+    CF_Ack = 3
+};
+
+/*! @brief Flags describing the payload of a record.
+ */
+enum RecordFlags
+{
+    /*! @brief The payload is a public key, which the key id stands for in
+     *         later records.
+     */
+    RF_Bind = 1,
+
+    /*! @brief The payload is a notice from the intermediary.
+     */
+    RF_Server = 2,
+
+    /*! @brief The payload is a fragment, see FragmentAssembler.
+     */
+    RF_Fragment = 4
+};
+
+/*! @brief A record read from a data packet. The payload points into the
+ *         packet.
+ */
+struct ChannelRecord
+{
+    uint32_t keyId;
+    uint8_t flags;
+    std::string_view payload;
+};
+
+/*! @brief Replaces a packet with a channel header.
+ *  @param packet The packet.
+ *  @param frame The kind of packet.
+ *  @param session Chosen by the sender when it starts, so the reciever can
+ *                 tell when sequence numbers start again.
+ *  @param sequence The sequence number of a data packet, or the next one
+ *                  expected for an ack.
+ */
+void writeChannelHeader(std::string& packet, ChannelFrame frame,
+                        uint32_t session, uint32_t sequence);
+
+/*! @brief Writes the header of a record.
+ *  @param header Recieves RecordHeaderSize bytes.
+ *  @param keyId Who the record is to or from, see readme.md.
+ *  @param flags Any of RecordFlags.
+ *  @param length The size of the payload.
+ */
+void writeRecordHeader(char* header, uint32_t keyId, uint8_t flags,
+                       uint16_t length);
+
+/*! @brief Adds a record to the end of a data packet.
+ *  @param packet The packet, starting with a header.
+ *  @param keyId See writeRecordHeader().
+ *  @param flags See writeRecordHeader().
+ *  @param payload The payload, at most 65535 bytes.
+ */
+void appendRecord(std::string& packet, uint32_t keyId, uint8_t flags,
+                  std::string_view payload);
+
+
+/*! @brief Reads the header and records of a channel packet.
+ */
+class ChannelReader
+{
+public:
+
+    /*! @brief Reads the header of a packet.
+     *  @param packet The packet, which must outlive the reader.
+     */
+    explicit ChannelReader(std::string_view packet);
+
+    /*! @brief Returns whether the packet has a valid header.
+     */
+    bool isValid() const;
+
+    /*! @brief Returns the kind of packet.
+     */
+    ChannelFrame getFrame() const;
+
+    /*! @brief Returns the session of the sender.
+     */
+    uint32_t getSession() const;
+
+    /*! @brief Returns the sequence number.
+     */
+    uint32_t getSequence() const;
+
+    /*! @brief Reads the next record of a data packet.
+     *  @param record Replaced with the record.
+     *  @return False once there are no more, or the rest is truncated.
+     */
+    bool next(ChannelRecord& record);
+
+private:
+
+    std::string_view mPacket;
+    size_t mPos;
+    bool mValid;
+    ChannelFrame mFrame;
+    uint32_t mSession;
+    uint32_t mSequence;
+};
+
+#endif
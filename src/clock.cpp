@@ -0,0 +1,81 @@
+#include "clock.h"
+
+#include <chrono>
+#include <climits>
+#include <thread>
+#include <poll.h>
+
+
+// The Clock implementation
+
+Clock::~Clock()
+{
+}
+
+void Clock::wait(uint64_t duration, int fd)
+{
+    sleep(duration);
+}
+
+
+// The SteadyClock implementation
+
+uint64_t SteadyClock::now()
+{
+    using namespace std::chrono;
+    return duration_cast<milliseconds>(
+        steady_clock::now().time_since_epoch()).count();
+}
+
+void SteadyClock::sleep(uint64_t duration)
+{
+    std::this_thread::sleep_for(std::chrono::milliseconds(duration));
+}
+
+void SteadyClock::wait(uint64_t duration, int fd)
+{
+    pollfd watched = {fd, POLLIN, 0};
+    uint64_t deadline = now() + duration;
+
+    // Restart after signals until the deadline
+    int timeout = duration < INT_MAX ? (int)duration : INT_MAX;
+    while (poll(&watched, 1, timeout) < 0)
+    {
+        uint64_t current = now();
+        if (current >= deadline)
+        {
+            break;
+        }
+        timeout = deadline - current < INT_MAX ? (int)(deadline - current)
+                                               : INT_MAX;
+    }
+}
+
+SteadyClock& SteadyClock::get()
+{
+    static SteadyClock instance;
+    return instance;
+}
+
+
+// The VirtualClock implementation
+
+VirtualClock::VirtualClock(uint64_t start)
+    : mNow(start)
+{
+}
+
+uint64_t VirtualClock::now()
+{
+    return mNow;
+}
+
+void VirtualClock::sleep(uint64_t duration)
+{
+    advance(duration);
+}
+
+void VirtualClock::advance(uint64_t duration)
+{
+    mNow += duration;
+}
@@ -0,0 +1,81 @@
+#ifndef CLOCK_H
+#define CLOCK_H
+
+#include <cstdint>
+
+/*! @brief A source of monotonic time that can also be waited on. Allows time
+ *         to be simulated.
+ */
+class Clock
+{
+public:
+
+    /*! @brief Destructor.
+     */
+    virtual ~Clock();
+
+    /*! @brief Returns the current time in milliseconds. Only differences
+     *         between times are meaningful.
+     */
+    virtual uint64_t now() = 0;
+
+    /*! @brief Blocks until the given amount of time has passed.
+     *  @param duration The time to wait in milliseconds.
+     */
+    virtual void sleep(uint64_t duration) = 0;
+
+    /*! @brief Blocks until the given amount of time has passed or a file
+     *         descriptor becomes readable, whichever is first. Defaults to
+     *         sleep(), ignoring the file descriptor.
+     *  @param duration The longest time to wait in milliseconds.
+     *  @param fd The file descriptor to watch.
+     */
+    virtual void wait(uint64_t duration, int fd);
+};
+
+
+/*! @brief The real monotonic clock of the system.
+ */
+class SteadyClock : public Clock
+{
+public:
+
+    uint64_t now() override;
+
+    void sleep(uint64_t duration) override;
+
+    void wait(uint64_t duration, int fd) override;
+
+    /*! @brief Returns a shared instance.
+     */
+    static SteadyClock& get();
+};
+
+
+/*! @brief A clock that only moves when told to. Sleeping advances the time
+ *         instantly.
+ */
+class VirtualClock : public Clock
+{
+public:
+
+    /*! @brief Constructor.
+     *  @param start The initial time in milliseconds.
+     */
+    explicit VirtualClock(uint64_t start=0);
+
+    uint64_t now() override;
+
+    void sleep(uint64_t duration) override;
+
+    /*! @brief Moves the time forward.
+     *  @param duration The amount to advance in milliseconds.
+     */
+    void advance(uint64_t duration);
+
+private:
+
+    uint64_t mNow;
+};
+
+#endif
@@ -0,0 +1,89 @@
+#include "commandqueue.h"
+
+#include <cassert>
+#include <cstdint>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+
+// The CommandQueue implementation
+
+CommandQueue::CommandQueue()
+    : mHead(nullptr)
+    , mFd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC))
+{
+    assert(mFd >= 0);
+}
+
+CommandQueue::~CommandQueue()
+{
+    Node* node = mHead.exchange(nullptr);
+    while (node)
+    {
+        Node* next = node->next;
+        delete node;
+        node = next;
+    }
+
+    close(mFd);
+}
+
+void CommandQueue::push(Command command)
+{
+    // The node belongs to the consumer once linked, so keep what it replaced
+    Node* head = mHead.load();
+    Node* node = new Node{std::move(command), head};
+    while (!mHead.compare_exchange_weak(head, node))
+    {
+        node->next = head;
+    }
+
+    // Only the command that ends an empty spell needs to wake the consumer
+    if (!head)
+    {
+        wake();
+    }
+}
+
+void CommandQueue::wake()
+{
+    uint64_t one = 1;
+    ssize_t written = write(mFd, &one, sizeof(one));
+    (void)written;
+}
+
+size_t CommandQueue::runAll()
+{
+    // Reset the eventfd first, anything pushed after this signals it again
+    uint64_t count;
+    ssize_t drained = read(mFd, &count, sizeof(count));
+    (void)drained;
+
+    Node* node = mHead.exchange(nullptr);
+
+    // Restore the order they were pushed in
+    Node* oldest = nullptr;
+    while (node)
+    {
+        Node* next = node->next;
+        node->next = oldest;
+        oldest = node;
+        node = next;
+    }
+
+    size_t ran = 0;
+    while (oldest)
+    {
+        Node* next = oldest->next;
+        oldest->command();
+        delete oldest;
+        oldest = next;
+        ++ran;
+    }
+    return ran;
+}
+
+int CommandQueue::getFd() const
+{
+    return mFd;
+}
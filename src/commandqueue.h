@@ -0,0 +1,68 @@
+#ifndef COMMANDQUEUE_H
+#define COMMANDQUEUE_H
+
+#include <atomic>
+#include <functional>
+
+/*! @brief Passes work from any number of threads to the one thread running
+ *         it. Submitting never blocks or takes a lock, and the first command
+ *         added to an empty queue makes an eventfd readable so the running
+ *         thread can wait on it alongside its timeout.
+ */
+class CommandQueue
+{
+public:
+
+    /*! @brief A unit of work, run on the consuming thread.
+     */
+    typedef std::function<void()> Command;
+
+    /*! @brief Constructor. Creates the eventfd.
+     */
+    CommandQueue();
+
+    /*! @brief Destroys any commands that were never run.
+     */
+    ~CommandQueue();
+
+
+    // No copy/assignment allowed
+    CommandQueue(const CommandQueue&) = delete;
+    CommandQueue& operator=(const CommandQueue&) = delete;
+
+
+    /*! @brief Adds a command. Safe to call from any thread.
+     *  @param command The command.
+     */
+    void push(Command command);
+
+    /*! @brief Makes the eventfd readable without adding a command. Safe to
+     *         call from any thread.
+     */
+    void wake();
+
+    /*! @brief Runs every command added so far, oldest first. Only called from
+     *         the consuming thread.
+     *  @return The number of commands run.
+     */
+    size_t runAll();
+
+    /*! @brief Returns the eventfd, readable while commands are waiting or
+     *         after wake().
+     */
+    int getFd() const;
+
+private:
+
+    struct Node
+    {
+        Command command;
+        Node* next;
+    };
+
+    // Newest first, reversed by the consumer
+    std::atomic<Node*> mHead;
+    int mFd;
+};
+
+#endif
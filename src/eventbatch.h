@@ -0,0 +1,92 @@
+#ifndef EVENTBATCH_H
+#define EVENTBATCH_H
+
+#include <cstdint>
+#include <string_view>
+#include <vector>
+#include "toxwrapper.h"
+
+/*! @brief The events reported by one iteration of a transport, grouped by
+ *         kind so they can be handled a kind at a time. Text is only valid
+ *         until the transport's next iteration.
+ */
+struct ToxEventBatch
+{
+    /*! @brief A friend request that was recieved.
+     */
+    struct FriendRequest
+    {
+        ToxKey publicKey;
+        std::string_view message;
+    };
+
+    /*! @brief A friend's name or status message changing.
+     */
+    struct TextChange
+    {
+        uint32_t alias;
+        std::string_view text;
+    };
+
+    /*! @brief A friend going online or offline.
+     */
+    struct ConnectionChange
+    {
+        uint32_t alias;
+        bool online;
+    };
+
+    /*! @brief The reciept for a sent message.
+     */
+    struct Reciept
+    {
+        uint32_t alias;
+        uint32_t messageId;
+    };
+
+    /*! @brief A message from a friend.
+     */
+    struct Message
+    {
+        uint32_t alias;
+        std::string_view message;
+        bool actionType;
+    };
+
+    /*! @brief A custom lossless packet from a friend.
+     */
+    struct Packet
+    {
+        uint32_t alias;
+        std::string_view packet;
+    };
+
+    /*! @brief Whether this instance's connection changed, and to what.
+     */
+    bool selfConnectionChanged = false;
+    bool selfOnline = false;
+
+    std::vector<FriendRequest> friendRequests;
+    std::vector<TextChange> nameChanges;
+    std::vector<TextChange> statusMessageChanges;
+    std::vector<ConnectionChange> connectionChanges;
+    std::vector<Reciept> reciepts;
+    std::vector<Message> messages;
+    std::vector<Packet> packets;
+
+    /*! @brief Removes every event, keeping the memory for the next batch.
+     */
+    void clear()
+    {
+        selfConnectionChanged = false;
+        friendRequests.clear();
+        nameChanges.clear();
+        statusMessageChanges.clear();
+        connectionChanges.clear();
+        reciepts.clear();
+        messages.clear();
+        packets.clear();
+    }
+};
+
+#endif
@@ -0,0 +1,104 @@
+#include "fileutil.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+
+
+bool writeAll(int fd, const void* data, size_t length)
+{
+    const char* bytes = (const char*)data;
+    while (length > 0)
+    {
+        ssize_t written = ::write(fd, bytes, length);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return false;
+        }
+        bytes += written;
+        length -= written;
+    }
+    return true;
+}
+
+bool readAll(int fd, void* data, size_t length, uint64_t offset)
+{
+    char* bytes = (char*)data;
+    while (length > 0)
+    {
+        ssize_t count = ::pread(fd, bytes, length, offset);
+        if (count < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        else if (count <= 0)
+        {
+            return false;
+        }
+        bytes += count;
+        length -= count;
+        offset += count;
+    }
+    return true;
+}
+
+void syncDirectory(const std::string& path)
+{
+    size_t slash = path.find_last_of('/');
+    std::string dir = (slash == std::string::npos) ? "." :
+                                                     path.substr(0, slash + 1);
+
+    int fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+    if (fd >= 0)
+    {
+        ::fsync(fd);
+        ::close(fd);
+    }
+}
+
+std::string getTempPath(const std::string& path)
+{
+    return path + ".tmp";
+}
+
+int openTempFile(const std::string& path, int flags)
+{
+    return ::open(getTempPath(path).c_str(),
+                  O_WRONLY | O_CREAT | O_TRUNC | flags, 0600);
+}
+
+bool replaceWithTempFile(int fd, const std::string& path)
+{
+    // The rename is only durable once the directory entry is
+    if (::fsync(fd) != 0 ||
+        ::rename(getTempPath(path).c_str(), path.c_str()) != 0)
+    {
+        return false;
+    }
+    syncDirectory(path);
+    return true;
+}
+
+bool writeFile(const std::string& path, const void* data, size_t length)
+{
+    int fd = openTempFile(path);
+    if (fd < 0)
+    {
+        return false;
+    }
+
+    bool success = writeAll(fd, data, length) &&
+                   replaceWithTempFile(fd, path);
+    ::close(fd);
+
+    if (!success)
+    {
+        ::unlink(getTempPath(path).c_str());
+    }
+    return success;
+}
@@ -0,0 +1,61 @@
+#ifndef FILEUTIL_H
+#define FILEUTIL_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+/*! @brief Writes all of a buffer to a file, retrying short and interrupted
+ *         writes.
+ *  @param fd The file.
+ *  @param data The bytes.
+ *  @param length The number of bytes.
+ *  @return False if a write failed.
+ */
+bool writeAll(int fd, const void* data, size_t length);
+
+/*! @brief Reads part of a file, retrying short and interrupted reads.
+ *  @param fd The file.
+ *  @param data Where the bytes are read to.
+ *  @param length The number of bytes.
+ *  @param offset Where in the file to start.
+ *  @return False if a read failed or the file ended first.
+ */
+bool readAll(int fd, void* data, size_t length, uint64_t offset);
+
+/*! @brief Syncs the directory holding a file, so that a file created or
+ *         renamed there survives a crash.
+ *  @param path The file.
+ */
+void syncDirectory(const std::string& path);
+
+/*! @brief Returns the temporary file that replaces a file, next to it.
+ *  @param path The file.
+ */
+std::string getTempPath(const std::string& path);
+
+/*! @brief Creates the empty temporary file that replaces a file.
+ *  @param path The file to replace.
+ *  @param flags Flags to open with besides O_WRONLY, O_CREAT and O_TRUNC.
+ *  @return The temporary file, or -1 on failure.
+ */
+int openTempFile(const std::string& path, int flags = 0);
+
+/*! @brief Syncs the temporary file, then atomically swaps it in, so that a
+ *         crash leaves either the old or the new file. The temporary file is
+ *         left open, and left in place on failure.
+ *  @param fd The temporary file, from openTempFile().
+ *  @param path The file to replace.
+ *  @return False if the temporary file could not be synced or renamed.
+ */
+bool replaceWithTempFile(int fd, const std::string& path);
+
+/*! @brief Atomically replaces a file with new contents.
+ *  @param path The file.
+ *  @param data The new contents.
+ *  @param length The number of bytes.
+ *  @return False if the file is unchanged.
+ */
+bool writeFile(const std::string& path, const void* data, size_t length);
+
+#endif
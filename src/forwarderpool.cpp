@@ -0,0 +1,355 @@
+#include "forwarderpool.h"
+
+#include <algorithm>
+#include <cassert>
+#include <climits>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include "clock.h"
+
+
+// The most events handled per wait
+static const int MaxEvents = 16;
+
+static uint64_t getTime()
+{
+    return SteadyClock::get().now();
+}
+
+
+// The ForwarderPool implementation
+
+ForwarderPool::ForwarderPool(size_t threads)
+    : mEpollFd(epoll_create1(EPOLL_CLOEXEC))
+    , mKickFd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC))
+    , mStop(false)
+{
+    assert(threads > 0);
+    assert(mEpollFd >= 0 && mKickFd >= 0);
+
+    for (size_t i = 0; i < threads; ++i)
+    {
+        mWorkers.emplace_back(new Worker());
+    }
+
+    // The kick is identified by a null pointer
+    epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.ptr = nullptr;
+    int added = epoll_ctl(mEpollFd, EPOLL_CTL_ADD, mKickFd, &event);
+    assert(added == 0);
+    (void)added;
+}
+
+ForwarderPool::~ForwarderPool()
+{
+    // Commands still queued may route to siblings, so stop that first
+    for (auto it = mIdentities.begin(); it != mIdentities.end(); ++it)
+    {
+        (*it)->forwarder->setRouter(nullptr);
+    }
+    mIdentities.clear();
+
+    close(mKickFd);
+    close(mEpollFd);
+}
+
+void ForwarderPool::add(std::unique_ptr<Intermediary> forwarder)
+{
+    assert(forwarder);
+    forwarder->setRouter(this);
+
+    Identity* identity = new Identity();
+    identity->forwarder = std::move(forwarder);
+    identity->state = Ready;
+    identity->generation = 0;
+    mIdentities.emplace_back(identity);
+
+    watch(identity, EPOLL_CTL_ADD);
+}
+
+size_t ForwarderPool::size() const
+{
+    return mIdentities.size();
+}
+
+Intermediary& ForwarderPool::operator[](size_t index)
+{
+    assert(index < mIdentities.size());
+    return *mIdentities[index]->forwarder;
+}
+
+void ForwarderPool::run()
+{
+    // Index every friend, it is only read while the workers run
+    mRoutes.clear();
+    std::vector<uint32_t> aliases;
+    for (auto it = mIdentities.begin(); it != mIdentities.end(); ++it)
+    {
+        Intermediary& forwarder = *(*it)->forwarder;
+        forwarder.getFriendList(aliases);
+        for (auto alias = aliases.begin(); alias != aliases.end(); ++alias)
+        {
+            mRoutes.emplace(forwarder.getFriendPublicKey(*alias), &forwarder);
+        }
+    }
+
+    // Everyone starts with an update, spread over the workers
+    mWakeups = decltype(mWakeups)();
+    for (auto it = mWorkers.begin(); it != mWorkers.end(); ++it)
+    {
+        (*it)->ready.clear();
+    }
+    for (size_t i = 0; i < mIdentities.size(); ++i)
+    {
+        Identity* identity = mIdentities[i].get();
+        identity->state = Ready;
+        mWorkers[i % mWorkers.size()]->ready.push_back(identity);
+        watch(identity, EPOLL_CTL_MOD);
+    }
+
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < mWorkers.size(); ++i)
+    {
+        threads.emplace_back(&ForwarderPool::work, this, i);
+    }
+    work(0);
+
+    for (auto it = threads.begin(); it != threads.end(); ++it)
+    {
+        it->join();
+    }
+
+    // Nothing changed is lost on shutdown
+    for (auto it = mIdentities.begin(); it != mIdentities.end(); ++it)
+    {
+        (*it)->forwarder->flushSaveData();
+    }
+}
+
+void ForwarderPool::stop()
+{
+    mStop = true;
+    kick();
+}
+
+bool ForwarderPool::serves(const ToxKey& publicKey)
+{
+    return mRoutes.find(publicKey) != mRoutes.end();
+}
+
+void ForwarderPool::route(const ToxKey& sender, const ToxKey& reciever,
+                          std::string_view message)
+{
+    auto it = mRoutes.find(reciever);
+    if (it == mRoutes.end())
+    {
+        return;
+    }
+
+    Intermediary* sibling = it->second;
+    sibling->post([sibling, sender, reciever, text = std::string(message)]()
+    {
+        sibling->deliverFromSibling(sender, reciever, text);
+    });
+}
+
+void ForwarderPool::work(size_t worker)
+{
+    while (!mStop)
+    {
+        Identity* identity = take(worker);
+        if (identity)
+        {
+            runIdentity(worker, identity);
+        }
+        else
+        {
+            idle(worker);
+        }
+    }
+}
+
+ForwarderPool::Identity* ForwarderPool::take(size_t worker)
+{
+    for (int attempt = 0; attempt < 2; ++attempt)
+    {
+        // Newest of our own first, it is the most likely to be cached
+        Worker& own = *mWorkers[worker];
+        {
+            std::lock_guard<std::mutex> lock(own.mutex);
+            if (!own.ready.empty())
+            {
+                Identity* identity = own.ready.back();
+                own.ready.pop_back();
+                return identity;
+            }
+        }
+
+        // Then the oldest of someone else's
+        for (size_t i = 1; i < mWorkers.size(); ++i)
+        {
+            Worker& victim = *mWorkers[(worker + i) % mWorkers.size()];
+            std::lock_guard<std::mutex> lock(victim.mutex);
+            if (!victim.ready.empty())
+            {
+                Identity* identity = victim.ready.front();
+                victim.ready.pop_front();
+                return identity;
+            }
+        }
+
+        if (attempt == 0)
+        {
+            collectDue(worker);
+        }
+    }
+
+    return nullptr;
+}
+
+void ForwarderPool::collectDue(size_t worker)
+{
+    size_t collected = 0;
+    {
+        std::lock_guard<std::mutex> lock(mScheduleMutex);
+        uint64_t now = getTime();
+        while (!mWakeups.empty() && mWakeups.top().due <= now)
+        {
+            Wakeup wakeup = mWakeups.top();
+            mWakeups.pop();
+
+            // Stale if woken by a command since
+            Identity* identity = wakeup.identity;
+            if (wakeup.generation == identity->generation &&
+                identity->state == Sleeping)
+            {
+                identity->state = Ready;
+                pushReady(worker, identity, true);
+                ++collected;
+            }
+        }
+    }
+
+    // Let the idle workers take a share
+    if (collected > 1)
+    {
+        kick();
+    }
+}
+
+void ForwarderPool::runIdentity(size_t worker, Identity* identity)
+{
+    identity->state = Running;
+
+    Intermediary& forwarder = *identity->forwarder;
+    forwarder.update();
+
+    uint64_t wait = forwarder.getWaitTime();
+    if (wait == 0)
+    {
+        // Back in line behind the work already waiting
+        identity->state = Ready;
+        pushReady(worker, identity, false);
+        return;
+    }
+
+    bool earliest;
+    {
+        std::lock_guard<std::mutex> lock(mScheduleMutex);
+        uint64_t due = getTime() + wait;
+        earliest = mWakeups.empty() || due < mWakeups.top().due;
+
+        identity->state = Sleeping;
+        ++identity->generation;
+        mWakeups.push(Wakeup{due, identity->generation, identity});
+    }
+
+    // Idle workers are waiting for a later time
+    if (earliest)
+    {
+        kick();
+    }
+
+    // Listen for posted commands again
+    watch(identity, EPOLL_CTL_MOD);
+}
+
+void ForwarderPool::idle(size_t worker)
+{
+    int timeout = -1;
+    {
+        std::lock_guard<std::mutex> lock(mScheduleMutex);
+        if (!mWakeups.empty())
+        {
+            uint64_t due = mWakeups.top().due;
+            uint64_t now = getTime();
+            timeout = due > now ? (int)std::min<uint64_t>(due - now, INT_MAX)
+                                : 0;
+        }
+    }
+
+    epoll_event events[MaxEvents];
+    int count = epoll_wait(mEpollFd, events, MaxEvents, timeout);
+    for (int i = 0; i < count; ++i)
+    {
+        Identity* identity = static_cast<Identity*>(events[i].data.ptr);
+        if (identity)
+        {
+            wake(worker, identity);
+        }
+        else if (!mStop)
+        {
+            // Left set once stopping, so every worker sees it
+            uint64_t value;
+            ssize_t drained = read(mKickFd, &value, sizeof(value));
+            (void)drained;
+        }
+    }
+}
+
+void ForwarderPool::wake(size_t worker, Identity* identity)
+{
+    std::lock_guard<std::mutex> lock(mScheduleMutex);
+
+    // Otherwise it is about to update and will see the command anyway
+    if (identity->state == Sleeping)
+    {
+        identity->state = Ready;
+        pushReady(worker, identity, true);
+    }
+}
+
+void ForwarderPool::pushReady(size_t worker, Identity* identity, bool back)
+{
+    Worker& own = *mWorkers[worker];
+    std::lock_guard<std::mutex> lock(own.mutex);
+    if (back)
+    {
+        own.ready.push_back(identity);
+    }
+    else
+    {
+        own.ready.push_front(identity);
+    }
+}
+
+void ForwarderPool::watch(Identity* identity, int operation)
+{
+    // One shot, so only one worker hears of each command
+    epoll_event event = {};
+    event.events = EPOLLIN | EPOLLONESHOT;
+    event.data.ptr = identity;
+    int watched = epoll_ctl(mEpollFd, operation,
+                            identity->forwarder->getWakeFd(), &event);
+    assert(watched == 0);
+    (void)watched;
+}
+
+void ForwarderPool::kick()
+{
+    uint64_t one = 1;
+    ssize_t written = write(mKickFd, &one, sizeof(one));
+    (void)written;
+}
@@ -0,0 +1,151 @@
+#ifndef FORWARDERPOOL_H
+#define FORWARDERPOOL_H
+
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "intermediary.h"
+
+/*! @brief Hosts several intermediaries, each its own tox identity, and
+ *         updates them on a pool of threads.
+ *
+ *  Every worker keeps a deque of intermediaries that are due an update. It
+ *  takes work from the back of its own deque and, once that is empty,
+ *  steals from the front of the others, so no worker idles while another
+ *  has a backlog. An intermediary is only ever updated by one worker at a
+ *  time. Between updates it sleeps for its ToxWrapper::getWaitTime(), or
+ *  until a command is posted to it.
+ *
+ *  Messages forwarded to a friend of a sibling intermediary are routed to it
+ *  in process, as a command posted to the sibling.
+ */
+class ForwarderPool : public SiblingRouter
+{
+public:
+
+    /*! @brief Constructor.
+     *  @param threads The number of worker threads, at least one. The thread
+     *                 calling run() is one of them.
+     */
+    explicit ForwarderPool(size_t threads);
+
+    /*! @brief Destroys the intermediaries.
+     */
+    ~ForwarderPool();
+
+
+    // No copy/assignment allowed
+    ForwarderPool(const ForwarderPool&) = delete;
+    ForwarderPool& operator=(const ForwarderPool&) = delete;
+
+
+    /*! @brief Adds an intermediary. Must be called before run().
+     *  @param forwarder The intermediary, which is routed through this pool
+     *                   from now on.
+     */
+    void add(std::unique_ptr<Intermediary> forwarder);
+
+    /*! @brief Returns the number of intermediaries added.
+     */
+    size_t size() const;
+
+    /*! @brief Returns an intermediary.
+     *  @param index The order it was added in.
+     */
+    Intermediary& operator[](size_t index);
+
+    /*! @brief Updates the intermediaries until stop() is called. The friends
+     *         each intermediary has when this is called are the ones that
+     *         can be routed to. Their save files are written once more
+     *         before it returns.
+     */
+    void run();
+
+    /*! @brief Stops run(), or makes it return straight away if it hasn't
+     *         started yet. Safe to call from any thread, and from signal
+     *         handlers.
+     */
+    void stop();
+
+    bool serves(const ToxKey& publicKey) override;
+
+    void route(const ToxKey& sender, const ToxKey& reciever,
+               std::string_view message) override;
+
+private:
+
+    // What an intermediary is doing. Only the worker that made it Ready may
+    // make it Running, other changes are made holding mScheduleMutex.
+    enum State
+    {
+        Sleeping,
+        Ready,
+        Running
+    };
+
+    struct Identity
+    {
+        std::unique_ptr<Intermediary> forwarder;
+        std::atomic<int> state;
+        // Distinguishes the latest wakeup from stale ones
+        uint64_t generation;
+    };
+
+    struct Wakeup
+    {
+        uint64_t due;
+        uint64_t generation;
+        Identity* identity;
+
+        bool operator>(const Wakeup& other) const
+        {
+            return due > other.due;
+        }
+    };
+
+    struct Worker
+    {
+        std::mutex mutex;
+        std::deque<Identity*> ready;
+    };
+
+    void work(size_t worker);
+
+    Identity* take(size_t worker);
+
+    void collectDue(size_t worker);
+
+    void runIdentity(size_t worker, Identity* identity);
+
+    void idle(size_t worker);
+
+    void wake(size_t worker, Identity* identity);
+
+    void pushReady(size_t worker, Identity* identity, bool back);
+
+    void watch(Identity* identity, int operation);
+
+    void kick();
+
+    std::vector<std::unique_ptr<Identity>> mIdentities;
+    std::vector<std::unique_ptr<Worker>> mWorkers;
+    // The friends of every intermediary, built by run()
+    std::unordered_map<ToxKey, Intermediary*> mRoutes;
+
+    // Sleeping intermediaries by when they are next due
+    std::mutex mScheduleMutex;
+    std::priority_queue<Wakeup, std::vector<Wakeup>,
+                        std::greater<Wakeup>> mWakeups;
+
+    // Reports posted commands and kicks idle workers
+    int mEpollFd;
+    int mKickFd;
+    std::atomic<bool> mStop;
+};
+
+#endif
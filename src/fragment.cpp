@@ -0,0 +1,143 @@
+#include "fragment.h"
+
+#include <cassert>
+#include <cstdlib>
+
+
+// Starts every fragment
+static const std::string_view FragmentTag = "!frag ";
+
+// The longest header, with three ten digit numbers
+static const size_t MaxHeaderSize = FragmentTag.size() + 3 * 11;
+
+static bool isContinuation(char byte)
+{
+    return (byte & 0xC0) == 0x80;
+}
+
+static bool readNumber(std::string_view str, size_t& pos, char end,
+                       uint32_t& value)
+{
+    size_t start = pos;
+    uint64_t number = 0;
+    while (pos < str.size() && str[pos] >= '0' && str[pos] <= '9')
+    {
+        number = number * 10 + (str[pos] - '0');
+        if (number > UINT32_MAX)
+        {
+            return false;
+        }
+        ++pos;
+    }
+
+    if (pos == start || pos == str.size() || str[pos] != end)
+    {
+        return false;
+    }
+
+    ++pos;
+    value = number;
+    return true;
+}
+
+
+void splitFragments(std::string_view message, size_t maxSize, uint32_t id,
+                    bool text, std::vector<std::string>& fragments)
+{
+    assert(maxSize > MaxHeaderSize + 4);
+    size_t capacity = maxSize - MaxHeaderSize;
+
+    // Find where each part ends, backing off to the start of a character in
+    // text
+    std::vector<size_t> ends;
+    size_t start = 0;
+    while (start < message.size())
+    {
+        size_t end = start + capacity;
+        if (end >= message.size())
+        {
+            end = message.size();
+        }
+        else if (text)
+        {
+            while (end > start + 1 && isContinuation(message[end]))
+            {
+                --end;
+            }
+        }
+
+        ends.push_back(end);
+        start = end;
+    }
+
+    fragments.clear();
+    start = 0;
+    for (size_t i = 0; i < ends.size(); ++i)
+    {
+        std::string fragment(FragmentTag);
+        fragment += std::to_string(id) + ' ' + std::to_string(i) + ' ' +
+                    std::to_string(ends.size()) + '\n';
+        fragment.append(message.substr(start, ends[i] - start));
+        fragments.push_back(std::move(fragment));
+        start = ends[i];
+    }
+}
+
+
+// The FragmentAssembler implementation
+
+FragmentAssembler::FragmentAssembler()
+    : mId(0)
+    , mNext(0)
+    , mCount(0)
+{
+}
+
+bool FragmentAssembler::isFragment(std::string_view message)
+{
+    return message.substr(0, FragmentTag.size()) == FragmentTag;
+}
+
+bool FragmentAssembler::add(std::string_view fragment, std::string& message)
+{
+    if (!isFragment(fragment))
+    {
+        return false;
+    }
+
+    size_t pos = FragmentTag.size();
+    uint32_t id, index, count;
+    if (!readNumber(fragment, pos, ' ', id) ||
+        !readNumber(fragment, pos, ' ', index) ||
+        !readNumber(fragment, pos, '\n', count) || index >= count)
+    {
+        return false;
+    }
+
+    if (index == 0)
+    {
+        // A new message, anything unfinished was abandoned
+        mBuffer.clear();
+        mId = id;
+        mNext = 0;
+        mCount = count;
+    }
+    else if (id != mId || index != mNext || count != mCount)
+    {
+        // Repeated, or from an abandoned message
+        return false;
+    }
+
+    mBuffer.append(fragment.substr(pos));
+    ++mNext;
+
+    if (mNext < mCount)
+    {
+        return false;
+    }
+
+    message.swap(mBuffer);
+    mBuffer.clear();
+    mCount = 0;
+    return true;
+}
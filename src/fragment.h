@@ -0,0 +1,57 @@
+#ifndef FRAGMENT_H
+#define FRAGMENT_H
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/*! @brief Splits a message too long for one tox message into fragments, each
+ *         "!frag <id> <index> <count>" and a newline followed by part of the
+ *         message. Parts of text never end inside a utf8 character, while
+ *         binary messages are split wherever a fragment is full.
+ *  @param message The message.
+ *  @param maxSize The most bytes allowed in each fragment.
+ *  @param id Tells the fragments of this message apart from others.
+ *  @param text Whether the message is utf8 text.
+ *  @param fragments Replaced with the fragments, in order.
+ */
+void splitFragments(std::string_view message, size_t maxSize, uint32_t id,
+                    bool text, std::vector<std::string>& fragments);
+
+
+/*! @brief Rebuilds messages from their fragments. For clients of the
+ *         intermediary, which fragments anything too long to send whole.
+ *
+ *  Fragments of a message are expected in order, as the intermediary sends
+ *  them. Fragments repeated after a reconnect are ignored.
+ */
+class FragmentAssembler
+{
+public:
+
+    /*! @brief Constructor.
+     */
+    FragmentAssembler();
+
+    /*! @brief Returns whether a message is a fragment.
+     *  @param message The message.
+     */
+    static bool isFragment(std::string_view message);
+
+    /*! @brief Adds a fragment.
+     *  @param fragment The fragment.
+     *  @param message Replaced with the rebuilt message once complete.
+     *  @return True if this completed a message.
+     */
+    bool add(std::string_view fragment, std::string& message);
+
+private:
+
+    std::string mBuffer;
+    uint32_t mId;
+    uint32_t mNext;
+    uint32_t mCount;
+};
+
+#endif
@@ -0,0 +1,96 @@
+#include "frienddirectory.h"
+
+
+FriendDirectory::FriendDirectory()
+{
+}
+
+void FriendDirectory::add(uint32_t alias, const ToxKey& publicKey)
+{
+    if (alias == UINT32_MAX)
+    {
+        return;
+    }
+
+    remove(alias);
+
+    if (alias >= mKeys.size())
+    {
+        mKeys.resize(alias + 1);
+        mOnline.resize(alias / 64 + 1, 0);
+    }
+
+    mKeys[alias] = publicKey;
+    mAliases[publicKey] = alias;
+}
+
+void FriendDirectory::reserve(size_t count)
+{
+    mKeys.reserve(count);
+    mAliases.reserve(count);
+    mOnline.reserve(count / 64 + 1);
+}
+
+void FriendDirectory::remove(uint32_t alias)
+{
+    if (!contains(alias))
+    {
+        return;
+    }
+
+    // Cleared while the alias is still valid, as it may be reused
+    setOnline(alias, false);
+    mAliases.erase(mKeys[alias]);
+    mKeys[alias] = ToxKey();
+}
+
+void FriendDirectory::clear()
+{
+    mKeys.clear();
+    mAliases.clear();
+    mOnline.clear();
+}
+
+bool FriendDirectory::contains(uint32_t alias) const
+{
+    return alias < mKeys.size() && mKeys[alias].getType() != ToxKey::None;
+}
+
+uint32_t FriendDirectory::find(const ToxKey& publicKey) const
+{
+    auto it = mAliases.find(publicKey);
+    return (it != mAliases.end()) ? it->second : UINT32_MAX;
+}
+
+const ToxKey& FriendDirectory::getPublicKey(uint32_t alias) const
+{
+    return contains(alias) ? mKeys[alias] : mEmpty;
+}
+
+void FriendDirectory::setOnline(uint32_t alias, bool online)
+{
+    if (!contains(alias))
+    {
+        return;
+    }
+
+    uint64_t bit = (uint64_t)1 << (alias % 64);
+    if (online)
+    {
+        mOnline[alias / 64] |= bit;
+    }
+    else
+    {
+        mOnline[alias / 64] &= ~bit;
+    }
+}
+
+bool FriendDirectory::isOnline(uint32_t alias) const
+{
+    return contains(alias) && (mOnline[alias / 64] >> (alias % 64)) & 1;
+}
+
+size_t FriendDirectory::size() const
+{
+    return mAliases.size();
+}
@@ -0,0 +1,84 @@
+#ifndef FRIENDDIRECTORY_H
+#define FRIENDDIRECTORY_H
+
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+#include "toxwrapper.h"
+
+/*! @brief A local copy of the friend list, indexed both ways, along with the
+ *         presence of each friend. Lets the wrapper answer lookups without
+ *         calling into the transport, which for toxcore means a linear scan.
+ */
+class FriendDirectory
+{
+public:
+
+    /*! @brief Constructor.
+     */
+    FriendDirectory();
+
+    /*! @brief Records a friend. The friend starts offline.
+     *  @param alias The alias for the friend.
+     *  @param publicKey The public key of the friend.
+     */
+    void add(uint32_t alias, const ToxKey& publicKey);
+
+    /*! @brief Makes room for more friends, so adding many at once doesn't
+     *         keep growing the indexes.
+     *  @param count The number of friends there will be.
+     */
+    void reserve(size_t count);
+
+    /*! @brief Forgets a friend.
+     *  @param alias The alias for the friend.
+     */
+    void remove(uint32_t alias);
+
+    /*! @brief Forgets every friend.
+     */
+    void clear();
+
+    /*! @brief Returns whether a friend has been recorded under an alias.
+     *  @param alias The alias for the friend.
+     */
+    bool contains(uint32_t alias) const;
+
+    /*! @brief Returns the alias for a public key, or UINT32_MAX if there is no
+     *         such friend.
+     *  @param publicKey The public key of the friend.
+     */
+    uint32_t find(const ToxKey& publicKey) const;
+
+    /*! @brief Returns the public key of a friend, or an empty key if there is
+     *         no such friend.
+     *  @param alias The alias for the friend.
+     */
+    const ToxKey& getPublicKey(uint32_t alias) const;
+
+    /*! @brief Changes whether a friend is online. Ignored for unknown
+     *         friends.
+     *  @param alias The alias for the friend.
+     *  @param online True if the friend is connected.
+     */
+    void setOnline(uint32_t alias, bool online);
+
+    /*! @brief Returns whether a friend is online.
+     *  @param alias The alias for the friend.
+     */
+    bool isOnline(uint32_t alias) const;
+
+    /*! @brief Returns the number of friends recorded.
+     */
+    size_t size() const;
+
+private:
+
+    // Indexed by alias, unused aliases hold an empty key
+    std::vector<ToxKey> mKeys;
+    std::unordered_map<ToxKey, uint32_t> mAliases;
+    std::vector<uint64_t> mOnline;
+    ToxKey mEmpty;
+};
+
+#endif
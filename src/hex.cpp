@@ -0,0 +1,135 @@
+#include "hex.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+
+static const char HexDigits[] = "0123456789abcdef";
+
+// The value of a hex digit, or -1 for any other character
+static int readDigit(char c)
+{
+    if (c >= '0' && c <= '9')
+    {
+        return c - '0';
+    }
+
+    // Setting bit 5 makes letters lowercase
+    char lower = c | 0x20;
+    if (lower >= 'a' && lower <= 'f')
+    {
+        return lower - 'a' + 10;
+    }
+    return -1;
+}
+
+#ifdef __SSE2__
+// Turns sixteen nibbles into their hex digits
+static __m128i writeDigits(__m128i nibbles)
+{
+    // Digits above 9 are letters, which start 39 characters after '9' + 1
+    __m128i letters = _mm_cmpgt_epi8(nibbles, _mm_set1_epi8(9));
+    return _mm_add_epi8(_mm_add_epi8(nibbles, _mm_set1_epi8('0')),
+                        _mm_and_si128(letters, _mm_set1_epi8(39)));
+}
+
+// Sets every byte from first to last to all ones, and the rest to zero
+static __m128i inRange(__m128i chars, char first, char last)
+{
+    return _mm_and_si128(_mm_cmpgt_epi8(chars, _mm_set1_epi8(first - 1)),
+                         _mm_cmplt_epi8(chars, _mm_set1_epi8(last + 1)));
+}
+
+// Reads sixteen hex digits into eight bytes, returning false if any is not a
+// digit. Bytes compare as signed, so characters past 127 are never in range
+static bool readDigits(const char* hex, uint8_t* binary)
+{
+    __m128i chars = _mm_loadu_si128((const __m128i*)hex);
+
+    __m128i digit = inRange(chars, '0', '9');
+    __m128i lower = _mm_or_si128(chars, _mm_set1_epi8(0x20));
+    __m128i letter = inRange(lower, 'a', 'f');
+    if (_mm_movemask_epi8(_mm_or_si128(digit, letter)) != 0xFFFF)
+    {
+        return false;
+    }
+
+    __m128i values = _mm_or_si128(
+        _mm_and_si128(digit, _mm_sub_epi8(chars, _mm_set1_epi8('0'))),
+        _mm_and_si128(letter, _mm_sub_epi8(lower, _mm_set1_epi8('a' - 10))));
+
+    // Each pair of digits is a 16 bit lane with the high nibble first
+    __m128i high = _mm_slli_epi16(_mm_and_si128(values, _mm_set1_epi16(0xFF)),
+                                  4);
+    __m128i low = _mm_srli_epi16(values, 8);
+    __m128i bytes = _mm_or_si128(high, low);
+    _mm_storel_epi64((__m128i*)binary, _mm_packus_epi16(bytes, bytes));
+    return true;
+}
+#endif
+
+
+void convertToHex(const uint8_t* binary, size_t length, char* hex)
+{
+    size_t i = 0;
+#ifdef __SSE2__
+    for (; i + 16 <= length; i += 16)
+    {
+        __m128i bytes = _mm_loadu_si128((const __m128i*)(binary + i));
+        __m128i mask = _mm_set1_epi8(0x0F);
+        __m128i high = _mm_and_si128(_mm_srli_epi16(bytes, 4), mask);
+        __m128i low = _mm_and_si128(bytes, mask);
+
+        // Interleaved so each byte's high digit comes first
+        _mm_storeu_si128((__m128i*)(hex + i * 2),
+                         writeDigits(_mm_unpacklo_epi8(high, low)));
+        _mm_storeu_si128((__m128i*)(hex + i * 2 + 16),
+                         writeDigits(_mm_unpackhi_epi8(high, low)));
+    }
+#endif
+
+    for (; i < length; ++i)
+    {
+        hex[i * 2] = HexDigits[binary[i] >> 4];
+        hex[i * 2 + 1] = HexDigits[binary[i] & 0x0F];
+    }
+}
+
+std::string convertToHex(const uint8_t* binary, size_t length)
+{
+    std::string hex(length * 2, '0');
+    convertToHex(binary, length, &hex[0]);
+    return hex;
+}
+
+bool convertToBinary(std::string_view hex, uint8_t* binary, size_t length)
+{
+    if (hex.size() / 2 < length)
+    {
+        return false;
+    }
+
+    size_t i = 0;
+#ifdef __SSE2__
+    for (; i + 8 <= length; i += 8)
+    {
+        if (!readDigits(hex.data() + i * 2, binary + i))
+        {
+            return false;
+        }
+    }
+#endif
+
+    for (; i < length; ++i)
+    {
+        int high = readDigit(hex[i * 2]);
+        int low = readDigit(hex[i * 2 + 1]);
+        if (high < 0 || low < 0)
+        {
+            return false;
+        }
+        binary[i] = (uint8_t)((high << 4) | low);
+    }
+    return true;
+}
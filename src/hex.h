@@ -0,0 +1,34 @@
+#ifndef HEX_H
+#define HEX_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+/*! @brief Writes bytes as lowercase hexadecimal. Sixteen bytes are converted
+ *         at a time with SSE2 where it is available.
+ *  @param binary The bytes.
+ *  @param length The number of bytes.
+ *  @param hex Where the length * 2 characters are written.
+ */
+void convertToHex(const uint8_t* binary, size_t length, char* hex);
+
+/*! @brief Returns bytes as lowercase hexadecimal.
+ *  @param binary The bytes.
+ *  @param length The number of bytes.
+ */
+std::string convertToHex(const uint8_t* binary, size_t length);
+
+/*! @brief Reads bytes from hexadecimal of either case. Sixteen characters
+ *         are converted at a time with SSE2 where it is available.
+ *  @param hex The hexadecimal. Characters past the first length * 2 are
+ *             ignored.
+ *  @param binary Where the bytes are written.
+ *  @param length The number of bytes.
+ *  @return False if there are too few characters or any is not a hex
+ *          digit, in which case binary is left partly written.
+ */
+bool convertToBinary(std::string_view hex, uint8_t* binary, size_t length);
+
+#endif
@@ -1,17 +1,138 @@
 #include "intermediary.h"
 
+#include <algorithm>
 #include <array>
 #include <cassert>
+#include <iostream>
+#include <unordered_set>
+#include "fragment.h"
+#include "transport.h"
 
 
+// Starts every bundle, each entry follows as its length, a ':' and its text
+static const std::string_view BundleHeader = "!bundle\n";
+
+// Spilled messages are read back this much at a time at most
+static const size_t MaxPrefetchSize = 1024 * 1024;
+
+// Every queued entry starts with a tag made of these flags, so nothing a
+// sender writes can be taken for a record or a shared payload
+enum EntryTag
+{
+    ET_Inline = 0,
+    ET_Record = 1,
+    ET_Shared = 2
+};
+
+// Shared entries follow their tag with the payload id
+static const size_t SharedEntrySize = 5;
+
+static bool isShared(std::string_view entry)
+{
+    return entry.size() >= SharedEntrySize &&
+           ((uint8_t)entry[0] & ET_Shared) != 0;
+}
+
+// Records are sent over the channel, anything else as text
+static bool isRecord(std::string_view entry)
+{
+    return !entry.empty() && ((uint8_t)entry[0] & ET_Record) != 0;
+}
+
+// Journals shorter than this are left to grow before a snapshot is taken
+static const uint64_t SnapshotThreshold = 64 * 1024 * 1024;
+
+// How a friend's reciever is kept in snapshots
+enum RecieverKind
+{
+    RK_None = 0,
+    RK_Key = 1,
+    RK_FanOut = 2
+};
+
+// The settings of a friend kept in snapshots
+enum StateFlags
+{
+    SF_Bundling = 1,
+    SF_Channel = 2
+};
+
+// Payload ids are stored least significant byte first, as in the journal
+static uint32_t readId(const char* in)
+{
+    const uint8_t* bytes = (const uint8_t*)in;
+    return (uint32_t)bytes[0] | ((uint32_t)bytes[1] << 8) |
+           ((uint32_t)bytes[2] << 16) | ((uint32_t)bytes[3] << 24);
+}
+
+static void writeId(char* out, uint32_t id)
+{
+    for (int i = 0; i < 4; ++i)
+    {
+        out[i] = (char)(id >> (i * 8));
+    }
+}
+
+static size_t countDigits(size_t value)
+{
+    size_t digits = 1;
+    while (value >= 10)
+    {
+        value /= 10;
+        ++digits;
+    }
+    return digits;
+}
+
+
+// The SiblingRouter implementation
+
+SiblingRouter::~SiblingRouter()
+{
+}
+
+
+// The Intermediary implementation
+
+const uint32_t Intermediary::SiblingAlias;
+const uint32_t Intermediary::FanOutAlias;
+
 Intermediary::Intermediary(const ToxOptionsWrapper& opts, double waitInterval)
     : ToxWrapper(opts)
     , mWaitInterval(waitInterval)
 {
+    init();
+}
+
+Intermediary::Intermediary(std::unique_ptr<ToxTransport> transport,
+                           double waitInterval)
+    : ToxWrapper(std::move(transport))
+    , mWaitInterval(waitInterval)
+{
+    init();
+}
+
+void Intermediary::init()
+{
+    mWindowSize = 8;
+    mRouter = nullptr;
+    mMemoryBudget = SIZE_MAX;
+    mFriendBudget = SIZE_MAX;
+    mQueuedBytes = 0;
+    mSnapshotId = 0;
+    mJournalFailed = false;
+    mReadyHead = nullptr;
+    mNextFragmentId = getTime();
+    mSession = getTime();
+    mTimers = TimerWheel(getTime());
+
     // Add default allowed commands
     mValidCommands.push_back("alias");
+    mValidCommands.push_back("bundle");
     mValidCommands.push_back("forward");
+    mValidCommands.push_back("group");
     mValidCommands.push_back("help");
+    mValidCommands.push_back("stats");
 }
 
 void Intermediary::addAllowedFriend(const ToxKey& publicKey)
@@ -21,288 +142,2078 @@ void Intermediary::addAllowedFriend(const ToxKey& publicKey)
     // Check for an error
     if (alias != UINT32_MAX)
     {
-        mFriends[alias].alias = alias;
+        // The rest is set up when the friend is first needed
+        getDetails(alias).publicKey = publicKey;
     }
 }
 
-void Intermediary::onFriendConnectionStatusChanged(uint32_t alias, bool online)
+size_t Intermediary::addAllowedFriends(const std::vector<ToxKey>& keys)
 {
-    Friend& f = mFriends[alias];
+    reserveFriends(keys.size());
 
-    // Add or remove the friend to/from the work queue
-    if (online && !f.unrecievedMessages.empty())
-    {
-        mWorkQueue.insert(alias);
-    }
-    else if (!online)
+    size_t added = 0;
+    for (auto it = keys.begin(); it != keys.end(); ++it)
     {
-        mWorkQueue.erase(alias);
+        // Looked up locally, tox would search its whole friend list
+        if (friendExists(getFriendByPublicKey(*it)))
+        {
+            continue;
+        }
+
+        uint32_t alias = addFriendNoRequest(*it);
+        if (alias != UINT32_MAX)
+        {
+            getDetails(alias).publicKey = *it;
+            ++added;
+        }
     }
+    return added;
 }
 
-void Intermediary::onMessageSentSuccess(uint32_t alias, uint32_t messageId)
+bool Intermediary::openJournal(const std::string& path)
 {
-    Friend& f = mFriends[alias];
+    // Shared payloads are stored again under new ids, and each is held until
+    // the end in case a later entry refers to it
+    std::unordered_map<uint32_t, uint32_t> payloadIds;
 
-    // TODO: There is the potential for there to be an issue once messageId
-    // goes back to zero.
-    if (messageId >= f.lastMessageMinId && !f.lastMessageSentSuccessful)
+    // With snapshots the journal starts with the one it records changes to,
+    // and is left from before the latest if it doesn't match. One that
+    // couldn't be replaced after a snapshot goes on to name the new one
+    uint64_t base = 0;
+
+    // Rebuild the queues
+    auto replay = [this, &payloadIds, &base](Journal::RecordType type,
+                                             const ToxKey& publicKey,
+                                             std::string_view message)
     {
-        f.lastMessageSentSuccessful = true;
-        f.unrecievedMessages.pop();
+        if (type == Journal::RT_Snapshot && message.size() == 8)
+        {
+            base = readId(message.data()) |
+                   ((uint64_t)readId(message.data() + 4) << 32);
+        }
 
-        // Check if any work remains
-        if (f.unrecievedMessages.empty())
+        if (type == Journal::RT_Snapshot ||
+            (mSnapshot && base != mSnapshot->getId()))
         {
-            mWorkQueue.erase(f.alias);
+            return;
         }
-    }
-}
+        else if (type == Journal::RT_Payload)
+        {
+            if (message.size() < 4)
+            {
+                return;
+            }
 
-std::string escapeMessage(const std::string& original)
-{
-    if (!original.empty() && original[0] == '!')
+            auto id = payloadIds.emplace(readId(message.data()), UINT32_MAX);
+            if (!id.second)
+            {
+                // The old payload with this id was freed before it was reused
+                mPayloads.release(id.first->second);
+            }
+            id.first->second = mPayloads.add(message.substr(4));
+            return;
+        }
+
+        uint32_t alias = getFriendByPublicKey(publicKey);
+        if (!friendExists(alias))
+        {
+            // No longer a friend, the messages can't be delivered
+            return;
+        }
+
+        Friend& f = getFriend(alias);
+        getDetails(alias).publicKey = publicKey;
+
+        if (type == Journal::RT_Enqueue && isShared(message))
+        {
+            auto id = payloadIds.find(readId(message.data() + 1));
+            if (id == payloadIds.end())
+            {
+                // Payloads are always written before the entries using them
+                return;
+            }
+            restoreEntry(f, message, id->second);
+        }
+        else if (type == Journal::RT_Enqueue)
+        {
+            restoreEntry(f, message);
+        }
+        else
+        {
+            // Dequeues reach into the spilled messages once memory is empty
+            SpillStore::Batch batch;
+            if (f.unrecievedMessages.empty() && f.spilled > 0 &&
+                mSpill.read(alias, mSpill.getStart(alias), getPrefetchSize(),
+                            batch))
+            {
+                takeSpilled(f, batch);
+            }
+
+            if (!f.unrecievedMessages.empty())
+            {
+                popFront(f);
+            }
+        }
+    };
+
+    bool valid = mSnapshotPath.empty() ? Journal::load(path, replay) :
+                                         mJournal.reopen(path, replay);
+
+    for (auto it = payloadIds.begin(); it != payloadIds.end(); ++it)
     {
-        return "!" + original;
+        mPayloads.release(it->second);
     }
-    else
+
+    if (!valid)
     {
-        return original;
+        return false;
     }
-}
 
-void Intermediary::onMessageRecieved(uint32_t alias, const std::string& message,
-                                     bool actionType)
-{
-    // Process the message based on the type.
-    if (messageIsCommand(message))
+    // Queue any friends that are already online
+    for (size_t i = 0; i < mFriends.size(); ++i)
     {
-        processCommand(alias, message);
+        Friend& f = mFriends[i];
+        if (f.alias != UINT32_MAX && canSend(f) && isFriendConnected(f.alias))
+        {
+            markReady(f);
+        }
     }
-    else
+
+    if (!mSnapshotPath.empty())
     {
-        sendStandardMessage(alias, mFriends[alias].currentReciever,
-			    escapeMessage(message));
+        // Snapshots that come later have later ids than any seen
+        mSnapshotId = std::max(mSnapshotId, base);
+
+        if (!mSnapshot)
+        {
+            // The first snapshot holds everything the journal did
+            return saveSnapshot();
+        }
+        else if (base != mSnapshot->getId())
+        {
+            // The snapshot already has all the journal held
+            return mJournal.rewrite([this](Journal& journal)
+            {
+                journal.appendSnapshot(mSnapshot->getId());
+            });
+        }
+        return true;
     }
+
+    // Start a fresh journal holding only what was left undelivered
+    return mJournal.open(path, [this](Journal& journal)
+    {
+        writeQueues(journal);
+    });
 }
 
-void Intermediary::onCoreUpdate()
+void Intermediary::setSnapshot(const std::string& path,
+                               std::unique_ptr<Snapshot> snapshot)
 {
-    // Perform work
-    std::time_t now = std::time(nullptr);
-    for (auto workIt = mWorkQueue.begin(); workIt != mWorkQueue.end(); ++workIt)
+    assert(!mJournal.isOpen());
+    mSnapshotPath = path;
+    mSnapshot = std::move(snapshot);
+    if (!mSnapshot)
     {
-        Friend& f = mFriends[*workIt];
+        return;
+    }
+    mSnapshotId = mSnapshot->getId();
 
-        if (f.lastMessageSentSuccessful)
-        {
-            // Send the next message
-            f.lastMessageSentSuccessful = false;
-            f.lastMessageMinId = sendMessage(f.alias,
-                                             f.unrecievedMessages.front());
-            f.lastMessageTimeStamp = now;
-        }
-        else if (std::difftime(now, f.lastMessageTimeStamp) > mWaitInterval)
+    // Payloads are held for each entry that refers to them until the entry
+    // is restored, then the entry holds it instead
+    mSnapshotPayloads.assign(mSnapshot->getPayloadCount(), UINT32_MAX);
+    for (uint32_t id = 0; id < mSnapshotPayloads.size(); ++id)
+    {
+        std::string_view payload;
+        uint32_t refs;
+        if (mSnapshot->getPayload(id, payload, refs))
         {
-            // Try resending
-            sendMessage(f.alias, f.unrecievedMessages.front());
-            f.lastMessageTimeStamp = now;
+            uint32_t stored = mPayloads.add(payload);
+            for (uint32_t i = 1; i < refs; ++i)
+            {
+                mPayloads.retain(stored);
+            }
+            mSnapshotPayloads[id] = stored;
         }
     }
 }
 
-std::string readArg(const std::string& str, size_t& start)
+bool Intermediary::saveSnapshot()
 {
-    if (start >= str.size())
+    if (mSnapshotPath.empty() || !mJournal.isOpen())
     {
-        return "";
+        return false;
     }
 
-    // Read the next arg and setup for the one that folows
-    std::string arg;
-    size_t end = str.find_first_of(' ', start);
-    if (end != std::string::npos)
+    SnapshotWriter writer;
+    uint64_t id = mSnapshotId + 1;
+    if (!writer.open(mSnapshotPath, id))
     {
-        // Don't include the space
-        arg = str.substr(start, end - start);
-        start = end + 1;
+        return false;
     }
-    else
+
+    std::vector<uint8_t> saveData;
+    getSaveData(saveData);
+    writer.writeSaveData(std::string_view((const char*)saveData.data(),
+                                          saveData.size()));
+
+    std::unordered_map<uint32_t, uint32_t> refs;
+    for (size_t i = 0; i < mFriends.size(); ++i)
     {
-        arg = str.substr(start);
-        start = str.size();
+        Friend& f = mFriends[i];
+        if (f.alias != UINT32_MAX && friendExists(f.alias))
+        {
+            writeFriend(writer, f, refs);
+        }
     }
 
-    return arg;
-}
+    // Friends never needed since the last snapshot are copied from it, as
+    // long as they are still friends
+    for (size_t i = 0; mSnapshot && i < mSnapshot->getFriendCount(); ++i)
+    {
+        uint32_t alias = getFriendByPublicKey(mSnapshot->getFriendKey(i));
+        if (friendExists(alias) && !isRestored(alias))
+        {
+            copyFriend(writer, i, refs);
+        }
+    }
 
-bool Intermediary::messageIsCommand(const std::string& message) const
-{
-    // Basic preliminary test
-    if (message.size() < 2 || message[0] != '!')
+    // Payloads keep their current ids, which the entries were written with
+    for (auto it = refs.begin(); it != refs.end(); ++it)
+    {
+        writer.writePayload(it->first, it->second,
+                            mPayloads.get(it->first));
+    }
+
+    std::unique_ptr<Snapshot> snapshot(new Snapshot());
+    if (!writer.commit() || !snapshot->open(mSnapshotPath))
     {
         return false;
     }
 
-    // Determine if the command is valid
-    size_t start = 1;
-    std::string command = readArg(message, start);
-    for (auto it = mValidCommands.begin(); it != mValidCommands.end(); ++it)
+    // The save file is kept at least as new as the snapshot
+    writeSaveData(std::move(saveData));
+
+    // Payloads are held as before, but their ids now match the snapshot's
+    mSnapshotId = id;
+    mSnapshot = std::move(snapshot);
+    mSnapshotPayloads.assign(mSnapshot->getPayloadCount(), UINT32_MAX);
+    for (uint32_t i = 0; i < mSnapshotPayloads.size(); ++i)
     {
-        if (command == *it)
+        std::string_view payload;
+        uint32_t refs;
+        if (mSnapshot->getPayload(i, payload, refs))
         {
-            return true;
+            mSnapshotPayloads[i] = i;
         }
     }
 
-    return false;
+    // Everything journaled so far is in the snapshot
+    auto fill = [id](Journal& journal)
+    {
+        journal.appendSnapshot(id);
+    };
+    if (!mJournal.rewrite(fill))
+    {
+        // The old journal goes on, and only what follows this applies to
+        // the new snapshot
+        mJournal.appendSnapshot(id);
+        return false;
+    }
+    return true;
 }
 
-void Intermediary::processCommand(uint32_t from, const std::string& message)
+bool Intermediary::setSpillDirectory(const std::string& path)
 {
-    Friend& f = mFriends[from];
-
-    // Process command
-    size_t start = 1;
-    std::string command = readArg(message, start);
-
-    if (command == "alias")
+    return mSpill.open(path, [this](SpillStore::Batch& batch)
     {
-        try
+        // Moved to this intermediary's thread rather than copied
+        auto loaded = std::make_shared<SpillStore::Batch>(std::move(batch));
+        post([this, loaded]()
         {
-            std::string name = readArg(message, start);
-            ToxKey publicKey = ToxKey(ToxKey::Public, readArg(message, start));
+            onSpillLoaded(*loaded);
+        });
+    });
+}
 
-            // Validate
-            if (name.empty())
-            {
-                sendServerMessage(from, "Use !help to see the description for "
-                                        "how to use the alias command.");
-            }
-            else if (!friendExists(getFriendByPublicKey(publicKey)))
-            {
-                sendServerMessage(from, "Unknown tox id passed to the alias "
-                                        "command.");
-            }
-            else
-            {
+void Intermediary::setMemoryBudget(size_t bytes)
+{
+    mMemoryBudget = bytes;
+}
 
-	        // Store mappings
-                f.aliases[name] = publicKey;
-                f.reverseAliases[publicKey] = name;
-            }
-        }
-        catch (const ToxKey::InvalidSize& e)
-	{
-            sendServerMessage(from, "Invalid tox id passed to the alias "
-                                    "command.");
-        }
-    }
-    else if (command == "forward")
+void Intermediary::setFriendMemoryBudget(size_t bytes)
+{
+    mFriendBudget = bytes;
+}
+
+void Intermediary::setWindowSize(size_t size)
+{
+    assert(size > 0);
+    mWindowSize = size;
+}
+
+void Intermediary::setRouter(SiblingRouter* router)
+{
+    mRouter = router;
+}
+
+void Intermediary::deliverFromSibling(const ToxKey& sender,
+                                      const ToxKey& reciever,
+                                      std::string_view message)
+{
+    uint32_t to = getFriendByPublicKey(reciever);
+    if (!friendExists(to))
     {
-        try
-        {
-            std::string recipient = readArg(message, start);
-            uint32_t reciever = UINT32_MAX;
+        // Removed since the sender chose them
+        return;
+    }
 
-            // Figure out who will recieve the message
-            if (f.aliases.find(recipient) != f.aliases.end())
-            {
-                reciever = getFriendByPublicKey(f.aliases[recipient]);
-            }
-            else
-            {
-                ToxKey publicKey(ToxKey::Public, recipient);
-                reciever = getFriendByPublicKey(publicKey);
-            }
+    deliver(getFriend(to), SiblingAlias, sender, message);
+}
 
-            // Process if valid
-            if (!friendExists(reciever))
-            {
-                sendServerMessage(from, "Unknown alias or tox id sent to the "
-                                        "forward command.");
-            }
-            else
-            {
-                f.currentReciever = reciever;
-            }
+void Intermediary::onFriendConnectionStatusChanged(uint32_t alias, bool online)
+{
+    Friend& f = getFriend(alias);
+
+    if (online)
+    {
+        // Reciepts for anything in flight were lost with the old connection
+        if (!f.inFlight.empty())
+        {
+            setResendDeadline(f, getTime());
         }
-        catch (const ToxKey::InvalidSize& e)
+
+        if (canSend(f))
         {
-            sendServerMessage(from, "Invalid tox id passed to the forward "
-                                    "command.");
+            markReady(f);
         }
-    }
-    else if (command == "help")
-    {
-        sendServerMessage(from, "Commands: alias, forward, help\n"
-                                "!alias <nickname> <tox id> - associates a "
-                                "name with a tox id if the server knows them\n"
-                                "!forward <alias> - will forward messages to "
-                                "an assigned alias\n"
-                                "!forward <tox id> - will forward messages to "
-                                "a tox id if the server knows them\n"
-                                "!help - displays some helpful information");
+        prefetch(f);
     }
     else
     {
-        // Unhandled command.
-        assert(false);
+        unmarkReady(f);
+        setResendDeadline(f, 0);
     }
 }
 
-void Intermediary::sendStandardMessage(uint32_t from, uint32_t to,
-                                       const std::string& message)
+void Intermediary::onMessageSentSuccess(uint32_t alias, uint32_t messageId)
 {
-    if (friendExists(to))
-    {
-        // Regular message
+    Friend& f = getFriend(alias);
 
-        Friend& sender = mFriends[from];
-        Friend& reciever = mFriends[to];
+    uint64_t now = getTime();
 
-        // Alert client to who is sending
-        if (reciever.lastSender != sender.alias)
+    // Find the message, ids only need to be unique within the window
+    for (size_t i = 0; i < f.inFlight.size(); ++i)
+    {
+        InFlight& sent = f.inFlight[i];
+        if (sent.messageId == messageId && !sent.recieved && !sent.packet)
         {
-            ToxKey publicKey = getFriendPublicKey(sender.alias);
+            sent.recieved = true;
 
-            // Retrieve user defined name if available, otherwise tox id
-            std::string name;
-            if (reciever.reverseAliases.find(publicKey) !=
-                    reciever.reverseAliases.end())
-            {
-                name = reciever.reverseAliases[publicKey];
-            }
-            else
+            // Only unambiguous round trips are measured (Karn's algorithm)
+            if (!sent.resent)
             {
-                name = publicKey.getHex();
+                f.rtt.addSample(now - sent.sentTime);
             }
-
-	    reciever.lastSender = sender.alias;
-            reciever.unrecievedMessages.push("!sender " + name);
+            break;
         }
+    }
 
-        reciever.unrecievedMessages.push(message);
+    removeRecieved(f, now);
+}
 
-        // Send the message if they are online.
-        if (isFriendConnected(reciever.alias))
+void Intermediary::removeRecieved(Friend& f, uint64_t now)
+{
+    // Remove everything at the front that has been recieved
+    bool progress = false;
+    while (!f.inFlight.empty() && f.inFlight.front().recieved)
+    {
+        uint32_t count = f.inFlight.front().count;
+        f.inFlight.pop_front();
+        f.inFlightMessages -= count;
+        for (uint32_t i = 0; i < count; ++i)
         {
-            mWorkQueue.insert(reciever.alias);
+            dequeue(f);
         }
+        progress = true;
     }
-    else
+
+    if (progress)
     {
-        sendServerMessage(from, "No reciever specified");
-    }
-}
+        setResendDeadline(f, f.inFlight.empty() ? 0 :
+                             now + f.rtt.getRto());
 
-void Intermediary::sendServerMessage(uint32_t to, const std::string& message)
-{
-    Friend& reciever = mFriends[to];
-    reciever.unrecievedMessages.push("!server " + message);
+        // Room was made in the window
+        if (canSend(f))
+        {
+            markReady(f);
+        }
+
+        prefetch(f);
+    }
+}
+
+void Intermediary::onMessageRecieved(uint32_t alias, std::string_view message,
+                                     bool actionType)
+{
+    // Process the message based on the type.
+    if (messageIsCommand(message))
+    {
+        processCommand(alias, message);
+    }
+    else
+    {
+        sendStandardMessage(alias, getFriend(alias).currentReciever, message);
+    }
+}
+
+void Intermediary::onLosslessPacketRecieved(uint32_t alias,
+                                            std::string_view packet)
+{
+    ChannelReader reader(packet);
+    if (!reader.isValid())
+    {
+        return;
+    }
+
+    // Any channel packet is a request to be sent records
+    Friend& f = getFriend(alias);
+    if (!f.channel)
+    {
+        f.channel = true;
+        f.lastSender = UINT32_MAX;
+    }
+
+    if (reader.getFrame() == CF_Ack)
+    {
+        // Acks meant for before a restart are ignored
+        if (reader.getSession() == mSession)
+        {
+            acknowledge(f, reader.getSequence());
+        }
+        return;
+    }
+    else if (reader.getFrame() != CF_Data)
+    {
+        return;
+    }
+
+    // Sequence numbers start again when the friend does
+    FriendDetails& details = getDetails(alias);
+    if (!details.peerKnown || reader.getSession() != details.peerSession)
+    {
+        details.peerKnown = true;
+        details.peerSession = reader.getSession();
+        details.peerSequence = reader.getSequence();
+    }
+
+    // Repeats are acknowledged too, the last ack may have been lost
+    if (!f.ackPending)
+    {
+        f.ackPending = true;
+        mPendingAcks.push_back(alias);
+    }
+
+    // Anything but the next packet was either seen already or sent after
+    // one that was lost, and will be sent again
+    if (reader.getSequence() != details.peerSequence)
+    {
+        return;
+    }
+    ++details.peerSequence;
+
+    ChannelRecord record;
+    while (reader.next(record))
+    {
+        processRecord(alias, record);
+    }
+}
+
+void Intermediary::onCoreUpdate()
+{
+    uint64_t now = getTime();
+
+    // Resend to anyone whose reciepts have not arrived in time
+    mExpiredTimers.clear();
+    mTimers.advance(now, mExpiredTimers);
+    for (auto it = mExpiredTimers.begin(); it != mExpiredTimers.end(); ++it)
+    {
+        Friend& f = getFriend(it->id);
+        if (it->deadline != f.timerDeadline)
+        {
+            // Replaced by an earlier timer
+            continue;
+        }
+        f.timerDeadline = 0;
+
+        if (f.resendDeadline == 0)
+        {
+            // Cancelled
+            continue;
+        }
+        else if (f.resendDeadline > now)
+        {
+            // Progress was made since the timer was scheduled
+            setResendDeadline(f, f.resendDeadline);
+            continue;
+        }
+
+        f.rtt.backoff();
+        resendWindow(f, now);
+        setResendDeadline(f, now + f.rtt.getRto());
+    }
+
+    // Send to everyone with room in their window
+    while (mReadyHead)
+    {
+        Friend& f = *mReadyHead;
+        unmarkReady(f);
+        fillWindow(f, now);
+    }
+
+    // Group commit everything queued or delivered during this update
+    bool committed = true;
+    if (mJournal.isOpen())
+    {
+        if (!mSnapshotPath.empty())
+        {
+            // Replaying a journal larger than the snapshot would take longer
+            // than writing a new one
+            uint64_t threshold = SnapshotThreshold;
+            if (mSnapshot)
+            {
+                threshold = std::max(threshold, mSnapshot->getSize());
+            }
+            if (mJournal.getSize() <= threshold || !saveSnapshot())
+            {
+                committed = mJournal.commit();
+            }
+        }
+        else if (mJournal.needsCompaction())
+        {
+            // Appended to the old journal if it can't be replaced
+            committed = mJournal.rewrite([this](Journal& journal)
+            {
+                writeQueues(journal);
+            }) || mJournal.commit();
+        }
+        else
+        {
+            committed = mJournal.commit();
+        }
+
+        // Failed commits are tried again with the next update
+        if (!committed && !mJournalFailed)
+        {
+            std::cout << "error: failed to write the journal" << std::endl;
+        }
+        mJournalFailed = !committed;
+    }
+
+    if (!committed)
+    {
+        return;
+    }
+
+    // Acknowledged only once what was recieved is in the journal
+    std::string ack;
+    for (auto it = mPendingAcks.begin(); it != mPendingAcks.end(); ++it)
+    {
+        getFriend(*it).ackPending = false;
+        FriendDetails& details = getDetails(*it);
+        writeChannelHeader(ack, CF_Ack, details.peerSession,
+                           details.peerSequence);
+        sendLosslessPacket(*it, ack);
+    }
+    mPendingAcks.clear();
+}
+
+uint64_t Intermediary::getNextDeadline()
+{
+    if (mReadyHead)
+    {
+        return 0;
+    }
+    return mTimers.getNextExpiry();
+}
+
+std::string_view readArg(std::string_view str, size_t& start)
+{
+    if (start >= str.size())
+    {
+        return std::string_view();
+    }
+
+    // Read the next arg and setup for the one that folows
+    std::string_view arg;
+    size_t end = str.find_first_of(' ', start);
+    if (end != std::string::npos)
+    {
+        // Don't include the space
+        arg = str.substr(start, end - start);
+        start = end + 1;
+    }
+    else
+    {
+        arg = str.substr(start);
+        start = str.size();
+    }
+
+    return arg;
+}
+
+bool Intermediary::messageIsCommand(std::string_view message) const
+{
+    // Basic preliminary test
+    if (message.size() < 2 || message[0] != '!')
+    {
+        return false;
+    }
+
+    // Determine if the command is valid
+    size_t start = 1;
+    std::string_view command = readArg(message, start);
+    for (auto it = mValidCommands.begin(); it != mValidCommands.end(); ++it)
+    {
+        if (command == *it)
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void Intermediary::processCommand(uint32_t from, std::string_view message)
+{
+    Friend& f = getFriend(from);
+
+    // Process command
+    size_t start = 1;
+    std::string_view command = readArg(message, start);
+
+    if (command == "alias")
+    {
+        try
+        {
+            std::string name(readArg(message, start));
+            ToxKey publicKey = ToxKey(ToxKey::Public, readArg(message, start));
+
+            // Validate
+            if (name.empty())
+            {
+                sendServerMessage(from, "Use !help to see the description for "
+                                        "how to use the alias command.");
+            }
+            else if (!friendExists(getFriendByPublicKey(publicKey)) &&
+                     !(mRouter && mRouter->serves(publicKey)))
+            {
+                sendServerMessage(from, "Unknown tox id passed to the alias "
+                                        "command.");
+            }
+            else
+            {
+
+	        // Store mappings
+                FriendDetails& details = getDetails(from);
+                details.aliases[name] = publicKey;
+                details.reverseAliases[publicKey] = name;
+            }
+        }
+        catch (const ToxKey::InvalidSize& e)
+	{
+            sendServerMessage(from, "Invalid tox id passed to the alias "
+                                    "command.");
+        }
+    }
+    else if (command == "forward")
+    {
+        try
+        {
+            FriendDetails& details = getDetails(from);
+            std::vector<std::string> names;
+            for (std::string_view name = readArg(message, start);
+                 !name.empty(); name = readArg(message, start))
+            {
+                names.emplace_back(name);
+            }
+
+            // Figure out who will recieve the message
+            ToxKey publicKey;
+            bool known = true;
+            for (auto it = names.begin(); it != names.end() && known; ++it)
+            {
+                known = details.groups.find(*it) != details.groups.end() ||
+                        findReciever(from, *it, publicKey);
+            }
+
+            // Process if valid
+            if (names.empty())
+            {
+                sendServerMessage(from, "Use !help to see the description for "
+                                        "how to use the forward command.");
+            }
+            else if (!known)
+            {
+                sendServerMessage(from, "Unknown alias or tox id sent to the "
+                                        "forward command.");
+            }
+            else if (names.size() > 1 ||
+                     details.groups.find(names[0]) != details.groups.end())
+            {
+                // Each message is stored once and shared by every reciever
+                details.fanOutNames.swap(names);
+                resolveFanOut(from);
+                f.currentReciever = FanOutAlias;
+            }
+            else
+            {
+                // Friends of a sibling are reached through the router
+                uint32_t reciever = getFriendByPublicKey(publicKey);
+                if (!friendExists(reciever))
+                {
+                    reciever = SiblingAlias;
+                    details.siblingReciever = publicKey;
+                }
+                f.currentReciever = reciever;
+            }
+        }
+        catch (const ToxKey::InvalidSize& e)
+        {
+            sendServerMessage(from, "Invalid tox id passed to the forward "
+                                    "command.");
+        }
+    }
+    else if (command == "group")
+    {
+        FriendDetails& details = getDetails(from);
+        std::string_view name = readArg(message, start);
+        std::string_view action = readArg(message, start);
+
+        if (name.empty() ||
+            (action != "add" && action != "remove" && action != "clear"))
+        {
+            sendServerMessage(from, "Use !help to see the description for "
+                                    "how to use the group command.");
+            return;
+        }
+
+        auto group = details.groups.find(name);
+        if (group == details.groups.end())
+        {
+            group = details.groups.emplace(name,
+                                           std::vector<ToxKey>()).first;
+        }
+
+        std::vector<ToxKey>& members = group->second;
+        if (action == "clear")
+        {
+            members.clear();
+        }
+
+        for (std::string_view member = readArg(message, start);
+             !member.empty(); member = readArg(message, start))
+        {
+            try
+            {
+                ToxKey publicKey;
+                bool known = findReciever(from, member, publicKey);
+                auto it = std::find(members.begin(), members.end(),
+                                    publicKey);
+
+                if (action == "remove" && it != members.end())
+                {
+                    members.erase(it);
+                }
+                else if (action == "add" && !known)
+                {
+                    sendServerMessage(from, "Unknown alias or tox id sent "
+                                            "to the group command.");
+                }
+                else if (action == "add" && it == members.end())
+                {
+                    members.push_back(publicKey);
+                }
+            }
+            catch (const ToxKey::InvalidSize& e)
+            {
+                sendServerMessage(from, "Invalid tox id passed to the group "
+                                        "command.");
+            }
+        }
+
+        if (members.empty())
+        {
+            details.groups.erase(group);
+        }
+
+        // Changes reach a group while it is being forwarded to
+        if (f.currentReciever == FanOutAlias)
+        {
+            resolveFanOut(from);
+        }
+    }
+    else if (command == "bundle")
+    {
+        std::string_view setting = readArg(message, start);
+        if (setting == "on" || setting == "off")
+        {
+            f.bundling = (setting == "on");
+        }
+        else
+        {
+            sendServerMessage(from, "Use !help to see the description for "
+                                    "how to use the bundle command.");
+        }
+    }
+    else if (command == "help")
+    {
+        sendServerMessage(from, "Commands: alias, bundle, forward, group, "
+                                "help, stats\n"
+                                "!alias <nickname> <tox id> - associates a "
+                                "name with a tox id if the server knows them\n"
+                                "!bundle <on|off> - packs several messages "
+                                "sent to you into one\n"
+                                "!forward <alias> - will forward messages to "
+                                "an assigned alias\n"
+                                "!forward <tox id> - will forward messages to "
+                                "a tox id if the server knows them\n"
+                                "!forward <name> <name>... - will forward "
+                                "messages to several aliases, groups or tox "
+                                "ids at once\n"
+                                "!group <name> <add|remove> <alias|tox id>... "
+                                "- changes who is in a group to forward to\n"
+                                "!group <name> clear - removes a group\n"
+                                "!help - displays some helpful information\n"
+                                "!stats - displays delivery statistics for "
+                                "messages sent to you");
+    }
+    else if (command == "stats")
+    {
+        sendServerMessage(from, "Queued: " +
+                                std::to_string(f.unrecievedMessages.size() +
+                                               f.spilled) +
+                                "\nOn disk: " + std::to_string(f.spilled) +
+                                "\nIn flight: " +
+                                std::to_string(f.inFlightMessages) +
+                                "\nSent: " + std::to_string(f.stats.sent) +
+                                "\nResent: " + std::to_string(f.stats.resent) +
+                                "\nDelivered: " +
+                                std::to_string(f.stats.delivered) +
+                                "\nSmoothed RTT: " +
+                                std::to_string(f.rtt.getSmoothedRtt()) +
+                                " ms\nRTT variance: " +
+                                std::to_string(f.rtt.getRttVariance()) +
+                                " ms\nResend timeout: " +
+                                std::to_string(f.rtt.getRto()) + " ms");
+    }
+    else
+    {
+        // Unhandled command.
+        assert(false);
+    }
+}
+
+void Intermediary::sendStandardMessage(uint32_t from, uint32_t to,
+                                       std::string_view message)
+{
+    if (to == FanOutAlias)
+    {
+        sendFanOut(from, message);
+    }
+    else if (to == SiblingAlias && mRouter)
+    {
+        // Another intermediary in this process delivers it
+        mRouter->route(getFriendPublicKey(from),
+                       getDetails(from).siblingReciever, message);
+    }
+    else if (friendExists(to))
+    {
+        // Regular message
+        deliver(getFriend(to), from, getFriendPublicKey(from), message);
+    }
+    else
+    {
+        sendServerMessage(from, "No reciever specified");
+    }
+}
+
+void Intermediary::sendFanOut(uint32_t from, std::string_view message)
+{
+    const std::vector<Binding>& fanOut = getDetails(from).fanOut;
+    if (fanOut.empty())
+    {
+        sendServerMessage(from, "No reciever specified");
+        return;
+    }
+
+    const ToxKey& sender = getFriendPublicKey(from);
+    SharedMessage shared;
+    shared.message = message;
+    for (auto it = fanOut.begin(); it != fanOut.end(); ++it)
+    {
+        // As with bound key ids, the friend may have been deleted since
+        if (friendExists(it->alias) &&
+            getFriendPublicKey(it->alias) == it->publicKey)
+        {
+            deliver(getFriend(it->alias), from, sender, message, &shared);
+        }
+        else if (mRouter)
+        {
+            mRouter->route(sender, it->publicKey, message);
+        }
+    }
+
+    // The queues now hold the only references
+    for (auto it = shared.text.begin(); it != shared.text.end(); ++it)
+    {
+        mPayloads.release(*it);
+    }
+    for (auto it = shared.records.begin(); it != shared.records.end(); ++it)
+    {
+        mPayloads.release(*it);
+    }
+}
+
+void Intermediary::deliver(Friend& reciever, uint32_t from,
+                           const ToxKey& sender, std::string_view message,
+                           SharedMessage* shared)
+{
+    if (reciever.channel)
+    {
+        // Records name their sender, so need no escaping or notices
+        if (reciever.lastSender != from || from == SiblingAlias)
+        {
+            reciever.lastSender = from;
+            reciever.lastSenderId = getSenderId(reciever, sender);
+        }
+        if (shared)
+        {
+            enqueueShared(reciever, *shared, reciever.lastSenderId);
+        }
+        else
+        {
+            enqueueRecord(reciever, reciever.lastSenderId, 0, message);
+        }
+    }
+    else
+    {
+        // Alert client to who is sending
+        if (reciever.lastSender != from ||
+            (from == SiblingAlias &&
+             getDetails(reciever.alias).lastSiblingSender != sender))
+        {
+            reciever.lastSender = from;
+            if (from == SiblingAlias)
+            {
+                getDetails(reciever.alias).lastSiblingSender = sender;
+            }
+            announceSender(reciever, sender);
+        }
+
+        if (shared)
+        {
+            enqueueShared(reciever, *shared, 0);
+        }
+        else
+        {
+            // Messages that look like commands are escaped with another '!'
+            bool escape = !message.empty() && message[0] == '!';
+            enqueue(reciever, escape ? "!" : "", message);
+        }
+    }
+
+    // Send the message if they are online.
+    sendWhenReady(reciever);
+}
+
+bool Intermediary::findReciever(uint32_t from, std::string_view name,
+                                ToxKey& publicKey)
+{
+    FriendDetails& details = getDetails(from);
+    auto alias = details.aliases.find(name);
+    if (alias != details.aliases.end())
+    {
+        publicKey = alias->second;
+    }
+    else
+    {
+        publicKey = ToxKey(ToxKey::Public, name);
+    }
+
+    return friendExists(getFriendByPublicKey(publicKey)) ||
+           (mRouter && mRouter->serves(publicKey));
+}
+
+void Intermediary::resolveFanOut(uint32_t from)
+{
+    FriendDetails& details = getDetails(from);
+    details.fanOut.clear();
+
+    std::vector<ToxKey> recievers;
+    for (auto it = details.fanOutNames.begin();
+         it != details.fanOutNames.end(); ++it)
+    {
+        auto group = details.groups.find(*it);
+        if (group != details.groups.end())
+        {
+            recievers.insert(recievers.end(), group->second.begin(),
+                             group->second.end());
+            continue;
+        }
+
+        // Names were checked by the forward command, but aliases may have
+        // changed since
+        try
+        {
+            ToxKey publicKey;
+            findReciever(from, *it, publicKey);
+            recievers.push_back(publicKey);
+        }
+        catch (const ToxKey::InvalidSize& e)
+        {
+            // An alias that has since been replaced by another name
+        }
+    }
+
+    // Anyone named twice only recieves each message once
+    std::unordered_set<ToxKey> seen;
+    for (auto it = recievers.begin(); it != recievers.end(); ++it)
+    {
+        uint32_t alias = getFriendByPublicKey(*it);
+        bool local = friendExists(alias);
+        if ((local || (mRouter && mRouter->serves(*it))) &&
+            seen.insert(*it).second)
+        {
+            Binding binding;
+            binding.publicKey = *it;
+            binding.alias = local ? alias : UINT32_MAX;
+            details.fanOut.push_back(binding);
+        }
+    }
+}
+
+void Intermediary::processRecord(uint32_t from, const ChannelRecord& record)
+{
+    FriendDetails& details = getDetails(from);
+
+    if (record.flags & RF_Bind)
+    {
+        if (record.payload.size() != getPublicKeySize())
+        {
+            sendServerMessage(from, "Invalid tox id bound to a key id.");
+            return;
+        }
+
+        ToxKey publicKey(ToxKey::Public, (const uint8_t*)record.payload.data(),
+                         record.payload.size());
+        if (!friendExists(getFriendByPublicKey(publicKey)) &&
+            !(mRouter && mRouter->serves(publicKey)))
+        {
+            sendServerMessage(from, "Unknown tox id bound to a key id.");
+            return;
+        }
+
+        Binding& binding = details.boundKeys[record.keyId];
+        binding.publicKey = publicKey;
+        binding.alias = getFriendByPublicKey(publicKey);
+        return;
+    }
+
+    auto bound = details.boundKeys.find(record.keyId);
+    if (bound == details.boundKeys.end())
+    {
+        sendServerMessage(from, "Record sent to an unbound key id.");
+        return;
+    }
+
+    // Routed straight to the reciever, without choosing them first. The
+    // alias is checked in case the friend was deleted since
+    const Binding& binding = bound->second;
+    if (friendExists(binding.alias) &&
+        getFriendPublicKey(binding.alias) == binding.publicKey)
+    {
+        deliver(getFriend(binding.alias), from, getFriendPublicKey(from),
+                record.payload);
+    }
+    else if (mRouter)
+    {
+        mRouter->route(getFriendPublicKey(from), binding.publicKey,
+                       record.payload);
+    }
+}
+
+void Intermediary::announceSender(Friend& reciever, const ToxKey& publicKey)
+{
+    // Use the user defined name if available, otherwise tox id
+    FriendDetails& details = getDetails(reciever.alias);
+    auto alias = details.reverseAliases.find(publicKey);
+    if (alias != details.reverseAliases.end())
+    {
+        enqueue(reciever, "!sender ", alias->second);
+    }
+    else
+    {
+        enqueue(reciever, "!sender ", publicKey.getHex());
+    }
+}
+
+void Intermediary::sendServerMessage(uint32_t to, std::string_view message)
+{
+    Friend& reciever = getFriend(to);
+    if (reciever.channel)
+    {
+        enqueueRecord(reciever, 0, RF_Server, message);
+    }
+    else
+    {
+        enqueue(reciever, "!server ", message);
+    }
+    sendWhenReady(reciever);
+}
+
+void Intermediary::enqueue(Friend& f, std::string_view prefix,
+                           std::string_view message)
+{
+    if (prefix.size() + message.size() > getMaxMessageSize())
+    {
+        // Queued as fragments, which are sent and acknowledged on their own
+        std::string whole(prefix);
+        whole.append(message);
+
+        std::vector<std::string> fragments;
+        splitFragments(whole, getMaxMessageSize(), mNextFragmentId++, true,
+                       fragments);
+        for (auto it = fragments.begin(); it != fragments.end(); ++it)
+        {
+            enqueue(f, "", *it);
+        }
+        return;
+    }
+
+    std::string head(1, (char)ET_Inline);
+    head.append(prefix);
+    append(f, head, message);
+}
+
+void Intermediary::enqueueRecord(Friend& f, uint32_t keyId, uint8_t flags,
+                                 std::string_view payload)
+{
+    size_t limit = getRecordLimit();
+    if (payload.size() > limit)
+    {
+        std::vector<std::string> fragments;
+        splitFragments(payload, limit, mNextFragmentId++, false,
+                       fragments);
+        for (auto it = fragments.begin(); it != fragments.end(); ++it)
+        {
+            enqueueRecord(f, keyId, flags | RF_Fragment, *it);
+        }
+        return;
+    }
+
+    char header[1 + RecordHeaderSize];
+    header[0] = (char)ET_Record;
+    writeRecordHeader(header + 1, keyId, flags, payload.size());
+    append(f, std::string_view(header, sizeof(header)), payload);
+}
+
+void Intermediary::enqueueShared(Friend& f, SharedMessage& shared,
+                                 uint32_t keyId)
+{
+    std::vector<std::string> fragments;
+
+    if (f.channel)
+    {
+        // Split as enqueueRecord() would
+        if (shared.records.empty())
+        {
+            if (shared.message.size() > getRecordLimit())
+            {
+                splitFragments(shared.message, getRecordLimit(),
+                               mNextFragmentId++, false, fragments);
+                shared.fragmented = true;
+            }
+            else
+            {
+                fragments.emplace_back(shared.message);
+            }
+
+            for (auto it = fragments.begin(); it != fragments.end(); ++it)
+            {
+                shared.records.push_back(sharePayload(*it));
+            }
+        }
+
+        // Only the record header differs between friends
+        char header[RecordHeaderSize];
+        for (auto it = shared.records.begin(); it != shared.records.end();
+             ++it)
+        {
+            writeRecordHeader(header, keyId,
+                              shared.fragmented ? RF_Fragment : 0,
+                              mPayloads.get(*it).size());
+            appendShared(f, true, std::string_view(header, sizeof(header)),
+                         *it);
+        }
+        return;
+    }
+
+    // Escaped and split as deliver() and enqueue() would
+    if (shared.text.empty())
+    {
+        std::string whole;
+        if (!shared.message.empty() && shared.message[0] == '!')
+        {
+            whole = "!";
+        }
+        whole.append(shared.message);
+
+        if (whole.size() > getMaxMessageSize())
+        {
+            splitFragments(whole, getMaxMessageSize(), mNextFragmentId++,
+                           true, fragments);
+        }
+        else
+        {
+            fragments.push_back(std::move(whole));
+        }
+
+        for (auto it = fragments.begin(); it != fragments.end(); ++it)
+        {
+            shared.text.push_back(sharePayload(*it));
+        }
+    }
+
+    for (auto it = shared.text.begin(); it != shared.text.end(); ++it)
+    {
+        appendShared(f, false, "", *it);
+    }
+}
+
+uint32_t Intermediary::sharePayload(std::string_view payload)
+{
+    uint32_t id = mPayloads.add(payload);
+
+    // Written ahead of the entries that refer to it
+    if (mJournal.isOpen())
+    {
+        mJournal.appendPayload(id, payload);
+    }
+    return id;
+}
+
+void Intermediary::appendShared(Friend& f, bool record, std::string_view head,
+                                uint32_t id)
+{
+    char ref[SharedEntrySize];
+    ref[0] = (char)(ET_Shared | (record ? ET_Record : ET_Inline));
+    writeId(ref + 1, id);
+
+    mPayloads.retain(id);
+    append(f, std::string_view(ref, sizeof(ref)), head);
+}
+
+Intermediary::Entry Intermediary::readEntry(std::string_view stored) const
+{
+    Entry entry;
+    if (isShared(stored))
+    {
+        entry.head = stored.substr(SharedEntrySize);
+        entry.payload = mPayloads.get(readId(stored.data() + 1));
+    }
+    else
+    {
+        entry.head = stored.substr(1);
+    }
+    return entry;
+}
+
+void Intermediary::append(Friend& f, std::string_view prefix,
+                          std::string_view entry)
+{
+    if (!store(f, prefix, entry))
+    {
+        if (mJournal.isOpen())
+        {
+            std::string whole(prefix);
+            whole.append(entry);
+            mJournal.appendEnqueue(getPublicKey(f), whole);
+        }
+        return;
+    }
+
+    if (mJournal.isOpen())
+    {
+        mJournal.appendEnqueue(getPublicKey(f), f.unrecievedMessages.back());
+    }
+}
+
+bool Intermediary::store(Friend& f, std::string_view prefix,
+                         std::string_view entry)
+{
+    // Only offline friends are held to the total, online ones are draining
+    size_t size = prefix.size() + entry.size();
+    if (mSpill.isOpen() &&
+        (f.spilled > 0 || f.queuedBytes + size > mFriendBudget ||
+         (mQueuedBytes + mPayloads.getBytes() + size > mMemoryBudget &&
+          !isFriendConnected(f.alias))))
+    {
+        // Behind anything spilled before, so the order is kept
+        mSpill.append(f.alias, prefix, entry);
+        ++f.spilled;
+        return false;
+    }
+
+    f.unrecievedMessages.push_back(prefix, entry);
+    f.queuedBytes += size;
+    mQueuedBytes += size;
+    return true;
+}
+
+void Intermediary::restoreFriend(Friend& f)
+{
+    std::string_view state;
+    if (!mSnapshot || !friendExists(f.alias) ||
+        !mSnapshot->findFriend(getPublicKey(f), state))
+    {
+        return;
+    }
+
+    FriendDetails& details = getDetails(f.alias);
+    StateReader reader(state);
+    uint64_t length;
+    std::string_view detailsState;
+    if (!reader.readInt(4, length) || !reader.readBytes(length, detailsState))
+    {
+        return;
+    }
+
+    StateReader in(detailsState);
+    uint64_t kind = RK_None;
+    uint64_t flags = 0;
+    uint64_t count;
+    std::string_view name;
+    std::string_view key;
+    in.readInt(1, kind);
+    if (kind == RK_Key && in.readBytes(getPublicKeySize(), key))
+    {
+        ToxKey publicKey(ToxKey::Public, (const uint8_t*)key.data(),
+                         key.size());
+        uint32_t alias = getFriendByPublicKey(publicKey);
+        if (friendExists(alias))
+        {
+            f.currentReciever = alias;
+        }
+        else
+        {
+            f.currentReciever = SiblingAlias;
+            details.siblingReciever = publicKey;
+        }
+    }
+
+    in.readInt(1, flags);
+    f.bundling = (flags & SF_Bundling) != 0;
+    f.channel = (flags & SF_Channel) != 0;
+
+    for (in.readInt(4, count); count > 0 && in.readString(name) &&
+                               in.readBytes(getPublicKeySize(), key);
+         --count)
+    {
+        ToxKey publicKey(ToxKey::Public, (const uint8_t*)key.data(),
+                         key.size());
+        details.aliases[std::string(name)] = publicKey;
+        details.reverseAliases[publicKey] = name;
+    }
+
+    uint64_t members;
+    for (in.readInt(4, count); count > 0 && in.readString(name) &&
+                               in.readInt(4, members);
+         --count)
+    {
+        std::vector<ToxKey>& group = details.groups[std::string(name)];
+        for (; members > 0 && in.readBytes(getPublicKeySize(), key);
+             --members)
+        {
+            group.emplace_back(ToxKey::Public, (const uint8_t*)key.data(),
+                               key.size());
+        }
+    }
+
+    for (in.readInt(4, count); count > 0 && in.readString(name); --count)
+    {
+        details.fanOutNames.emplace_back(name);
+    }
+
+    if (kind == RK_FanOut)
+    {
+        resolveFanOut(f.alias);
+        f.currentReciever = FanOutAlias;
+    }
+
+    // The queue follows, each entry preceded by its length
+    std::string_view entry;
+    while (reader.readInt(4, length) && reader.readBytes(length, entry))
+    {
+        if (!isShared(entry))
+        {
+            restoreEntry(f, entry);
+            continue;
+        }
+
+        uint32_t id = readId(entry.data() + 1);
+        if (id < mSnapshotPayloads.size() &&
+            mSnapshotPayloads[id] != UINT32_MAX)
+        {
+            // The entry now holds the payload instead of the snapshot
+            restoreEntry(f, entry, mSnapshotPayloads[id]);
+            mPayloads.release(mSnapshotPayloads[id]);
+        }
+    }
+}
+
+void Intermediary::writeFriend(SnapshotWriter& writer, Friend& f,
+                               std::unordered_map<uint32_t, uint32_t>& refs)
+{
+    FriendDetails& details = getDetails(f.alias);
+    std::string state;
+
+    if (f.currentReciever == FanOutAlias)
+    {
+        writeStateInt(state, RK_FanOut, 1);
+    }
+    else if (f.currentReciever == SiblingAlias)
+    {
+        writeStateInt(state, RK_Key, 1);
+        state.append((const char*)details.siblingReciever.data(),
+                     details.siblingReciever.size());
+    }
+    else if (friendExists(f.currentReciever))
+    {
+        const ToxKey& publicKey = getFriendPublicKey(f.currentReciever);
+        writeStateInt(state, RK_Key, 1);
+        state.append((const char*)publicKey.data(), publicKey.size());
+    }
+    else
+    {
+        writeStateInt(state, RK_None, 1);
+    }
+
+    writeStateInt(state, (f.bundling ? SF_Bundling : 0) |
+                         (f.channel ? SF_Channel : 0), 1);
+
+    writeStateInt(state, details.aliases.size(), 4);
+    for (auto it = details.aliases.begin(); it != details.aliases.end(); ++it)
+    {
+        writeStateString(state, it->first);
+        state.append((const char*)it->second.data(), it->second.size());
+    }
+
+    writeStateInt(state, details.groups.size(), 4);
+    for (auto it = details.groups.begin(); it != details.groups.end(); ++it)
+    {
+        writeStateString(state, it->first);
+        writeStateInt(state, it->second.size(), 4);
+        for (auto member = it->second.begin(); member != it->second.end();
+             ++member)
+        {
+            state.append((const char*)member->data(), member->size());
+        }
+    }
+
+    writeStateInt(state, details.fanOutNames.size(), 4);
+    for (auto it = details.fanOutNames.begin();
+         it != details.fanOutNames.end(); ++it)
+    {
+        writeStateString(state, *it);
+    }
+
+    // Friends with nothing set and nothing queued are left out
+    if (f.currentReciever == UINT32_MAX && !f.bundling && !f.channel &&
+        details.aliases.empty() && details.groups.empty() &&
+        details.fanOutNames.empty() && f.unrecievedMessages.empty() &&
+        f.spilled == 0)
+    {
+        return;
+    }
+
+    writer.beginFriend(getPublicKey(f));
+    std::string length;
+    writeStateInt(length, state.size(), 4);
+    writer.write(length);
+    writer.write(state);
+
+    auto writeEntry = [&writer, &refs](std::string_view entry)
+    {
+        if (isShared(entry))
+        {
+            ++refs[readId(entry.data() + 1)];
+        }
+
+        char length[4];
+        writeId(length, entry.size());
+        writer.write(std::string_view(length, sizeof(length)));
+        writer.write(entry);
+    };
+
+    for (auto it = f.unrecievedMessages.begin();
+         it != f.unrecievedMessages.end(); ++it)
+    {
+        writeEntry(*it);
+    }
+
+    // Spilled messages follow, read back a batch at a time
+    SpillStore::Batch batch;
+    for (uint64_t offset = mSpill.getStart(f.alias);
+         f.spilled > 0 && mSpill.read(f.alias, offset, getPrefetchSize(),
+                                      batch);
+         offset += batch.length)
+    {
+        SpillStore::forEachEntry(batch, writeEntry);
+    }
+}
+
+void Intermediary::copyFriend(SnapshotWriter& writer, size_t index,
+                              std::unordered_map<uint32_t, uint32_t>& refs)
+{
+    std::string_view state;
+    if (!mSnapshot->getFriendState(index, state))
+    {
+        return;
+    }
+
+    // Everything but the queue's payload ids is copied as is
+    StateReader reader(state);
+    uint64_t length;
+    std::string_view entry;
+    if (!reader.readInt(4, length) || !reader.readBytes(length, entry))
+    {
+        return;
+    }
+    writer.beginFriend(mSnapshot->getFriendKey(index));
+    writer.write(state.substr(0, reader.getPosition()));
+
+    while (reader.readInt(4, length) && reader.readBytes(length, entry))
+    {
+        if (!isShared(entry))
+        {
+            writer.write(state.substr(reader.getPosition() - length - 4,
+                                      length + 4));
+            continue;
+        }
+
+        uint32_t id = readId(entry.data() + 1);
+        if (id >= mSnapshotPayloads.size() ||
+            mSnapshotPayloads[id] == UINT32_MAX)
+        {
+            continue;
+        }
+
+        std::string stored(state.substr(reader.getPosition() - length - 4,
+                                        length + 4));
+        writeId(&stored[5], mSnapshotPayloads[id]);
+        ++refs[mSnapshotPayloads[id]];
+        writer.write(stored);
+    }
+}
+
+bool Intermediary::isRestored(uint32_t alias) const
+{
+    return alias < mFriends.size() && mFriends[alias].alias != UINT32_MAX;
+}
+
+void Intermediary::restoreEntry(Friend& f, std::string_view stored,
+                                uint32_t payloadId)
+{
+    if (stored.empty())
+    {
+        // Every entry has at least its tag
+        return;
+    }
+
+    if (isRecord(stored))
+    {
+        // Only friends using the channel are sent records
+        f.channel = true;
+        f.lastSender = UINT32_MAX;
+    }
+
+    if (payloadId != UINT32_MAX)
+    {
+        char ref[SharedEntrySize];
+        ref[0] = stored[0];
+        writeId(ref + 1, payloadId);
+
+        mPayloads.retain(payloadId);
+        store(f, std::string_view(ref, sizeof(ref)),
+              stored.substr(SharedEntrySize));
+    }
+    else
+    {
+        store(f, "", stored);
+    }
+}
+
+uint32_t Intermediary::getSenderId(Friend& reciever, const ToxKey& sender)
+{
+    FriendDetails& details = getDetails(reciever.alias);
+    auto it = details.senderIds.find(sender);
+    if (it != details.senderIds.end())
+    {
+        return it->second;
+    }
+
+    // Zero is left for server notices
+    uint32_t keyId = details.senderIds.size() + 1;
+    details.senderIds.emplace(sender, keyId);
+    enqueueRecord(reciever, keyId, RF_Bind,
+                  std::string_view((const char*)sender.data(), sender.size()));
+    return keyId;
+}
+
+void Intermediary::dequeue(Friend& f)
+{
+    popFront(f);
+    ++f.stats.delivered;
+
+    if (mJournal.isOpen())
+    {
+        mJournal.appendDequeue(getPublicKey(f));
+    }
+}
+
+void Intermediary::popFront(Friend& f)
+{
+    std::string_view front = f.unrecievedMessages.front();
+    if (isShared(front))
+    {
+        mPayloads.release(readId(front.data() + 1));
+    }
+    f.queuedBytes -= front.size();
+    mQueuedBytes -= front.size();
+    f.unrecievedMessages.pop_front();
+}
+
+size_t Intermediary::getRecordLimit() const
+{
+    return getMaxCustomPacketSize() - ChannelHeaderSize - RecordHeaderSize;
+}
+
+size_t Intermediary::getPrefetchSize() const
+{
+    return std::min(mFriendBudget / 2, MaxPrefetchSize);
+}
+
+void Intermediary::prefetch(Friend& f)
+{
+    // Read ahead while what is left in memory is still being sent
+    if (f.spilled > 0 && f.queuedBytes <= getPrefetchSize() &&
+        isFriendConnected(f.alias))
+    {
+        mSpill.load(f.alias, getPrefetchSize());
+    }
+}
+
+void Intermediary::onSpillLoaded(SpillStore::Batch& batch)
+{
+    Friend& f = getFriend(batch.owner);
+    takeSpilled(f, batch);
+
+    sendWhenReady(f);
+    if (batch.count > 0)
+    {
+        prefetch(f);
+    }
+}
+
+void Intermediary::takeSpilled(Friend& f, const SpillStore::Batch& batch)
+{
+    if (!mSpill.consume(batch))
+    {
+        return;
+    }
+
+    // Already journaled when they were spilled
+    f.spilled -= batch.count;
+    SpillStore::forEachEntry(batch, [this, &f](std::string_view entry)
+    {
+        f.unrecievedMessages.push_back(entry);
+        f.queuedBytes += entry.size();
+        mQueuedBytes += entry.size();
+    });
+}
+
+void Intermediary::fillWindow(Friend& f, uint64_t now)
+{
+    if (f.inFlight.capacity() != mWindowSize &&
+        f.inFlight.size() <= mWindowSize)
+    {
+        f.inFlight.setCapacity(mWindowSize);
+    }
+
+    if (f.inFlight.empty() && canSend(f))
+    {
+        setResendDeadline(f, now + f.rtt.getRto());
+    }
+
+    // Send the next messages while there is room in the window
+    MessageQueue::Iterator next = f.unrecievedMessages.begin();
+    if (!f.inFlight.empty())
+    {
+        next = f.inFlight.back().message;
+        for (uint32_t i = 0; i < f.inFlight.back().count; ++i)
+        {
+            ++next;
+        }
+    }
+
+    while (!f.inFlight.full() &&
+           f.inFlightMessages < f.unrecievedMessages.size())
+    {
+        size_t available = f.unrecievedMessages.size() - f.inFlightMessages;
+        bool delivering = true;
+
+        InFlight sent;
+        sent.message = next;
+        if (isRecord(*next))
+        {
+            sent.packet = true;
+            sent.count = countRecords(next, available);
+            sent.messageId = f.nextSequence++;
+            delivering = sendLosslessPacket(f.alias, getPayload(sent));
+        }
+        else
+        {
+            if (f.bundling)
+            {
+                sent.count = countBundle(next, available);
+            }
+            sent.messageId = sendMessage(f.alias, getPayload(sent));
+        }
+        sent.sentTime = now;
+        f.inFlight.push_back(sent);
+        f.inFlightMessages += sent.count;
+        f.stats.sent += sent.count;
+
+        for (uint32_t i = 0; i < sent.count; ++i)
+        {
+            ++next;
+        }
+
+        // Packets after a gap would only be dropped, so the rest wait to be
+        // resent with it
+        if (!delivering)
+        {
+            break;
+        }
+    }
+}
+
+uint32_t Intermediary::countBundle(MessageQueue::Iterator next,
+                                   size_t available) const
+{
+    size_t limit = getMaxMessageSize();
+    size_t size = BundleHeader.size();
+    uint32_t count = 0;
+    while (count < available)
+    {
+        if (isRecord(*next))
+        {
+            break;
+        }
+
+        Entry entry = readEntry(*next);
+        size_t length = entry.head.size() + entry.payload.size();
+        size_t packed = countDigits(length) + 1 + length;
+        if (size + packed > limit)
+        {
+            break;
+        }
+
+        size += packed;
+        ++count;
+        ++next;
+    }
+
+    return count > 1 ? count : 1;
+}
+
+uint32_t Intermediary::countRecords(MessageQueue::Iterator next,
+                                    size_t available) const
+{
+    size_t limit = getMaxCustomPacketSize();
+    size_t size = ChannelHeaderSize;
+    uint32_t count = 0;
+    while (count < available)
+    {
+        if (!isRecord(*next))
+        {
+            break;
+        }
+
+        Entry entry = readEntry(*next);
+        size_t record = entry.head.size() + entry.payload.size();
+        if (size + record > limit)
+        {
+            break;
+        }
+
+        size += record;
+        ++count;
+        ++next;
+    }
+
+    return count > 1 ? count : 1;
+}
+
+std::string_view Intermediary::getPayload(const InFlight& sent)
+{
+    if (sent.packet)
+    {
+        writeChannelHeader(mBundle, CF_Data, mSession, sent.messageId);
+        MessageQueue::Iterator it = sent.message;
+        for (uint32_t i = 0; i < sent.count; ++i, ++it)
+        {
+            // Records always keep their header in the queue
+            Entry entry = readEntry(*it);
+            mBundle.append(entry.head);
+            mBundle.append(entry.payload);
+        }
+        return mBundle;
+    }
+    else if (sent.count == 1)
+    {
+        // Shared text is queued without a head, so is sent from the store
+        Entry entry = readEntry(*sent.message);
+        if (entry.payload.empty())
+        {
+            return entry.head;
+        }
+        else if (entry.head.empty())
+        {
+            return entry.payload;
+        }
+
+        mBundle.assign(entry.head);
+        mBundle.append(entry.payload);
+        return mBundle;
+    }
+
+    mBundle.assign(BundleHeader);
+    MessageQueue::Iterator it = sent.message;
+    for (uint32_t i = 0; i < sent.count; ++i, ++it)
+    {
+        Entry entry = readEntry(*it);
+        mBundle += std::to_string(entry.head.size() + entry.payload.size());
+        mBundle += ':';
+        mBundle.append(entry.head);
+        mBundle.append(entry.payload);
+    }
+    return mBundle;
+}
+
+void Intermediary::sendWhenReady(Friend& f)
+{
+    // Anything queued behind spilled messages needs them read back first
+    if (f.spilled > 0)
+    {
+        prefetch(f);
+    }
+
+    if (!canSend(f) || !isFriendConnected(f.alias))
+    {
+        return;
+    }
+
+    // Nothing ahead of the message, so there is no reason to wait for the
+    // end of the update
+    if (isImmediateFlush() && f.inFlight.empty())
+    {
+        unmarkReady(f);
+        fillWindow(f, getTime());
+    }
+    else
+    {
+        markReady(f);
+    }
+}
+
+void Intermediary::acknowledge(Friend& f, uint32_t next)
+{
+    uint64_t now = getTime();
+
+    for (size_t i = 0; i < f.inFlight.size(); ++i)
+    {
+        // Compared as a difference, so wrap around is handled
+        InFlight& sent = f.inFlight[i];
+        if (sent.packet && !sent.recieved &&
+            (int32_t)(next - sent.messageId) > 0)
+        {
+            sent.recieved = true;
+            if (!sent.resent)
+            {
+                f.rtt.addSample(now - sent.sentTime);
+            }
+        }
+    }
+
+    removeRecieved(f, now);
+}
+
+void Intermediary::resendWindow(Friend& f, uint64_t now)
+{
+    for (size_t i = 0; i < f.inFlight.size(); ++i)
+    {
+        InFlight& sent = f.inFlight[i];
+        if (sent.recieved)
+        {
+            continue;
+        }
+
+        // Packets keep their sequence number, so the friend can drop copies
+        bool delivering = true;
+        if (sent.packet)
+        {
+            delivering = sendLosslessPacket(f.alias, getPayload(sent));
+        }
+        else
+        {
+            sent.messageId = sendMessage(f.alias, getPayload(sent));
+        }
+        sent.sentTime = now;
+        sent.resent = true;
+        f.stats.resent += sent.count;
+
+        // As when filling the window, nothing is sent after a gap
+        if (!delivering)
+        {
+            break;
+        }
+    }
+}
+
+Intermediary::Friend& Intermediary::getFriend(uint32_t alias)
+{
+    assert(alias != UINT32_MAX);
+    mFriends.grow(alias + 1);
+
+    Friend& f = mFriends[alias];
+    if (f.alias == UINT32_MAX)
+    {
+        f.alias = alias;
+        f.rtt = RttEstimator(mWaitInterval * 1000);
+        f.unrecievedMessages.setPool(&mChunkPool);
+        restoreFriend(f);
+    }
+    return f;
+}
+
+Intermediary::FriendDetails& Intermediary::getDetails(uint32_t alias)
+{
+    assert(alias != UINT32_MAX);
+    mDetails.grow(alias + 1);
+    return mDetails[alias];
+}
+
+void Intermediary::setResendDeadline(Friend& f, uint64_t deadline)
+{
+    f.resendDeadline = deadline;
+
+    // Moving the deadline later is handled when the timer expires
+    if (deadline != 0 && (f.timerDeadline == 0 || deadline < f.timerDeadline))
+    {
+        mTimers.schedule(f.alias, deadline);
+        f.timerDeadline = deadline;
+    }
+}
+
+bool Intermediary::canSend(const Friend& f) const
+{
+    return f.inFlightMessages < f.unrecievedMessages.size() &&
+           f.inFlight.size() < mWindowSize;
+}
+
+void Intermediary::markReady(Friend& f)
+{
+    if (f.ready)
+    {
+        return;
+    }
+
+    f.ready = true;
+    f.readyPrev = nullptr;
+    f.readyNext = mReadyHead;
+    if (mReadyHead)
+    {
+        mReadyHead->readyPrev = &f;
+    }
+    mReadyHead = &f;
+}
+
+void Intermediary::unmarkReady(Friend& f)
+{
+    if (!f.ready)
+    {
+        return;
+    }
+
+    if (f.readyPrev)
+    {
+        f.readyPrev->readyNext = f.readyNext;
+    }
+    else
+    {
+        mReadyHead = f.readyNext;
+    }
+
+    if (f.readyNext)
+    {
+        f.readyNext->readyPrev = f.readyPrev;
+    }
 
-    if (isFriendConnected(reciever.alias))
+    f.ready = false;
+    f.readyPrev = nullptr;
+    f.readyNext = nullptr;
+}
+
+void Intermediary::writeQueues(Journal& journal)
+{
+    // Entries refer to shared payloads by id, so those go first
+    mPayloads.forEach([&journal](uint32_t id, std::string_view payload)
+    {
+        journal.appendPayload(id, payload);
+    });
+
+    for (size_t i = 0; i < mFriends.size(); ++i)
+    {
+        const Friend& f = mFriends[i];
+        for (auto it = f.unrecievedMessages.begin();
+             it != f.unrecievedMessages.end(); ++it)
+        {
+            journal.appendEnqueue(getPublicKey(f), *it);
+        }
+
+        // Spilled messages follow, read back a batch at a time
+        SpillStore::Batch batch;
+        for (uint64_t offset = mSpill.getStart(f.alias);
+             f.spilled > 0 && mSpill.read(f.alias, offset, getPrefetchSize(),
+                                          batch);
+             offset += batch.length)
+        {
+            SpillStore::forEachEntry(batch, [&](std::string_view entry)
+            {
+                journal.appendEnqueue(getPublicKey(f), entry);
+            });
+        }
+    }
+}
+
+const ToxKey& Intermediary::getPublicKey(const Friend& f)
+{
+    FriendDetails& details = getDetails(f.alias);
+    if (details.publicKey.getType() == ToxKey::None)
     {
-        mWorkQueue.insert(reciever.alias);
+        details.publicKey = getFriendPublicKey(f.alias);
     }
+    return details.publicKey;
 }
@@ -1,12 +1,50 @@
 #ifndef INTERMEDIARY_H
 #define INTERMEDIARY_H
 
-#include <ctime>
 #include <map>
-#include <set>
-#include <queue>
+#include <memory>
+#include <string_view>
+#include <unordered_map>
+#include "channel.h"
+#include "journal.h"
+#include "messagequeue.h"
+#include "payloadstore.h"
+#include "ringbuffer.h"
+#include "rttestimator.h"
+#include "slotarray.h"
+#include "snapshot.h"
+#include "spillstore.h"
+#include "timerwheel.h"
 #include "toxwrapper.h"
 
+/*! @brief Delivers messages to friends served by other intermediaries in the
+ *         same process.
+ */
+class SiblingRouter
+{
+public:
+
+    /*! @brief Destructor.
+     */
+    virtual ~SiblingRouter();
+
+    /*! @brief Returns whether a sibling serves a friend. Called from the
+     *         thread of the intermediary asking.
+     *  @param publicKey The public key of the friend.
+     */
+    virtual bool serves(const ToxKey& publicKey) = 0;
+
+    /*! @brief Passes a message to the sibling that serves the reciever.
+     *         Called from the thread of the intermediary sending it.
+     *  @param sender The public key of the friend who sent the message.
+     *  @param reciever The public key of the friend to deliver it to.
+     *  @param message The message.
+     */
+    virtual void route(const ToxKey& sender, const ToxKey& reciever,
+                       std::string_view message) = 0;
+};
+
+
 /*! @brief Forwards messages sent by one friend to another.
  */
 class Intermediary : public ToxWrapper
@@ -15,33 +53,189 @@ public:
 
     /*! @brief Constructor.
      *  @param options Configurations options for the underlying tox instance.
-     *  @param waitInterval How long to wait before resending a message.
+     *  @param waitInterval How long to wait before resending a message, in
+     *                      seconds, until round trips to a friend have been
+     *                      measured.
      */
     Intermediary(const ToxOptionsWrapper& options, double waitInterval=10);
 
+    /*! @brief Constructor.
+     *  @param transport The transport to forward messages over.
+     *  @param waitInterval See above.
+     */
+    Intermediary(std::unique_ptr<ToxTransport> transport,
+                 double waitInterval=10);
+
     /*! @brief Sets up a friend to recieve forwarded messages, does not send a
      *         request.
      *  @param publicKey The public key of the friend.
      */
     void addAllowedFriend(const ToxKey& publicKey);
 
+    /*! @brief Sets up many friends in one pass, as addAllowedFriend() does.
+     *         Keys that are already friends, including those loaded from
+     *         save data and any given twice, are skipped without asking tox.
+     *  @param keys The public keys of the friends.
+     *  @return The number of friends added.
+     */
+    size_t addAllowedFriends(const std::vector<ToxKey>& keys);
+
+    /*! @brief Rebuilds the message queues from a journal and records all
+     *         further changes to it. Should be called after the allowed
+     *         friends have been added and before run().
+     *  @param path The location of the journal.
+     *  @return True on success.
+     */
+    bool openJournal(const std::string& path);
+
+    /*! @brief Keeps the queues, aliases, groups and recievers of every
+     *         friend in snapshots as well, so the journal only records the
+     *         changes since the last one. Should be called before
+     *         openJournal().
+     *  @param path Where snapshots are written.
+     *  @param snapshot The snapshot found there, or null. Its savedata
+     *                  should have created this instance. Each friend's
+     *                  state is only read from it when they are first
+     *                  needed.
+     */
+    void setSnapshot(const std::string& path,
+                     std::unique_ptr<Snapshot> snapshot);
+
+    /*! @brief Writes a snapshot now and starts the journal again from it.
+     *         Snapshots are also written whenever the journal grows larger
+     *         than the last one.
+     *  @return False if snapshots are not enabled or it could not be
+     *          written.
+     */
+    bool saveSnapshot();
+
+    /*! @brief Keeps the newest queued messages in segment files in a
+     *         directory once queues outgrow their memory budget. Should be
+     *         called before openJournal().
+     *  @param path The directory, created if needed.
+     *  @return True on success.
+     */
+    bool setSpillDirectory(const std::string& path);
+
+    /*! @brief Sets how much memory all queues together may use before the
+     *         messages of offline friends are spilled, see
+     *         setSpillDirectory(). Spilled messages are read back in the
+     *         background as an online friend's queue drains.
+     *  @param bytes The budget.
+     */
+    void setMemoryBudget(size_t bytes);
+
+    /*! @brief Sets how much memory any one queue may use before further
+     *         messages to the friend are spilled, whether they are online or
+     *         not.
+     *  @param bytes The budget.
+     */
+    void setFriendMemoryBudget(size_t bytes);
+
+    /*! @brief Sets how many messages may be awaiting a reciept at once for
+     *         each friend.
+     *  @param size The number of messages, must be at least one.
+     */
+    void setWindowSize(size_t size);
+
+    /*! @brief Sets where messages go when forwarded to a friend this
+     *         intermediary doesn't have, but a sibling does.
+     *  @param router The router, or nullptr to only forward to friends.
+     */
+    void setRouter(SiblingRouter* router);
+
+    /*! @brief Queues a message routed from a sibling. Must be called on this
+     *         intermediary's thread, for instance through post().
+     *  @param sender The public key of the friend who sent the message.
+     *  @param reciever The public key of the friend to deliver it to.
+     *  @param message The message.
+     */
+    void deliverFromSibling(const ToxKey& sender, const ToxKey& reciever,
+                            std::string_view message);
+
     void onFriendConnectionStatusChanged(uint32_t alias, bool online) override;
 
     void onMessageSentSuccess(uint32_t friendAlias,
                               uint32_t messageId) override;
 
-    void onMessageRecieved(uint32_t friendAlias, const std::string& message,
+    void onMessageRecieved(uint32_t friendAlias, std::string_view message,
                            bool actionType) override;
 
+    void onLosslessPacketRecieved(uint32_t friendAlias,
+                                  std::string_view packet) override;
+
     void onCoreUpdate() override;
 
+    uint64_t getNextDeadline() override;
+
 private:
 
-    /*! @brief Contains the messages and other important data for a friend.
+    /*! @brief Sets up the state shared by the constructors.
+     */
+    void init();
+
+    /*! @brief A message that has been sent and is awaiting its reciept.
+     */
+    struct InFlight
+    {
+        /*! @brief The message in the friend's queue.
+         */
+        MessageQueue::Iterator message;
+
+        /*! @brief The number of queued messages sent together as a bundle,
+         *         starting at message.
+         */
+        uint32_t count = 1;
+
+        /*! @brief The id tox assigned to the most recent send. Compared for
+         *         equality only, so it is unaffected by wrap around. For a
+         *         channel packet, its sequence number instead.
+         */
+        uint32_t messageId = UINT32_MAX;
+
+        /*! @brief Whether the messages are records sent as a channel packet,
+         *         which is acknowledged by sequence number.
+         */
+        bool packet = false;
+
+        /*! @brief Whether the reciept has arrived. Reciepts can arrive out of
+         *         order, so this may be set before the messages ahead of it.
+         */
+        bool recieved = false;
+
+        /*! @brief Whether the message has been sent more than once.
+         */
+        bool resent = false;
+
+        /*! @brief When the message was last sent, in milliseconds.
+         */
+        uint64_t sentTime = 0;
+    };
+
+    /*! @brief Counters describing delivery to a friend.
+     */
+    struct Stats
+    {
+        /*! @brief Messages sent for the first time.
+         */
+        uint64_t sent = 0;
+
+        /*! @brief Messages sent again after their reciept timed out.
+         */
+        uint64_t resent = 0;
+
+        /*! @brief Messages removed from the queue after being recieved.
+         */
+        uint64_t delivered = 0;
+    };
+
+    /*! @brief Contains the messages and delivery state for a friend. Touched
+     *         for every message, so rarely used data is kept in FriendDetails.
      */
     struct Friend
     {
-        /*! @brief The alias that maps to this friend.
+        /*! @brief The alias that maps to this friend, UINT32_MAX if the slot
+         *         is unused.
          */
         uint32_t alias = UINT32_MAX;
 
@@ -49,52 +243,225 @@ private:
          */
         uint32_t lastSender = UINT32_MAX;
 
-        /*! @brief The alias of the friend to whom messages are being sent.
+        /*! @brief The key id standing for lastSender in records.
+         */
+        uint32_t lastSenderId = 0;
+
+        /*! @brief The alias of the friend to whom messages are being sent,
+         *         SiblingAlias or FanOutAlias.
          */
         uint32_t currentReciever = UINT32_MAX;
 
         /*! @brief The queued up messages (and other information, such as a
          *         change in sender) that have yet to be delivered.
          */
-        std::queue<std::string> unrecievedMessages;
+        MessageQueue unrecievedMessages;
+
+        /*! @brief The bytes of the queued messages held in memory.
+         */
+        size_t queuedBytes = 0;
+
+        /*! @brief The number of messages spilled to disk, which follow those
+         *         in memory.
+         */
+        size_t spilled = 0;
+
+        /*! @brief The messages that have been sent but not yet removed from
+         *         the queue, in queue order.
+         */
+        RingBuffer<InFlight> inFlight;
+
+        /*! @brief The number of queued messages covered by inFlight, which
+         *         is more than its size when messages are bundled.
+         */
+        size_t inFlightMessages = 0;
+
+        /*! @brief Whether this friend asked for messages to be bundled.
+         */
+        bool bundling = false;
+
+        /*! @brief Whether this friend uses the binary channel, so messages to
+         *         them are queued as records.
+         */
+        bool channel = false;
+
+        /*! @brief The sequence number of the next channel packet sent.
+         */
+        uint32_t nextSequence = 0;
+
+        /*! @brief Whether packets from this friend are waiting to be
+         *         acknowledged.
+         */
+        bool ackPending = false;
+
+        /*! @brief Measures round trips to this friend to decide when
+         *         messages in flight should be resent.
+         */
+        RttEstimator rtt;
+
+        /*! @brief Delivery counters reported by the stats command.
+         */
+        Stats stats;
+
+        /*! @brief When the messages in flight should be resent, in
+         *         milliseconds. Pushed back whenever progress is made and zero
+         *         while nothing is in flight.
+         */
+        uint64_t resendDeadline = 0;
+
+        /*! @brief When the scheduled timer for this friend expires, zero if
+         *         there is none. Timers that expire before resendDeadline are
+         *         scheduled again, timers for other deadlines are stale.
+         */
+        uint64_t timerDeadline = 0;
 
-        /*! @brief The status of the last message sent.
+        /*! @brief Whether this friend is linked into the ready list.
          */
-        bool lastMessageSentSuccessful = true;
+        bool ready = false;
 
-        /*! @brief The starting unique id of the last message sent to this
-         *         friend. According to the tox documentation, this number will
-         *         increment linearly.
+        /*! @brief The neighbours in the ready list.
          */
-        uint32_t lastMessageMinId = UINT32_MAX;
+        Friend* readyPrev = nullptr;
+        Friend* readyNext = nullptr;
+    };
 
-        /*! @brief The time stamp of the last message sent to this friend.
+    /*! @brief A reciever bound to a key id by a friend using the channel.
+     */
+    struct Binding
+    {
+        /*! @brief The public key of the reciever.
          */
-        std::time_t lastMessageTimeStamp;
+        ToxKey publicKey;
+
+        /*! @brief The alias of the reciever, UINT32_MAX if a sibling serves
+         *         them.
+         */
+        uint32_t alias = UINT32_MAX;
+    };
+
+    /*! @brief The data for a friend that is only needed by commands and the
+     *         journal.
+     */
+    struct FriendDetails
+    {
+        /*! @brief The public key of this friend. Identifies the friend in the
+         *         journal, since aliases are not guaranteed to survive a
+         *         restart.
+         */
+        ToxKey publicKey;
 
         /*! @brief The user defined aliases for different friends. The name
          *         is the key.
          */
-        std::map<std::string, ToxKey> aliases;
+        std::map<std::string, ToxKey, std::less<>> aliases;
 
         /*! @brief The used defined aliases for different friends. The public
          *         key is the key.
          */
-        std::map<ToxKey, std::string> reverseAliases;
+        std::unordered_map<ToxKey, std::string> reverseAliases;
+
+        /*! @brief Who messages are forwarded to while currentReciever is
+         *         SiblingAlias.
+         */
+        ToxKey siblingReciever;
+
+        /*! @brief Who sent the last message routed from a sibling, while
+         *         lastSender is SiblingAlias.
+         */
+        ToxKey lastSiblingSender;
+
+        /*! @brief The user defined groups of friends to forward to together.
+         *         The name is the key.
+         */
+        std::map<std::string, std::vector<ToxKey>, std::less<>> groups;
+
+        /*! @brief The aliases, groups and tox ids given to the last forward
+         *         command naming more than one reciever, or a group.
+         */
+        std::vector<std::string> fanOutNames;
+
+        /*! @brief Who messages are forwarded to while currentReciever is
+         *         FanOutAlias, resolved from fanOutNames.
+         */
+        std::vector<Binding> fanOut;
+
+        /*! @brief The recievers this friend has bound to key ids.
+         */
+        std::unordered_map<uint32_t, Binding> boundKeys;
+
+        /*! @brief The key ids that senders were bound to in records for
+         *         this friend.
+         */
+        std::unordered_map<ToxKey, uint32_t> senderIds;
+
+        /*! @brief The session of this friend's last channel packet, and the
+         *         sequence number expected next.
+         */
+        bool peerKnown = false;
+        uint32_t peerSession = 0;
+        uint32_t peerSequence = 0;
     };
 
+    /*! @brief A message being forwarded to several friends. Each form it is
+     *         queued in is stored once, when the first friend needing it is
+     *         reached, and shared by the queues of the rest.
+     */
+    struct SharedMessage
+    {
+        /*! @brief The message.
+         */
+        std::string_view message;
+
+        /*! @brief The payloads queued for friends recieving text, in order.
+         */
+        std::vector<uint32_t> text;
+
+        /*! @brief The payloads queued for friends using the channel, in
+         *         order.
+         */
+        std::vector<uint32_t> records;
+
+        /*! @brief Whether records is split into fragments.
+         */
+        bool fragmented = false;
+    };
+
+    /*! @brief A queued entry. Entries referring to a shared payload keep only
+     *         what comes before it in the queue.
+     */
+    struct Entry
+    {
+        /*! @brief The start of the entry after its tag, or all the rest of
+         *         it if not shared.
+         */
+        std::string_view head;
+
+        /*! @brief The shared payload following head, if any.
+         */
+        std::string_view payload;
+    };
+
+    /*! @brief Stands in for the alias of a friend served by a sibling.
+     */
+    static const uint32_t SiblingAlias = UINT32_MAX - 1;
+
+    /*! @brief Stands in for the alias of the reciever while forwarding to
+     *         several friends.
+     */
+    static const uint32_t FanOutAlias = UINT32_MAX - 2;
+
     /*! @brief Determines if a message is a command. A command is any message
      *         starting with a '!' followed by a specific keyword. The current
      *         keywords can be queried using !help.
      *  @param message The recieved message.
      */
-    bool messageIsCommand(const std::string& message) const;
+    bool messageIsCommand(std::string_view message) const;
 
     /*! @brief Processes a command.
      *  @param from The alias of the sender.
      *  @param message The entire command string.
      */
-    void processCommand(uint32_t from, const std::string& message);
+    void processCommand(uint32_t from, std::string_view message);
 
     /*! @brief Sends a regular message from one user to another.
      *  @param from The alias of the sender.
@@ -102,23 +469,358 @@ private:
      *  @param message The message to send.
      */
     void sendStandardMessage(uint32_t from, uint32_t to,
-                             const std::string& message);
+                             std::string_view message);
+
+    /*! @brief Sends a message to every friend a sender is forwarding to.
+     *  @param from The alias of the sender.
+     *  @param message The message to send.
+     */
+    void sendFanOut(uint32_t from, std::string_view message);
+
+    /*! @brief Queues a message for a friend of this intermediary and sends
+     *         it if they are ready.
+     *  @param reciever The friend to recieve the message.
+     *  @param from The alias of the sender, or SiblingAlias.
+     *  @param sender The public key of the sender.
+     *  @param message The message.
+     *  @param shared Set when the message goes to several friends, so its
+     *                payloads are shared instead of copied.
+     */
+    void deliver(Friend& reciever, uint32_t from, const ToxKey& sender,
+                 std::string_view message, SharedMessage* shared=nullptr);
+
+    /*! @brief Looks up a reciever named in a command.
+     *  @param from The alias of the friend who sent the command.
+     *  @param name An alias defined by that friend or a tox id.
+     *  @param publicKey Replaced with the public key of the reciever.
+     *  @return False if the reciever is not known to this intermediary or a
+     *          sibling.
+     *  @throw ToxKey::InvalidSize if name is neither an alias nor a tox id.
+     */
+    bool findReciever(uint32_t from, std::string_view name,
+                      ToxKey& publicKey);
+
+    /*! @brief Works out who a friend is forwarding to from the names given
+     *         to the forward command, dropping any no longer known.
+     *  @param from The alias of the friend forwarding.
+     */
+    void resolveFanOut(uint32_t from);
+
+    /*! @brief Acts on a record recieved over the channel.
+     *  @param from The alias of the sender.
+     *  @param record The record.
+     */
+    void processRecord(uint32_t from, const ChannelRecord& record);
+
+    /*! @brief Queues a notice of who the following messages are from.
+     *  @param reciever The friend recieving the messages.
+     *  @param publicKey The public key of the sender.
+     */
+    void announceSender(Friend& reciever, const ToxKey& publicKey);
 
     /*! @brief Sends a server message to a user.
      *  @param to The alias of the reciever.
      *  @param message The message to send.
      */
-    void sendServerMessage(uint32_t to, const std::string& message);
+    void sendServerMessage(uint32_t to, std::string_view message);
+
+    /*! @brief Adds a message to the back of a friend's queue. Messages too
+     *         long for one tox message are split into fragments first.
+     *  @param f The friend to recieve the message.
+     *  @param prefix Placed before the message, such as "!server ".
+     *  @param message The message to queue.
+     */
+    void enqueue(Friend& f, std::string_view prefix, std::string_view message);
+
+    /*! @brief Adds a record to the back of a friend's queue, splitting its
+     *         payload into fragments if it doesn't fit in one packet.
+     *  @param f The friend to recieve the record.
+     *  @param keyId See writeRecordHeader().
+     *  @param flags See writeRecordHeader().
+     *  @param payload The payload.
+     */
+    void enqueueRecord(Friend& f, uint32_t keyId, uint8_t flags,
+                       std::string_view payload);
+
+    /*! @brief Adds a message to the back of a friend's queue, referring to
+     *         the payloads of a message shared with other friends. They are
+     *         stored the first time a friend needs them.
+     *  @param f The friend to recieve the message.
+     *  @param shared The message.
+     *  @param keyId For a friend using the channel, the key id standing for
+     *               the sender.
+     */
+    void enqueueShared(Friend& f, SharedMessage& shared, uint32_t keyId);
+
+    /*! @brief Stores a payload to be shared by several queues.
+     *  @param payload The payload.
+     *  @return Its id, holding a reference until released.
+     */
+    uint32_t sharePayload(std::string_view payload);
+
+    /*! @brief Adds an entry referring to a shared payload to the back of a
+     *         friend's queue.
+     *  @param f The friend.
+     *  @param record Whether the entry is a record rather than text.
+     *  @param head Placed before the payload.
+     *  @param id The id of the payload.
+     */
+    void appendShared(Friend& f, bool record, std::string_view head,
+                      uint32_t id);
+
+    /*! @brief Returns a queued entry, looking up its payload if shared.
+     *  @param stored The entry as stored in the queue.
+     */
+    Entry readEntry(std::string_view stored) const;
+
+    /*! @brief Adds an entry to the back of a friend's queue as is.
+     *  @param f The friend.
+     *  @param prefix Placed before the entry.
+     *  @param entry The entry.
+     */
+    void append(Friend& f, std::string_view prefix, std::string_view entry);
+
+    /*! @brief Adds an entry to the back of a friend's queue as is, without
+     *         journaling it.
+     *  @param f The friend.
+     *  @param prefix Placed before the entry.
+     *  @param entry The entry.
+     *  @return False if the entry was spilled rather than kept in memory.
+     */
+    bool store(Friend& f, std::string_view prefix, std::string_view entry);
+
+    /*! @brief Adds an entry read back from the journal or a snapshot to a
+     *         friend's queue, without journaling it. Friends sent records
+     *         are switched to the channel.
+     *  @param f The friend.
+     *  @param stored The entry as it was stored.
+     *  @param payloadId The id the entry's shared payload has been stored
+     *                   under now, if it has one.
+     */
+    void restoreEntry(Friend& f, std::string_view stored,
+                      uint32_t payloadId = UINT32_MAX);
 
-    // The amount of time in seconds to wait before resending a message.
+    /*! @brief Restores a friend's state from the snapshot. Called when the
+     *         friend is first needed.
+     *  @param f The friend.
+     */
+    void restoreFriend(Friend& f);
+
+    /*! @brief Writes a friend's state to a snapshot, if there is any.
+     *  @param writer The snapshot.
+     *  @param f The friend.
+     *  @param refs Counts the entries written for each shared payload.
+     */
+    void writeFriend(SnapshotWriter& writer, Friend& f,
+                     std::unordered_map<uint32_t, uint32_t>& refs);
+
+    /*! @brief Copies the state of a friend that was never restored from the
+     *         current snapshot to a new one.
+     *  @param writer The new snapshot.
+     *  @param index The friend's position in the current snapshot.
+     *  @param refs Counts the entries written for each shared payload.
+     */
+    void copyFriend(SnapshotWriter& writer, size_t index,
+                    std::unordered_map<uint32_t, uint32_t>& refs);
+
+    /*! @brief Returns whether a friend has been set up, and so restored
+     *         from the snapshot.
+     *  @param alias The alias of the friend.
+     */
+    bool isRestored(uint32_t alias) const;
+
+    /*! @brief Returns the key id standing for a sender in records to a
+     *         friend, binding a new one if needed.
+     *  @param reciever The friend.
+     *  @param sender The public key of the sender.
+     */
+    uint32_t getSenderId(Friend& reciever, const ToxKey& sender);
+
+    /*! @brief Removes the message at the front of a friend's queue.
+     *  @param f The friend that recieved the message.
+     */
+    void dequeue(Friend& f);
+
+    /*! @brief Removes the entry at the front of a friend's queue, releasing
+     *         its payload if shared. Not journaled.
+     *  @param f The friend.
+     */
+    void popFront(Friend& f);
+
+    /*! @brief Returns the most bytes of payload in one queued record.
+     */
+    size_t getRecordLimit() const;
+
+    /*! @brief Returns how many bytes of spilled messages to read back at a
+     *         time.
+     */
+    size_t getPrefetchSize() const;
+
+    /*! @brief Starts reading a friend's spilled messages back if they are
+     *         online and running short of messages in memory.
+     *  @param f The friend.
+     */
+    void prefetch(Friend& f);
+
+    /*! @brief Adds spilled messages that were read back to a friend's queue.
+     *         Called on this intermediary's thread.
+     *  @param batch The messages.
+     */
+    void onSpillLoaded(SpillStore::Batch& batch);
+
+    /*! @brief Moves spilled messages that were read back into memory.
+     *  @param f The friend they belong to.
+     *  @param batch The messages, dropped if no longer the oldest spilled.
+     */
+    void takeSpilled(Friend& f, const SpillStore::Batch& batch);
+
+    /*! @brief Returns how many queued messages fit in one bundle.
+     *  @param next The first message to bundle.
+     *  @param available The most messages that may be bundled.
+     *  @return At least one. One means the message is sent unbundled.
+     */
+    uint32_t countBundle(MessageQueue::Iterator next, size_t available) const;
+
+    /*! @brief Returns how many queued records fit in one channel packet.
+     *  @param next The first record.
+     *  @param available The most records that may be sent.
+     *  @return At least one.
+     */
+    uint32_t countRecords(MessageQueue::Iterator next, size_t available) const;
+
+    /*! @brief Returns what to send for a message in flight, packing bundles
+     *         and channel packets into a buffer that is reused.
+     *  @param sent The message in flight.
+     */
+    std::string_view getPayload(const InFlight& sent);
+
+    /*! @brief Sends queued messages until the friend's window is full.
+     *  @param f The friend to send to.
+     *  @param now The current time in milliseconds.
+     */
+    void fillWindow(Friend& f, uint64_t now);
+
+    /*! @brief Sends to a friend that has queued messages and is online, or
+     *         marks them ready to be sent at the end of the update. With
+     *         immediate flush enabled, friends with nothing in flight are
+     *         sent to straight away.
+     *  @param f The friend.
+     */
+    void sendWhenReady(Friend& f);
+
+    /*! @brief Marks the channel packets before a sequence number recieved.
+     *  @param f The friend who acknowledged them.
+     *  @param next The sequence number of the next packet they expect.
+     */
+    void acknowledge(Friend& f, uint32_t next);
+
+    /*! @brief Removes the messages at the front of the window that have been
+     *         recieved.
+     *  @param f The friend.
+     *  @param now The current time in milliseconds.
+     */
+    void removeRecieved(Friend& f, uint64_t now);
+
+    /*! @brief Resends every message in flight that has not been recieved.
+     *  @param f The friend to resend to.
+     *  @param now The current time in milliseconds.
+     */
+    void resendWindow(Friend& f, uint64_t now);
+
+    /*! @brief Returns the data for a friend, creating it if needed.
+     *         References remain valid as more friends are added.
+     *  @param alias The alias for the friend.
+     */
+    Friend& getFriend(uint32_t alias);
+
+    /*! @brief Returns the rarely used data for a friend, creating it if
+     *         needed.
+     *  @param alias The alias for the friend.
+     */
+    FriendDetails& getDetails(uint32_t alias);
+
+    /*! @brief Sets when the messages in flight should be resent, scheduling a
+     *         timer if one is not already pending.
+     *  @param f The friend.
+     *  @param deadline The time in milliseconds, zero to cancel.
+     */
+    void setResendDeadline(Friend& f, uint64_t deadline);
+
+    /*! @brief Returns whether there are queued messages that have not been
+     *         sent and room in the window to send them.
+     *  @param f The friend.
+     */
+    bool canSend(const Friend& f) const;
+
+    /*! @brief Links a friend into the ready list if it is not already.
+     *  @param f The friend that has messages to send.
+     */
+    void markReady(Friend& f);
+
+    /*! @brief Unlinks a friend from the ready list if it is linked.
+     *  @param f The friend.
+     */
+    void unmarkReady(Friend& f);
+
+    /*! @brief Writes every shared payload and queued message to a journal.
+     *  @param journal The journal being rewritten.
+     */
+    void writeQueues(Journal& journal);
+
+    /*! @brief Returns the public key of a friend, looking it up if needed.
+     *  @param f The friend.
+     */
+    const ToxKey& getPublicKey(const Friend& f);
+
+    // The amount of time in seconds to wait before resending a message to a
+    // friend whose round trip time is unknown.
     double mWaitInterval;
+    // The maximum number of messages awaiting a reciept per friend
+    size_t mWindowSize;
+    // Delivers to friends of other intermediaries, if set
+    SiblingRouter* mRouter;
 
-    // Contains the data for any given friend
-    std::map<uint32_t, Friend> mFriends;
-    // Contains a list of the friends that need processing
-    std::set<uint32_t> mWorkQueue;
+    // Provides the memory for every friend's queue, so must outlive them
+    ChunkPool mChunkPool;
+    // Holds the payloads of messages forwarded to several friends
+    PayloadStore mPayloads;
+    // Holds the messages queued beyond the memory budget
+    SpillStore mSpill;
+    size_t mMemoryBudget;
+    size_t mFriendBudget;
+    // The bytes of every queue held in memory
+    size_t mQueuedBytes;
+    // Contains the data for any given friend, indexed by alias
+    SlotArray<Friend> mFriends;
+    SlotArray<FriendDetails> mDetails;
+    // The online friends that can send right now
+    Friend* mReadyHead;
+    // Expires when messages in flight need to be resent
+    TimerWheel mTimers;
+    std::vector<TimerWheel::Timer> mExpiredTimers;
 
     std::vector<std::string> mValidCommands;
+
+    // Holds the bundle being sent
+    std::string mBundle;
+    // Tells fragmented messages apart, starts from the time so it is unlikely
+    // to repeat ids still queued from before a restart
+    uint32_t mNextFragmentId;
+    // Sent in every channel packet so friends can tell when sequence numbers
+    // start again, chosen the same way
+    uint32_t mSession;
+    // The friends whose channel packets are acknowledged after the commit
+    std::vector<uint32_t> mPendingAcks;
+
+    // Records changes to the queues so they survive a restart
+    Journal mJournal;
+    // The state the journal records changes to, if snapshots are enabled,
+    // and the ids its payloads have been stored under
+    std::string mSnapshotPath;
+    std::unique_ptr<Snapshot> mSnapshot;
+    std::vector<uint32_t> mSnapshotPayloads;
+    uint64_t mSnapshotId;
+    bool mJournalFailed;
 };
 
 #endif
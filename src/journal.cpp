@@ -0,0 +1,371 @@
+#include "journal.h"
+
+#include <algorithm>
+#include <array>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <fcntl.h>
+#include <unistd.h>
+#include "fileutil.h"
+
+
+// Identifies the file and the version of the record format
+static const char JournalMagic[4] = { 'T', 'F', 'J', '2' };
+
+// Size of the crc and length fields in front of each record
+static const size_t RecordHeaderSize = 8;
+
+// Rewrite the journal once it holds this many bytes and most of its records
+// have been superseded
+static const uint64_t CompactionThreshold = 4 * 1024 * 1024;
+
+
+// Utility functions
+
+static uint32_t crc32(const uint8_t* data, size_t length)
+{
+    static std::array<uint32_t, 256> table = []()
+    {
+        std::array<uint32_t, 256> t;
+        for (uint32_t i = 0; i < 256; ++i)
+        {
+            uint32_t c = i;
+            for (int k = 0; k < 8; ++k)
+            {
+                c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : (c >> 1);
+            }
+            t[i] = c;
+        }
+        return t;
+    }();
+
+    uint32_t crc = 0xFFFFFFFF;
+    for (size_t i = 0; i < length; ++i)
+    {
+        crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return crc ^ 0xFFFFFFFF;
+}
+
+static void writeUint32(std::vector<uint8_t>& out, size_t at, uint32_t value)
+{
+    out[at + 0] = value & 0xFF;
+    out[at + 1] = (value >> 8) & 0xFF;
+    out[at + 2] = (value >> 16) & 0xFF;
+    out[at + 3] = (value >> 24) & 0xFF;
+}
+
+static uint32_t readUint32(const uint8_t* in)
+{
+    return (uint32_t)in[0] | ((uint32_t)in[1] << 8) |
+           ((uint32_t)in[2] << 16) | ((uint32_t)in[3] << 24);
+}
+
+
+// The Journal implementation
+
+Journal::Journal()
+    : mFile(-1)
+    , mTorn(false)
+    , mWritten(0)
+    , mRecords(0)
+    , mLiveRecords(0)
+{
+}
+
+Journal::~Journal()
+{
+    close();
+}
+
+bool Journal::load(const std::string& path, const Visitor& visitor)
+{
+    // Nothing has been journaled yet if there is no file
+    std::vector<uint8_t> data;
+    size_t end;
+    uint64_t records;
+    return !readFile(path, data) || replay(data, visitor, end, records);
+}
+
+bool Journal::readFile(const std::string& path, std::vector<uint8_t>& data)
+{
+    std::ifstream file(path.c_str(), std::ios_base::in | std::ios_base::binary);
+    if (!file.is_open())
+    {
+        return false;
+    }
+
+    data.assign((std::istreambuf_iterator<char>(file)),
+                std::istreambuf_iterator<char>());
+    return true;
+}
+
+bool Journal::replay(const std::vector<uint8_t>& data, const Visitor& visitor,
+                     size_t& end, uint64_t& records)
+{
+    end = 0;
+    records = 0;
+    if (data.size() < sizeof(JournalMagic) ||
+        !std::equal(JournalMagic, JournalMagic + sizeof(JournalMagic),
+                    data.begin()))
+    {
+        return data.empty();
+    }
+
+    // Replay each record until the end or a torn write
+    size_t pos = sizeof(JournalMagic);
+    while (data.size() - pos >= RecordHeaderSize)
+    {
+        uint32_t crc = readUint32(&data[pos]);
+        uint32_t length = readUint32(&data[pos + 4]);
+        const uint8_t* body = &data[pos + RecordHeaderSize];
+
+        if (length < 2 || data.size() - pos - RecordHeaderSize < length ||
+            crc32(body, length) != crc)
+        {
+            break;
+        }
+
+        RecordType type = (RecordType)body[0];
+        size_t keyLength = body[1];
+        if (2 + keyLength > length)
+        {
+            break;
+        }
+
+        std::string_view message((const char*)body + 2 + keyLength,
+                                 length - 2 - keyLength);
+        try
+        {
+            if ((type == RT_Payload || type == RT_Snapshot) && keyLength == 0)
+            {
+                visitor(type, ToxKey(), message);
+            }
+            else if (type == RT_Enqueue || type == RT_Dequeue)
+            {
+                visitor(type, ToxKey(ToxKey::Public, body + 2, keyLength),
+                        message);
+            }
+        }
+        catch (const ToxKey::InvalidSize& e)
+        {
+            // Checksum matched, so the record was written this way; skip it
+        }
+
+        pos += RecordHeaderSize + length;
+        ++records;
+    }
+
+    end = pos;
+    return true;
+}
+
+bool Journal::open(const std::string& path,
+                   const std::function<void(Journal&)>& fill)
+{
+    close();
+    mPath = path;
+    return rewrite(fill);
+}
+
+bool Journal::reopen(const std::string& path, const Visitor& visitor)
+{
+    close();
+    mPath = path;
+
+    std::vector<uint8_t> data;
+    size_t end = 0;
+    uint64_t records = 0;
+    if (readFile(path, data) && !replay(data, visitor, end, records))
+    {
+        return false;
+    }
+
+    if (end == 0)
+    {
+        // Nothing to keep, so start a fresh one
+        return rewrite([](Journal&) {});
+    }
+
+    // Anything after the last intact record was torn, and would hide the
+    // records appended after it
+    mFile = ::open(path.c_str(), O_WRONLY | O_APPEND);
+    if (mFile < 0 || ::ftruncate(mFile, end) != 0)
+    {
+        return false;
+    }
+
+    mTorn = false;
+    mWritten = end;
+    mRecords = records;
+    mLiveRecords = 0;
+    return true;
+}
+
+bool Journal::isOpen() const
+{
+    return mFile >= 0;
+}
+
+void Journal::close()
+{
+    if (mFile >= 0)
+    {
+        commit();
+        ::close(mFile);
+        mFile = -1;
+    }
+}
+
+void Journal::appendEnqueue(const ToxKey& publicKey,
+                            std::string_view message)
+{
+    appendRecord(RT_Enqueue, publicKey, message);
+    ++mLiveRecords;
+}
+
+void Journal::appendPayload(uint32_t id, std::string_view payload)
+{
+    // Payloads belong to no queue, so have no key
+    std::string message(4, '\0');
+    for (int i = 0; i < 4; ++i)
+    {
+        message[i] = (char)(id >> (i * 8));
+    }
+    message.append(payload);
+    appendRecord(RT_Payload, ToxKey(), message);
+}
+
+void Journal::appendSnapshot(uint64_t id)
+{
+    std::string message(8, '\0');
+    for (int i = 0; i < 8; ++i)
+    {
+        message[i] = (char)(id >> (i * 8));
+    }
+    appendRecord(RT_Snapshot, ToxKey(), message);
+}
+
+void Journal::appendDequeue(const ToxKey& publicKey)
+{
+    appendRecord(RT_Dequeue, publicKey, "");
+    if (mLiveRecords > 0)
+    {
+        --mLiveRecords;
+    }
+}
+
+bool Journal::commit()
+{
+    if (mFile < 0 || mPending.empty())
+    {
+        return true;
+    }
+
+    // Part of a failed commit would hide every record appended after it
+    if (mTorn)
+    {
+        if (::ftruncate(mFile, mWritten) != 0)
+        {
+            return false;
+        }
+        mTorn = false;
+    }
+
+    // One write and one sync for everything since the last commit
+    if (!writeAll(mFile, mPending.data(), mPending.size()) ||
+        ::fdatasync(mFile) != 0)
+    {
+        // Cut back to the last intact record, and keep the records to write
+        // again on the next commit
+        mTorn = ::ftruncate(mFile, mWritten) != 0;
+        return false;
+    }
+
+    mWritten += mPending.size();
+    mPending.clear();
+    return true;
+}
+
+bool Journal::needsCompaction() const
+{
+    return mWritten > CompactionThreshold && mRecords > 2 * mLiveRecords;
+}
+
+uint64_t Journal::getSize() const
+{
+    return mWritten + mPending.size();
+}
+
+bool Journal::rewrite(const std::function<void(Journal&)>& fill)
+{
+    // Anything pending is already reflected in the live state, but is still
+    // appended to the old journal if the new one can't be written
+    std::vector<uint8_t> pending;
+    pending.swap(mPending);
+    uint64_t records = mRecords;
+    uint64_t liveRecords = mLiveRecords;
+
+    mPending.assign(JournalMagic, JournalMagic + sizeof(JournalMagic));
+    mRecords = 0;
+    mLiveRecords = 0;
+
+    fill(*this);
+
+    // Write the new journal next to the old one, then atomically swap it in
+    int fd = openTempFile(mPath, O_APPEND);
+    if (fd < 0 || !writeAll(fd, mPending.data(), mPending.size()) ||
+        !replaceWithTempFile(fd, mPath))
+    {
+        if (fd >= 0)
+        {
+            ::close(fd);
+            ::unlink(getTempPath(mPath).c_str());
+        }
+
+        mPending.swap(pending);
+        mRecords = records;
+        mLiveRecords = liveRecords;
+        return false;
+    }
+
+    // Continue appending to the new file
+    if (mFile >= 0)
+    {
+        ::close(mFile);
+    }
+    mFile = fd;
+    mTorn = false;
+    mWritten = mPending.size();
+    mPending.clear();
+    return true;
+}
+
+void Journal::appendRecord(RecordType type, const ToxKey& publicKey,
+                           std::string_view message)
+{
+    if (mFile < 0 && mPath.empty())
+    {
+        // Journaling is disabled
+        return;
+    }
+
+    uint32_t length = 2 + publicKey.size() + message.size();
+
+    size_t start = mPending.size();
+    mPending.resize(start + RecordHeaderSize + length);
+
+    // Body
+    uint8_t* body = &mPending[start + RecordHeaderSize];
+    body[0] = (uint8_t)type;
+    body[1] = (uint8_t)publicKey.size();
+    std::copy(publicKey.data(), publicKey.data() + publicKey.size(), body + 2);
+    std::copy(message.begin(), message.end(), body + 2 + publicKey.size());
+
+    // Header
+    writeUint32(mPending, start, crc32(body, length));
+    writeUint32(mPending, start + 4, length);
+
+    ++mRecords;
+}
@@ -0,0 +1,168 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <functional>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "toxwrapper.h"
+
+/*! @brief An append-only, checksummed log of the changes made to the message
+ *         queues. Replaying it rebuilds the queues after a restart or crash.
+ *
+ *  Records are buffered in memory and written out together by commit(), so
+ *  that a single fsync covers every change made during an update.
+ */
+class Journal
+{
+public:
+
+    /*! @brief The kinds of records stored in the journal.
+     */
+    enum RecordType
+    {
+        RT_Enqueue = 1,
+        RT_Dequeue = 2,
+        RT_Payload = 3,
+        RT_Snapshot = 4
+    };
+
+    /*! @brief Called for each valid record found while loading.
+     *  @param type The kind of record.
+     *  @param publicKey The public key of the friend that owns the queue,
+     *                   empty for payload and snapshot records.
+     *  @param message The queued message, empty for dequeue records. For
+     *                 payload records, the id as four bytes least
+     *                 significant first, followed by the payload. For
+     *                 snapshot records, the id as eight bytes.
+     */
+    typedef std::function<void(RecordType type, const ToxKey& publicKey,
+                               std::string_view message)> Visitor;
+
+    /*! @brief Constructor.
+     */
+    Journal();
+
+    /*! @brief Commits any buffered records and closes the file.
+     */
+    ~Journal();
+
+
+    // No copy/assignment allowed
+    Journal(const Journal&) = delete;
+    Journal& operator=(const Journal&) = delete;
+
+
+    /*! @brief Reads every intact record from a journal file. Reading stops at
+     *         the first truncated or corrupt record, which is what a crash
+     *         in the middle of a write leaves behind.
+     *  @param path The location of the journal.
+     *  @param visitor Called once for each record in the order written.
+     *  @return False if the file exists but is not a journal.
+     */
+    static bool load(const std::string& path, const Visitor& visitor);
+
+    /*! @brief Opens a journal for appending. Any existing contents are
+     *         replaced, so callers should load() the old journal first.
+     *  @param path The location of the journal.
+     *  @param fill Called to write the initial contents, see rewrite().
+     *  @return True on success.
+     */
+    bool open(const std::string& path,
+              const std::function<void(Journal&)>& fill);
+
+    /*! @brief Replays a journal and opens it for appending after its last
+     *         intact record, rather than replacing it. For journals that
+     *         only record the changes since a snapshot, so stay small.
+     *  @param path The location of the journal.
+     *  @param visitor Called once for each record in the order written.
+     *  @return False if the file exists but is not a journal, or could not
+     *          be opened.
+     */
+    bool reopen(const std::string& path, const Visitor& visitor);
+
+    /*! @brief Returns whether or not the journal is open for appending.
+     */
+    bool isOpen() const;
+
+    /*! @brief Commits any buffered records and closes the file.
+     */
+    void close();
+
+    /*! @brief Records a message being added to the back of a queue.
+     *  @param publicKey The owner of the queue.
+     *  @param message The message that was added.
+     */
+    void appendEnqueue(const ToxKey& publicKey, std::string_view message);
+
+    /*! @brief Records a payload shared by several queues being stored. Queued
+     *         messages that refer to it follow.
+     *  @param id The id of the payload, which replaces any earlier payload
+     *            with the same id.
+     *  @param payload The payload.
+     */
+    void appendPayload(uint32_t id, std::string_view payload);
+
+    /*! @brief Records which snapshot the changes that follow were made to.
+     *  @param id The id of the snapshot.
+     */
+    void appendSnapshot(uint64_t id);
+
+    /*! @brief Records the message at the front of a queue being removed.
+     *  @param publicKey The owner of the queue.
+     */
+    void appendDequeue(const ToxKey& publicKey);
+
+    /*! @brief Writes out every buffered record and waits for them to reach
+     *         the disk.
+     *  @return True on success. On failure the records stay buffered, and
+     *          anything partly written is cut off before the next commit
+     *          writes them again.
+     */
+    bool commit();
+
+    /*! @brief Returns true once enough records have been superseded that the
+     *         journal is worth rewriting.
+     */
+    bool needsCompaction() const;
+
+    /*! @brief Returns the bytes written since the journal was last
+     *         rewritten.
+     */
+    uint64_t getSize() const;
+
+    /*! @brief Atomically replaces the journal with a fresh one containing only
+     *         the messages that are still queued.
+     *  @param fill Called with this journal; should appendPayload() every
+     *              shared payload and then appendEnqueue() every message
+     *              that is still waiting to be delivered.
+     *  @return True on success. On failure the old journal is kept, along
+     *          with the records buffered for it.
+     */
+    bool rewrite(const std::function<void(Journal&)>& fill);
+
+private:
+
+    static bool readFile(const std::string& path, std::vector<uint8_t>& data);
+
+    static bool replay(const std::vector<uint8_t>& data,
+                       const Visitor& visitor, size_t& end, uint64_t& records);
+
+    void appendRecord(RecordType type, const ToxKey& publicKey,
+                      std::string_view message);
+
+    std::string mPath;
+    int mFile;
+    std::vector<uint8_t> mPending;
+
+    // Whether a failed commit may have left part of its records behind
+    bool mTorn;
+
+    // Bytes written since the journal was last rewritten
+    uint64_t mWritten;
+    // Records written and how many of them are still queued
+    uint64_t mRecords;
+    uint64_t mLiveRecords;
+};
+
+#endif
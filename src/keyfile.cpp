@@ -0,0 +1,191 @@
+#include "keyfile.h"
+
+#include <cassert>
+#include <functional>
+#include <thread>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "hex.h"
+
+
+static const size_t KeySize = 32;
+
+// Runs work(0) to work(count - 1) at once, the last on this thread
+static void runParallel(size_t count, const std::function<void(size_t)>& work)
+{
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i + 1 < count; ++i)
+    {
+        threads.emplace_back(work, i);
+    }
+    work(count - 1);
+
+    for (auto it = threads.begin(); it != threads.end(); ++it)
+    {
+        it->join();
+    }
+}
+
+// Text is printable characters and line breaks
+static bool isText(std::string_view data)
+{
+    for (size_t i = 0; i < data.size(); ++i)
+    {
+        unsigned char c = data[i];
+        if ((c < 0x20 && c != '\n' && c != '\r' && c != '\t') || c >= 0x7F)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// The start of the line after pos, or the end of the text
+static size_t nextLine(std::string_view text, size_t pos)
+{
+    if (pos == 0)
+    {
+        return 0;
+    }
+
+    size_t end = text.find('\n', pos - 1);
+    return (end == std::string_view::npos) ? text.size() : end + 1;
+}
+
+static size_t parseLines(std::string_view text, std::vector<ToxKey>& keys)
+{
+    size_t invalid = 0;
+    uint8_t bin[KeySize];
+    for (size_t pos = 0; pos < text.size();)
+    {
+        size_t end = text.find('\n', pos);
+        if (end == std::string_view::npos)
+        {
+            end = text.size();
+        }
+        std::string_view line = text.substr(pos, end - pos);
+        pos = end + 1;
+
+        size_t start = line.find_first_not_of(" \t\r");
+        if (start == std::string_view::npos || line[start] == '#')
+        {
+            continue;
+        }
+
+        // Anything after the key is ignored, such as the rest of a tox id
+        if (convertToBinary(line.substr(start), bin, KeySize))
+        {
+            keys.emplace_back(ToxKey::Public, bin, KeySize);
+        }
+        else
+        {
+            ++invalid;
+        }
+    }
+    return invalid;
+}
+
+
+size_t parseHexKeys(std::string_view text, size_t threads,
+                    std::vector<ToxKey>& keys)
+{
+    assert(threads > 0);
+
+    // Each thread takes the lines starting in its share of the text
+    std::vector<std::vector<ToxKey>> parts(threads);
+    std::vector<size_t> invalid(threads, 0);
+    runParallel(threads, [&](size_t i)
+    {
+        size_t begin = nextLine(text, text.size() * i / threads);
+        size_t end = nextLine(text, text.size() * (i + 1) / threads);
+        if (begin < end)
+        {
+            parts[i].reserve((end - begin) / (KeySize * 2 + 1));
+            invalid[i] = parseLines(text.substr(begin, end - begin), parts[i]);
+        }
+    });
+
+    size_t count = 0;
+    for (size_t i = 0; i < threads; ++i)
+    {
+        count += parts[i].size();
+    }
+
+    keys.clear();
+    keys.reserve(count);
+    size_t invalidLines = 0;
+    for (size_t i = 0; i < threads; ++i)
+    {
+        keys.insert(keys.end(), parts[i].begin(), parts[i].end());
+        invalidLines += invalid[i];
+    }
+    return invalidLines;
+}
+
+bool readKeyFile(const std::string& path, size_t threads,
+                 std::vector<ToxKey>& keys, KeyFileStats& stats)
+{
+    assert(threads > 0);
+    keys.clear();
+    stats = KeyFileStats();
+
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        return false;
+    }
+
+    struct stat info;
+    if (::fstat(fd, &info) != 0)
+    {
+        ::close(fd);
+        return false;
+    }
+    if (info.st_size == 0)
+    {
+        ::close(fd);
+        return true;
+    }
+
+    void* data = ::mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (data == MAP_FAILED)
+    {
+        return false;
+    }
+
+    std::string_view text((const char*)data, info.st_size);
+    ::madvise(data, info.st_size, MADV_SEQUENTIAL);
+
+    bool success = true;
+    if (isText(text.substr(0, KeySize)))
+    {
+        stats.invalid = parseHexKeys(text, threads, keys);
+    }
+    else if (text.size() % KeySize == 0)
+    {
+        // Already binary, only copied into place
+        size_t count = text.size() / KeySize;
+        keys.resize(count);
+        runParallel(threads, [&](size_t i)
+        {
+            const uint8_t* bin = (const uint8_t*)text.data();
+            for (size_t k = count * i / threads; k < count * (i + 1) / threads;
+                 ++k)
+            {
+                keys[k] = ToxKey(ToxKey::Public, bin + k * KeySize, KeySize);
+            }
+        });
+    }
+    else
+    {
+        success = false;
+    }
+
+    ::munmap(data, info.st_size);
+
+    stats.read = keys.size();
+    return success;
+}
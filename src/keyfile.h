@@ -0,0 +1,52 @@
+#ifndef KEYFILE_H
+#define KEYFILE_H
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "toxwrapper.h"
+
+/*! @brief Counts of what was found while reading keys.
+ */
+struct KeyFileStats
+{
+    /*! @brief The keys read.
+     */
+    size_t read = 0;
+
+    /*! @brief The lines of a hex file that did not start with a key.
+     */
+    size_t invalid = 0;
+};
+
+/*! @brief Reads the public keys of friends from a file, which is mapped into
+ *         memory and parsed by several threads at once.
+ *
+ *  A binary file is the keys one after another, 32 bytes each. Any other
+ *  file is read as hex, one key per line, of which only the first 64
+ *  characters are used so tox ids can be given too. Blank lines and lines
+ *  starting with '#' are skipped. Binary files are told apart by their first
+ *  key, which is very unlikely to be only text.
+ *  @param path The file.
+ *  @param threads The number of threads to parse with, at least one.
+ *  @param keys Replaced with the keys, including any duplicates, in the
+ *              order given.
+ *  @param stats Replaced with what was found.
+ *  @return False if the file could not be read, or is binary with a size
+ *          that isn't a whole number of keys.
+ */
+bool readKeyFile(const std::string& path, size_t threads,
+                 std::vector<ToxKey>& keys, KeyFileStats& stats);
+
+/*! @brief Parses public keys in hex, one per line, as readKeyFile() does.
+ *  @param text The lines.
+ *  @param threads The number of threads to parse with, at least one.
+ *  @param keys Replaced with the keys, including any duplicates, in the
+ *              order given.
+ *  @return The number of lines that did not start with a key.
+ */
+size_t parseHexKeys(std::string_view text, size_t threads,
+                    std::vector<ToxKey>& keys);
+
+#endif
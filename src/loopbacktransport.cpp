@@ -0,0 +1,272 @@
+#include "loopbacktransport.h"
+
+#include <cassert>
+
+
+LoopbackTransport::LoopbackTransport(const ToxKey& address)
+    : mAddress(address)
+    , mIterationInterval(0)
+{
+}
+
+void LoopbackTransport::setDeliveryHandler(const DeliveryHandler& handler)
+{
+    mDeliveryHandler = handler;
+}
+
+void LoopbackTransport::setPacketHandler(const PacketHandler& handler)
+{
+    mPacketHandler = handler;
+}
+
+void LoopbackTransport::setFriendConnected(uint32_t alias, bool online)
+{
+    assert(friendExists(alias));
+    mFriends[alias].online = online;
+
+    Event event;
+    event.type = Event::ConnectionChanged;
+    event.alias = alias;
+    event.online = online;
+    mEvents.push_back(event);
+}
+
+void LoopbackTransport::injectMessage(uint32_t alias,
+                                      const std::string& message)
+{
+    Event event;
+    event.type = Event::MessageRecieved;
+    event.alias = alias;
+    event.message = message;
+    mEvents.push_back(event);
+}
+
+void LoopbackTransport::injectPacket(uint32_t alias,
+                                     const std::string& packet)
+{
+    Event event;
+    event.type = Event::PacketRecieved;
+    event.alias = alias;
+    event.message = packet;
+    mEvents.push_back(event);
+}
+
+void LoopbackTransport::setIterationInterval(uint32_t interval)
+{
+    mIterationInterval = interval;
+}
+
+bool LoopbackTransport::bootstrapNode(const std::string& address,
+                                      uint16_t port, const ToxKey& publicKey)
+{
+    return true;
+}
+
+void LoopbackTransport::getSaveData(std::vector<uint8_t>& data)
+{
+    data.clear();
+}
+
+bool LoopbackTransport::isConnected()
+{
+    return true;
+}
+
+ToxKey LoopbackTransport::getAddress()
+{
+    return mAddress;
+}
+
+std::string LoopbackTransport::getName()
+{
+    return mName;
+}
+
+bool LoopbackTransport::setName(const std::string& name)
+{
+    mName = name;
+    return true;
+}
+
+std::string LoopbackTransport::getStatusMessage()
+{
+    return mStatusMessage;
+}
+
+bool LoopbackTransport::setStatusMessage(const std::string& message)
+{
+    mStatusMessage = message;
+    return true;
+}
+
+uint32_t LoopbackTransport::addFriend(const ToxKey& address,
+                                      const std::string& message)
+{
+    // The public key is the start of the address
+    return addFriendNoRequest(ToxKey(ToxKey::Public, address.data(),
+                                     ToxKey::getSize(ToxKey::Public)));
+}
+
+uint32_t LoopbackTransport::addFriendNoRequest(const ToxKey& publicKey)
+{
+    if (mFriendsByKey.find(publicKey) != mFriendsByKey.end())
+    {
+        return UINT32_MAX;
+    }
+
+    uint32_t alias = mFriends.size();
+    mFriends.push_back(Friend());
+    mFriends[alias].publicKey = publicKey;
+    mFriends[alias].exists = true;
+    mFriendsByKey[publicKey] = alias;
+
+    return alias;
+}
+
+void LoopbackTransport::getFriendList(std::vector<uint32_t>& aliases)
+{
+    aliases.clear();
+    for (uint32_t alias = 0; alias < mFriends.size(); ++alias)
+    {
+        if (mFriends[alias].exists)
+        {
+            aliases.push_back(alias);
+        }
+    }
+}
+
+uint32_t LoopbackTransport::getFriendByPublicKey(const ToxKey& publicKey)
+{
+    auto it = mFriendsByKey.find(publicKey);
+    return (it != mFriendsByKey.end()) ? it->second : UINT32_MAX;
+}
+
+bool LoopbackTransport::friendExists(uint32_t alias)
+{
+    return alias < mFriends.size() && mFriends[alias].exists;
+}
+
+bool LoopbackTransport::deleteFriend(uint32_t alias)
+{
+    if (!friendExists(alias))
+    {
+        return false;
+    }
+
+    mFriendsByKey.erase(mFriends[alias].publicKey);
+    mFriends[alias] = Friend();
+    return true;
+}
+
+ToxKey LoopbackTransport::getFriendPublicKey(uint32_t alias)
+{
+    return friendExists(alias) ? mFriends[alias].publicKey : ToxKey();
+}
+
+bool LoopbackTransport::isFriendConnected(uint32_t alias)
+{
+    return friendExists(alias) && mFriends[alias].online;
+}
+
+uint32_t LoopbackTransport::sendMessage(uint32_t friendAlias,
+                                        std::string_view message,
+                                        bool actionType)
+{
+    if (!isFriendConnected(friendAlias) || message.empty() ||
+        message.size() > tox_max_message_length())
+    {
+        return UINT32_MAX;
+    }
+
+    // The friend recieves the message and replies with a reciept
+    Event event;
+    event.type = Event::RecieptRecieved;
+    event.alias = friendAlias;
+    event.messageId = mFriends[friendAlias].nextMessageId++;
+    event.message = message;
+    mEvents.push_back(event);
+
+    return event.messageId;
+}
+
+bool LoopbackTransport::sendLosslessPacket(uint32_t friendAlias,
+                                           std::string_view packet)
+{
+    if (!isFriendConnected(friendAlias) || packet.empty() ||
+        packet.size() > tox_max_custom_packet_size())
+    {
+        return false;
+    }
+
+    // The friend recieves it on the next iteration
+    Event event;
+    event.type = Event::PacketSent;
+    event.alias = friendAlias;
+    event.message = packet;
+    mEvents.push_back(event);
+
+    return true;
+}
+
+uint32_t LoopbackTransport::getIterationInterval()
+{
+    return mIterationInterval;
+}
+
+void LoopbackTransport::iterate()
+{
+    // Events caused by handling these wait for the next iteration
+    std::deque<Event> events;
+    events.swap(mEvents);
+
+    ToxWrapper* wrapper = getWrapper();
+    for (auto it = events.begin(); it != events.end(); ++it)
+    {
+        switch (it->type)
+        {
+        case Event::ConnectionChanged:
+            if (wrapper)
+            {
+                wrapper->friendConnectionStatusChanged(it->alias, it->online);
+            }
+            break;
+
+        case Event::MessageRecieved:
+            if (wrapper)
+            {
+                wrapper->onMessageRecieved(it->alias, it->message, false);
+            }
+            break;
+
+        case Event::RecieptRecieved:
+            if (!isFriendConnected(it->alias))
+            {
+                // Lost with the connection
+                break;
+            }
+            if (mDeliveryHandler)
+            {
+                mDeliveryHandler(it->alias, it->message);
+            }
+            if (wrapper)
+            {
+                wrapper->onMessageSentSuccess(it->alias, it->messageId);
+            }
+            break;
+
+        case Event::PacketRecieved:
+            if (wrapper)
+            {
+                wrapper->onLosslessPacketRecieved(it->alias, it->message);
+            }
+            break;
+
+        case Event::PacketSent:
+            if (isFriendConnected(it->alias) && mPacketHandler)
+            {
+                mPacketHandler(it->alias, it->message);
+            }
+            break;
+        }
+    }
+}
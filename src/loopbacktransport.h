@@ -0,0 +1,180 @@
+#ifndef LOOPBACKTRANSPORT_H
+#define LOOPBACKTRANSPORT_H
+
+#include <deque>
+#include <functional>
+#include <unordered_map>
+#include "transport.h"
+
+/*! @brief A transport that simulates friends entirely in process. Presence,
+ *         incoming messages and read reciepts are driven by the owner, which
+ *         makes it possible to exercise a ToxWrapper without a network.
+ *
+ *  Every message sent to an online friend is handed to the delivery handler
+ *  and acknowledged with a reciept on the following call to iterate().
+ *  Lossless packets are handed to the packet handler in the same way.
+ */
+class LoopbackTransport : public ToxTransport
+{
+public:
+
+    /*! @brief Called when a simulated friend recieves a message.
+     *  @param alias The alias for the friend.
+     *  @param message The message recieved.
+     */
+    typedef std::function<void(uint32_t alias,
+                               const std::string& message)> DeliveryHandler;
+
+    /*! @brief Called when a simulated friend recieves a lossless packet.
+     *  @param alias The alias for the friend.
+     *  @param packet The packet recieved.
+     */
+    typedef std::function<void(uint32_t alias,
+                               const std::string& packet)> PacketHandler;
+
+    /*! @brief Constructor.
+     *  @param address The address reported for this instance.
+     */
+    explicit LoopbackTransport(const ToxKey& address=ToxKey());
+
+    /*! @brief Sets the function called when a friend recieves a message.
+     *  @param handler The handler.
+     */
+    void setDeliveryHandler(const DeliveryHandler& handler);
+
+    /*! @brief Sets the function called when a friend recieves a lossless
+     *         packet.
+     *  @param handler The handler.
+     */
+    void setPacketHandler(const PacketHandler& handler);
+
+    /*! @brief Changes whether a friend is online. The wrapper is notified on
+     *         the next call to iterate().
+     *  @param alias The alias for the friend.
+     *  @param online True if the friend should be online.
+     */
+    void setFriendConnected(uint32_t alias, bool online);
+
+    /*! @brief Has a friend send a message. The wrapper recieves it on the next
+     *         call to iterate().
+     *  @param alias The alias for the friend sending the message.
+     *  @param message The message.
+     */
+    void injectMessage(uint32_t alias, const std::string& message);
+
+    /*! @brief Has a friend send a lossless packet. The wrapper recieves it on
+     *         the next call to iterate().
+     *  @param alias The alias for the friend sending the packet.
+     *  @param packet The packet.
+     */
+    void injectPacket(uint32_t alias, const std::string& packet);
+
+    /*! @brief Sets how long the wrapper should wait between iterations.
+     *  @param interval The interval in milliseconds.
+     */
+    void setIterationInterval(uint32_t interval);
+
+    bool bootstrapNode(const std::string& address, uint16_t port,
+                       const ToxKey& publicKey) override;
+
+    void getSaveData(std::vector<uint8_t>& data) override;
+
+    bool isConnected() override;
+
+    ToxKey getAddress() override;
+
+    std::string getName() override;
+
+    bool setName(const std::string& name) override;
+
+    std::string getStatusMessage() override;
+
+    bool setStatusMessage(const std::string& message) override;
+
+    uint32_t addFriend(const ToxKey& address,
+                       const std::string& message) override;
+
+    uint32_t addFriendNoRequest(const ToxKey& publicKey) override;
+
+    void getFriendList(std::vector<uint32_t>& aliases) override;
+
+    uint32_t getFriendByPublicKey(const ToxKey& publicKey) override;
+
+    bool friendExists(uint32_t alias) override;
+
+    bool deleteFriend(uint32_t alias) override;
+
+    ToxKey getFriendPublicKey(uint32_t alias) override;
+
+    bool isFriendConnected(uint32_t alias) override;
+
+    uint32_t sendMessage(uint32_t friendAlias, std::string_view message,
+                         bool actionType) override;
+
+    bool sendLosslessPacket(uint32_t friendAlias,
+                            std::string_view packet) override;
+
+    uint32_t getIterationInterval() override;
+
+    void iterate() override;
+
+protected:
+
+    /*! @brief The state of a simulated friend.
+     */
+    struct Friend
+    {
+        /*! @brief The public key the friend was added with.
+         */
+        ToxKey publicKey;
+
+        /*! @brief False once the friend has been deleted.
+         */
+        bool exists = false;
+
+        /*! @brief Whether the friend is currently connected.
+         */
+        bool online = false;
+
+        /*! @brief The id assigned to the next message sent to the friend.
+         */
+        uint32_t nextMessageId = 0;
+    };
+
+    /*! @brief Something the wrapper will be told about on the next iteration.
+     */
+    struct Event
+    {
+        enum Type
+        {
+            ConnectionChanged,
+            MessageRecieved,
+            RecieptRecieved,
+            PacketRecieved,
+            PacketSent
+        };
+
+        Type type;
+        uint32_t alias = 0;
+        bool online = false;
+        uint32_t messageId = 0;
+        std::string message;
+    };
+
+    std::vector<Friend> mFriends;
+    DeliveryHandler mDeliveryHandler;
+    PacketHandler mPacketHandler;
+
+private:
+
+    ToxKey mAddress;
+    std::string mName;
+    std::string mStatusMessage;
+    uint32_t mIterationInterval;
+
+    std::unordered_map<ToxKey, uint32_t> mFriendsByKey;
+
+    std::deque<Event> mEvents;
+};
+
+#endif
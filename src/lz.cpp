@@ -0,0 +1,276 @@
+#include "lz.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+
+// Matches shorter than this aren't worth their offset
+static const size_t MinMatch = 4;
+
+// Farthest back a match can start, offsets are two bytes
+static const size_t MaxOffset = 65535;
+
+// Lengths up to this fit in the token, longer ones continue after it
+static const size_t TokenLength = 15;
+
+// Positions of earlier text are looked up by a hash of their first bytes
+static const int HashBits = 14;
+
+static const uint32_t NoPosition = UINT32_MAX;
+
+// Short copies are done this many bytes at a time, so that much room is left
+// past the end of the output while decompressing
+static const size_t CopySize = 16;
+
+static uint32_t read32(const char* in)
+{
+    uint32_t value;
+    memcpy(&value, in, sizeof(value));
+    return value;
+}
+
+static uint32_t hash(uint32_t value)
+{
+    return (value * 2654435761u) >> (32 - HashBits);
+}
+
+static void writeLength(std::string& output, size_t length)
+{
+    for (; length >= 255; length -= 255)
+    {
+        output.push_back((char)255);
+    }
+    output.push_back((char)length);
+}
+
+static bool readLength(const uint8_t*& in, const uint8_t* end, size_t& length)
+{
+    uint8_t byte;
+    do
+    {
+        if (in == end)
+        {
+            return false;
+        }
+        byte = *in++;
+        length += byte;
+    }
+    while (byte == 255);
+    return true;
+}
+
+static void writeSequence(std::string& output, const char* literals,
+                          size_t count, size_t offset, size_t length)
+{
+    size_t match = length - MinMatch;
+    output.push_back((char)((std::min(count, TokenLength) << 4) |
+                            std::min(match, TokenLength)));
+    if (count >= TokenLength)
+    {
+        writeLength(output, count - TokenLength);
+    }
+    output.append(literals, count);
+    output.push_back((char)offset);
+    output.push_back((char)(offset >> 8));
+    if (match >= TokenLength)
+    {
+        writeLength(output, match - TokenLength);
+    }
+}
+
+
+
+// The LzDictionary implementation
+
+LzDictionary::LzDictionary(std::string text)
+    : mText(std::move(text))
+    , mTable(1 << HashBits, NoPosition)
+{
+    // Only the end can be reached from a block
+    if (mText.size() > MaxOffset)
+    {
+        mText.erase(0, mText.size() - MaxOffset);
+    }
+
+    for (size_t pos = 0; pos + MinMatch <= mText.size(); ++pos)
+    {
+        mTable[hash(read32(mText.data() + pos))] = pos;
+    }
+}
+
+std::string_view LzDictionary::getText() const
+{
+    return mText;
+}
+
+
+void lzCompress(std::string_view input, const LzDictionary* dictionary,
+                std::string& output)
+{
+    std::string_view start = dictionary ? dictionary->getText() : "";
+    std::string buffer;
+    buffer.reserve(start.size() + input.size());
+    buffer.append(start);
+    buffer.append(input);
+    const char* text = buffer.data();
+    size_t end = buffer.size();
+
+    std::vector<uint32_t> table;
+    if (dictionary)
+    {
+        table = dictionary->mTable;
+    }
+    else
+    {
+        table.assign(1 << HashBits, NoPosition);
+    }
+
+    size_t anchor = start.size();
+    size_t pos = anchor;
+    while (pos + MinMatch <= end)
+    {
+        uint32_t value = read32(text + pos);
+        uint32_t& slot = table[hash(value)];
+        size_t candidate = slot;
+        slot = pos;
+
+        if (candidate == NoPosition || pos - candidate > MaxOffset ||
+            read32(text + candidate) != value)
+        {
+            // Step faster through text that doesn't match
+            pos += 1 + ((pos - anchor) >> 6);
+            continue;
+        }
+
+        size_t length = MinMatch;
+        while (pos + length < end &&
+               text[candidate + length] == text[pos + length])
+        {
+            ++length;
+        }
+        while (pos > anchor && candidate > 0 &&
+               text[pos - 1] == text[candidate - 1])
+        {
+            --pos;
+            --candidate;
+            ++length;
+        }
+
+        writeSequence(output, text + anchor, pos - anchor, pos - candidate,
+                      length);
+        pos += length;
+        anchor = pos;
+    }
+
+    // The rest is literals
+    size_t count = end - anchor;
+    output.push_back((char)(std::min(count, TokenLength) << 4));
+    if (count >= TokenLength)
+    {
+        writeLength(output, count - TokenLength);
+    }
+    output.append(text + anchor, count);
+}
+
+bool lzDecompress(std::string_view input, std::string_view dictionary,
+                  size_t size, std::string& output)
+{
+    size_t begin = output.size();
+    output.resize(begin + size + CopySize);
+    char* out = &output[begin];
+    size_t pos = 0;
+
+    const uint8_t* in = (const uint8_t*)input.data();
+    const uint8_t* inEnd = in + input.size();
+    bool valid = false;
+    while (in < inEnd)
+    {
+        uint8_t token = *in++;
+        size_t count = token >> 4;
+        if (count == TokenLength && !readLength(in, inEnd, count))
+        {
+            break;
+        }
+        if (count > (size_t)(inEnd - in) || count > size - pos)
+        {
+            break;
+        }
+        if (count <= CopySize && (size_t)(inEnd - in) >= CopySize)
+        {
+            memcpy(out + pos, in, CopySize);
+        }
+        else
+        {
+            memcpy(out + pos, in, count);
+        }
+        in += count;
+        pos += count;
+
+        // Only the last sequence has no match
+        if (in == inEnd)
+        {
+            valid = pos == size;
+            break;
+        }
+
+        if (inEnd - in < 2)
+        {
+            break;
+        }
+        size_t offset = in[0] | (in[1] << 8);
+        in += 2;
+
+        size_t length = token & TokenLength;
+        if (length == TokenLength && !readLength(in, inEnd, length))
+        {
+            break;
+        }
+        length += MinMatch;
+        if (offset == 0 || offset > pos + dictionary.size() ||
+            length > size - pos)
+        {
+            break;
+        }
+
+        if (offset > pos)
+        {
+            // Starts in the dictionary, and may carry on into the output
+            size_t back = offset - pos;
+            size_t count = std::min(back, length);
+            memcpy(out + pos, dictionary.data() + dictionary.size() - back,
+                   count);
+            pos += count;
+            length -= count;
+        }
+
+        // Chunks may overlap the match, as long as they start behind it
+        const char* from = out + pos - std::min(offset, pos);
+        if (offset >= CopySize)
+        {
+            for (size_t i = 0; i < length; i += CopySize)
+            {
+                memcpy(out + pos + i, from + i, CopySize);
+            }
+        }
+        else if (offset >= 8)
+        {
+            for (size_t i = 0; i < length; i += 8)
+            {
+                memcpy(out + pos + i, from + i, 8);
+            }
+        }
+        else
+        {
+            for (size_t i = 0; i < length; ++i)
+            {
+                out[pos + i] = from[i];
+            }
+        }
+        pos += length;
+    }
+
+    output.resize(valid ? begin + size : begin);
+    return valid;
+}
@@ -0,0 +1,66 @@
+#ifndef LZ_H
+#define LZ_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/*! @brief Text like the blocks to be compressed, which matches can reach back
+ *         into. Only the last 64 KiB are used.
+ *
+ *  Where each part of the text can be found is worked out once, so small
+ *  blocks can be compressed against it cheaply.
+ */
+class LzDictionary
+{
+public:
+
+    /*! @brief Constructor.
+     *  @param text The text.
+     */
+    explicit LzDictionary(std::string text);
+
+    /*! @brief Returns the text.
+     */
+    std::string_view getText() const;
+
+private:
+
+    friend void lzCompress(std::string_view input,
+                           const LzDictionary* dictionary,
+                           std::string& output);
+
+    std::string mText;
+    std::vector<uint32_t> mTable;
+};
+
+/*! @brief Compresses a block with a fast LZ77 codec in the style of LZ4.
+ *
+ *  The block is a series of sequences, each a token byte holding the number
+ *  of literals in its high four bits and the match length less four in its
+ *  low four, longer lengths continued in bytes of 255 and a final smaller
+ *  byte, then the literals, then the match offset, two bytes least
+ *  significant first. The last sequence is only literals.
+ *
+ *  Matches may reach back up to 64 KiB, into the dictionary if there is one,
+ *  whose text then has to be given to decompress the block.
+ *  @param input The block.
+ *  @param dictionary The dictionary, or null.
+ *  @param output Has the compressed block appended.
+ */
+void lzCompress(std::string_view input, const LzDictionary* dictionary,
+                std::string& output);
+
+/*! @brief Decompresses a block compressed by lzCompress().
+ *  @param input The compressed block.
+ *  @param dictionary The text of the dictionary it was compressed with.
+ *  @param size The size of the block before it was compressed.
+ *  @param output Has the block appended.
+ *  @return False if the compressed block is corrupt.
+ */
+bool lzDecompress(std::string_view input, std::string_view dictionary,
+                  size_t size, std::string& output);
+
+#endif
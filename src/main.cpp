@@ -1,27 +1,67 @@
+#include <algorithm>
+#include <chrono>
 #include <fstream>
 #include <iostream>
+#include <memory>
+#include <thread>
+#include <signal.h>
 #include <libconfig.h++>
 #include "cmdline.h"
+#include "forwarderpool.h"
 #include "intermediary.h"
+#include "keyfile.h"
 
 
 using namespace std;
 using namespace libconfig;
 
-int main(int argc, char* argv[])
+// Whatever is running, stopped by a signal so it can save on the way out
+static Intermediary* runningForwarder = nullptr;
+static ForwarderPool* runningPool = nullptr;
+
+static void onStopSignal(int signal)
+{
+    // Both only set a flag and write to an eventfd
+    if (runningForwarder)
+    {
+        runningForwarder->stop();
+    }
+    if (runningPool)
+    {
+        runningPool->stop();
+    }
+}
+
+// Stops the main loop on SIGINT and SIGTERM instead of exiting straight away
+static void handleStopSignals()
+{
+    struct sigaction action = {};
+    action.sa_handler = onStopSignal;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, nullptr);
+    sigaction(SIGTERM, &action, nullptr);
+}
+
+// Creates an intermediary from the instance saved in a data directory, or the
+// latest snapshot there, saving a new one if there is neither
+static unique_ptr<Intermediary> createForwarder(const string& dataDirName)
 {
     ToxOptionsWrapper options;
     bool newInstance = true;
-    string instFileName = "instance.tox";
-    string cfgFileName;
-    string dataDirName;
+    string instFileName = dataDirName + "instance.tox";
+    string snapshotFileName = dataDirName + "state.snapshot";
     fstream saveFile;
 
-    // Process cmd arguments
-    parseCmdLineArgs(argc, argv, cfgFileName, dataDirName);
-    instFileName.insert(0, dataDirName);
+    // Queues and friend settings are read from it as they are needed
+    unique_ptr<Snapshot> snapshot(new Snapshot());
+    if (!snapshot->open(snapshotFileName))
+    {
+        cout << "error: invalid snapshot " << snapshotFileName << endl;
+        exit(1);
+    }
 
-    // Use saved data if it exists
+    // Use saved data if it exists. It is rewritten after every snapshot, so
+    // is never older than the snapshot's copy
     saveFile.open(instFileName.c_str(), ios_base::in);
     if (saveFile.is_open())
     {
@@ -30,72 +70,128 @@ int main(int argc, char* argv[])
         newInstance = false;
         options.loadSaveData(saveFile);
     }
+    else if (snapshot->isOpen() && !snapshot->getSaveData().empty())
+    {
+        cout << "Found snapshot." << endl;
+        newInstance = false;
+        options.loadSaveData(snapshot->getSaveData());
+    }
     saveFile.close();
 
 
     // Start
-    Intermediary forwarder(options);
+    unique_ptr<Intermediary> forwarder(new Intermediary(options));
+    forwarder->setSnapshot(snapshotFileName,
+                           snapshot->isOpen() ? move(snapshot) : nullptr);
+
+    // Changes such as new friends are saved in the background from now on
+    forwarder->setSaveFile(instFileName);
 
     // Save to file
     if (newInstance)
     {
         cout << "Saving to file." << endl;
-        saveFile.open(instFileName.c_str(), ios_base::out);
-        forwarder.save(saveFile);
-        saveFile.close();
+        forwarder->markSaveDataChanged();
+        forwarder->flushSaveData();
     }
 
-    // Setup
-    Config cfg;
+    return forwarder;
+}
 
-    try
+// Applies the settings found in a group of the config file
+static void configure(Intermediary& forwarder, const Setting& settings)
+{
+    string name;
+    if (settings.lookupValue("name", name))
     {
-        cfg.readFile(cfgFileName.c_str());
+        forwarder.setName(name);
     }
-    catch (ParseException& pe)
+
+    string statusMessage;
+    if (settings.lookupValue("status", statusMessage))
     {
-        cout << "parse error: " << pe.getFile() << ":" << pe.getLine() << " ";
-        cout << pe.getError() << endl;
-        exit(1);
+        forwarder.setStatusMessage(statusMessage);
     }
-    catch (FileIOException& fe)
+
+    unsigned windowSize;
+    if (settings.lookupValue("window", windowSize) && windowSize > 0)
     {
-        cout << "file error: failed to read " << cfgFileName << endl;
-        exit(1);
+        forwarder.setWindowSize(windowSize);
     }
 
-    string name;
-    if (cfg.lookupValue("name", name))
+    unsigned saveInterval;
+    if (settings.lookupValue("save_interval", saveInterval))
     {
-        forwarder.setName(name);
+        forwarder.setSaveInterval((uint64_t)saveInterval * 1000);
     }
 
-    string statusMessage;
-    if (cfg.lookupValue("status", statusMessage))
+    bool immediateFlush;
+    if (settings.lookupValue("immediate_flush", immediateFlush))
     {
-        forwarder.setStatusMessage(statusMessage);
+        forwarder.setImmediateFlush(immediateFlush);
+    }
+
+    // Queues beyond their budget are spilled to the data directory
+    unsigned memoryBudget;
+    if (settings.lookupValue("memory_budget_mb", memoryBudget))
+    {
+        forwarder.setMemoryBudget((size_t)memoryBudget * 1024 * 1024);
+    }
+
+    unsigned friendBudget;
+    if (settings.lookupValue("friend_memory_budget_kb", friendBudget))
+    {
+        forwarder.setFriendMemoryBudget((size_t)friendBudget * 1024);
     }
 
-    if (cfg.exists("friends"))
+    // Friends are gathered from the list and the file, then added at once
+    auto importStart = chrono::steady_clock::now();
+    vector<ToxKey> keys;
+    KeyFileStats stats;
+
+    string friendsFileName;
+    if (settings.lookupValue("friends_file", friendsFileName))
     {
-        Setting& friends = cfg.lookup("friends");
+        unsigned threads = max(thread::hardware_concurrency(), 1u);
+        if (!readKeyFile(friendsFileName, threads, keys, stats))
+        {
+            cout << "error: failed to read friends file " << friendsFileName
+                 << endl;
+            exit(1);
+        }
+    }
+
+    if (settings.exists("friends"))
+    {
+        Setting& friends = settings.lookup("friends");
         for (auto it = friends.begin(); it != friends.end(); ++it)
         {
             try
             {
-                forwarder.addAllowedFriend(ToxKey(ToxKey::Public, it->c_str()));
+                keys.push_back(ToxKey(ToxKey::Public, it->c_str()));
+                ++stats.read;
             }
             catch(const ToxKey::InvalidSize &e)
             {
-                cout << "Warning! Key in friends too small: " << it->c_str();
-                cout << endl;
+                cout << "Warning! Key in friends the wrong size: ";
+                cout << it->c_str() << endl;
             }
         }
     }
 
-    if (cfg.exists("nodes"))
+    if (!keys.empty())
+    {
+        size_t added = forwarder.addAllowedFriends(keys);
+        double ms = chrono::duration<double, milli>(
+            chrono::steady_clock::now() - importStart).count();
+        cout << "Friends: " << stats.read << " read, " << added << " new, "
+             << stats.read - added << " known or repeated, " << stats.invalid
+             << " invalid lines in " << ms << " ms" << endl;
+    }
+
+    if (settings.exists("nodes"))
     {
-        Setting& nodes = cfg.lookup("nodes");
+        Setting& nodes = settings.lookup("nodes");
         for (auto node = nodes.begin(); node != nodes.end(); ++node)
         {
             bool valid = true;
@@ -116,18 +212,124 @@ int main(int argc, char* argv[])
                 }
                 catch (const ToxKey::InvalidSize &e)
                 {
-                    cout << "Warning! Key in nodes too small: " << key;
+                    cout << "Warning! Key in nodes the wrong size: " << key;
 		    cout << endl;
                 }
             }
         }
     }
+}
+
+// Restores undelivered messages from the journal in a data directory
+static void openJournal(Intermediary& forwarder, const string& dataDirName)
+{
+    string spillDirName = dataDirName + "spill";
+    if (!forwarder.setSpillDirectory(spillDirName))
+    {
+        cout << "error: failed to open spill directory " << spillDirName
+             << endl;
+        exit(1);
+    }
+
+    string journalFileName = dataDirName + "queue.journal";
+    if (!forwarder.openJournal(journalFileName))
+    {
+        cout << "error: failed to open journal " << journalFileName << endl;
+        exit(1);
+    }
+}
+
+static void printStartupTime(chrono::steady_clock::time_point start)
+{
+    double ms = chrono::duration<double, milli>(
+        chrono::steady_clock::now() - start).count();
+    cout << "Started in " << ms << " ms" << endl;
+}
+
+int main(int argc, char* argv[])
+{
+    auto start = chrono::steady_clock::now();
+    string cfgFileName;
+    string dataDirName;
+
+    // Process cmd arguments
+    parseCmdLineArgs(argc, argv, cfgFileName, dataDirName);
+
+    // Setup
+    Config cfg;
+
+    try
+    {
+        cfg.readFile(cfgFileName.c_str());
+    }
+    catch (ParseException& pe)
+    {
+        cout << "parse error: " << pe.getFile() << ":" << pe.getLine() << " ";
+        cout << pe.getError() << endl;
+        exit(1);
+    }
+    catch (FileIOException& fe)
+    {
+        cout << "file error: failed to read " << cfgFileName << endl;
+        exit(1);
+    }
+
+    if (!cfg.exists("identities"))
+    {
+        unique_ptr<Intermediary> forwarder = createForwarder(dataDirName);
+        configure(*forwarder, cfg.getRoot());
+        openJournal(*forwarder, dataDirName);
+
+        // Print address
+        cout << "Address: " << forwarder->getAddress().getHex() << endl;
+
+        printStartupTime(start);
+
+        // Main loop
+        runningForwarder = forwarder.get();
+        handleStopSignals();
+        forwarder->run();
+        return 0;
+    }
+
+    // Host every identity, each in its own directory under the data directory
+    unsigned threads = thread::hardware_concurrency();
+    cfg.lookupValue("threads", threads);
+    ForwarderPool pool(max(threads, 1u));
+
+    Setting& identities = cfg.lookup("identities");
+    for (auto identity = identities.begin(); identity != identities.end();
+         ++identity)
+    {
+        string identityDirName;
+        if (!identity->lookupValue("datadir", identityDirName) ||
+            identityDirName.empty())
+        {
+            cout << "error: identity without a datadir" << endl;
+            exit(1);
+        }
+        if (identityDirName.back() != '/')
+        {
+            identityDirName.push_back('/');
+        }
+        identityDirName.insert(0, dataDirName);
+
+        // The top level settings apply to every identity
+        unique_ptr<Intermediary> forwarder = createForwarder(identityDirName);
+        configure(*forwarder, cfg.getRoot());
+        configure(*forwarder, *identity);
+        openJournal(*forwarder, identityDirName);
+
+        cout << "Address: " << forwarder->getAddress().getHex() << endl;
+        pool.add(move(forwarder));
+    }
 
-    // Print address
-    cout << "Address: " << forwarder.getAddress().getHex() << endl;
+    printStartupTime(start);
 
     // Main loop
-    forwarder.run();
+    runningPool = &pool;
+    handleStopSignals();
+    pool.run();
 
     return 0;
 }
@@ -0,0 +1,299 @@
+#include "messagequeue.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <new>
+
+
+// Every message is preceded by its length
+static const uint32_t LengthSize = sizeof(uint32_t);
+
+static uint32_t readLength(const MessageChunk* chunk, uint32_t offset)
+{
+    uint32_t length;
+    std::memcpy(&length, const_cast<MessageChunk*>(chunk)->data() + offset,
+                LengthSize);
+    return length;
+}
+
+
+// The ChunkPool implementation
+
+const uint32_t ChunkPool::MinChunkSize;
+const uint32_t ChunkPool::MaxChunkSize;
+
+ChunkPool::ChunkPool(size_t maxFree)
+    : mMaxFree(maxFree)
+    , mUsed(0)
+{
+    static_assert(MinChunkSize << (Classes - 1) == MaxChunkSize,
+                  "Every power of two size needs a class");
+}
+
+ChunkPool::~ChunkPool()
+{
+    assert(mUsed == 0);
+    for (int i = 0; i < Classes; ++i)
+    {
+        for (auto it = mFree[i].begin(); it != mFree[i].end(); ++it)
+        {
+            ::operator delete(*it);
+        }
+    }
+}
+
+MessageChunk* ChunkPool::acquire(uint32_t needed, uint32_t preferred)
+{
+    // Round up to the pooled size that fits
+    uint32_t wanted = sizeof(MessageChunk) + std::max(needed, preferred);
+    uint32_t size = MinChunkSize;
+    while (size < wanted && size < MaxChunkSize)
+    {
+        size *= 2;
+    }
+    if (size < sizeof(MessageChunk) + needed)
+    {
+        size = sizeof(MessageChunk) + needed;
+    }
+
+    MessageChunk* chunk;
+    int sizeClass = getClass(size - sizeof(MessageChunk));
+    if (sizeClass >= 0 && !mFree[sizeClass].empty())
+    {
+        chunk = mFree[sizeClass].back();
+        mFree[sizeClass].pop_back();
+    }
+    else
+    {
+        chunk = static_cast<MessageChunk*>(::operator new(size));
+        chunk->capacity = size - sizeof(MessageChunk);
+    }
+
+    chunk->next = nullptr;
+    chunk->used = 0;
+    ++mUsed;
+    return chunk;
+}
+
+void ChunkPool::release(MessageChunk* chunk)
+{
+    assert(mUsed > 0);
+    --mUsed;
+
+    int sizeClass = getClass(chunk->capacity);
+    if (sizeClass >= 0 && mFree[sizeClass].size() < mMaxFree)
+    {
+        mFree[sizeClass].push_back(chunk);
+    }
+    else
+    {
+        ::operator delete(chunk);
+    }
+}
+
+size_t ChunkPool::getUsedCount() const
+{
+    return mUsed;
+}
+
+size_t ChunkPool::getFreeCount() const
+{
+    size_t count = 0;
+    for (int i = 0; i < Classes; ++i)
+    {
+        count += mFree[i].size();
+    }
+    return count;
+}
+
+int ChunkPool::getClass(uint32_t capacity)
+{
+    uint32_t size = capacity + sizeof(MessageChunk);
+    for (int i = 0; i < Classes; ++i)
+    {
+        if (size == MinChunkSize << i)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+
+// The MessageQueue::Iterator implementation
+
+MessageQueue::Iterator::Iterator()
+    : mChunk(nullptr)
+    , mOffset(0)
+{
+}
+
+MessageQueue::Iterator::Iterator(MessageChunk* chunk, uint32_t offset)
+    : mChunk(chunk)
+    , mOffset(offset)
+{
+}
+
+std::string_view MessageQueue::Iterator::operator*() const
+{
+    assert(mChunk && mOffset < mChunk->used);
+    return std::string_view(mChunk->data() + mOffset + LengthSize,
+                            readLength(mChunk, mOffset));
+}
+
+MessageQueue::Iterator& MessageQueue::Iterator::operator++()
+{
+    mOffset += LengthSize + readLength(mChunk, mOffset);
+
+    // Chunks that have been followed by another are never written again
+    if (mOffset == mChunk->used && mChunk->next)
+    {
+        mChunk = mChunk->next;
+        mOffset = 0;
+    }
+    return *this;
+}
+
+bool MessageQueue::Iterator::operator==(const Iterator& other) const
+{
+    return mChunk == other.mChunk && mOffset == other.mOffset;
+}
+
+bool MessageQueue::Iterator::operator!=(const Iterator& other) const
+{
+    return !(*this == other);
+}
+
+
+// The MessageQueue implementation
+
+MessageQueue::MessageQueue(ChunkPool* pool)
+    : mHead(nullptr)
+    , mTail(nullptr)
+    , mHeadOffset(0)
+    , mBackOffset(0)
+    , mSize(0)
+    , mPool(pool)
+{
+}
+
+MessageQueue::~MessageQueue()
+{
+    clear();
+}
+
+void MessageQueue::setPool(ChunkPool* pool)
+{
+    assert(empty());
+    mPool = pool;
+}
+
+size_t MessageQueue::size() const
+{
+    return mSize;
+}
+
+bool MessageQueue::empty() const
+{
+    return mSize == 0;
+}
+
+std::string_view MessageQueue::front() const
+{
+    assert(!empty());
+    return *begin();
+}
+
+std::string_view MessageQueue::back() const
+{
+    assert(!empty());
+    return *Iterator(mTail, mBackOffset);
+}
+
+MessageQueue::Iterator MessageQueue::begin() const
+{
+    return empty() ? end() : Iterator(mHead, mHeadOffset);
+}
+
+MessageQueue::Iterator MessageQueue::end() const
+{
+    return Iterator(mTail, mTail ? mTail->used : 0);
+}
+
+void MessageQueue::push_back(std::string_view message)
+{
+    push_back(std::string_view(), message);
+}
+
+void MessageQueue::push_back(std::string_view prefix, std::string_view message)
+{
+    assert(mPool);
+    uint32_t length = prefix.size() + message.size();
+    uint32_t needed = LengthSize + length;
+
+    if (!mTail || mTail->capacity - mTail->used < needed)
+    {
+        // Each chunk is twice the size of the last, up to the pool's limit
+        MessageChunk* chunk = mPool->acquire(needed,
+                                             mTail ? mTail->capacity * 2 : 0);
+        if (mTail)
+        {
+            mTail->next = chunk;
+        }
+        else
+        {
+            mHead = chunk;
+            mHeadOffset = 0;
+        }
+        mTail = chunk;
+    }
+
+    char* out = mTail->data() + mTail->used;
+    std::memcpy(out, &length, LengthSize);
+    std::copy(prefix.begin(), prefix.end(), out + LengthSize);
+    std::copy(message.begin(), message.end(),
+              out + LengthSize + prefix.size());
+
+    mBackOffset = mTail->used;
+    mTail->used += needed;
+    ++mSize;
+}
+
+void MessageQueue::pop_front()
+{
+    assert(!empty());
+    mHeadOffset += LengthSize + readLength(mHead, mHeadOffset);
+    --mSize;
+
+    if (mHeadOffset < mHead->used)
+    {
+        return;
+    }
+
+    // The head chunk has been used up
+    MessageChunk* next = mHead->next;
+    mPool->release(mHead);
+    mHead = next;
+    mHeadOffset = 0;
+    if (!mHead)
+    {
+        mTail = nullptr;
+        mBackOffset = 0;
+    }
+}
+
+void MessageQueue::clear()
+{
+    while (mHead)
+    {
+        MessageChunk* next = mHead->next;
+        mPool->release(mHead);
+        mHead = next;
+    }
+
+    mTail = nullptr;
+    mHeadOffset = 0;
+    mBackOffset = 0;
+    mSize = 0;
+}
@@ -0,0 +1,216 @@
+#ifndef MESSAGEQUEUE_H
+#define MESSAGEQUEUE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+#include <vector>
+
+/*! @brief A block of memory that queued messages are written into.
+ */
+struct MessageChunk
+{
+    /*! @brief The next chunk in the queue.
+     */
+    MessageChunk* next;
+
+    /*! @brief The number of bytes that can be stored.
+     */
+    uint32_t capacity;
+
+    /*! @brief The number of bytes written.
+     */
+    uint32_t used;
+
+    /*! @brief Returns the bytes following this header.
+     */
+    char* data()
+    {
+        return reinterpret_cast<char*>(this + 1);
+    }
+};
+
+
+/*! @brief Recycles the chunks used by message queues, so that queues growing
+ *         and shrinking don't go back to the allocator each time.
+ *
+ *  Chunks come in power of two sizes from MinChunkSize to MaxChunkSize,
+ *  including their header, so queues holding a few short messages stay small.
+ */
+class ChunkPool
+{
+public:
+
+    /*! @brief The smallest and largest pooled chunk sizes in bytes.
+     */
+    static const uint32_t MinChunkSize = 256;
+    static const uint32_t MaxChunkSize = 4096;
+
+    /*! @brief Constructor.
+     *  @param maxFree The most unused chunks of each size to keep for reuse.
+     */
+    explicit ChunkPool(size_t maxFree=256);
+
+    /*! @brief Frees the unused chunks.
+     */
+    ~ChunkPool();
+
+
+    // No copy/assignment allowed
+    ChunkPool(const ChunkPool&) = delete;
+    ChunkPool& operator=(const ChunkPool&) = delete;
+
+
+    /*! @brief Returns an empty chunk.
+     *  @param needed The number of bytes that must fit. Requests too large
+     *                for any pooled size are allocated exactly and never
+     *                pooled.
+     *  @param preferred The number of bytes wanted if available, rounded up
+     *                   to a pooled size and limited to the largest.
+     */
+    MessageChunk* acquire(uint32_t needed, uint32_t preferred=0);
+
+    /*! @brief Returns a chunk that is no longer used.
+     *  @param chunk The chunk.
+     */
+    void release(MessageChunk* chunk);
+
+    /*! @brief Returns the number of chunks handed out and not released.
+     */
+    size_t getUsedCount() const;
+
+    /*! @brief Returns the number of unused chunks kept for reuse.
+     */
+    size_t getFreeCount() const;
+
+private:
+
+    // The number of pooled sizes
+    static const int Classes = 5;
+
+    static int getClass(uint32_t capacity);
+
+    std::vector<MessageChunk*> mFree[Classes];
+    size_t mMaxFree;
+    size_t mUsed;
+};
+
+
+/*! @brief A first in, first out queue of messages. Messages are stored length
+ *         prefixed and back to back in pooled chunks, and are read through
+ *         views into the chunks rather than copies.
+ *
+ *  Stored messages never move, so views and iterators stay valid until the
+ *  message they refer to is removed. An empty queue holds no chunks.
+ */
+class MessageQueue
+{
+public:
+
+    /*! @brief Walks the stored messages from oldest to newest.
+     */
+    class Iterator
+    {
+    public:
+
+        /*! @brief Constructor. Creates an iterator that refers to nothing.
+         */
+        Iterator();
+
+        /*! @brief Returns the message referred to.
+         */
+        std::string_view operator*() const;
+
+        /*! @brief Moves to the next message.
+         */
+        Iterator& operator++();
+
+        bool operator==(const Iterator& other) const;
+
+        bool operator!=(const Iterator& other) const;
+
+    private:
+
+        Iterator(MessageChunk* chunk, uint32_t offset);
+
+        MessageChunk* mChunk;
+        uint32_t mOffset;
+
+        friend class MessageQueue;
+    };
+
+    /*! @brief Constructor.
+     *  @param pool Provides the chunks. May be set later with setPool().
+     */
+    explicit MessageQueue(ChunkPool* pool=nullptr);
+
+    /*! @brief Returns all chunks to the pool.
+     */
+    ~MessageQueue();
+
+
+    // No copy/assignment allowed
+    MessageQueue(const MessageQueue&) = delete;
+    MessageQueue& operator=(const MessageQueue&) = delete;
+
+
+    /*! @brief Sets where chunks come from. The queue must be empty.
+     *  @param pool The pool, which must outlive the queue.
+     */
+    void setPool(ChunkPool* pool);
+
+    /*! @brief Returns the number of messages stored.
+     */
+    size_t size() const;
+
+    /*! @brief Returns whether or not there are no messages stored.
+     */
+    bool empty() const;
+
+    /*! @brief Returns the oldest message. The queue must not be empty.
+     */
+    std::string_view front() const;
+
+    /*! @brief Returns the newest message. The queue must not be empty.
+     */
+    std::string_view back() const;
+
+    /*! @brief Returns an iterator to the oldest message.
+     */
+    Iterator begin() const;
+
+    /*! @brief Returns an iterator past the newest message.
+     */
+    Iterator end() const;
+
+    /*! @brief Adds a message to the back of the queue.
+     *  @param message The message.
+     */
+    void push_back(std::string_view message);
+
+    /*! @brief Adds a message made of two parts to the back of the queue,
+     *         without joining them first.
+     *  @param prefix The start of the message.
+     *  @param message The rest of the message.
+     */
+    void push_back(std::string_view prefix, std::string_view message);
+
+    /*! @brief Removes the oldest message. The queue must not be empty.
+     */
+    void pop_front();
+
+    /*! @brief Removes every message.
+     */
+    void clear();
+
+private:
+
+    MessageChunk* mHead;
+    MessageChunk* mTail;
+    uint32_t mHeadOffset;
+    uint32_t mBackOffset;
+    size_t mSize;
+    ChunkPool* mPool;
+};
+
+#endif
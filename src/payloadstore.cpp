@@ -0,0 +1,89 @@
+#include "payloadstore.h"
+
+#include <cassert>
+
+
+PayloadStore::PayloadStore()
+    : mSize(0)
+    , mBytes(0)
+{
+}
+
+uint32_t PayloadStore::add(std::string_view payload)
+{
+    uint32_t id;
+    if (!mFree.empty())
+    {
+        id = mFree.back();
+        mFree.pop_back();
+    }
+    else
+    {
+        id = mPayloads.size();
+        mPayloads.emplace_back();
+    }
+
+    Payload& p = mPayloads[id];
+    p.data.assign(payload);
+    p.refs = 1;
+
+    ++mSize;
+    mBytes += payload.size();
+    return id;
+}
+
+void PayloadStore::retain(uint32_t id)
+{
+    assert(id < mPayloads.size() && mPayloads[id].refs > 0);
+    ++mPayloads[id].refs;
+}
+
+void PayloadStore::release(uint32_t id)
+{
+    assert(id < mPayloads.size() && mPayloads[id].refs > 0);
+    Payload& p = mPayloads[id];
+    if (--p.refs > 0)
+    {
+        return;
+    }
+
+    // Give the memory back rather than keeping it for the next payload
+    --mSize;
+    mBytes -= p.data.size();
+    std::string().swap(p.data);
+    mFree.push_back(id);
+}
+
+std::string_view PayloadStore::get(uint32_t id) const
+{
+    assert(id < mPayloads.size() && mPayloads[id].refs > 0);
+    return mPayloads[id].data;
+}
+
+uint32_t PayloadStore::getRefCount(uint32_t id) const
+{
+    return id < mPayloads.size() ? mPayloads[id].refs : 0;
+}
+
+size_t PayloadStore::size() const
+{
+    return mSize;
+}
+
+size_t PayloadStore::getBytes() const
+{
+    return mBytes;
+}
+
+void PayloadStore::forEach(const std::function<void(uint32_t id,
+                                                    std::string_view payload)>&
+                               visitor) const
+{
+    for (uint32_t id = 0; id < mPayloads.size(); ++id)
+    {
+        if (mPayloads[id].refs > 0)
+        {
+            visitor(id, mPayloads[id].data);
+        }
+    }
+}
@@ -0,0 +1,87 @@
+#ifndef PAYLOADSTORE_H
+#define PAYLOADSTORE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/*! @brief Holds payloads shared by several message queues, so a message sent
+ *         to many friends is stored once. Each payload is reference counted
+ *         and freed when the last queue referring to it lets go.
+ *
+ *  Ids are small integers that are reused once a payload is freed.
+ */
+class PayloadStore
+{
+public:
+
+    /*! @brief Constructor.
+     */
+    PayloadStore();
+
+
+    // No copy/assignment allowed
+    PayloadStore(const PayloadStore&) = delete;
+    PayloadStore& operator=(const PayloadStore&) = delete;
+
+
+    /*! @brief Stores a payload.
+     *  @param payload The payload.
+     *  @return Its id, holding one reference for the caller.
+     */
+    uint32_t add(std::string_view payload);
+
+    /*! @brief Adds a reference to a payload.
+     *  @param id The id of a stored payload.
+     */
+    void retain(uint32_t id);
+
+    /*! @brief Removes a reference to a payload, freeing it if it was the
+     *         last.
+     *  @param id The id of a stored payload.
+     */
+    void release(uint32_t id);
+
+    /*! @brief Returns a payload. The view is valid until it is freed.
+     *  @param id The id of a stored payload.
+     */
+    std::string_view get(uint32_t id) const;
+
+    /*! @brief Returns the number of references to a payload.
+     *  @param id The id of a stored payload.
+     */
+    uint32_t getRefCount(uint32_t id) const;
+
+    /*! @brief Returns the number of payloads stored.
+     */
+    size_t size() const;
+
+    /*! @brief Returns the total size of the payloads stored, in bytes.
+     */
+    size_t getBytes() const;
+
+    /*! @brief Calls a function for every payload stored.
+     *  @param visitor Called with the id and contents of each payload.
+     */
+    void forEach(const std::function<void(uint32_t id,
+                                          std::string_view payload)>&
+                     visitor) const;
+
+private:
+
+    struct Payload
+    {
+        std::string data;
+        uint32_t refs = 0;
+    };
+
+    std::vector<Payload> mPayloads;
+    std::vector<uint32_t> mFree;
+    size_t mSize;
+    size_t mBytes;
+};
+
+#endif
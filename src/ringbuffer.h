@@ -0,0 +1,134 @@
+#ifndef RINGBUFFER_H
+#define RINGBUFFER_H
+
+#include <cassert>
+#include <cstddef>
+#include <vector>
+
+/*! @brief A fixed capacity first in, first out buffer that supports indexed
+ *         access. The storage is allocated once and reused.
+ */
+template <typename T>
+class RingBuffer
+{
+public:
+
+    /*! @brief Constructor.
+     *  @param capacity The maximum number of elements that can be stored.
+     */
+    explicit RingBuffer(size_t capacity=0)
+        : mData(capacity)
+        , mHead(0)
+        , mSize(0)
+    {
+    }
+
+    /*! @brief Returns the number of stored elements.
+     */
+    size_t size() const
+    {
+        return mSize;
+    }
+
+    /*! @brief Returns the maximum number of elements that can be stored.
+     */
+    size_t capacity() const
+    {
+        return mData.size();
+    }
+
+    /*! @brief Returns whether or not there are no elements stored.
+     */
+    bool empty() const
+    {
+        return mSize == 0;
+    }
+
+    /*! @brief Returns whether or not the capacity has been reached.
+     */
+    bool full() const
+    {
+        return mSize == mData.size();
+    }
+
+    /*! @brief Changes the capacity, keeping the stored elements.
+     *  @param capacity The new capacity. Must be at least size().
+     */
+    void setCapacity(size_t capacity)
+    {
+        assert(capacity >= mSize);
+
+        std::vector<T> data(capacity);
+        for (size_t i = 0; i < mSize; ++i)
+        {
+            data[i] = (*this)[i];
+        }
+
+        mData.swap(data);
+        mHead = 0;
+    }
+
+    /*! @brief Accesses an element, the oldest being at index 0.
+     *  @param index Must be less than size().
+     */
+    T& operator[](size_t index)
+    {
+        assert(index < mSize);
+        return mData[(mHead + index) % mData.size()];
+    }
+
+    const T& operator[](size_t index) const
+    {
+        assert(index < mSize);
+        return mData[(mHead + index) % mData.size()];
+    }
+
+    /*! @brief Returns the oldest element.
+     */
+    T& front()
+    {
+        return (*this)[0];
+    }
+
+    /*! @brief Returns the newest element.
+     */
+    T& back()
+    {
+        return (*this)[mSize - 1];
+    }
+
+    /*! @brief Adds an element. The buffer must not be full.
+     *  @param value The element to add.
+     */
+    void push_back(const T& value)
+    {
+        assert(!full());
+        mData[(mHead + mSize) % mData.size()] = value;
+        ++mSize;
+    }
+
+    /*! @brief Removes the oldest element. The buffer must not be empty.
+     */
+    void pop_front()
+    {
+        assert(!empty());
+        mHead = (mHead + 1) % mData.size();
+        --mSize;
+    }
+
+    /*! @brief Removes every element.
+     */
+    void clear()
+    {
+        mHead = 0;
+        mSize = 0;
+    }
+
+private:
+
+    std::vector<T> mData;
+    size_t mHead;
+    size_t mSize;
+};
+
+#endif
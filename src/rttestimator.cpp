@@ -0,0 +1,65 @@
+#include "rttestimator.h"
+
+#include <algorithm>
+
+
+const uint64_t RttEstimator::MinRto;
+const uint64_t RttEstimator::MaxRto;
+
+RttEstimator::RttEstimator(uint64_t initialRto)
+    : mSmoothedRtt8(0)
+    , mRttVariance4(0)
+    , mRto(std::min(std::max(initialRto, MinRto), MaxRto))
+    , mSamples(0)
+{
+}
+
+void RttEstimator::addSample(uint64_t rtt)
+{
+    if (mSamples == 0)
+    {
+        // SRTT = R, RTTVAR = R / 2
+        mSmoothedRtt8 = rtt * 8;
+        mRttVariance4 = rtt * 2;
+    }
+    else
+    {
+        // RTTVAR = 3/4 RTTVAR + 1/4 |SRTT - R|
+        uint64_t srtt = mSmoothedRtt8 / 8;
+        uint64_t error = (srtt > rtt) ? srtt - rtt : rtt - srtt;
+        mRttVariance4 = mRttVariance4 - mRttVariance4 / 4 + error;
+
+        // SRTT = 7/8 SRTT + 1/8 R
+        mSmoothedRtt8 = mSmoothedRtt8 - mSmoothedRtt8 / 8 + rtt;
+    }
+    ++mSamples;
+
+    // RTO = SRTT + 4 RTTVAR, which also discards any backoff
+    mRto = mSmoothedRtt8 / 8 + mRttVariance4;
+    mRto = std::min(std::max(mRto, MinRto), MaxRto);
+}
+
+void RttEstimator::backoff()
+{
+    mRto = std::min(mRto * 2, MaxRto);
+}
+
+uint64_t RttEstimator::getRto() const
+{
+    return mRto;
+}
+
+uint64_t RttEstimator::getSmoothedRtt() const
+{
+    return mSmoothedRtt8 / 8;
+}
+
+uint64_t RttEstimator::getRttVariance() const
+{
+    return mRttVariance4 / 4;
+}
+
+uint64_t RttEstimator::getSampleCount() const
+{
+    return mSamples;
+}
@@ -0,0 +1,61 @@
+#ifndef RTTESTIMATOR_H
+#define RTTESTIMATOR_H
+
+#include <cstdint>
+
+/*! @brief Estimates how long to wait for a reciept before resending, using
+ *         the smoothed round trip time and variance from RFC 6298.
+ */
+class RttEstimator
+{
+public:
+
+    /*! @brief Constructor.
+     *  @param initialRto The timeout used until a round trip has been
+     *                    measured, in milliseconds.
+     */
+    explicit RttEstimator(uint64_t initialRto=10000);
+
+    /*! @brief Adds a measured round trip. Measurements must not be taken from
+     *         messages that were resent, since it is unknown which send the
+     *         reciept belongs to.
+     *  @param rtt The time between sending and the reciept in milliseconds.
+     */
+    void addSample(uint64_t rtt);
+
+    /*! @brief Doubles the timeout after it expired without a reciept.
+     */
+    void backoff();
+
+    /*! @brief Returns the current timeout in milliseconds.
+     */
+    uint64_t getRto() const;
+
+    /*! @brief Returns the smoothed round trip time in milliseconds, zero if
+     *         nothing has been measured yet.
+     */
+    uint64_t getSmoothedRtt() const;
+
+    /*! @brief Returns the round trip time variation in milliseconds.
+     */
+    uint64_t getRttVariance() const;
+
+    /*! @brief Returns the number of round trips measured.
+     */
+    uint64_t getSampleCount() const;
+
+    /*! @brief The bounds placed on the timeout, in milliseconds.
+     */
+    static const uint64_t MinRto = 250;
+    static const uint64_t MaxRto = 120000;
+
+private:
+
+    // Kept scaled by 8 and 4 respectively, as in most TCP implementations
+    uint64_t mSmoothedRtt8;
+    uint64_t mRttVariance4;
+    uint64_t mRto;
+    uint64_t mSamples;
+};
+
+#endif
@@ -0,0 +1,97 @@
+#include "savedatawriter.h"
+
+#include "fileutil.h"
+
+
+// The SaveDataWriter implementation
+
+SaveDataWriter::SaveDataWriter(const std::string& path)
+    : mPath(path)
+    , mHasPending(false)
+    , mWriting(false)
+    , mFailed(false)
+    , mStopping(false)
+    , mWriter(&SaveDataWriter::run, this)
+{
+}
+
+SaveDataWriter::~SaveDataWriter()
+{
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mStopping = true;
+    }
+    mCondition.notify_all();
+    mWriter.join();
+}
+
+const std::string& SaveDataWriter::getPath() const
+{
+    return mPath;
+}
+
+void SaveDataWriter::write(std::vector<uint8_t>&& data)
+{
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mPending.swap(data);
+        mHasPending = true;
+    }
+    mCondition.notify_all();
+
+    // The older data is freed here rather than while holding the lock
+    data.clear();
+}
+
+bool SaveDataWriter::flush()
+{
+    std::unique_lock<std::mutex> lock(mMutex);
+    mCondition.wait(lock, [this]()
+    {
+        return !mHasPending && !mWriting;
+    });
+    return !mFailed;
+}
+
+bool SaveDataWriter::takeFailure()
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (!mFailed || mHasPending || mWriting)
+    {
+        return false;
+    }
+    mFailed = false;
+    return true;
+}
+
+void SaveDataWriter::run()
+{
+    std::vector<uint8_t> data;
+    for (;;)
+    {
+        {
+            std::unique_lock<std::mutex> lock(mMutex);
+            mWriting = false;
+            mCondition.notify_all();
+            mCondition.wait(lock, [this]()
+            {
+                return mStopping || mHasPending;
+            });
+
+            // Whatever is waiting is still written before stopping
+            if (!mHasPending)
+            {
+                return;
+            }
+            data.swap(mPending);
+            mPending.clear();
+            mHasPending = false;
+            mWriting = true;
+        }
+
+        bool success = writeFile(mPath, data.data(), data.size());
+
+        std::lock_guard<std::mutex> lock(mMutex);
+        mFailed = !success;
+    }
+}
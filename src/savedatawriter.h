@@ -0,0 +1,76 @@
+#ifndef SAVEDATAWRITER_H
+#define SAVEDATAWRITER_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/*! @brief Writes tox savedata to a file on a thread of its own, so the thread
+ *         updating the instance never waits on the disk.
+ *
+ *  Each write goes to a file next to the old one, which it replaces once it
+ *  has reached the disk, so a crash leaves either the old or the new data.
+ *  Data handed over while a write is in progress waits for it, and replaces
+ *  any older data still waiting, so only the latest is written.
+ */
+class SaveDataWriter
+{
+public:
+
+    /*! @brief Starts the writer thread.
+     *  @param path The file to write.
+     */
+    explicit SaveDataWriter(const std::string& path);
+
+    /*! @brief Finishes writing whatever was handed over, then stops the
+     *         writer thread.
+     */
+    ~SaveDataWriter();
+
+
+    // No copy/assignment allowed
+    SaveDataWriter(const SaveDataWriter&) = delete;
+    SaveDataWriter& operator=(const SaveDataWriter&) = delete;
+
+
+    /*! @brief Returns the file being written.
+     */
+    const std::string& getPath() const;
+
+    /*! @brief Hands savedata over to be written. Never waits for the disk.
+     *  @param data The savedata, taken from the caller.
+     */
+    void write(std::vector<uint8_t>&& data);
+
+    /*! @brief Waits until everything handed over has been written.
+     *  @return False if the last write failed.
+     */
+    bool flush();
+
+    /*! @brief Returns whether the last write failed with nothing newer
+     *         handed over since, so the data needs handing over again. Each
+     *         failure is only returned once. Never waits for the disk.
+     */
+    bool takeFailure();
+
+private:
+
+    void run();
+
+    std::string mPath;
+
+    // Shared with the writer thread
+    std::mutex mMutex;
+    std::condition_variable mCondition;
+    std::vector<uint8_t> mPending;
+    bool mHasPending;
+    bool mWriting;
+    bool mFailed;
+    bool mStopping;
+    std::thread mWriter;
+};
+
+#endif
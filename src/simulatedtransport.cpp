@@ -0,0 +1,174 @@
+#include "simulatedtransport.h"
+
+
+SimulatedTransport::SimulatedTransport(const SimulationConfig& config)
+    : mConfig(config)
+    , mClock(0)
+    , mRandom(config.seed)
+    , mSequence(0)
+    , mSends(0)
+    , mLosses(0)
+    , mFlaps(0)
+{
+    setIterationInterval(config.iterationInterval);
+}
+
+void SimulatedTransport::scheduleMessage(uint64_t time, uint32_t alias,
+                                         const std::string& message)
+{
+    TimedEvent event;
+    event.time = time;
+    event.type = TimedEvent::Send;
+    event.alias = alias;
+    event.message = message;
+    schedule(event);
+}
+
+void SimulatedTransport::startFlapping(uint32_t alias)
+{
+    scheduleToggle(alias);
+}
+
+uint64_t SimulatedTransport::getSendCount() const
+{
+    return mSends;
+}
+
+uint64_t SimulatedTransport::getLossCount() const
+{
+    return mLosses;
+}
+
+uint64_t SimulatedTransport::getFlapCount() const
+{
+    return mFlaps;
+}
+
+uint32_t SimulatedTransport::addFriendNoRequest(const ToxKey& publicKey)
+{
+    uint32_t alias = LoopbackTransport::addFriendNoRequest(publicKey);
+    if (alias != UINT32_MAX)
+    {
+        mFriends[alias].nextMessageId = mConfig.firstMessageId;
+        mEpochs.resize(mFriends.size(), 0);
+    }
+    return alias;
+}
+
+uint32_t SimulatedTransport::sendMessage(uint32_t friendAlias,
+                                         std::string_view message,
+                                         bool actionType)
+{
+    if (!isFriendConnected(friendAlias) || message.empty() ||
+        message.size() > tox_max_message_length())
+    {
+        return UINT32_MAX;
+    }
+
+    uint32_t messageId = mFriends[friendAlias].nextMessageId++;
+    ++mSends;
+
+    std::uniform_real_distribution<double> chance(0, 1);
+    if (chance(mRandom) < mConfig.messageLoss)
+    {
+        ++mLosses;
+        return messageId;
+    }
+
+    // Arrives and is acknowledged after a random delay
+    std::uniform_int_distribution<uint32_t> delay(mConfig.minRecieptDelay,
+                                                  mConfig.maxRecieptDelay);
+    TimedEvent event;
+    event.time = mClock.now() + delay(mRandom);
+    event.type = TimedEvent::Arrive;
+    event.alias = friendAlias;
+    event.epoch = mEpochs[friendAlias];
+    event.messageId = messageId;
+    event.recieptLost = chance(mRandom) < mConfig.recieptLoss;
+    event.message = message;
+    schedule(event);
+
+    return messageId;
+}
+
+void SimulatedTransport::iterate()
+{
+    uint64_t now = mClock.now();
+    ToxWrapper* wrapper = getWrapper();
+
+    while (!mTimed.empty() && mTimed.top().time <= now)
+    {
+        TimedEvent event = mTimed.top();
+        mTimed.pop();
+
+        switch (event.type)
+        {
+        case TimedEvent::Arrive:
+            if (event.epoch != mEpochs[event.alias] ||
+                !isFriendConnected(event.alias))
+            {
+                // The connection dropped while it was in flight
+                ++mLosses;
+                break;
+            }
+            if (mDeliveryHandler)
+            {
+                mDeliveryHandler(event.alias, event.message);
+            }
+            if (event.recieptLost)
+            {
+                ++mLosses;
+            }
+            else if (wrapper)
+            {
+                wrapper->onMessageSentSuccess(event.alias, event.messageId);
+            }
+            break;
+
+        case TimedEvent::Toggle:
+        {
+            bool online = !isFriendConnected(event.alias);
+            if (!online)
+            {
+                ++mEpochs[event.alias];
+            }
+            setFriendConnected(event.alias, online);
+            scheduleToggle(event.alias);
+            ++mFlaps;
+            break;
+        }
+
+        case TimedEvent::Send:
+            injectMessage(event.alias, event.message);
+            break;
+        }
+    }
+
+    // Deliver the presence changes and messages queued above
+    LoopbackTransport::iterate();
+}
+
+Clock& SimulatedTransport::getClock()
+{
+    return mClock;
+}
+
+void SimulatedTransport::schedule(TimedEvent& event)
+{
+    event.sequence = mSequence++;
+    mTimed.push(event);
+}
+
+void SimulatedTransport::scheduleToggle(uint32_t alias)
+{
+    // Stay in the current state for an exponentially distributed time
+    uint64_t mean = isFriendConnected(alias) ? mConfig.meanOnlineTime :
+                                               mConfig.meanOfflineTime;
+    std::exponential_distribution<double> duration(1.0 / (mean + 1));
+
+    TimedEvent event;
+    event.time = mClock.now() + 1 + (uint64_t)duration(mRandom);
+    event.type = TimedEvent::Toggle;
+    event.alias = alias;
+    schedule(event);
+}
@@ -0,0 +1,150 @@
+#ifndef SIMULATEDTRANSPORT_H
+#define SIMULATEDTRANSPORT_H
+
+#include <queue>
+#include <random>
+#include "clock.h"
+#include "loopbacktransport.h"
+
+/*! @brief The network conditions simulated by a SimulatedTransport.
+ */
+struct SimulationConfig
+{
+    /*! @brief Seeds every random decision, runs with the same seed and inputs
+     *         are identical.
+     */
+    uint64_t seed = 1;
+
+    /*! @brief The probability that a sent message never arrives.
+     */
+    double messageLoss = 0;
+
+    /*! @brief The probability that the reciept for an arrived message is
+     *         lost.
+     */
+    double recieptLoss = 0;
+
+    /*! @brief The range of delays between sending a message and recieving
+     *         its reciept, in milliseconds.
+     */
+    uint32_t minRecieptDelay = 20;
+    uint32_t maxRecieptDelay = 500;
+
+    /*! @brief The average time a flapping friend stays online and offline, in
+     *         milliseconds.
+     */
+    uint64_t meanOnlineTime = 30 * 60 * 1000;
+    uint64_t meanOfflineTime = 10 * 60 * 1000;
+
+    /*! @brief The first message id given out for each friend. Set close to
+     *         UINT32_MAX to exercise wrap around.
+     */
+    uint32_t firstMessageId = 0;
+
+    /*! @brief The interval requested between iterations, in milliseconds.
+     */
+    uint32_t iterationInterval = 50;
+};
+
+
+/*! @brief A loopback transport driven by a virtual clock, with simulated
+ *         loss, latency and presence changes. Every event is ordered by time
+ *         so a day of traffic can be replayed in seconds, reproducibly.
+ */
+class SimulatedTransport : public LoopbackTransport
+{
+public:
+
+    /*! @brief Constructor.
+     *  @param config The network conditions to simulate.
+     */
+    explicit SimulatedTransport(const SimulationConfig& config);
+
+    /*! @brief Has a friend send a message at a later time.
+     *  @param time When the message is sent, in virtual milliseconds.
+     *  @param alias The alias for the friend sending the message.
+     *  @param message The message.
+     */
+    void scheduleMessage(uint64_t time, uint32_t alias,
+                         const std::string& message);
+
+    /*! @brief Starts toggling a friend between online and offline, with
+     *         exponentially distributed durations.
+     *  @param alias The alias for the friend.
+     */
+    void startFlapping(uint32_t alias);
+
+    /*! @brief Returns the number of messages sent, including resends.
+     */
+    uint64_t getSendCount() const;
+
+    /*! @brief Returns the number of messages or reciepts that were lost.
+     */
+    uint64_t getLossCount() const;
+
+    /*! @brief Returns the number of presence changes simulated.
+     */
+    uint64_t getFlapCount() const;
+
+    uint32_t addFriendNoRequest(const ToxKey& publicKey) override;
+
+    uint32_t sendMessage(uint32_t friendAlias, std::string_view message,
+                         bool actionType) override;
+
+    void iterate() override;
+
+    Clock& getClock() override;
+
+private:
+
+    /*! @brief Something that happens at a specific virtual time.
+     */
+    struct TimedEvent
+    {
+        enum Type
+        {
+            Arrive,
+            Toggle,
+            Send
+        };
+
+        uint64_t time;
+        uint64_t sequence;
+        Type type;
+        uint32_t alias;
+        uint32_t epoch;
+        uint32_t messageId;
+        bool recieptLost;
+        std::string message;
+    };
+
+    /*! @brief Orders events by time, then by when they were scheduled.
+     */
+    struct Later
+    {
+        bool operator()(const TimedEvent& a, const TimedEvent& b) const
+        {
+            return a.time > b.time ||
+                   (a.time == b.time && a.sequence > b.sequence);
+        }
+    };
+
+    void schedule(TimedEvent& event);
+
+    void scheduleToggle(uint32_t alias);
+
+    SimulationConfig mConfig;
+    VirtualClock mClock;
+    std::mt19937_64 mRandom;
+    std::priority_queue<TimedEvent, std::vector<TimedEvent>, Later> mTimed;
+    uint64_t mSequence;
+
+    // Bumped each time a friend disconnects, so anything in flight is lost
+    std::vector<uint32_t> mEpochs;
+
+    uint64_t mSends;
+    uint64_t mLosses;
+    uint64_t mFlaps;
+};
+
+#endif
@@ -0,0 +1,73 @@
+#ifndef SLOTARRAY_H
+#define SLOTARRAY_H
+
+#include <cassert>
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+/*! @brief An array indexed by small dense integers that only grows. Elements
+ *         are stored contiguously in fixed size pages, so growing never moves
+ *         existing elements and references to them stay valid.
+ */
+template <typename T, size_t PageBits=10>
+class SlotArray
+{
+public:
+
+    /*! @brief The number of elements stored in each page.
+     */
+    static const size_t PageSize = (size_t)1 << PageBits;
+
+    /*! @brief Constructor.
+     */
+    SlotArray()
+        : mSize(0)
+    {
+    }
+
+    /*! @brief Returns the number of slots.
+     */
+    size_t size() const
+    {
+        return mSize;
+    }
+
+    /*! @brief Adds default constructed slots until there are at least the
+     *         given number.
+     *  @param size The number of slots required.
+     */
+    void grow(size_t size)
+    {
+        while (mPages.size() * PageSize < size)
+        {
+            mPages.emplace_back(new T[PageSize]());
+        }
+        if (size > mSize)
+        {
+            mSize = size;
+        }
+    }
+
+    /*! @brief Accesses a slot.
+     *  @param index Must be less than size().
+     */
+    T& operator[](size_t index)
+    {
+        assert(index < mSize);
+        return mPages[index >> PageBits][index & (PageSize - 1)];
+    }
+
+    const T& operator[](size_t index) const
+    {
+        assert(index < mSize);
+        return mPages[index >> PageBits][index & (PageSize - 1)];
+    }
+
+private:
+
+    std::vector<std::unique_ptr<T[]>> mPages;
+    size_t mSize;
+};
+
+#endif
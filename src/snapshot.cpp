@@ -0,0 +1,454 @@
+#include "snapshot.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "fileutil.h"
+
+
+// Identifies the file, followed by the version of the format
+static const char SnapshotMagic[4] = { 'T', 'F', 'S', 'S' };
+static const uint32_t SnapshotVersion = 2;
+
+// The magic, version and id, then the offset and length of the savedata,
+// the payload index and the friend index
+static const size_t HeaderSize = 64;
+
+static const size_t PayloadEntrySize = 16;
+
+// Friend index entries are a public key, then the offset and length of the
+// friend's state
+static const size_t KeySize = 32;
+static const size_t FriendEntrySize = KeySize + 16;
+
+// New snapshots are written out this much at a time
+static const size_t WriteSize = 1024 * 1024;
+
+static uint64_t readInt(const char* in, size_t size)
+{
+    const uint8_t* bytes = (const uint8_t*)in;
+    uint64_t value = 0;
+    for (size_t i = 0; i < size; ++i)
+    {
+        value |= (uint64_t)bytes[i] << (i * 8);
+    }
+    return value;
+}
+
+static void writeInt(char* out, uint64_t value, size_t size)
+{
+    for (size_t i = 0; i < size; ++i)
+    {
+        out[i] = (char)(value >> (i * 8));
+    }
+}
+
+
+// The Snapshot implementation
+
+Snapshot::Snapshot()
+    : mData(nullptr)
+    , mSize(0)
+    , mId(0)
+{
+}
+
+Snapshot::~Snapshot()
+{
+    if (mData)
+    {
+        ::munmap((void*)mData, mSize);
+    }
+}
+
+bool Snapshot::open(const std::string& path)
+{
+    assert(!isOpen());
+
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        // Nothing has been written yet
+        return errno == ENOENT;
+    }
+
+    struct stat info;
+    if (::fstat(fd, &info) != 0 || (size_t)info.st_size < HeaderSize)
+    {
+        ::close(fd);
+        return false;
+    }
+
+    // Pages are only read in as friends are looked up
+    void* data = ::mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (data == MAP_FAILED)
+    {
+        return false;
+    }
+
+    mData = (const char*)data;
+    mSize = info.st_size;
+
+    if (memcmp(mData, SnapshotMagic, sizeof(SnapshotMagic)) != 0 ||
+        readInt(mData + 4, 4) != SnapshotVersion)
+    {
+        ::munmap(data, mSize);
+        mData = nullptr;
+        mSize = 0;
+        return false;
+    }
+
+    mId = readInt(mData + 8, 8);
+    mSaveData = getRange(readInt(mData + 16, 8), readInt(mData + 24, 8));
+
+    uint64_t payloads = readInt(mData + 40, 8);
+    uint64_t friends = readInt(mData + 56, 8);
+    if (payloads <= UINT32_MAX && friends <= mSize / FriendEntrySize)
+    {
+        mPayloads = getRange(readInt(mData + 32, 8),
+                             payloads * PayloadEntrySize);
+        mFriends = getRange(readInt(mData + 48, 8), friends * FriendEntrySize);
+    }
+
+    // A truncated file would have its indexes cut off
+    if (mPayloads.size() != payloads * PayloadEntrySize ||
+        mFriends.size() != friends * FriendEntrySize)
+    {
+        ::munmap(data, mSize);
+        mData = nullptr;
+        mSize = 0;
+        mSaveData = mPayloads = mFriends = std::string_view();
+        return false;
+    }
+
+    return true;
+}
+
+bool Snapshot::isOpen() const
+{
+    return mData != nullptr;
+}
+
+uint64_t Snapshot::getId() const
+{
+    return mId;
+}
+
+uint64_t Snapshot::getSize() const
+{
+    return mSize;
+}
+
+std::string_view Snapshot::getSaveData() const
+{
+    return mSaveData;
+}
+
+uint32_t Snapshot::getPayloadCount() const
+{
+    return mPayloads.size() / PayloadEntrySize;
+}
+
+bool Snapshot::getPayload(uint32_t id, std::string_view& payload,
+                          uint32_t& refs) const
+{
+    assert(id < getPayloadCount());
+    const char* entry = mPayloads.data() + id * PayloadEntrySize;
+    uint64_t length = readInt(entry + 8, 4);
+    payload = getRange(readInt(entry, 8), length);
+    refs = readInt(entry + 12, 4);
+    return refs > 0 && payload.size() == length;
+}
+
+size_t Snapshot::getFriendCount() const
+{
+    return mFriends.size() / FriendEntrySize;
+}
+
+ToxKey Snapshot::getFriendKey(size_t index) const
+{
+    assert(index < getFriendCount());
+    const char* entry = mFriends.data() + index * FriendEntrySize;
+    return ToxKey(ToxKey::Public, (const uint8_t*)entry, KeySize);
+}
+
+bool Snapshot::getFriendState(size_t index, std::string_view& state) const
+{
+    assert(index < getFriendCount());
+    const char* entry = mFriends.data() + index * FriendEntrySize;
+    uint64_t length = readInt(entry + KeySize + 8, 8);
+    state = getRange(readInt(entry + KeySize, 8), length);
+    return state.size() == length;
+}
+
+bool Snapshot::findFriend(const ToxKey& publicKey,
+                          std::string_view& state) const
+{
+    if (publicKey.size() != KeySize)
+    {
+        return false;
+    }
+
+    // Binary search of the index, which is sorted by key
+    size_t low = 0;
+    size_t high = getFriendCount();
+    while (low < high)
+    {
+        size_t middle = low + (high - low) / 2;
+        int order = memcmp(mFriends.data() + middle * FriendEntrySize,
+                           publicKey.data(), KeySize);
+        if (order == 0)
+        {
+            return getFriendState(middle, state);
+        }
+        else if (order < 0)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+    return false;
+}
+
+std::string_view Snapshot::getRange(uint64_t offset, uint64_t length) const
+{
+    if (offset > mSize || length > mSize - offset)
+    {
+        return std::string_view();
+    }
+    return std::string_view(mData + offset, length);
+}
+
+
+// The SnapshotWriter implementation
+
+SnapshotWriter::SnapshotWriter()
+    : mFile(-1)
+    , mFailed(false)
+    , mId(0)
+    , mOffset(0)
+    , mSaveDataOffset(0)
+    , mSaveDataLength(0)
+{
+}
+
+SnapshotWriter::~SnapshotWriter()
+{
+    if (mFile >= 0)
+    {
+        ::close(mFile);
+        ::unlink(mTempPath.c_str());
+    }
+}
+
+bool SnapshotWriter::open(const std::string& path, uint64_t id)
+{
+    assert(mFile < 0);
+    mPath = path;
+    mTempPath = getTempPath(path);
+    mId = id;
+
+    mFile = openTempFile(path);
+    if (mFile < 0)
+    {
+        return false;
+    }
+
+    // The header is filled in by commit()
+    mBuffer.assign(HeaderSize, '\0');
+    mOffset = HeaderSize;
+    return true;
+}
+
+void SnapshotWriter::writeSaveData(std::string_view saveData)
+{
+    assert(mFriends.empty() && mPayloads.empty());
+    mSaveDataOffset = mOffset;
+    mSaveDataLength = saveData.size();
+    append(saveData);
+}
+
+void SnapshotWriter::writePayload(uint32_t id, uint32_t refs,
+                                  std::string_view payload)
+{
+    if (id >= mPayloads.size())
+    {
+        mPayloads.resize(id + 1);
+    }
+
+    PayloadEntry& entry = mPayloads[id];
+    entry.offset = mOffset;
+    entry.length = payload.size();
+    entry.refs = refs;
+    append(payload);
+}
+
+void SnapshotWriter::beginFriend(const ToxKey& publicKey)
+{
+    assert(publicKey.size() == KeySize);
+
+    FriendEntry entry;
+    entry.publicKey = publicKey;
+    entry.offset = mOffset;
+    entry.length = 0;
+    mFriends.push_back(entry);
+}
+
+void SnapshotWriter::write(std::string_view data)
+{
+    assert(!mFriends.empty());
+    mFriends.back().length += data.size();
+    append(data);
+}
+
+bool SnapshotWriter::commit()
+{
+    if (mFile < 0)
+    {
+        return false;
+    }
+
+    std::sort(mFriends.begin(), mFriends.end(),
+              [](const FriendEntry& a, const FriendEntry& b)
+    {
+        return memcmp(a.publicKey.data(), b.publicKey.data(), KeySize) < 0;
+    });
+
+    // Indexes follow everything they point to
+    uint64_t payloadIndex = mOffset;
+    for (auto it = mPayloads.begin(); it != mPayloads.end(); ++it)
+    {
+        char entry[PayloadEntrySize];
+        writeInt(entry, it->offset, 8);
+        writeInt(entry + 8, it->length, 4);
+        writeInt(entry + 12, it->refs, 4);
+        append(std::string_view(entry, sizeof(entry)));
+    }
+
+    uint64_t friendIndex = mOffset;
+    for (auto it = mFriends.begin(); it != mFriends.end(); ++it)
+    {
+        char entry[FriendEntrySize];
+        memcpy(entry, it->publicKey.data(), KeySize);
+        writeInt(entry + KeySize, it->offset, 8);
+        writeInt(entry + KeySize + 8, it->length, 8);
+        append(std::string_view(entry, sizeof(entry)));
+    }
+
+    bool success = flush();
+
+    char header[HeaderSize];
+    memcpy(header, SnapshotMagic, sizeof(SnapshotMagic));
+    writeInt(header + 4, SnapshotVersion, 4);
+    writeInt(header + 8, mId, 8);
+    writeInt(header + 16, mSaveDataOffset, 8);
+    writeInt(header + 24, mSaveDataLength, 8);
+    writeInt(header + 32, payloadIndex, 8);
+    writeInt(header + 40, mPayloads.size(), 8);
+    writeInt(header + 48, friendIndex, 8);
+    writeInt(header + 56, mFriends.size(), 8);
+
+    success = success && ::pwrite(mFile, header, sizeof(header), 0) ==
+                             (ssize_t)sizeof(header) &&
+              replaceWithTempFile(mFile, mPath);
+    ::close(mFile);
+    mFile = -1;
+
+    if (!success)
+    {
+        ::unlink(mTempPath.c_str());
+    }
+    return success;
+}
+
+void SnapshotWriter::append(std::string_view data)
+{
+    mBuffer.append(data);
+    mOffset += data.size();
+    if (mBuffer.size() >= WriteSize)
+    {
+        flush();
+    }
+}
+
+bool SnapshotWriter::flush()
+{
+    if (!mFailed && !writeAll(mFile, mBuffer.data(), mBuffer.size()))
+    {
+        mFailed = true;
+    }
+    mBuffer.clear();
+    return !mFailed;
+}
+
+
+// Utility functions
+
+void writeStateInt(std::string& state, uint64_t value, size_t size)
+{
+    char bytes[8];
+    assert(size <= sizeof(bytes));
+    writeInt(bytes, value, size);
+    state.append(bytes, size);
+}
+
+void writeStateString(std::string& state, std::string_view value)
+{
+    assert(value.size() <= UINT16_MAX);
+    writeStateInt(state, value.size(), 2);
+    state.append(value);
+}
+
+
+// The StateReader implementation
+
+StateReader::StateReader(std::string_view state)
+    : mState(state)
+    , mPos(0)
+    , mValid(true)
+{
+}
+
+bool StateReader::readInt(size_t size, uint64_t& value)
+{
+    std::string_view bytes;
+    if (size > 8 || !readBytes(size, bytes))
+    {
+        mValid = false;
+        return false;
+    }
+    value = ::readInt(bytes.data(), size);
+    return true;
+}
+
+bool StateReader::readString(std::string_view& value)
+{
+    uint64_t length;
+    return readInt(2, length) && readBytes(length, value);
+}
+
+bool StateReader::readBytes(size_t length, std::string_view& value)
+{
+    if (!mValid || mState.size() - mPos < length)
+    {
+        mValid = false;
+        return false;
+    }
+    value = mState.substr(mPos, length);
+    mPos += length;
+    return true;
+}
+
+size_t StateReader::getPosition() const
+{
+    return mPos;
+}
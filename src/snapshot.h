@@ -0,0 +1,265 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "toxwrapper.h"
+
+/*! @brief A snapshot of a tox instance and the state kept for each of its
+ *         friends, mapped into memory so nothing is read until it is used.
+ *
+ *  The file starts with a header giving the format version, the id of the
+ *  snapshot and where the tox savedata, the payload index and the friend
+ *  index are. Payload index entries are the offset, length and reference
+ *  count of each payload, the id being its position. Friend index entries
+ *  are a public key followed by the offset and length of that friend's
+ *  state, sorted by key so a friend can be found without reading the rest.
+ *  Every number is stored least significant byte first.
+ *
+ *  What a friend's state holds is up to the writer, see StateReader.
+ */
+class Snapshot
+{
+public:
+
+    /*! @brief Constructor.
+     */
+    Snapshot();
+
+    /*! @brief Unmaps the file.
+     */
+    ~Snapshot();
+
+
+    // No copy/assignment allowed
+    Snapshot(const Snapshot&) = delete;
+    Snapshot& operator=(const Snapshot&) = delete;
+
+
+    /*! @brief Maps a snapshot file.
+     *  @param path The location of the snapshot.
+     *  @return False if the file exists but is not a snapshot.
+     */
+    bool open(const std::string& path);
+
+    /*! @brief Returns whether a snapshot has been mapped.
+     */
+    bool isOpen() const;
+
+    /*! @brief Returns the id the snapshot was written with.
+     */
+    uint64_t getId() const;
+
+    /*! @brief Returns the size of the file in bytes.
+     */
+    uint64_t getSize() const;
+
+    /*! @brief Returns the tox savedata, empty if there is none.
+     */
+    std::string_view getSaveData() const;
+
+    /*! @brief Returns one more than the highest payload id.
+     */
+    uint32_t getPayloadCount() const;
+
+    /*! @brief Returns a payload.
+     *  @param id The id, less than getPayloadCount().
+     *  @param payload Replaced with the payload.
+     *  @param refs Replaced with the number of references to it.
+     *  @return False if there is no payload with that id.
+     */
+    bool getPayload(uint32_t id, std::string_view& payload,
+                    uint32_t& refs) const;
+
+    /*! @brief Returns the number of friends with state.
+     */
+    size_t getFriendCount() const;
+
+    /*! @brief Returns the public key of a friend with state.
+     *  @param index Less than getFriendCount(), in order of public key.
+     */
+    ToxKey getFriendKey(size_t index) const;
+
+    /*! @brief Returns the state of a friend.
+     *  @param index Less than getFriendCount(), in order of public key.
+     *  @param state Replaced with the state.
+     *  @return False if the entry is corrupt.
+     */
+    bool getFriendState(size_t index, std::string_view& state) const;
+
+    /*! @brief Finds the state of a friend.
+     *  @param publicKey The public key of the friend.
+     *  @param state Replaced with the state.
+     *  @return False if the friend has no state.
+     */
+    bool findFriend(const ToxKey& publicKey, std::string_view& state) const;
+
+private:
+
+    std::string_view getRange(uint64_t offset, uint64_t length) const;
+
+    const char* mData;
+    size_t mSize;
+    uint64_t mId;
+    std::string_view mSaveData;
+    std::string_view mPayloads;
+    std::string_view mFriends;
+};
+
+
+/*! @brief Writes a snapshot next to the file it replaces, then renames it
+ *         into place once it has reached the disk. Payloads and friends can
+ *         be written in any order after the savedata.
+ */
+class SnapshotWriter
+{
+public:
+
+    /*! @brief Constructor.
+     */
+    SnapshotWriter();
+
+    /*! @brief Deletes the new file if it was not committed.
+     */
+    ~SnapshotWriter();
+
+
+    // No copy/assignment allowed
+    SnapshotWriter(const SnapshotWriter&) = delete;
+    SnapshotWriter& operator=(const SnapshotWriter&) = delete;
+
+
+    /*! @brief Starts writing a snapshot.
+     *  @param path The location of the snapshot.
+     *  @param id Tells this snapshot apart from the ones before it.
+     *  @return True on success.
+     */
+    bool open(const std::string& path, uint64_t id);
+
+    /*! @brief Writes the tox savedata.
+     *  @param saveData The savedata.
+     */
+    void writeSaveData(std::string_view saveData);
+
+    /*! @brief Writes a payload.
+     *  @param id The id of the payload.
+     *  @param refs The number of references to it.
+     *  @param payload The payload.
+     */
+    void writePayload(uint32_t id, uint32_t refs, std::string_view payload);
+
+    /*! @brief Starts the state of a friend, which is then written by
+     *         write().
+     *  @param publicKey The public key of the friend, which is not written
+     *                   again.
+     */
+    void beginFriend(const ToxKey& publicKey);
+
+    /*! @brief Writes part of the state of the current friend.
+     *  @param data The part.
+     */
+    void write(std::string_view data);
+
+    /*! @brief Writes the indexes and puts the snapshot in place of the old
+     *         one.
+     *  @return True on success.
+     */
+    bool commit();
+
+private:
+
+    struct PayloadEntry
+    {
+        uint64_t offset = 0;
+        uint32_t length = 0;
+        uint32_t refs = 0;
+    };
+
+    struct FriendEntry
+    {
+        ToxKey publicKey;
+        uint64_t offset;
+        uint64_t length;
+    };
+
+    void append(std::string_view data);
+
+    bool flush();
+
+    std::string mPath;
+    std::string mTempPath;
+    int mFile;
+    bool mFailed;
+    uint64_t mId;
+    std::string mBuffer;
+    uint64_t mOffset;
+    uint64_t mSaveDataOffset;
+    uint64_t mSaveDataLength;
+    std::vector<PayloadEntry> mPayloads;
+    std::vector<FriendEntry> mFriends;
+};
+
+
+/*! @brief Appends an integer to the state of a friend.
+ *  @param state The state.
+ *  @param value The integer.
+ *  @param size The number of bytes to store it in.
+ */
+void writeStateInt(std::string& state, uint64_t value, size_t size);
+
+/*! @brief Appends a string to the state of a friend, preceded by its length
+ *         in two bytes.
+ *  @param state The state.
+ *  @param value The string, at most 65535 bytes.
+ */
+void writeStateString(std::string& state, std::string_view value);
+
+
+/*! @brief Reads the fields of a friend's state written with writeStateInt()
+ *         and writeStateString(). Once a read runs past the end, it and every
+ *         read after it fail.
+ */
+class StateReader
+{
+public:
+
+    /*! @brief Constructor.
+     *  @param state The state, which must outlive the reader.
+     */
+    explicit StateReader(std::string_view state);
+
+    /*! @brief Reads an integer.
+     *  @param size The number of bytes it is stored in.
+     *  @param value Replaced with the integer.
+     *  @return False if the state is truncated.
+     */
+    bool readInt(size_t size, uint64_t& value);
+
+    /*! @brief Reads a string written with writeStateString().
+     *  @param value Replaced with the string.
+     *  @return False if the state is truncated.
+     */
+    bool readString(std::string_view& value);
+
+    /*! @brief Reads a number of bytes.
+     *  @param length The number of bytes.
+     *  @param value Replaced with the bytes.
+     *  @return False if the state is truncated.
+     */
+    bool readBytes(size_t length, std::string_view& value);
+
+    /*! @brief Returns how much has been read.
+     */
+    size_t getPosition() const;
+
+private:
+
+    std::string_view mState;
+    size_t mPos;
+    bool mValid;
+};
+
+#endif
@@ -0,0 +1,494 @@
+#include "spillstore.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <dirent.h>
+#include <fcntl.h>
+#include <linux/falloc.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "fileutil.h"
+
+
+// Every entry is preceded by its length
+static const size_t LengthSize = 4;
+
+// Segments compress and write out their buffer once it holds this many bytes
+static const size_t BlockSize = 64 * 1024;
+
+// Every buffer is written out once they hold this many bytes between them
+static const size_t MaxPendingBytes = 1024 * 1024;
+
+// Blocks start with the size of their entries, the size stored and how
+// they were stored
+static const size_t BlockHeaderSize = 9;
+
+enum BlockMethod
+{
+    BM_Stored = 0,
+    BM_Lz = 1,
+    BM_LzDictionary = 2
+};
+
+// How much of the first entries spilled makes up the dictionary, and how much
+// of each entry is taken so it covers many
+static const size_t DictionarySize = 32 * 1024;
+static const size_t SampleSize = 256;
+
+// The space read back from the front of a segment is given back to the file
+// system in steps of this many bytes
+static const uint64_t PunchSize = 1024 * 1024;
+
+static const std::string SegmentSuffix = ".seg";
+
+static uint32_t readLength(const char* in)
+{
+    const uint8_t* bytes = (const uint8_t*)in;
+    return (uint32_t)bytes[0] | ((uint32_t)bytes[1] << 8) |
+           ((uint32_t)bytes[2] << 16) | ((uint32_t)bytes[3] << 24);
+}
+
+static void writeLength(char* out, uint32_t length)
+{
+    for (size_t i = 0; i < LengthSize; ++i)
+    {
+        out[i] = (char)(length >> (i * 8));
+    }
+}
+
+static size_t countEntries(std::string_view data)
+{
+    size_t count = 0;
+    for (size_t pos = 0; data.size() - pos >= LengthSize; ++count)
+    {
+        pos += LengthSize + readLength(data.data() + pos);
+    }
+    return count;
+}
+
+
+// The SpillStore implementation
+
+SpillStore::SpillStore()
+    : mPendingBytes(0)
+    , mStopping(false)
+{
+}
+
+SpillStore::~SpillStore()
+{
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mStopping = true;
+    }
+    mCondition.notify_one();
+    if (mLoader.joinable())
+    {
+        mLoader.join();
+    }
+
+    for (auto it = mSegments.begin(); it != mSegments.end(); ++it)
+    {
+        if (it->second.fd >= 0)
+        {
+            ::close(it->second.fd);
+        }
+        ::unlink(it->second.path.c_str());
+    }
+}
+
+bool SpillStore::open(const std::string& directory,
+                      const LoadHandler& handler)
+{
+    assert(!isOpen() && !directory.empty());
+
+    if (::mkdir(directory.c_str(), 0700) != 0 && errno != EEXIST)
+    {
+        return false;
+    }
+
+    // Whatever was left is also in the journal being replayed
+    DIR* dir = ::opendir(directory.c_str());
+    if (!dir)
+    {
+        return false;
+    }
+
+    mDirectory = directory;
+    if (mDirectory.back() != '/')
+    {
+        mDirectory.push_back('/');
+    }
+
+    while (dirent* entry = ::readdir(dir))
+    {
+        std::string name = entry->d_name;
+        if (name.size() > SegmentSuffix.size() &&
+            name.compare(name.size() - SegmentSuffix.size(),
+                         SegmentSuffix.size(), SegmentSuffix) == 0)
+        {
+            ::unlink((mDirectory + name).c_str());
+        }
+    }
+    ::closedir(dir);
+
+    mHandler = handler;
+    return true;
+}
+
+bool SpillStore::isOpen() const
+{
+    return !mDirectory.empty();
+}
+
+void SpillStore::append(uint32_t owner, std::string_view prefix,
+                        std::string_view entry)
+{
+    assert(isOpen());
+
+    Segment& segment = mSegments[owner];
+    if (segment.path.empty())
+    {
+        segment.path = mDirectory + std::to_string(owner) + SegmentSuffix;
+    }
+    if (!mDictionary)
+    {
+        sample(prefix, entry);
+    }
+
+    char header[LengthSize];
+    writeLength(header, prefix.size() + entry.size());
+    segment.pending.append(header, sizeof(header));
+    segment.pending.append(prefix);
+    segment.pending.append(entry);
+    ++segment.count;
+    mPendingBytes += LengthSize + prefix.size() + entry.size();
+
+    if (segment.pending.size() >= BlockSize)
+    {
+        flush(segment);
+    }
+    else if (mPendingBytes > MaxPendingBytes)
+    {
+        flush();
+    }
+}
+
+uint64_t SpillStore::getStart(uint32_t owner) const
+{
+    auto it = mSegments.find(owner);
+    return it != mSegments.end() ? it->second.start : 0;
+}
+
+bool SpillStore::load(uint32_t owner, size_t maxBytes)
+{
+    auto it = mSegments.find(owner);
+    if (it == mSegments.end() || it->second.loading ||
+        it->second.count == 0 || !flush(it->second))
+    {
+        return false;
+    }
+
+    Segment& segment = it->second;
+    Request request;
+    request.owner = owner;
+    request.path = segment.path;
+    request.offset = segment.start;
+    request.end = segment.written;
+    request.maxBytes = maxBytes;
+    request.dictionary = mDictionary;
+
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mRequests.push_back(request);
+    }
+    mCondition.notify_one();
+
+    // Started on first use, most stores never spill
+    if (!mLoader.joinable())
+    {
+        mLoader = std::thread(&SpillStore::runLoader, this);
+    }
+
+    segment.loading = true;
+    return true;
+}
+
+bool SpillStore::read(uint32_t owner, uint64_t offset, size_t maxBytes,
+                      Batch& batch)
+{
+    auto it = mSegments.find(owner);
+    if (it == mSegments.end() || !flush(it->second) ||
+        offset >= it->second.written)
+    {
+        return false;
+    }
+
+    bool success = readSegment(it->second.path, offset, it->second.written,
+                               maxBytes, mDictionary, batch);
+    batch.owner = owner;
+    batch.loaded = false;
+    return success && batch.count > 0;
+}
+
+bool SpillStore::consume(const Batch& batch)
+{
+    auto it = mSegments.find(batch.owner);
+    if (it == mSegments.end())
+    {
+        return false;
+    }
+
+    Segment& segment = it->second;
+    if (batch.loaded)
+    {
+        segment.loading = false;
+    }
+
+    bool current = batch.offset == segment.start;
+    if (current)
+    {
+        assert(batch.count <= segment.count);
+        segment.start += batch.length;
+        segment.count -= batch.count;
+
+        // A queue that never quite catches up keeps its segment, so what was
+        // read back is freed without moving the rest
+        uint64_t punch = segment.start - segment.start % PunchSize;
+        if (segment.fd >= 0 && punch > segment.punched)
+        {
+            ::fallocate(segment.fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                        segment.punched, punch - segment.punched);
+            segment.punched = punch;
+        }
+    }
+
+    // Nothing is left to read back
+    if (segment.count == 0 && !segment.loading)
+    {
+        if (segment.fd >= 0)
+        {
+            ::close(segment.fd);
+        }
+        ::unlink(segment.path.c_str());
+        mSegments.erase(it);
+
+        // Once nothing needs it the next dictionary is taken from what is
+        // spilled then, in case the traffic has changed
+        if (mSegments.empty())
+        {
+            mDictionary.reset();
+            mSample.clear();
+        }
+    }
+
+    return current;
+}
+
+bool SpillStore::flush()
+{
+    bool success = true;
+    for (auto it = mSegments.begin(); it != mSegments.end(); ++it)
+    {
+        success &= flush(it->second);
+    }
+    return success;
+}
+
+void SpillStore::forEachEntry(const Batch& batch,
+                              const std::function<void(std::string_view)>&
+                                  visitor)
+{
+    std::string_view data = batch.data;
+    size_t pos = 0;
+    while (data.size() - pos >= LengthSize)
+    {
+        uint32_t length = readLength(data.data() + pos);
+        visitor(data.substr(pos + LengthSize, length));
+        pos += LengthSize + length;
+    }
+}
+
+bool SpillStore::flush(Segment& segment)
+{
+    if (segment.pending.empty())
+    {
+        return true;
+    }
+
+    if (segment.fd < 0)
+    {
+        segment.fd = ::open(segment.path.c_str(),
+                            O_WRONLY | O_CREAT | O_TRUNC, 0600);
+        if (segment.fd < 0)
+        {
+            return false;
+        }
+    }
+
+    uint8_t method = mDictionary ? BM_LzDictionary : BM_Lz;
+    std::string block(BlockHeaderSize, '\0');
+    lzCompress(segment.pending, mDictionary.get(), block);
+    if (block.size() - BlockHeaderSize >= segment.pending.size())
+    {
+        // Nothing to gain, so kept as it is
+        method = BM_Stored;
+        block.resize(BlockHeaderSize);
+        block.append(segment.pending);
+    }
+    writeLength(&block[0], segment.pending.size());
+    writeLength(&block[LengthSize], block.size() - BlockHeaderSize);
+    block[2 * LengthSize] = (char)method;
+
+    // Kept buffered to try again if the write fails
+    if (!writeAll(segment.fd, block.data(), block.size()))
+    {
+        return false;
+    }
+
+    segment.written += block.size();
+    mPendingBytes -= segment.pending.size();
+    segment.pending.clear();
+    return true;
+}
+
+void SpillStore::sample(std::string_view prefix, std::string_view entry)
+{
+    // Mostly the start of messages, where the sender headers are
+    size_t length = std::min(SampleSize, DictionarySize - mSample.size());
+    mSample.append(prefix.substr(0, length));
+    mSample.append(entry.substr(0, length - std::min(length, prefix.size())));
+
+    if (mSample.size() >= DictionarySize)
+    {
+        mDictionary = std::make_shared<const LzDictionary>(std::move(mSample));
+        mSample.clear();
+    }
+}
+
+void SpillStore::runLoader()
+{
+    for (;;)
+    {
+        Request request;
+        {
+            std::unique_lock<std::mutex> lock(mMutex);
+            mCondition.wait(lock, [this]()
+            {
+                return mStopping || !mRequests.empty();
+            });
+            if (mStopping)
+            {
+                return;
+            }
+            request = std::move(mRequests.front());
+            mRequests.pop_front();
+        }
+
+        // A failed read is still handed over, so the load is finished
+        Batch batch;
+        readSegment(request.path, request.offset, request.end,
+                    request.maxBytes, request.dictionary, batch);
+        batch.owner = request.owner;
+        batch.loaded = true;
+        mHandler(batch);
+    }
+}
+
+bool SpillStore::readSegment(const std::string& path, uint64_t offset,
+                             uint64_t end, size_t maxBytes,
+                             const Dictionary& dictionary, Batch& batch)
+{
+    batch.offset = offset;
+    batch.data.clear();
+    batch.length = 0;
+    batch.count = 0;
+
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        return false;
+    }
+
+    // Blocks are never larger than their entries, give or take the header
+    size_t length = std::min<uint64_t>(end - offset,
+                                       std::max(maxBytes, BlockHeaderSize));
+
+    // Ask for the next batch too, so it is read while this one is used
+    ::posix_fadvise(fd, offset, 2 * length, POSIX_FADV_WILLNEED);
+
+    std::string stored(length, '\0');
+    bool success = readAll(fd, &stored[0], length, offset);
+
+    // Take whole blocks up to maxBytes of entries, but always at least one
+    size_t pos = 0;
+    while (success && stored.size() - pos >= BlockHeaderSize)
+    {
+        const char* header = stored.data() + pos;
+        uint32_t size = readLength(header);
+        uint64_t block = BlockHeaderSize + readLength(header + LengthSize);
+        uint8_t method = header[2 * LengthSize];
+        if (batch.count > 0 && batch.data.size() + size > maxBytes)
+        {
+            break;
+        }
+
+        if (stored.size() - pos < block)
+        {
+            if (batch.count > 0 || offset + pos + block > end)
+            {
+                break;
+            }
+
+            size_t have = stored.size();
+            stored.resize(pos + block);
+            success = readAll(fd, &stored[have], stored.size() - have,
+                              offset + have);
+            if (!success)
+            {
+                break;
+            }
+        }
+
+        size_t start = batch.data.size();
+        std::string_view data(stored.data() + pos + BlockHeaderSize,
+                              block - BlockHeaderSize);
+        if (method == BM_Stored && data.size() == size)
+        {
+            batch.data.append(data);
+        }
+        else if (method == BM_Lz)
+        {
+            success = lzDecompress(data, "", size, batch.data);
+        }
+        else if (method == BM_LzDictionary && dictionary)
+        {
+            success = lzDecompress(data, dictionary->getText(), size,
+                                   batch.data);
+        }
+        else
+        {
+            success = false;
+        }
+
+        if (success)
+        {
+            batch.count += countEntries(
+                std::string_view(batch.data).substr(start));
+            pos += block;
+        }
+    }
+
+    ::close(fd);
+    if (success)
+    {
+        batch.length = pos;
+    }
+    else
+    {
+        batch.data.clear();
+        batch.count = 0;
+    }
+    return success;
+}
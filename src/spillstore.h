@@ -0,0 +1,206 @@
+#ifndef SPILLSTORE_H
+#define SPILLSTORE_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "lz.h"
+
+/*! @brief Keeps the newest entries of message queues that have outgrown
+ *         their memory budget in segment files, one per queue, and reads
+ *         them back oldest first.
+ *
+ *  Entries are stored as their length, four bytes least significant first,
+ *  followed by their bytes. Appends are buffered into blocks of about 64 KiB,
+ *  which are compressed with lzCompress() as they are written. The first
+ *  entries spilled after the store was last empty are sampled into a
+ *  dictionary that later blocks are compressed with, so even small blocks
+ *  share the sender headers and phrases common to every queue.
+ *
+ *  Reads started with load() happen on a thread of the store's own, which
+ *  asks the kernel to read ahead of each batch so the next is usually
+ *  cached, and decompresses the blocks there. Everything else is called from
+ *  the thread owning the queues. The space of entries read back is given
+ *  back to the file system as the segment is consumed, and the file is
+ *  deleted once it is empty.
+ *
+ *  Segments only cache what the journal holds, so any left behind are
+ *  deleted when the store is opened again.
+ */
+class SpillStore
+{
+public:
+
+    /*! @brief Entries read back from a segment, made of whole blocks.
+     */
+    struct Batch
+    {
+        /*! @brief The queue the entries belong to.
+         */
+        uint32_t owner = 0;
+
+        /*! @brief Where in the segment the entries start.
+         */
+        uint64_t offset = 0;
+
+        /*! @brief The entries, decompressed.
+         */
+        std::string data;
+
+        /*! @brief The bytes the entries take up in the segment.
+         */
+        uint64_t length = 0;
+
+        /*! @brief The number of entries.
+         */
+        size_t count = 0;
+
+        /*! @brief Whether the batch was read by load().
+         */
+        bool loaded = false;
+    };
+
+    /*! @brief Called on the loader thread with each batch read by load().
+     */
+    typedef std::function<void(Batch& batch)> LoadHandler;
+
+    /*! @brief Constructor.
+     */
+    SpillStore();
+
+    /*! @brief Stops the loader thread and deletes the segments.
+     */
+    ~SpillStore();
+
+
+    // No copy/assignment allowed
+    SpillStore(const SpillStore&) = delete;
+    SpillStore& operator=(const SpillStore&) = delete;
+
+
+    /*! @brief Starts keeping segments in a directory, creating it if needed
+     *         and deleting any segments left in it.
+     *  @param directory The directory.
+     *  @param handler Recieves the batches read by load().
+     *  @return True on success.
+     */
+    bool open(const std::string& directory, const LoadHandler& handler);
+
+    /*! @brief Returns whether the store has been opened.
+     */
+    bool isOpen() const;
+
+    /*! @brief Adds an entry made of two parts to the back of a queue's
+     *         segment.
+     *  @param owner The queue.
+     *  @param prefix The start of the entry.
+     *  @param entry The rest of the entry.
+     */
+    void append(uint32_t owner, std::string_view prefix,
+                std::string_view entry);
+
+    /*! @brief Returns where the oldest entry not consumed starts.
+     *  @param owner The queue.
+     */
+    uint64_t getStart(uint32_t owner) const;
+
+    /*! @brief Starts reading the oldest entries of a queue's segment on the
+     *         loader thread. At most one load per queue is outstanding.
+     *  @param owner The queue.
+     *  @param maxBytes How much to read, though at least one block is.
+     *  @return False if nothing was started.
+     */
+    bool load(uint32_t owner, size_t maxBytes);
+
+    /*! @brief Reads entries of a queue's segment on this thread.
+     *  @param owner The queue.
+     *  @param offset Where to start, the start of a block.
+     *  @param maxBytes How much to read, though at least one block is.
+     *  @param batch Replaced with the entries.
+     *  @return False if there were none, or they could not be read.
+     */
+    bool read(uint32_t owner, uint64_t offset, size_t maxBytes, Batch& batch);
+
+    /*! @brief Removes the entries of a batch from the front of a segment,
+     *         deleting the segment once it is empty.
+     *  @param batch A batch starting at getStart().
+     *  @return False if the segment has moved on since the batch was read,
+     *          in which case it should be dropped.
+     */
+    bool consume(const Batch& batch);
+
+    /*! @brief Writes out every buffered entry.
+     *  @return True on success.
+     */
+    bool flush();
+
+    /*! @brief Calls a function for each entry of a batch.
+     *  @param batch The batch.
+     *  @param visitor Called with each entry in order.
+     */
+    static void forEachEntry(const Batch& batch,
+                             const std::function<void(std::string_view)>&
+                                 visitor);
+
+private:
+
+    typedef std::shared_ptr<const LzDictionary> Dictionary;
+
+    struct Segment
+    {
+        std::string path;
+        int fd = -1;
+        std::string pending;
+        uint64_t written = 0;
+        uint64_t start = 0;
+        uint64_t punched = 0;
+        size_t count = 0;
+        bool loading = false;
+    };
+
+    struct Request
+    {
+        uint32_t owner;
+        std::string path;
+        uint64_t offset;
+        uint64_t end;
+        size_t maxBytes;
+        Dictionary dictionary;
+    };
+
+    bool flush(Segment& segment);
+
+    void sample(std::string_view prefix, std::string_view entry);
+
+    void runLoader();
+
+    static bool readSegment(const std::string& path, uint64_t offset,
+                            uint64_t end, size_t maxBytes,
+                            const Dictionary& dictionary, Batch& batch);
+
+    std::string mDirectory;
+    LoadHandler mHandler;
+    std::unordered_map<uint32_t, Segment> mSegments;
+    size_t mPendingBytes;
+
+    // Read by the loader thread once set, so replaced rather than changed
+    Dictionary mDictionary;
+    std::string mSample;
+
+    // Shared with the loader thread
+    std::mutex mMutex;
+    std::condition_variable mCondition;
+    std::deque<Request> mRequests;
+    bool mStopping;
+    std::thread mLoader;
+};
+
+#endif
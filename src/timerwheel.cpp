@@ -0,0 +1,179 @@
+#include "timerwheel.h"
+
+#include <algorithm>
+
+
+TimerWheel::TimerWheel(uint64_t now)
+    : mNow(now)
+    , mCount(0)
+{
+    for (int level = 0; level < Levels; ++level)
+    {
+        mLevels[level].occupied.fill(0);
+    }
+}
+
+void TimerWheel::schedule(uint32_t id, uint64_t deadline)
+{
+    Timer timer;
+    timer.id = id;
+    timer.deadline = deadline;
+
+    insert(timer);
+    ++mCount;
+}
+
+void TimerWheel::advance(uint64_t now, std::vector<Timer>& expired)
+{
+    while (mNow < now)
+    {
+        if (mCount == 0)
+        {
+            mNow = now;
+            break;
+        }
+
+        // Skip ahead to the next occupied slot, stopping where the upper
+        // levels need to cascade down
+        uint64_t boundary = (mNow | SlotMask) + 1;
+        uint64_t limit = std::min(now, boundary);
+        mNow = findOccupied(mNow + 1, limit);
+
+        if ((mNow & SlotMask) == 0)
+        {
+            cascade();
+        }
+
+        // Expire the slot
+        size_t index = mNow & SlotMask;
+        Slot& slot = mLevels[0].slots[index];
+        if (!slot.empty())
+        {
+            expired.insert(expired.end(), slot.begin(), slot.end());
+            mCount -= slot.size();
+            slot.clear();
+            setOccupied(0, index, false);
+        }
+    }
+
+    // Anything scheduled in the past, or cascaded down exactly on time
+    if (!mOverdue.empty())
+    {
+        expired.insert(expired.end(), mOverdue.begin(), mOverdue.end());
+        mCount -= mOverdue.size();
+        mOverdue.clear();
+    }
+}
+
+size_t TimerWheel::size() const
+{
+    return mCount;
+}
+
+uint64_t TimerWheel::getNextExpiry() const
+{
+    if (mCount == 0)
+    {
+        return UINT64_MAX;
+    }
+    if (!mOverdue.empty())
+    {
+        return mNow;
+    }
+
+    // The lowest level only holds this turn, beyond it the upper levels
+    // cascade at the boundary
+    uint64_t boundary = (mNow | SlotMask) + 1;
+    return findOccupied(mNow + 1, boundary);
+}
+
+void TimerWheel::insert(const Timer& timer)
+{
+    if (timer.deadline <= mNow)
+    {
+        mOverdue.push_back(timer);
+        return;
+    }
+
+    // Pick the lowest level on which the deadline and now share the same
+    // upper bits
+    uint64_t diff = timer.deadline ^ mNow;
+    int level = 0;
+    while (level < Levels - 1 && (diff >> ((level + 1) * LevelBits)) != 0)
+    {
+        ++level;
+    }
+
+    int shift = level * LevelBits;
+    size_t index = (timer.deadline >> shift) & SlotMask;
+    if (level == Levels - 1 &&
+        (timer.deadline >> shift) - (mNow >> shift) > SlotsPerLevel)
+    {
+        // Beyond the range of the wheel, revisit after a full turn
+        index = (mNow >> shift) & SlotMask;
+    }
+
+    mLevels[level].slots[index].push_back(timer);
+    setOccupied(level, index, true);
+}
+
+void TimerWheel::cascade()
+{
+    // Move the upper level slots that have come due down the hierarchy
+    for (int level = 1; level < Levels; ++level)
+    {
+        size_t index = (mNow >> (level * LevelBits)) & SlotMask;
+
+        Slot slot;
+        slot.swap(mLevels[level].slots[index]);
+        setOccupied(level, index, false);
+
+        for (auto it = slot.begin(); it != slot.end(); ++it)
+        {
+            insert(*it);
+        }
+
+        // Only continue while the lower level wrapped around as well
+        if (index != 0)
+        {
+            break;
+        }
+    }
+}
+
+uint64_t TimerWheel::findOccupied(uint64_t first, uint64_t last) const
+{
+    // Both bounds are within the same turn of the lowest level, except for
+    // last which may be the first slot of the next turn
+    const std::array<uint64_t, SlotsPerLevel / 64>& occupied =
+        mLevels[0].occupied;
+
+    uint64_t time = first;
+    while (time < last)
+    {
+        size_t index = time & SlotMask;
+        uint64_t bits = occupied[index / 64] >> (index % 64);
+        if (bits != 0)
+        {
+            return std::min(last, time + __builtin_ctzll(bits));
+        }
+
+        // Nothing else in this word
+        time += 64 - (index % 64);
+    }
+
+    return last;
+}
+
+void TimerWheel::setOccupied(int level, size_t slot, bool occupied)
+{
+    uint64_t bit = uint64_t(1) << (slot % 64);
+    if (occupied)
+    {
+        mLevels[level].occupied[slot / 64] |= bit;
+    }
+    else
+    {
+        mLevels[level].occupied[slot / 64] &= ~bit;
+    }
+}
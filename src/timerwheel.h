@@ -0,0 +1,91 @@
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/*! @brief A hierarchical timing wheel with millisecond resolution. Scheduling
+ *         a timer is constant time and advancing the wheel only costs time
+ *         proportional to the timers that are due, plus a small constant.
+ *
+ *  Timers cannot be cancelled. Owners that need to move a deadline should
+ *  record it themselves and check it when the timer expires.
+ */
+class TimerWheel
+{
+public:
+
+    /*! @brief A timer that has expired.
+     */
+    struct Timer
+    {
+        /*! @brief Identifies what the timer was scheduled for.
+         */
+        uint32_t id;
+
+        /*! @brief The time the timer was scheduled to expire.
+         */
+        uint64_t deadline;
+    };
+
+    /*! @brief Constructor.
+     *  @param now The current time in milliseconds.
+     */
+    explicit TimerWheel(uint64_t now=0);
+
+    /*! @brief Schedules a timer.
+     *  @param id Identifies what the timer is for.
+     *  @param deadline When the timer should expire, in milliseconds. Times in
+     *                  the past expire on the next call to advance().
+     */
+    void schedule(uint32_t id, uint64_t deadline);
+
+    /*! @brief Moves time forward, collecting every timer that expires.
+     *  @param now The current time in milliseconds.
+     *  @param expired Expired timers are appended to this.
+     */
+    void advance(uint64_t now, std::vector<Timer>& expired);
+
+    /*! @brief Returns the number of scheduled timers.
+     */
+    size_t size() const;
+
+    /*! @brief Returns when advance() should next be called, in milliseconds.
+     *         This is never later than the earliest deadline, but may be
+     *         earlier while the timers are far enough out to be on the upper
+     *         levels. UINT64_MAX if nothing is scheduled.
+     */
+    uint64_t getNextExpiry() const;
+
+private:
+
+    static const int LevelBits = 8;
+    static const int Levels = 4;
+    static const size_t SlotsPerLevel = 1 << LevelBits;
+    static const uint64_t SlotMask = SlotsPerLevel - 1;
+
+    typedef std::vector<Timer> Slot;
+
+    struct Level
+    {
+        std::array<Slot, SlotsPerLevel> slots;
+        std::array<uint64_t, SlotsPerLevel / 64> occupied;
+    };
+
+    void insert(const Timer& timer);
+
+    void cascade();
+
+    uint64_t findOccupied(uint64_t first, uint64_t last) const;
+
+    void setOccupied(int level, size_t slot, bool occupied);
+
+    uint64_t mNow;
+    size_t mCount;
+    std::array<Level, Levels> mLevels;
+    Slot mOverdue;
+};
+
+#endif
@@ -0,0 +1,405 @@
+#include "toxcoretransport.h"
+
+#include <cassert>
+
+
+// The ToxcoreTransport implementation
+
+ToxcoreTransport::ToxcoreTransport(const ToxOptionsWrapper& options)
+    : BasicToxWrapper(options)
+{
+}
+
+ToxcoreTransport::~ToxcoreTransport()
+{
+}
+
+bool ToxcoreTransport::bootstrapNode(const std::string& address,
+                                     uint16_t port, const ToxKey& publicKey)
+{
+    // Attempt to bootstrap the node
+    assert(publicKey.getType() == ToxKey::Public);
+    return tox_bootstrap(mTox, address.c_str(), port,
+                         publicKey.data(), nullptr);
+}
+
+void ToxcoreTransport::getSaveData(std::vector<uint8_t>& data)
+{
+    // Read in data from tox
+    size_t length = tox_get_savedata_size(mTox);
+
+    data.resize(length, 0);
+    tox_get_savedata(mTox, &data[0]);
+}
+
+bool ToxcoreTransport::isConnected()
+{
+    TOX_CONNECTION status = tox_self_get_connection_status(mTox);
+    return (status != TOX_CONNECTION_NONE);
+}
+
+ToxKey ToxcoreTransport::getAddress()
+{
+    // Retrieve the binary address
+    uint8_t addressBin[TOX_ADDRESS_SIZE];
+    tox_self_get_address(mTox, addressBin);
+
+    return ToxKey(ToxKey::Address, addressBin, sizeof(addressBin));
+}
+
+std::string ToxcoreTransport::getName()
+{
+    // Retrieve the name in utf8
+    std::vector<uint8_t> rawName(tox_self_get_name_size(mTox), 0);
+    tox_self_get_name(mTox, &rawName[0]);
+
+    // Return as a string
+    return std::string(rawName.begin(), rawName.end());
+}
+
+bool ToxcoreTransport::setName(const std::string& name)
+{
+    // Convert to uint8_t format
+    std::vector<uint8_t> rawName(name.begin(), name.end());
+
+    // Set name
+    return tox_self_set_name(mTox, &rawName[0], rawName.size(), nullptr);
+}
+
+std::string ToxcoreTransport::getStatusMessage()
+{
+    // Retrieve the message
+    std::vector<uint8_t> rawMessage(tox_self_get_status_message_size(mTox));
+    tox_self_get_status_message(mTox, &rawMessage[0]);
+
+    // Return as a string
+    return std::string(rawMessage.begin(), rawMessage.end());
+}
+
+bool ToxcoreTransport::setStatusMessage(const std::string& message)
+{
+    // Convert to uint8_t format
+    std::vector<uint8_t> rawMessage(message.begin(), message.end());
+
+    // Set message
+    return tox_self_set_status_message(mTox, &rawMessage[0], rawMessage.size(),
+                                       nullptr);
+}
+
+uint32_t ToxcoreTransport::addFriend(const ToxKey& address,
+                                     const std::string& message)
+{
+    // Setup
+    assert (address.getType() == ToxKey::Address);
+    std::vector<uint8_t> rawMessage(message.begin(), message.end());
+
+    // Add friend
+    return tox_friend_add(mTox, address.data(), &rawMessage[0],
+                          rawMessage.size(), nullptr);
+}
+
+uint32_t ToxcoreTransport::addFriendNoRequest(const ToxKey& publicKey)
+{
+    // Add friend
+    assert(publicKey.getType() == ToxKey::Public);
+    return tox_friend_add_norequest(mTox, publicKey.data(), nullptr);
+}
+
+void ToxcoreTransport::getFriendList(std::vector<uint32_t>& aliases)
+{
+    aliases.resize(tox_self_get_friend_list_size(mTox));
+    if (!aliases.empty())
+    {
+        tox_self_get_friend_list(mTox, &aliases[0]);
+    }
+}
+
+uint32_t ToxcoreTransport::getFriendByPublicKey(const ToxKey& publicKey)
+{
+    // Retrieve alias
+    assert(publicKey.getType() == ToxKey::Public);
+    return tox_friend_by_public_key(mTox, publicKey.data(),
+                                    nullptr);
+}
+
+bool ToxcoreTransport::friendExists(uint32_t alias)
+{
+    return tox_friend_exists(mTox, alias);
+}
+
+bool ToxcoreTransport::deleteFriend(uint32_t alias)
+{
+    // They must be DESTROYED!!!
+    return tox_friend_delete(mTox, alias, nullptr);
+}
+
+ToxKey ToxcoreTransport::getFriendPublicKey(uint32_t alias)
+{
+    // Retrieve key
+    uint8_t rawKey[TOX_PUBLIC_KEY_SIZE] = {};
+    tox_friend_get_public_key(mTox, alias, rawKey, nullptr);
+
+    return ToxKey(ToxKey::Public, rawKey, sizeof(rawKey));
+}
+
+bool ToxcoreTransport::isFriendConnected(uint32_t alias)
+{
+    // Check if the friend is online.
+    TOX_CONNECTION status;
+    status = tox_friend_get_connection_status(mTox, alias, nullptr);
+
+    return (status != TOX_CONNECTION_NONE);
+}
+
+uint32_t ToxcoreTransport::sendMessage(uint32_t friendAlias,
+                                       std::string_view message,
+                                       bool actionType)
+{
+    // Select message type
+    TOX_MESSAGE_TYPE messageType = (actionType) ? TOX_MESSAGE_TYPE_ACTION :
+                                                  TOX_MESSAGE_TYPE_NORMAL;
+
+    // Send the message straight from the caller's buffer
+    return tox_friend_send_message(mTox, friendAlias, messageType,
+                                   (const uint8_t*)message.data(),
+                                   message.size(), nullptr);
+}
+
+bool ToxcoreTransport::sendLosslessPacket(uint32_t friendAlias,
+                                          std::string_view packet)
+{
+    return tox_friend_send_lossless_packet(mTox, friendAlias,
+                                           (const uint8_t*)packet.data(),
+                                           packet.size(), nullptr);
+}
+
+uint32_t ToxcoreTransport::getIterationInterval()
+{
+    return tox_iteration_interval(mTox);
+}
+
+void ToxcoreTransport::iterate()
+{
+#ifdef USE_TOX_EVENTS
+    // Null when nothing happened
+    Tox_Events* events = tox_events_iterate(mTox, false, nullptr);
+    if (!events)
+    {
+        return;
+    }
+
+    collectEvents(events);
+    if (getWrapper())
+    {
+        getWrapper()->dispatchEvents(mBatch);
+    }
+
+    // The batch refers to text owned by the events
+    mBatch.clear();
+    tox_events_free(events);
+#else
+    // Calls the hooks below
+    BasicToxWrapper::iterate();
+#endif
+}
+
+#ifndef USE_TOX_EVENTS
+void ToxcoreTransport::onConnectionStatusChanged(bool online)
+{
+    if (getWrapper())
+    {
+        // Tox saves the nodes it connected through
+        getWrapper()->markSaveDataChanged();
+        getWrapper()->onConnectionStatusChanged(online);
+    }
+}
+
+void ToxcoreTransport::onFriendRequestRecieved(const ToxKey& publicKey,
+                                               std::string_view message)
+{
+    if (getWrapper())
+    {
+        getWrapper()->onFriendRequestRecieved(publicKey, std::string(message));
+    }
+}
+
+void ToxcoreTransport::onFriendNameChanged(uint32_t alias,
+                                           std::string_view name)
+{
+    if (getWrapper())
+    {
+        getWrapper()->markSaveDataChanged();
+        getWrapper()->onFriendNameChanged(alias, std::string(name));
+    }
+}
+
+void ToxcoreTransport::onFriendStatusMessageChanged(uint32_t alias,
+                                                    std::string_view message)
+{
+    if (getWrapper())
+    {
+        getWrapper()->markSaveDataChanged();
+        getWrapper()->onFriendStatusMessageChanged(alias,
+                                                   std::string(message));
+    }
+}
+
+void ToxcoreTransport::onFriendConnectionStatusChanged(uint32_t alias,
+                                                       bool online)
+{
+    if (getWrapper())
+    {
+        getWrapper()->friendConnectionStatusChanged(alias, online);
+    }
+}
+
+void ToxcoreTransport::onMessageSentSuccess(uint32_t friendAlias,
+                                            uint32_t messageId)
+{
+    if (getWrapper())
+    {
+        getWrapper()->onMessageSentSuccess(friendAlias, messageId);
+    }
+}
+
+void ToxcoreTransport::onMessageRecieved(uint32_t friendAlias,
+                                         std::string_view message,
+                                         bool actionType)
+{
+    if (getWrapper())
+    {
+        getWrapper()->onMessageRecieved(friendAlias, message, actionType);
+    }
+}
+
+void ToxcoreTransport::onLosslessPacketRecieved(uint32_t friendAlias,
+                                                std::string_view packet)
+{
+    if (getWrapper())
+    {
+        getWrapper()->onLosslessPacketRecieved(friendAlias, packet);
+    }
+}
+#endif
+
+#ifdef USE_TOX_EVENTS
+void ToxcoreTransport::collectEvents(const Tox_Events* events)
+{
+    uint32_t count = tox_events_get_size(events);
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        const Tox_Event* event = tox_events_get(events, i);
+        switch (tox_event_get_type(event))
+        {
+        case TOX_EVENT_SELF_CONNECTION_STATUS:
+        {
+            const Tox_Event_Self_Connection_Status* e =
+                tox_event_get_self_connection_status(event);
+            mBatch.selfConnectionChanged = true;
+            mBatch.selfOnline =
+                tox_event_self_connection_status_get_connection_status(e) !=
+                TOX_CONNECTION_NONE;
+            break;
+        }
+
+        case TOX_EVENT_FRIEND_REQUEST:
+        {
+            const Tox_Event_Friend_Request* e =
+                tox_event_get_friend_request(event);
+            ToxEventBatch::FriendRequest request;
+            request.publicKey = ToxKey(
+                ToxKey::Public, tox_event_friend_request_get_public_key(e),
+                TOX_PUBLIC_KEY_SIZE);
+            request.message = std::string_view(
+                (const char*)tox_event_friend_request_get_message(e),
+                tox_event_friend_request_get_message_length(e));
+            mBatch.friendRequests.push_back(request);
+            break;
+        }
+
+        case TOX_EVENT_FRIEND_NAME:
+        {
+            const Tox_Event_Friend_Name* e = tox_event_get_friend_name(event);
+            ToxEventBatch::TextChange change;
+            change.alias = tox_event_friend_name_get_friend_number(e);
+            change.text = std::string_view(
+                (const char*)tox_event_friend_name_get_name(e),
+                tox_event_friend_name_get_name_length(e));
+            mBatch.nameChanges.push_back(change);
+            break;
+        }
+
+        case TOX_EVENT_FRIEND_STATUS_MESSAGE:
+        {
+            const Tox_Event_Friend_Status_Message* e =
+                tox_event_get_friend_status_message(event);
+            ToxEventBatch::TextChange change;
+            change.alias = tox_event_friend_status_message_get_friend_number(e);
+            change.text = std::string_view(
+                (const char*)tox_event_friend_status_message_get_message(e),
+                tox_event_friend_status_message_get_message_length(e));
+            mBatch.statusMessageChanges.push_back(change);
+            break;
+        }
+
+        case TOX_EVENT_FRIEND_CONNECTION_STATUS:
+        {
+            const Tox_Event_Friend_Connection_Status* e =
+                tox_event_get_friend_connection_status(event);
+            ToxEventBatch::ConnectionChange change;
+            change.alias =
+                tox_event_friend_connection_status_get_friend_number(e);
+            change.online =
+                tox_event_friend_connection_status_get_connection_status(e) !=
+                TOX_CONNECTION_NONE;
+            mBatch.connectionChanges.push_back(change);
+            break;
+        }
+
+        case TOX_EVENT_FRIEND_READ_RECEIPT:
+        {
+            const Tox_Event_Friend_Read_Receipt* e =
+                tox_event_get_friend_read_receipt(event);
+            ToxEventBatch::Reciept reciept;
+            reciept.alias = tox_event_friend_read_receipt_get_friend_number(e);
+            reciept.messageId = tox_event_friend_read_receipt_get_message_id(e);
+            mBatch.reciepts.push_back(reciept);
+            break;
+        }
+
+        case TOX_EVENT_FRIEND_MESSAGE:
+        {
+            const Tox_Event_Friend_Message* e =
+                tox_event_get_friend_message(event);
+            ToxEventBatch::Message message;
+            message.alias = tox_event_friend_message_get_friend_number(e);
+            message.message = std::string_view(
+                (const char*)tox_event_friend_message_get_message(e),
+                tox_event_friend_message_get_message_length(e));
+            message.actionType =
+                tox_event_friend_message_get_type(e) == TOX_MESSAGE_TYPE_ACTION;
+            mBatch.messages.push_back(message);
+            break;
+        }
+
+        case TOX_EVENT_FRIEND_LOSSLESS_PACKET:
+        {
+            const Tox_Event_Friend_Lossless_Packet* e =
+                tox_event_get_friend_lossless_packet(event);
+            ToxEventBatch::Packet packet;
+            packet.alias =
+                tox_event_friend_lossless_packet_get_friend_number(e);
+            packet.packet = std::string_view(
+                (const char*)tox_event_friend_lossless_packet_get_data(e),
+                tox_event_friend_lossless_packet_get_data_length(e));
+            mBatch.packets.push_back(packet);
+            break;
+        }
+
+        default:
+            // Not used by the wrapper
+            break;
+        }
+    }
+}
+#endif
@@ -0,0 +1,106 @@
+#ifndef TOXCORETRANSPORT_H
+#define TOXCORETRANSPORT_H
+
+#include "basictoxwrapper.h"
+#include "eventbatch.h"
+#include "transport.h"
+
+#ifdef USE_TOX_EVENTS
+#include <tox/tox_events.h>
+#endif
+
+/*! @brief A transport backed by a toxcore instance on the tox network.
+ *         Callbacks reach it through BasicToxWrapper and are forwarded to
+ *         the virtual hooks of its ToxWrapper.
+ *
+ *  When built with USE_TOX_EVENTS, each iteration collects toxcore's events
+ *  with tox_events_iterate() and hands them to the wrapper as one batch,
+ *  instead of calling the wrapper from a callback per event.
+ */
+class ToxcoreTransport : public ToxTransport,
+                         private BasicToxWrapper<ToxcoreTransport>
+{
+public:
+
+    /*! @brief Initializes a tox instance.
+     *  @param options The options to be set when creating the tox instance.
+     */
+    ToxcoreTransport(const ToxOptionsWrapper& options);
+
+    /*! @brief Destroys the associated tox instance.
+     */
+    ~ToxcoreTransport() override;
+
+    bool bootstrapNode(const std::string& address, uint16_t port,
+                       const ToxKey& publicKey) override;
+
+    void getSaveData(std::vector<uint8_t>& data) override;
+
+    bool isConnected() override;
+
+    ToxKey getAddress() override;
+
+    std::string getName() override;
+
+    bool setName(const std::string& name) override;
+
+    std::string getStatusMessage() override;
+
+    bool setStatusMessage(const std::string& message) override;
+
+    uint32_t addFriend(const ToxKey& address,
+                       const std::string& message) override;
+
+    uint32_t addFriendNoRequest(const ToxKey& publicKey) override;
+
+    void getFriendList(std::vector<uint32_t>& aliases) override;
+
+    uint32_t getFriendByPublicKey(const ToxKey& publicKey) override;
+
+    bool friendExists(uint32_t alias) override;
+
+    bool deleteFriend(uint32_t alias) override;
+
+    ToxKey getFriendPublicKey(uint32_t alias) override;
+
+    bool isFriendConnected(uint32_t alias) override;
+
+    uint32_t sendMessage(uint32_t friendAlias, std::string_view message,
+                         bool actionType) override;
+
+    bool sendLosslessPacket(uint32_t friendAlias,
+                            std::string_view packet) override;
+
+    uint32_t getIterationInterval() override;
+
+    void iterate() override;
+
+private:
+
+#ifndef USE_TOX_EVENTS
+    // Called by BasicToxWrapper, see there
+    void onConnectionStatusChanged(bool online);
+    void onFriendRequestRecieved(const ToxKey& publicKey,
+                                 std::string_view message);
+    void onFriendNameChanged(uint32_t alias, std::string_view name);
+    void onFriendStatusMessageChanged(uint32_t alias,
+                                      std::string_view message);
+    void onFriendConnectionStatusChanged(uint32_t alias, bool online);
+    void onMessageSentSuccess(uint32_t friendAlias, uint32_t messageId);
+    void onMessageRecieved(uint32_t friendAlias, std::string_view message,
+                           bool actionType);
+    void onLosslessPacketRecieved(uint32_t friendAlias,
+                                  std::string_view packet);
+#endif
+
+#ifdef USE_TOX_EVENTS
+    void collectEvents(const Tox_Events* events);
+
+    // Reused between iterations
+    ToxEventBatch mBatch;
+#endif
+
+    friend class BasicToxWrapper<ToxcoreTransport>;
+};
+
+#endif
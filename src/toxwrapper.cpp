@@ -2,168 +2,15 @@
 
 #include <algorithm>
 #include <cassert>
-#include <chrono>
-#include <map>
-#include <thread>
-#include <sodium.h>
+#include <cstring>
+#include <iostream>
 #include <vector>
-
-
-// Utility functions
-
-std::string convertToHex(const uint8_t* binary, size_t length)
-{
-    // Setup
-    std::string hex(length * 2 + 1, '0');
-
-    // Convert. sodium_bin2hex returns nullptr on failure.
-    assert(sodium_bin2hex(&hex[0], hex.size(), &binary[0], length));
-    hex.pop_back(); // remove null character
-
-    return hex;
-}
-
-std::vector<uint8_t> convertToBinary(const std::string& hex)
-{
-    // Setup
-    std::vector<uint8_t> binary(hex.size() / 2, 0);
-
-    // Convert. sodium_hex2bin returns 0 on success.
-    size_t hexSize = hex.size() - (hex.size() % 2);
-    assert(!sodium_hex2bin(&binary[0], binary.size(), &hex[0], hexSize,
-                           nullptr, nullptr, nullptr));
-
-    return binary;
-}
-
-
-/*! @brief Used to map callbacks to specific instances.
- */
-class ToxWrapperRegistry
-{
-public:
-    /*! @brief Registers a specific wrapper tied to a specific instance.
-     *  @param instance The Tox instance.
-     *  @param wrapper The wrapper.
-     */
-    void registerWrapper(Tox* instance, ToxWrapper* wrapper);
-
-    /*! @brief Unregisters the wrapper tied to a specific instance.
-     *  @param instance The Tox instance to be unmapped.
-     */
-    void unregisterWrapper(Tox* instance);
-
-    /*! @brief Returns the wrapper tied to a specific instance. Assumes it
-     *         exists.
-     *  @param instance The Tox instance the wrapper has been tied to.
-     */
-    ToxWrapper* lookup(Tox* instance);
-
-    /*! @brief Returns the global instance of the ToxWrapperRegistry class
-     */
-    static ToxWrapperRegistry& get();
-
-private:
-    ToxWrapperRegistry() = default;
-    ~ToxWrapperRegistry() = default;
-
-    std::map<Tox*, ToxWrapper*> mRegistrations;
-};
-
-
-// A bunch of callbacks
-
-void self_connection_status_changed(Tox* tox, TOX_CONNECTION status,
-                                    void* user_data)
-{
-    bool online = (status != TOX_CONNECTION_NONE);
-    ToxWrapperRegistry::get().lookup(tox)->onConnectionStatusChanged(online);
-}
-
-void friend_request(Tox* tox, const uint8_t* publicKeyBin,
-                    const uint8_t* rawMessage, size_t length, void* userData)
-{
-    ToxKey publicKey(ToxKey::Public, std::vector<uint8_t>(publicKeyBin,
-                     publicKeyBin+length));
-    std::string message(rawMessage, rawMessage+length);
-    ToxWrapperRegistry::get().lookup(tox)->onFriendRequestRecieved(publicKey,
-                                                                   message);
-}
-
-void friend_name_changed(Tox* tox, uint32_t alias, const uint8_t* rawName,
-                         size_t length, void* user_data)
-{
-    std::string name(rawName, rawName+length);
-    ToxWrapperRegistry::get().lookup(tox)->onFriendNameChanged(alias, name);
-}
-
-void friend_status_message_changed(Tox* tox, uint32_t alias,
-                                   const uint8_t* rawMessage, size_t length,
-                                   void *userData)
-{
-    std::string message(rawMessage, rawMessage+length);
-    ToxWrapperRegistry::get().lookup(tox)->
-        onFriendStatusMessageChanged(alias, message);
-}
-
-void friend_connection_status_changed(Tox* tox, uint32_t alias,
-                                      TOX_CONNECTION status, void* userData)
-{
-    bool online = (status != TOX_CONNECTION_NONE);
-    ToxWrapperRegistry::get().lookup(tox)->
-        onFriendConnectionStatusChanged(alias, online);
-}
-
-void friend_read_reciept(Tox* tox, uint32_t alias, uint32_t messageId,
-                                  void *user_data)
-{
-    ToxWrapperRegistry::get().lookup(tox)->onMessageSentSuccess(alias,
-                                                                messageId);
-}
-
-void friend_message(Tox* tox, uint32_t alias, TOX_MESSAGE_TYPE type,
-                    const uint8_t* rawMessage, size_t length, void* userData)
-{
-    std::string message(rawMessage, rawMessage+length);
-    bool actionType = (type == TOX_MESSAGE_TYPE_ACTION);
-    ToxWrapperRegistry::get().lookup(tox)->onMessageRecieved(alias, message,
-                                                             actionType);
-}
-
-
-// The ToxWrapperRegistry implementation
-
-void ToxWrapperRegistry::registerWrapper(Tox* tox, ToxWrapper* wrapper)
-{
-    // Register
-    mRegistrations[tox] = wrapper;
-
-    // Add callbacks
-    tox_callback_self_connection_status(tox, self_connection_status_changed);
-    tox_callback_friend_name(tox, friend_name_changed);
-    tox_callback_friend_status_message(tox, friend_status_message_changed);
-    tox_callback_friend_connection_status(tox,
-                                          friend_connection_status_changed);
-    tox_callback_friend_read_receipt(tox, friend_read_reciept);
-    tox_callback_friend_message(tox, friend_message);
-    tox_callback_friend_request(tox, friend_request);
-}
-
-void ToxWrapperRegistry::unregisterWrapper(Tox* instance)
-{
-    mRegistrations.erase(instance);
-}
-
-ToxWrapper* ToxWrapperRegistry::lookup(Tox* instance)
-{
-    return mRegistrations[instance];
-}
-
-ToxWrapperRegistry& ToxWrapperRegistry::get()
-{
-    static ToxWrapperRegistry instance;
-    return instance;
-}
+#include "commandqueue.h"
+#include "eventbatch.h"
+#include "frienddirectory.h"
+#include "hex.h"
+#include "savedatawriter.h"
+#include "toxcoretransport.h"
 
 
 // The ToxOptionsWrapper implementation
@@ -248,6 +95,15 @@ void ToxOptionsWrapper::loadSaveData(std::istream& data)
     tox_options_set_savedata_data(mOptions, &mSaveData[0], mSaveData.size());
 }
 
+void ToxOptionsWrapper::loadSaveData(std::string_view data)
+{
+    mSaveData.clear();
+    tox_options_set_savedata_type(mOptions, TOX_SAVEDATA_TYPE_TOX_SAVE);
+    tox_options_set_savedata_length(mOptions, data.size());
+    tox_options_set_savedata_data(mOptions, (const uint8_t*)data.data(),
+                                  data.size());
+}
+
 
 // The ToxKey implementation
 
@@ -275,104 +131,153 @@ size_t ToxKey::InvalidSize::getExpectedSize() const
     return mExpected;
 }
 
+const size_t ToxKey::MaxSize;
+
 ToxKey::ToxKey()
     : mType(None)
+    , mSize(0)
 {
+    mBin.fill(0);
 }
 
-ToxKey::ToxKey(Type type, const std::string& hex)
-    : mType(type)
-    , mHex(hex)
-    , mBin(convertToBinary(hex))
+ToxKey::ToxKey(Type type, std::string_view hex)
+    : ToxKey()
 {
-    std::transform(mHex.begin(), mHex.end(), mHex.begin(), ::tolower);
-    validate();
+    size_t given = hex.size() / 2;
+    size_t expected = (type == None) ? std::min(given, MaxSize) :
+                                       getSize(type);
+    if (hex.size() != expected * 2)
+    {
+        throw InvalidSize(given, expected);
+    }
+
+    bool converted = convertToBinary(hex, mBin.data(), expected);
+    assert(converted);
+    (void)converted;
+
+    mType = type;
+    mSize = expected;
 }
 
 ToxKey::ToxKey(Type type, const std::vector<uint8_t>& bin)
-    : mType(type)
-    , mHex(convertToHex(bin.data(), bin.size()))
-    , mBin(bin)
+    : ToxKey(type, bin.data(), bin.size())
 {
-    std::transform(mHex.begin(), mHex.end(), mHex.begin(), ::tolower);
-    validate();
 }
 
-ToxKey::Type ToxKey::getType() const
+ToxKey::ToxKey(Type type, const uint8_t* bin, size_t length)
+    : ToxKey()
 {
-    return mType;
+    assign(type, bin, length);
 }
 
-const std::string& ToxKey::getHex() const
+ToxKey::Type ToxKey::getType() const
 {
-    return mHex;
+    return (Type)mType;
 }
 
-const std::vector<uint8_t>& ToxKey::getBin() const
+std::string ToxKey::getHex() const
 {
-    return mBin;
+    return convertToHex(mBin.data(), mSize);
 }
 
-bool ToxKey::operator<(const ToxKey& other) const
+const uint8_t* ToxKey::data() const
 {
-    return (*this).mBin < other.mBin;
+    return mBin.data();
 }
 
-void ToxKey::validate()
+size_t ToxKey::size() const
 {
-    size_t given = mBin.size();
-    size_t expected = 0;
+    return mSize;
+}
 
-    switch (mType)
+size_t ToxKey::hash() const
+{
+    // Keys are mostly random bytes already, so mixing in a word at a time is
+    // plenty. Unused bytes are always zero.
+    uint64_t hash = mSize;
+    for (size_t i = 0; i + sizeof(uint64_t) <= MaxSize; i += sizeof(uint64_t))
     {
-    case Address:
-        expected = tox_address_size();
-        break;
-    case Public:
-        expected = tox_public_key_size();
-        break;
-    case Secret:
-        expected = tox_secret_key_size();
-        break;
-    case None:
-        expected = given;
+        uint64_t word;
+        std::memcpy(&word, &mBin[i], sizeof(word));
+        hash = (hash ^ word) * 0x9e3779b97f4a7c15ULL;
     }
 
-    if (expected > given)
-    {
-        mType = None;
-        throw InvalidSize(given, expected);
-    }
-    else
+    const size_t tail = MaxSize % sizeof(uint64_t);
+    uint64_t word = 0;
+    std::memcpy(&word, &mBin[MaxSize - tail], tail);
+    hash = (hash ^ word) * 0x9e3779b97f4a7c15ULL;
+
+    return (size_t)(hash ^ (hash >> 32));
+}
+
+bool ToxKey::operator<(const ToxKey& other) const
+{
+    int order = std::memcmp(mBin.data(), other.mBin.data(),
+                            std::min(mSize, other.mSize));
+    return order < 0 || (order == 0 && mSize < other.mSize);
+}
+
+bool ToxKey::operator==(const ToxKey& other) const
+{
+    // Unused bytes are always zero, so the whole array can be compared
+    return mSize == other.mSize && mBin == other.mBin;
+}
+
+bool ToxKey::operator!=(const ToxKey& other) const
+{
+    return !(*this == other);
+}
+
+void ToxKey::assign(Type type, const uint8_t* bin, size_t length)
+{
+    size_t expected = (type == None) ? std::min(length, MaxSize) :
+                                       getSize(type);
+    if (expected != length)
     {
-        // Trim off extra characters
-        mBin.resize(expected);
-        mHex.resize(expected * 2);
+        throw InvalidSize(length, expected);
     }
+
+    std::copy(bin, bin + expected, mBin.begin());
+    mType = type;
+    mSize = expected;
 }
 
 
 // The ToxWrapper implementation
 
 ToxWrapper::ToxWrapper(const ToxOptionsWrapper& options)
-    : mTox(nullptr)
+    : ToxWrapper(std::unique_ptr<ToxTransport>(new ToxcoreTransport(options)))
+{
+}
+
+ToxWrapper::ToxWrapper(std::unique_ptr<ToxTransport> transport)
+    : mTransport(std::move(transport))
+    , mDirectory(new FriendDirectory())
+    , mCommands(new CommandQueue())
+    , mSaveChanged(false)
+    , mSaveInterval(60 * 1000)
+    , mNextSave(0)
     , mStop(false)
+    , mImmediateFlush(false)
+    , mFlushPending(false)
 {
-    // Create tox instance
-    mTox = tox_new(options.mOptions, nullptr);
-    assert(mTox);
+    assert(mTransport);
+    mTransport->setWrapper(this);
 
-    // Register
-    ToxWrapperRegistry::get().registerWrapper(mTox, this);
+    // Copy the friend list, including any loaded from save data
+    std::vector<uint32_t> aliases;
+    mTransport->getFriendList(aliases);
+    for (auto it = aliases.begin(); it != aliases.end(); ++it)
+    {
+        mDirectory->add(*it, mTransport->getFriendPublicKey(*it));
+        mDirectory->setOnline(*it, mTransport->isFriendConnected(*it));
+    }
 }
 
 ToxWrapper::~ToxWrapper()
 {
-    // Destroy tox instance
-    tox_kill(mTox);
-
-    // Unregister
-    ToxWrapperRegistry::get().unregisterWrapper(mTox);
+    // Destroyed by the transport
+    mTransport->setWrapper(nullptr);
 }
 
 uint32_t ToxWrapper::getPublicKeySize() const
@@ -433,148 +338,181 @@ uint32_t ToxWrapper::getMaxFileNameSize() const
 bool ToxWrapper::bootstrapNode(const std::string& address, uint16_t port,
                                const ToxKey& publicKey)
 {
-    // Attempt to bootstrap the node
-    assert(publicKey.getType() == ToxKey::Public);
-    return tox_bootstrap(mTox, address.c_str(), port,
-                         publicKey.getBin().data(), nullptr);
+    return mTransport->bootstrapNode(address, port, publicKey);
 }
 
 void ToxWrapper::save(std::ostream& str)
 {
-    // Read in data from tox
-    size_t length = tox_get_savedata_size(mTox);
-
+    // Read in data from the transport
     std::vector<uint8_t> data;
-    data.resize(length, 0);
-    tox_get_savedata(mTox, &data[0]);
+    getSaveData(data);
 
     // Write to stream
-    str.write((char*)&data[0], length);
+    str.write((char*)data.data(), data.size());
+}
+
+void ToxWrapper::getSaveData(std::vector<uint8_t>& data)
+{
+    mTransport->getSaveData(data);
+}
+
+void ToxWrapper::setSaveFile(const std::string& path)
+{
+    mSaveWriter.reset(new SaveDataWriter(path));
+}
+
+void ToxWrapper::setSaveInterval(uint64_t interval)
+{
+    mSaveInterval = interval;
+}
+
+void ToxWrapper::markSaveDataChanged()
+{
+    mSaveChanged = true;
+}
+
+void ToxWrapper::writeSaveData(std::vector<uint8_t>&& data)
+{
+    if (mSaveWriter)
+    {
+        mSaveWriter->write(std::move(data));
+        mSaveChanged = false;
+        mNextSave = getTime() + mSaveInterval;
+    }
+}
+
+bool ToxWrapper::flushSaveData()
+{
+    if (!mSaveWriter)
+    {
+        return false;
+    }
+
+    if (mSaveChanged)
+    {
+        std::vector<uint8_t> data;
+        getSaveData(data);
+        writeSaveData(std::move(data));
+    }
+    return mSaveWriter->flush();
 }
 
 bool ToxWrapper::isConnected()
 {
-    TOX_CONNECTION status = tox_self_get_connection_status(mTox);
-    return (status != TOX_CONNECTION_NONE);
+    return mTransport->isConnected();
 }
 
 ToxKey ToxWrapper::getAddress()
 {
-    // Retrieve the binary address
-    std::vector<uint8_t> addressBin(tox_address_size(), 0);
-    tox_self_get_address(mTox, &addressBin[0]);
-
-    return ToxKey(ToxKey::Address, addressBin);
+    return mTransport->getAddress();
 }
 
 std::string ToxWrapper::getName()
 {
-    // Retrieve the name in utf8
-    std::vector<uint8_t> rawName(tox_self_get_name_size(mTox), 0);
-    tox_self_get_name(mTox, &rawName[0]);
-
-    // Return as a string
-    return std::string(rawName.begin(), rawName.end());
+    return mTransport->getName();
 }
 
 bool ToxWrapper::setName(const std::string& name)
 {
-    // Convert to uint8_t format
-    std::vector<uint8_t> rawName(name.begin(), name.end());
-
-    // Set name
-    return tox_self_set_name(mTox, &rawName[0], rawName.size(), nullptr);
+    bool success = mTransport->setName(name);
+    mSaveChanged |= success;
+    return success;
 }
 
 std::string ToxWrapper::getStatusMessage()
 {
-    // Retrieve the message
-    std::vector<uint8_t> rawMessage(tox_self_get_status_message_size(mTox));
-    tox_self_get_status_message(mTox, &rawMessage[0]);
-
-    // Return as a string
-    return std::string(rawMessage.begin(), rawMessage.end());
+    return mTransport->getStatusMessage();
 }
 
 bool ToxWrapper::setStatusMessage(const std::string& message)
 {
-    // Convert to uint8_t format
-    std::vector<uint8_t> rawMessage(message.begin(), message.end());
-
-    // Set message
-    return tox_self_set_status_message(mTox, &rawMessage[0], rawMessage.size(),
-                                       nullptr);
+    bool success = mTransport->setStatusMessage(message);
+    mSaveChanged |= success;
+    return success;
 }
 
 uint32_t ToxWrapper::addFriend(const ToxKey& address,
                                const std::string& message)
 {
-    // Setup
-    assert (address.getType() == ToxKey::Address);
-    std::vector<uint8_t> rawMessage(message.begin(), message.end());
-
-    // Add friend
-    return tox_friend_add(mTox, address.getBin().data(), &rawMessage[0],
-                          rawMessage.size(), nullptr);
+    uint32_t alias = mTransport->addFriend(address, message);
+    if (alias != UINT32_MAX)
+    {
+        // The public key is the start of the address
+        mDirectory->add(alias, ToxKey(ToxKey::Public, address.data(),
+                                      ToxKey::getSize(ToxKey::Public)));
+        mSaveChanged = true;
+    }
+    return alias;
 }
 
 uint32_t ToxWrapper::addFriendNoRequest(const ToxKey& publicKey)
 {
-    // Add friend
-    assert(publicKey.getType() == ToxKey::Public);
-    return tox_friend_add_norequest(mTox, publicKey.getBin().data(), nullptr);
+    uint32_t alias = mTransport->addFriendNoRequest(publicKey);
+    if (alias != UINT32_MAX)
+    {
+        mDirectory->add(alias, publicKey);
+        mSaveChanged = true;
+    }
+    return alias;
+}
+
+void ToxWrapper::reserveFriends(size_t count)
+{
+    mDirectory->reserve(mDirectory->size() + count);
 }
 
 uint32_t ToxWrapper::getFriendByPublicKey(const ToxKey& publicKey)
 {
-    // Retrieve alias
-    assert(publicKey.getType() == ToxKey::Public);
-    return tox_friend_by_public_key(mTox, publicKey.getBin().data(),
-                                    nullptr);
+    return mDirectory->find(publicKey);
 }
 
 bool ToxWrapper::friendExists(uint32_t alias)
 {
-    return tox_friend_exists(mTox, alias);
+    return mDirectory->contains(alias);
 }
 
-bool ToxWrapper::deleteFriend(uint32_t alias)
+void ToxWrapper::getFriendList(std::vector<uint32_t>& aliases)
 {
-    // They must be DESTROYED!!!
-    return tox_friend_delete(mTox, alias, nullptr);
+    mTransport->getFriendList(aliases);
 }
 
-ToxKey ToxWrapper::getFriendPublicKey(uint32_t alias)
+bool ToxWrapper::deleteFriend(uint32_t alias)
 {
-    // Retrieve key
-    std::vector<uint8_t> rawKey(tox_public_key_size(), 0);
-    tox_friend_get_public_key(mTox, alias, &rawKey[0], nullptr);
+    if (!mTransport->deleteFriend(alias))
+    {
+        return false;
+    }
 
-    return ToxKey(ToxKey::Public, rawKey);
+    mDirectory->remove(alias);
+    mSaveChanged = true;
+    return true;
 }
 
-bool ToxWrapper::isFriendConnected(uint32_t alias)
+const ToxKey& ToxWrapper::getFriendPublicKey(uint32_t alias)
 {
-    // Check if the friend is online.
-    TOX_CONNECTION status;
-    status = tox_friend_get_connection_status(mTox, alias, nullptr);
-
-    return (status != TOX_CONNECTION_NONE);
+    return mDirectory->getPublicKey(alias);
 }
 
-uint32_t ToxWrapper::sendMessage(uint32_t friendAlias, std::string message,
-                                 bool actionType)
+bool ToxWrapper::isFriendConnected(uint32_t alias)
 {
-    // Select message type
-    TOX_MESSAGE_TYPE messageType = (actionType) ? TOX_MESSAGE_TYPE_ACTION :
-                                                  TOX_MESSAGE_TYPE_NORMAL;
+    return mDirectory->isOnline(alias);
+}
 
-    // Convert message fo uint8_t form
-    std::vector<uint8_t> rawMessage(message.begin(), message.end());
+uint32_t ToxWrapper::sendMessage(uint32_t friendAlias,
+                                 std::string_view message, bool actionType)
+{
+    uint32_t messageId = mTransport->sendMessage(friendAlias, message,
+                                                 actionType);
+    mFlushPending = mImmediateFlush;
+    return messageId;
+}
 
-    // Send the message
-    return tox_friend_send_message(mTox, friendAlias, messageType,
-                                   &rawMessage[0], rawMessage.size(), nullptr);
+bool ToxWrapper::sendLosslessPacket(uint32_t friendAlias,
+                                    std::string_view packet)
+{
+    bool sent = mTransport->sendLosslessPacket(friendAlias, packet);
+    mFlushPending = mImmediateFlush;
+    return sent;
 }
 
 void ToxWrapper::onConnectionStatusChanged(bool online)
@@ -603,8 +541,74 @@ void ToxWrapper::onMessageSentSuccess(uint32_t friendAlias, uint32_t messageId)
 {
 }
 
+void ToxWrapper::friendConnectionStatusChanged(uint32_t alias, bool online)
+{
+    mDirectory->setOnline(alias, online);
+    onFriendConnectionStatusChanged(alias, online);
+}
+
+void ToxWrapper::dispatchEvents(const ToxEventBatch& batch)
+{
+    // Tox saves the nodes it connected through, and friends' names
+    if (batch.selfConnectionChanged || !batch.nameChanges.empty() ||
+        !batch.statusMessageChanges.empty())
+    {
+        markSaveDataChanged();
+    }
+
+    if (batch.selfConnectionChanged)
+    {
+        onConnectionStatusChanged(batch.selfOnline);
+    }
+
+    for (auto it = batch.friendRequests.begin();
+         it != batch.friendRequests.end(); ++it)
+    {
+        onFriendRequestRecieved(it->publicKey, std::string(it->message));
+    }
+
+    for (auto it = batch.nameChanges.begin(); it != batch.nameChanges.end();
+         ++it)
+    {
+        onFriendNameChanged(it->alias, std::string(it->text));
+    }
+
+    for (auto it = batch.statusMessageChanges.begin();
+         it != batch.statusMessageChanges.end(); ++it)
+    {
+        onFriendStatusMessageChanged(it->alias, std::string(it->text));
+    }
+
+    for (auto it = batch.connectionChanges.begin();
+         it != batch.connectionChanges.end(); ++it)
+    {
+        friendConnectionStatusChanged(it->alias, it->online);
+    }
+
+    // Windows are refilled after the update, once every reciept is applied
+    for (auto it = batch.reciepts.begin(); it != batch.reciepts.end(); ++it)
+    {
+        onMessageSentSuccess(it->alias, it->messageId);
+    }
+
+    for (auto it = batch.messages.begin(); it != batch.messages.end(); ++it)
+    {
+        onMessageRecieved(it->alias, it->message, it->actionType);
+    }
+
+    for (auto it = batch.packets.begin(); it != batch.packets.end(); ++it)
+    {
+        onLosslessPacketRecieved(it->alias, it->packet);
+    }
+}
+
 void ToxWrapper::onMessageRecieved(uint32_t friendAlias,
-                                   const std::string& message, bool actionType)
+                                   std::string_view message, bool actionType)
+{
+}
+
+void ToxWrapper::onLosslessPacketRecieved(uint32_t friendAlias,
+                                          std::string_view packet)
 {
 }
 
@@ -612,24 +616,103 @@ void ToxWrapper::onCoreUpdate()
 {
 }
 
+uint64_t ToxWrapper::getNextDeadline()
+{
+    return UINT64_MAX;
+}
+
+uint64_t ToxWrapper::getTime()
+{
+    return mTransport->getClock().now();
+}
+
+void ToxWrapper::setImmediateFlush(bool enable)
+{
+    mImmediateFlush = enable;
+}
+
+bool ToxWrapper::isImmediateFlush() const
+{
+    return mImmediateFlush;
+}
+
+uint64_t ToxWrapper::getWaitTime()
+{
+    if (mFlushPending)
+    {
+        // Get what was just sent onto the network
+        return 0;
+    }
+
+    uint64_t timeout = mTransport->getIterationInterval();
+    if (mImmediateFlush)
+    {
+        uint64_t deadline = getNextDeadline();
+        uint64_t now = getTime();
+        timeout = std::min(timeout, deadline > now ? deadline - now : 0);
+    }
+    return timeout;
+}
+
+int ToxWrapper::getWakeFd() const
+{
+    return mCommands->getFd();
+}
+
+void ToxWrapper::update()
+{
+    mFlushPending = false;
+    mCommands->runAll();
+
+    // Let the transport do its work
+    mTransport->iterate();
+
+    // Callback
+    onCoreUpdate();
+
+    // A failed save is captured again, once the interval since it is up
+    if (!mSaveChanged && mSaveWriter && mSaveWriter->takeFailure())
+    {
+        std::cout << "error: failed to write " << mSaveWriter->getPath()
+                  << std::endl;
+        mSaveChanged = true;
+    }
+
+    // Captured here, but written on the save file's own thread
+    if (mSaveChanged && mSaveWriter && getTime() >= mNextSave)
+    {
+        std::vector<uint8_t> data;
+        getSaveData(data);
+        writeSaveData(std::move(data));
+    }
+}
+
 void ToxWrapper::run()
 {
-    mStop = false;
+    Clock& clock = mTransport->getClock();
+
+    // Not cleared here, so a stop() from a signal that arrives first holds
     while (!mStop)
     {
-        // Wait until the next update is required
-        std::this_thread::sleep_for(
-            std::chrono::milliseconds(tox_iteration_interval(mTox)));
-
-        // Let tox do its work
-        tox_iterate(mTox, nullptr);
+        // Wait until the next update is required or work is posted
+        clock.wait(getWaitTime(), getWakeFd());
+        update();
+    }
 
-        // Callback
-        onCoreUpdate();
+    // Nothing changed is lost on shutdown
+    if (mSaveWriter)
+    {
+        flushSaveData();
     }
 }
 
 void ToxWrapper::stop()
 {
     mStop = true;
+    mCommands->wake();
+}
+
+void ToxWrapper::post(std::function<void()> command)
+{
+    mCommands->push(std::move(command));
 }
@@ -1,12 +1,23 @@
 #ifndef TOXWRAPPER_H
 #define TOXWRAPPER_H
 
+#include <array>
+#include <atomic>
+#include <functional>
 #include <istream>
+#include <memory>
 #include <ostream>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <tox/tox.h>
 
+class CommandQueue;
+class FriendDirectory;
+class SaveDataWriter;
+struct ToxEventBatch;
+class ToxTransport;
+
 /*! @brief Wraps the creation options for a tox instance.
  */
 class ToxOptionsWrapper
@@ -85,17 +96,26 @@ public:
      */
     void loadSaveData(std::istream& data);
 
+    /*! @brief Uses saved information from a previous tox instance without
+     *         copying it.
+     *  @param data The data created using ToxWrapper::save(), which must
+     *              stay valid until the instance is created.
+     */
+    void loadSaveData(std::string_view data);
+
 private:
 
     Tox_Options* mOptions;
     std::string mProxyHost;
     std::vector<uint8_t> mSaveData;
 
-    friend class ToxWrapper;
+    template <typename Derived> friend class BasicToxWrapper;
 };
 
 
-/*! @brief Can be used to store the various types of keys used in tox.
+/*! @brief Can be used to store the various types of keys used in tox. Keys
+ *         are stored inline in a fixed size array, so they can be copied,
+ *         compared and hashed without allocating.
  */
 class ToxKey
 {
@@ -111,6 +131,10 @@ public:
         Secret
     };
 
+    /*! @brief The size of the largest type of key, in bytes.
+     */
+    static const size_t MaxSize = TOX_ADDRESS_SIZE;
+
     /*! @brief Thrown when the key size is invalid for the type.
      */
     class InvalidSize
@@ -147,8 +171,9 @@ public:
     /*! @brief Constructs the key from a hex string.
      *  @param type The type of key.
      *  @param hex The key in hexadecimal.
+     *  @throw InvalidSize if hex isn't exactly the size of the type.
      */
-    ToxKey(Type type, const std::string& hex);
+    ToxKey(Type type, std::string_view hex);
 
     /*! @brief Constructs the key from a byte array.
      *  @param type The type of key.
@@ -156,27 +181,59 @@ public:
      */
     ToxKey(Type type, const std::vector<uint8_t>& bin);
 
+    /*! @brief Constructs the key from raw bytes.
+     *  @param type The type of key.
+     *  @param bin The key in binary.
+     *  @param length The number of bytes at bin.
+     *  @throw InvalidSize if length isn't exactly the size of the type.
+     */
+    ToxKey(Type type, const uint8_t* bin, size_t length);
+
+    /*! @brief Returns the size in bytes of a type of key. Untyped keys may
+     *         hold up to MaxSize bytes.
+     *  @param type The type of key.
+     */
+    static constexpr size_t getSize(Type type)
+    {
+        return type == Address ? TOX_ADDRESS_SIZE :
+               type == Public  ? TOX_PUBLIC_KEY_SIZE :
+               type == Secret  ? TOX_SECRET_KEY_SIZE : MaxSize;
+    }
+
     /*! @brief Retrieves the key type.
      */
     Type getType() const;
 
-    /*! @brief Retrieves the hexadecimal version of the key.
+    /*! @brief Retrieves the hexadecimal version of the key. This is built on
+     *         each call.
      */
-    const std::string& getHex() const;
+    std::string getHex() const;
 
     /*! @brief Retrieves the binary version of the key.
      */
-    const std::vector<uint8_t>& getBin() const;
+    const uint8_t* data() const;
+
+    /*! @brief Retrieves the length of the key in bytes.
+     */
+    size_t size() const;
+
+    /*! @brief Returns a hash of the binary key.
+     */
+    size_t hash() const;
 
     bool operator<(const ToxKey& other) const;
 
+    bool operator==(const ToxKey& other) const;
+
+    bool operator!=(const ToxKey& other) const;
+
 private:
 
-    void validate();
+    void assign(Type type, const uint8_t* bin, size_t length);
 
-    Type mType;
-    std::string mHex;
-    std::vector<uint8_t> mBin;
+    std::array<uint8_t, MaxSize> mBin;
+    uint8_t mType;
+    uint8_t mSize;
 };
 
 namespace std
@@ -188,14 +245,15 @@ namespace std
 
         result_type operator()(argument_type const& key) const
         {
-            return hash<string>{}(key.getHex());
+            return key.hash();
         }
     };
 }
 
 
 /*! @brief Wraps a tox instance. This is based largely off of the tox api, look
- *         there for more documentation.
+ *         there for more documentation. The work is carried out by a
+ *         ToxTransport, which is toxcore unless another is supplied.
  */
 class ToxWrapper
 {
@@ -206,7 +264,12 @@ public:
      */
     ToxWrapper(const ToxOptionsWrapper& options);
 
-    /*! @brief Destroys the associated tox instance.
+    /*! @brief Uses the given transport in place of a tox instance.
+     *  @param transport The transport, must not be null.
+     */
+    explicit ToxWrapper(std::unique_ptr<ToxTransport> transport);
+
+    /*! @brief Destroys the associated transport.
      */
     virtual ~ToxWrapper();
 
@@ -276,6 +339,44 @@ public:
      */
     void save(std::ostream& str);
 
+    /*! @brief Gets the current instance data so it can be recreated later.
+     *  @param data Replaced with the data.
+     */
+    void getSaveData(std::vector<uint8_t>& data);
+
+    /*! @brief Keeps a file of the instance data up to date. Once the data
+     *         has changed it is captured after the next update, at most once
+     *         per save interval, and written out on a thread of its own. It
+     *         is captured once more when run() returns.
+     *  @param path The file, which is replaced whole with each write.
+     */
+    void setSaveFile(const std::string& path);
+
+    /*! @brief Sets the least time between captures for the save file.
+     *         Defaults to 60 seconds.
+     *  @param interval The time in milliseconds.
+     */
+    void setSaveInterval(uint64_t interval);
+
+    /*! @brief Notes that the instance data has changed, so the save file
+     *         needs writing again. Called for every change made through this
+     *         class, and by transports for changes reported by tox.
+     */
+    void markSaveDataChanged();
+
+    /*! @brief Hands data already captured with getSaveData() to the save
+     *         file, as if captured after an update.
+     *  @param data The data, taken from the caller.
+     */
+    void writeSaveData(std::vector<uint8_t>&& data);
+
+    /*! @brief Captures the instance data if it changed since the last
+     *         capture, and waits until the save file has been written. Must
+     *         not be called while the main loop runs on another thread.
+     *  @return False if there is no save file or it could not be written.
+     */
+    bool flushSaveData();
+
 
     /*! @brief Returns whether or not this instance is online.
      *  @return True if connected.
@@ -323,19 +424,30 @@ public:
      */
     uint32_t addFriendNoRequest(const ToxKey& publicKey);
 
-    /*! @brief Returns the alias for a specific friend.
+    /*! @brief Makes room to look up more friends before adding them in bulk.
+     *  @param count The number of friends about to be added.
+     */
+    void reserveFriends(size_t count);
+
+    /*! @brief Returns the alias for a specific friend. Answered from the
+     *         local friend directory.
      *  @param publicKey The public key of the friend.
      *  @return The alias for the friend if succussful, otherwise UINT32_MAX.
      */
     uint32_t getFriendByPublicKey(const ToxKey& publicKey);
 
     /*! @brief Returns whether an alias has been mapped to a friend. Can be used
-     *         for validation.
+     *         for validation. Answered from the local friend directory.
      *  @param alias The alias to check.
      *  @return True if the the friend exists.
      */
     bool friendExists(uint32_t alias);
 
+    /*! @brief Retrieves the aliases of every friend.
+     *  @param aliases Replaced with the aliases.
+     */
+    void getFriendList(std::vector<uint32_t>& aliases);
+
     /*! @brief Removes the friend from the friend list.
      *  @param alias The alias for the friend.
      *  @return True on success.
@@ -343,12 +455,15 @@ public:
     bool deleteFriend(uint32_t alias);
 
 
-    /*! @brief Returns the public key of a specific friend.
+    /*! @brief Returns the public key of a specific friend, or an empty key if
+     *         there is no such friend. Answered from the local friend
+     *         directory.
      *  @param alias The alias for the friend.
      */
-    ToxKey getFriendPublicKey(uint32_t alias);
+    const ToxKey& getFriendPublicKey(uint32_t alias);
 
-    /*! @brief Returns whether or not a specific friend is online.
+    /*! @brief Returns whether or not a specific friend is online, as last
+     *         reported by the connection status callback.
      *  @param alias
      *  @return True if the friend is connected.
      */
@@ -361,9 +476,19 @@ public:
      *  @return The unique message identifier for the given friend. Can be used
      *          to verify the message sent was recieved.
      */
-    uint32_t sendMessage(uint32_t friendAlias, std::string message,
+    uint32_t sendMessage(uint32_t friendAlias, std::string_view message,
                          bool actionType=false);
 
+    /*! @brief Sends a custom lossless packet to a specific friend. Packets
+     *         arrive in order while the friend stays connected, but are not
+     *         acknowledged.
+     *  @param friendAlias The alias for a friend.
+     *  @param packet The packet, starting with a byte from 160 to 191. Must be
+     *                no longer than getMaxCustomPacketSize().
+     *  @return True if the packet was queued for sending.
+     */
+    bool sendLosslessPacket(uint32_t friendAlias, std::string_view packet);
+
 
     /*! @brief Called when the connection status changes.
      *  @param online True if we are online.
@@ -402,31 +527,117 @@ public:
      */
     virtual void onMessageSentSuccess(uint32_t friendAlias, uint32_t messageId);
 
+    /*! @brief Records a change to the connection status of a friend, then
+     *         calls onFriendConnectionStatusChanged(). Called by transports.
+     *  @param alias The alias for the friend.
+     *  @param online True if the friend is online.
+     */
+    void friendConnectionStatusChanged(uint32_t alias, bool online);
+
+    /*! @brief Delivers a batch of events to the hooks a kind at a time:
+     *         connection changes first, then every reciept, then every
+     *         message and then every packet. Called by transports that
+     *         collect events per iteration.
+     *  @param batch The events.
+     */
+    void dispatchEvents(const ToxEventBatch& batch);
+
     /*! @brief Called when a message from a friend is recieved.
      *  @param friendAlias The alias for the friend.
-     *  @param message The message recieved.
+     *  @param message The message recieved. Only valid until this returns.
      *  @param actionType Whether or not the message is an action (/me for ex.).
      */
     virtual void onMessageRecieved(uint32_t friendAlias,
-                                   const std::string& message, bool actionType);
+                                   std::string_view message, bool actionType);
+
+    /*! @brief Called when a custom lossless packet from a friend is recieved.
+     *  @param friendAlias The alias for the friend.
+     *  @param packet The packet, including its first byte. Only valid until
+     *                this returns.
+     */
+    virtual void onLosslessPacketRecieved(uint32_t friendAlias,
+                                          std::string_view packet);
 
     /*! @brief Called after each update to the Tox instance.
      */
     virtual void onCoreUpdate();
 
+    /*! @brief Returns when onCoreUpdate() next has work to do, in
+     *         milliseconds from getTime(). Only consulted with immediate flush
+     *         enabled. Defaults to UINT64_MAX, for no deadline.
+     */
+    virtual uint64_t getNextDeadline();
+
 
-    /*! @brief Executes main loop for Tox instance. Currently not thread safe.
+    /*! @brief Returns the current time in milliseconds from the transport's
+     *         monotonic clock.
+     */
+    uint64_t getTime();
+
+
+    /*! @brief Sets whether sent messages are flushed straight away. When
+     *         enabled, the main loop updates again without waiting after any
+     *         message is sent, and otherwise waits no longer than
+     *         getNextDeadline(). Lowers latency at the cost of more updates.
+     *         Disabled by default.
+     *  @param enable True to enable, false to disable.
+     */
+    void setImmediateFlush(bool enable);
+
+    /*! @brief Returns whether sent messages are flushed straight away.
+     */
+    bool isImmediateFlush() const;
+
+    /*! @brief Returns how long to wait before the next call to update(), in
+     *         milliseconds.
+     */
+    uint64_t getWaitTime();
+
+    /*! @brief Returns a file descriptor that becomes readable when commands
+     *         are posted, so that the wait before update() can end early.
+     */
+    int getWakeFd() const;
+
+    /*! @brief Performs one pass of the main loop without waiting: runs posted
+     *         commands, lets the transport do its work and calls
+     *         onCoreUpdate(). Allows instances to be scheduled by something
+     *         other than run(), but only on one thread at a time.
+     */
+    void update();
+
+    /*! @brief Executes main loop for Tox instance. Between updates the loop
+     *         waits for getWaitTime(), waking early to run commands added
+     *         with post(). Nothing but post() and stop() may be called from
+     *         other threads while it runs.
      */
     void run();
 
-    /*! @brief Stops the main loop started by calling run().
+    /*! @brief Stops the main loop started by calling run(), or makes it
+     *         return straight away if it hasn't started yet. Safe to call
+     *         from any thread, and from signal handlers.
      */
     void stop();
 
+    /*! @brief Runs a command on the thread calling run(), before the next
+     *         update. This is how other threads send messages, add friends or
+     *         change settings. Safe to call from any thread, never blocks.
+     *  @param command The command. Commands run in the order they were
+     *                 posted by each thread.
+     */
+    void post(std::function<void()> command);
+
 private:
 
-    Tox* mTox;
-    bool mStop;
+    std::unique_ptr<ToxTransport> mTransport;
+    std::unique_ptr<FriendDirectory> mDirectory;
+    std::unique_ptr<CommandQueue> mCommands;
+    std::unique_ptr<SaveDataWriter> mSaveWriter;
+    bool mSaveChanged;
+    uint64_t mSaveInterval;
+    uint64_t mNextSave;
+    std::atomic<bool> mStop;
+    bool mImmediateFlush;
+    bool mFlushPending;
 };
 
 #endif
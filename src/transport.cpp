@@ -0,0 +1,26 @@
+#include "transport.h"
+
+
+ToxTransport::ToxTransport()
+    : mWrapper(nullptr)
+{
+}
+
+ToxTransport::~ToxTransport()
+{
+}
+
+void ToxTransport::setWrapper(ToxWrapper* wrapper)
+{
+    mWrapper = wrapper;
+}
+
+ToxWrapper* ToxTransport::getWrapper() const
+{
+    return mWrapper;
+}
+
+Clock& ToxTransport::getClock()
+{
+    return SteadyClock::get();
+}
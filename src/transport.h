@@ -0,0 +1,141 @@
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#include <string>
+#include <vector>
+#include "clock.h"
+#include "toxwrapper.h"
+
+/*! @brief The network backend beneath a ToxWrapper. Implementations perform
+ *         the actual friend management and messaging, and report events by
+ *         calling the on* hooks of the wrapper they are attached to.
+ */
+class ToxTransport
+{
+public:
+
+    /*! @brief Constructor.
+     */
+    ToxTransport();
+
+    /*! @brief Destructor.
+     */
+    virtual ~ToxTransport();
+
+
+    // No copy/assignment allowed
+    ToxTransport(const ToxTransport&) = delete;
+    ToxTransport& operator=(const ToxTransport&) = delete;
+
+
+    /*! @brief Sets the wrapper that recieves events. Called by ToxWrapper.
+     *  @param wrapper The wrapper, or nullptr to discard events.
+     */
+    void setWrapper(ToxWrapper* wrapper);
+
+    /*! @brief Returns the wrapper that recieves events.
+     */
+    ToxWrapper* getWrapper() const;
+
+
+    /*! @brief See ToxWrapper::bootstrapNode().
+     */
+    virtual bool bootstrapNode(const std::string& address, uint16_t port,
+                               const ToxKey& publicKey) = 0;
+
+    /*! @brief Retrieves the data needed to recreate this instance.
+     *  @param data Replaced with the saved data.
+     */
+    virtual void getSaveData(std::vector<uint8_t>& data) = 0;
+
+    /*! @brief See ToxWrapper::isConnected().
+     */
+    virtual bool isConnected() = 0;
+
+    /*! @brief See ToxWrapper::getAddress().
+     */
+    virtual ToxKey getAddress() = 0;
+
+    /*! @brief See ToxWrapper::getName().
+     */
+    virtual std::string getName() = 0;
+
+    /*! @brief See ToxWrapper::setName().
+     */
+    virtual bool setName(const std::string& name) = 0;
+
+    /*! @brief See ToxWrapper::getStatusMessage().
+     */
+    virtual std::string getStatusMessage() = 0;
+
+    /*! @brief See ToxWrapper::setStatusMessage().
+     */
+    virtual bool setStatusMessage(const std::string& message) = 0;
+
+    /*! @brief See ToxWrapper::addFriend().
+     */
+    virtual uint32_t addFriend(const ToxKey& address,
+                               const std::string& message) = 0;
+
+    /*! @brief See ToxWrapper::addFriendNoRequest().
+     */
+    virtual uint32_t addFriendNoRequest(const ToxKey& publicKey) = 0;
+
+    /*! @brief Retrieves the aliases of every friend.
+     *  @param aliases Replaced with the aliases.
+     */
+    virtual void getFriendList(std::vector<uint32_t>& aliases) = 0;
+
+    /*! @brief See ToxWrapper::getFriendByPublicKey().
+     */
+    virtual uint32_t getFriendByPublicKey(const ToxKey& publicKey) = 0;
+
+    /*! @brief See ToxWrapper::friendExists().
+     */
+    virtual bool friendExists(uint32_t alias) = 0;
+
+    /*! @brief See ToxWrapper::deleteFriend().
+     */
+    virtual bool deleteFriend(uint32_t alias) = 0;
+
+    /*! @brief See ToxWrapper::getFriendPublicKey().
+     */
+    virtual ToxKey getFriendPublicKey(uint32_t alias) = 0;
+
+    /*! @brief See ToxWrapper::isFriendConnected().
+     */
+    virtual bool isFriendConnected(uint32_t alias) = 0;
+
+    /*! @brief See ToxWrapper::sendMessage().
+     */
+    virtual uint32_t sendMessage(uint32_t friendAlias,
+                                 std::string_view message,
+                                 bool actionType) = 0;
+
+    /*! @brief See ToxWrapper::sendLosslessPacket().
+     */
+    virtual bool sendLosslessPacket(uint32_t friendAlias,
+                                    std::string_view packet) = 0;
+
+    /*! @brief Returns how long to wait before the next call to iterate(), in
+     *         milliseconds.
+     */
+    virtual uint32_t getIterationInterval() = 0;
+
+    /*! @brief Performs any pending work, calling the wrapper's hooks for each
+     *         event that occurred.
+     */
+    virtual void iterate() = 0;
+
+    /*! @brief Returns the clock that drives this transport. The wrapper uses
+     *         it for all timing, so simulated transports can replace real
+     *         time. Defaults to the system's steady clock.
+     */
+    virtual Clock& getClock();
+
+private:
+
+    ToxWrapper* mWrapper;
+};
+
+#endif
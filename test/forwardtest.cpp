@@ -0,0 +1,250 @@
+#include <cstdio>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+#include "fragment.h"
+#include "frienddirectory.h"
+#include "intermediary.h"
+#include "loopbacktransport.h"
+
+
+using namespace std;
+
+
+static const string JournalFile = "forwardtest.journal";
+
+static int failures = 0;
+
+// Reports a check that failed
+static void check(bool passed, const string& what)
+{
+    if (!passed)
+    {
+        cout << "FAILED: " << what << endl;
+        ++failures;
+    }
+}
+
+// Deterministic public key for simulated friend i
+static ToxKey makeKey(uint32_t i)
+{
+    vector<uint8_t> bin(ToxKey::getSize(ToxKey::Public), 0);
+    for (size_t b = 0; b < bin.size(); ++b)
+    {
+        bin[b] = (uint8_t)((i >> ((b % 4) * 8)) ^ (b * 131));
+    }
+    return ToxKey(ToxKey::Public, bin);
+}
+
+// What the simulated friends have recieved, by alias
+struct Recieved
+{
+    vector<vector<string>> messages;
+    vector<vector<string>> packets;
+};
+
+// Creates an intermediary with friends 0 to count - 1, all offline, over the
+// journal left by the last one
+static unique_ptr<Intermediary> start(LoopbackTransport* transport,
+                                      uint32_t count, Recieved& recieved)
+{
+    unique_ptr<Intermediary> forwarder(
+        new Intermediary(unique_ptr<ToxTransport>(transport)));
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        forwarder->addAllowedFriend(makeKey(i));
+    }
+
+    recieved.messages.assign(count, vector<string>());
+    recieved.packets.assign(count, vector<string>());
+    transport->setDeliveryHandler([&recieved](uint32_t alias,
+                                              const string& message)
+    {
+        recieved.messages[alias].push_back(message);
+    });
+    transport->setPacketHandler([&recieved](uint32_t alias,
+                                            const string& packet)
+    {
+        recieved.packets[alias].push_back(packet);
+    });
+
+    if (!forwarder->openJournal(JournalFile))
+    {
+        return nullptr;
+    }
+    return forwarder;
+}
+
+// Brings a friend online and updates until they have been sent everything
+static void deliverTo(Intermediary& forwarder, LoopbackTransport& transport,
+                      uint32_t alias)
+{
+    transport.setFriendConnected(alias, true);
+    for (int i = 0; i < 100; ++i)
+    {
+        forwarder.update();
+    }
+}
+
+// Forwards a message from friend 0 to friend 1 while they are offline, then
+// delivers it, after a restart if asked
+static void forwardOffline(const string& message, bool restart,
+                           Recieved& recieved)
+{
+    remove(JournalFile.c_str());
+
+    LoopbackTransport* transport = new LoopbackTransport();
+    unique_ptr<Intermediary> forwarder = start(transport, 2, recieved);
+    check(forwarder != nullptr, "the journal opens");
+    if (!forwarder)
+    {
+        return;
+    }
+
+    transport->setFriendConnected(0, true);
+    transport->injectMessage(0, "!forward " + makeKey(1).getHex());
+    transport->injectMessage(0, message);
+    forwarder->update();
+
+    if (restart)
+    {
+        forwarder.reset();
+        transport = new LoopbackTransport();
+        forwarder = start(transport, 2, recieved);
+        check(forwarder != nullptr, "the journal reopens");
+        if (!forwarder)
+        {
+            return;
+        }
+    }
+
+    deliverTo(*forwarder, *transport, 1);
+    forwarder.reset();
+    remove(JournalFile.c_str());
+}
+
+
+// Text is never taken for a reference to a shared payload, however it starts
+static void testSharedTag()
+{
+    string message(1, '\xA1');
+    message.append(4, '\0');
+    message.append("hello");
+
+    for (int restart = 0; restart < 2; ++restart)
+    {
+        Recieved recieved;
+        forwardOffline(message, restart, recieved);
+        check(!recieved.messages[1].empty() &&
+              recieved.messages[1].back() == message,
+              restart ? "text starting with 0xA1 is delivered after a restart" :
+                        "text starting with 0xA1 is delivered");
+    }
+}
+
+// Text that starts like a record is still sent to text-only friends as
+// text, and doesn't switch them to the channel on a restart
+static void testRecordTag()
+{
+    string message(1, (char)ChannelPacketId);
+    message.append("not a record");
+
+    for (int restart = 0; restart < 2; ++restart)
+    {
+        Recieved recieved;
+        forwardOffline(message, restart, recieved);
+        check(!recieved.messages[1].empty() &&
+              recieved.messages[1].back() == message,
+              restart ? "text starting with 0xA0 is delivered after a restart" :
+                        "text starting with 0xA0 is delivered");
+        check(recieved.packets[1].empty(),
+              restart ? "no packets are sent after a restart" :
+                        "no packets are sent");
+    }
+}
+
+// Hex keys must be exactly the size of their type rather than truncated
+static void testKeySize()
+{
+    string hex = makeKey(1).getHex();
+    check(ToxKey(ToxKey::Public, hex) == makeKey(1),
+          "a public key is read from hex");
+
+    string address = hex + string(12, '0');
+    bool thrown = false;
+    try
+    {
+        ToxKey(ToxKey::Public, address);
+    }
+    catch (const ToxKey::InvalidSize& e)
+    {
+        thrown = true;
+    }
+    check(thrown, "a tox id isn't taken for a public key");
+
+    thrown = false;
+    try
+    {
+        ToxKey(ToxKey::Public, hex.substr(1));
+    }
+    catch (const ToxKey::InvalidSize& e)
+    {
+        thrown = true;
+    }
+    check(thrown, "a short key is rejected");
+}
+
+// Binary records are split wherever a fragment is full, even when every byte
+// looks like the middle of a utf8 character
+static void testBinaryFragments()
+{
+    const size_t maxSize = 1000;
+    string record(10 * maxSize, '\x80');
+    vector<string> fragments;
+    splitFragments(record, maxSize, 7, false, fragments);
+    check(fragments.size() < 12, "a binary record fills its fragments");
+
+    FragmentAssembler assembler;
+    string rebuilt;
+    bool complete = false;
+    for (size_t i = 0; i < fragments.size(); ++i)
+    {
+        check(fragments[i].size() <= maxSize, "fragments fit the limit");
+        complete = assembler.add(fragments[i], rebuilt);
+    }
+    check(complete && rebuilt == record, "a binary record is rebuilt");
+}
+
+// A friend deleted while online doesn't leave a reused alias looking online
+static void testReusedAlias()
+{
+    FriendDirectory directory;
+    directory.add(5, makeKey(0));
+    directory.setOnline(5, true);
+    directory.remove(5);
+    directory.add(5, makeKey(1));
+    check(!directory.isOnline(5), "a reused alias starts offline");
+
+    directory.setOnline(5, true);
+    directory.add(5, makeKey(2));
+    check(!directory.isOnline(5), "a replaced friend starts offline");
+}
+
+
+int main()
+{
+    testSharedTag();
+    testRecordTag();
+    testKeySize();
+    testBinaryFragments();
+    testReusedAlias();
+
+    if (failures > 0)
+    {
+        cout << failures << " checks failed" << endl;
+        return 1;
+    }
+    cout << "All checks passed" << endl;
+    return 0;
+}